@@ -2532,23 +2532,87 @@ EXPORTED int annotatemore_msg_lookup(const char *mboxname, uint32_t uid, const c
     return r;
 }
 
+struct lookupmask_rock {
+    size_t keylen[3];
+    struct buf value[3];
+};
+
+static int lookupmask_cb(void *rock,
+                         const char *key __attribute__((unused)),
+                         size_t keylen,
+                         const char *data, size_t datalen)
+{
+    struct lookupmask_rock *lrock = (struct lookupmask_rock *)rock;
+    struct annotate_metadata mdata;
+    int i;
+
+    /* the keys only differ in the userid on the end */
+    for (i = 0; i < 3; i++) {
+        if (keylen != lrock->keylen[i]) continue;
+
+        buf_free(&lrock->value[i]);
+        if (split_attribs(data, datalen, &lrock->value[i], &mdata)) break;
+
+        /* Force a copy, in case the putdb() call destroys
+         * the per-db data area that @data points to.  */
+        buf_cstring(&lrock->value[i]);
+
+        if (mdata.flags & ANNOTATE_FLAG_DELETED)
+            buf_reset(&lrock->value[i]);
+        break;
+    }
+
+    return 0;
+}
+
 EXPORTED int annotatemore_msg_lookupmask(const char *mboxname, uint32_t uid, const char *entry,
                                          const char *userid, struct buf *value)
 {
+    char keys[3][MAX_MAILBOX_PATH+1];
+    struct buf keybufs[3];
+    const char *userids[3];
+    struct lookupmask_rock lrock;
+    annotate_db_t *d = NULL;
+    int n = 0;
+    int i;
     int r = 0;
     value->len = 0; /* just in case! */
 
     init_internal();
 
-    /* only if the user isn't the owner, we look for a masking value */
+    r = _annotate_getdb(mboxname, uid, 0, &d);
+    if (r)
+        return (r == CYRUSDB_NOTFOUND ? 0 : r);
+
+    /* in order of preference, looked up all at once: only if the user
+     * isn't the owner, we look for a masking value.  And if there isn't
+     * one, we fall through to the shared value.  And because of Bron's
+     * use of NULL rather than "" at FastMail... */
     if (!mboxname_userownsmailbox(userid, mboxname))
-        r = annotatemore_msg_lookup(mboxname, uid, entry, userid, value);
-    /* and if there isn't one, we fall through to the shared value */
-    if (value->len == 0)
-        r = annotatemore_msg_lookup(mboxname, uid, entry, "", value);
-    /* and because of Bron's use of NULL rather than "" at FastMail... */
-    if (value->len == 0)
-        r = annotatemore_msg_lookup(mboxname, uid, entry, NULL, value);
+        userids[n++] = userid;
+    userids[n++] = "";
+    userids[n++] = NULL;
+
+    memset(&lrock, 0, sizeof(struct lookupmask_rock));
+
+    /* NULL sorts first, then "", then the user */
+    for (i = 0; i < n; i++) {
+        lrock.keylen[i] = make_key(mboxname, uid, entry, userids[i],
+                                   keys[i], sizeof(keys[i]));
+        buf_init_ro(&keybufs[n-1-i], keys[i], lrock.keylen[i]);
+    }
+
+    do {
+        r = cyrusdb_fetchmany(d->db, keybufs, n, lookupmask_cb, &lrock, tid(d));
+    } while (r == CYRUSDB_AGAIN);
+
+    for (i = 0; i < n; i++) {
+        if (!r && !value->len && lrock.value[i].len)
+            buf_copy(value, &lrock.value[i]);
+        buf_free(&lrock.value[i]);
+    }
+
+    annotate_putdb(&d);
     return r;
 }
 
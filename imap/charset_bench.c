@@ -0,0 +1,282 @@
+/* charset_bench.c -- measure charset conversion and search throughput
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "charset.h"
+#include "exitcodes.h"
+#include "global.h"
+#include "util.h"
+#include "xmalloc.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-b] [-s kbytes] [-n iterations] [-u percent]"
+                    " [-c charset] [-e encoding]\n", name);
+    fprintf(stderr, "Generates <kbytes> of mail-like text, of which about"
+                    " <percent> of the words\nare non-ASCII UTF-8, encodes"
+                    " it with <encoding> (none, qp or base64)\nand times"
+                    " decoding, searching, extracting and converting it"
+                    " <iterations> times.\nWith -b, generates random"
+                    " binary data like an attachment instead.\n");
+    exit(EC_USAGE);
+}
+
+static const char *const ascii_words[] = {
+    "the", "quick", "brown", "fox", "jumps", "over", "lazy", "dog",
+    "Meeting", "Tuesday", "report", "attached", "regards,", "thanks!",
+    "please", "review", "before", "Friday.", "--", "http://example.com/"
+};
+
+static const char *const utf8_words[] = {
+    "caf\xc3\xa9", "na\xc3\xafve", "Stra\xc3\x9f" "e", "\xe2\x80\x94",
+    "\xe6\x97\xa5\xe6\x9c\xac", "\xd0\x9f\xd1\x80\xd0\xb8\xd0\xb2\xd0\xb5\xd1\x82",
+    "\xf0\x9f\x99\x82"
+};
+
+#define NWORDS(a) (sizeof(a) / sizeof(a[0]))
+
+static void generate(struct buf *text, size_t size, int percent)
+{
+    unsigned seed = 1;
+    size_t linelen = 0;
+
+    while (buf_len(text) < size) {
+        const char *word;
+
+        seed = seed * 1103515245 + 12345;
+        if ((int) ((seed >> 16) % 100) < percent)
+            word = utf8_words[(seed >> 8) % NWORDS(utf8_words)];
+        else
+            word = ascii_words[(seed >> 8) % NWORDS(ascii_words)];
+
+        if (linelen > 72) {
+            buf_appendcstr(text, "\r\n");
+            linelen = 0;
+        }
+        else if (linelen) {
+            buf_putc(text, ' ');
+            linelen++;
+        }
+        buf_appendcstr(text, word);
+        linelen += strlen(word);
+    }
+    buf_appendcstr(text, "\r\n");
+}
+
+static void generate_binary(struct buf *data, size_t size)
+{
+    unsigned seed = 1;
+
+    while (buf_len(data) < size) {
+        seed = seed * 1103515245 + 12345;
+        buf_putc(data, (seed >> 16) & 0xff);
+    }
+}
+
+static void extract_cb(const struct buf *text __attribute__((unused)),
+                       void *rock)
+{
+    size_t *total = (size_t *) rock;
+    *total += text->len;
+}
+
+static void report(const char *name, const struct timeval *start,
+                   size_t bytes, int iterations)
+{
+    struct timeval end;
+    double secs;
+
+    gettimeofday(&end, NULL);
+    secs = timesub(start, &end);
+
+    printf("%-10s %10.1f MB/s\n", name,
+           secs > 0 ? (double) bytes * iterations / secs / (1024 * 1024) : 0);
+}
+
+int main(int argc, char **argv)
+{
+    struct buf text = BUF_INITIALIZER;
+    struct buf data = BUF_INITIALIZER;
+    struct buf decoded = BUF_INITIALIZER;
+    const char *csname = "utf-8";
+    const char *encname = "none";
+    size_t kbytes = 1024;
+    int iterations = 20;
+    int percent = 2;
+    int binary = 0;
+    int flags = CHARSET_SKIPDIACRIT | CHARSET_MERGESPACE;
+    int encoding;
+    charset_t cs;
+    comp_pat *pat;
+    char *term;
+    struct timeval start;
+    size_t total = 0;
+    int opt, i;
+
+    while ((opt = getopt(argc, argv, "bs:n:u:c:e:")) != EOF) {
+        switch (opt) {
+        case 'b':
+            binary = 1;
+            break;
+        case 's':
+            kbytes = atoi(optarg);
+            break;
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        case 'u':
+            percent = atoi(optarg);
+            break;
+        case 'c':
+            csname = optarg;
+            break;
+        case 'e':
+            encname = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind != argc || kbytes < 1 || iterations < 1
+        || percent < 0 || percent > 100)
+        usage(argv[0]);
+
+    if (!strcasecmp(encname, "none"))
+        encoding = ENCODING_NONE;
+    else if (!strcasecmp(encname, "qp"))
+        encoding = ENCODING_QP;
+    else
+        encoding = encoding_lookupname(encname);
+    if (encoding == ENCODING_UNKNOWN)
+        usage(argv[0]);
+
+    cs = charset_lookupname(csname);
+    if (cs == CHARSET_UNKNOWN_CHARSET) {
+        fprintf(stderr, "unknown charset %s\n", csname);
+        exit(EC_USAGE);
+    }
+
+    if (binary)
+        generate_binary(&text, kbytes * 1024);
+    else
+        generate(&text, kbytes * 1024, percent);
+
+    switch (encoding) {
+    case ENCODING_QP: {
+        size_t len;
+        char *enc = charset_qpencode_mimebody(text.s, text.len, &len);
+        buf_initm(&data, enc, len);
+        break;
+    }
+    case ENCODING_BASE64: {
+        size_t len;
+        int lines;
+        charset_encode_mimebody(NULL, text.len, NULL, &len, &lines);
+        buf_ensure(&data, len);
+        charset_encode_mimebody(text.s, text.len, data.s, &len, &lines);
+        buf_truncate(&data, len);
+        break;
+    }
+    default:
+        buf_copy(&data, &text);
+        break;
+    }
+
+    if (binary)
+        printf("%s, %s: %zu bytes (%zu encoded) of binary data,"
+               " %d iterations\n", charset_name(cs), encoding_name(encoding),
+               text.len, data.len, iterations);
+    else
+        printf("%s, %s: %zu bytes (%zu encoded), %d%% non-ASCII words,"
+               " %d iterations\n", charset_name(cs), encoding_name(encoding),
+               text.len, data.len, percent, iterations);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++)
+        charset_decode(&decoded, data.s, data.len, encoding);
+    report("decode", &start, data.len, iterations);
+    if (!buf_len(&decoded) || buf_cmp(&decoded, &text))
+        fatal("decoded data differs from the original", EC_SOFTWARE);
+
+    /* a term that never matches, so every search scans all the data */
+    term = charset_utf8_to_searchform("zebrafish", flags);
+    pat = charset_compilepat(term);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++) {
+        if (charset_searchfile(term, pat, data.s, data.len, cs, encoding, flags))
+            fatal("search term unexpectedly matched", EC_SOFTWARE);
+    }
+    report("search", &start, data.len, iterations);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++)
+        charset_extract(extract_cb, &total, &data, cs, encoding, "PLAIN", flags);
+    report("extract", &start, data.len, iterations);
+
+    gettimeofday(&start, NULL);
+    for (i = 0; i < iterations; i++) {
+        char *utf8 = charset_to_utf8(data.s, data.len, cs, encoding);
+        free(utf8);
+    }
+    report("to_utf8", &start, data.len, iterations);
+
+    charset_freepat(pat);
+    free(term);
+    charset_free(&cs);
+    buf_free(&decoded);
+    buf_free(&data);
+    buf_free(&text);
+
+    return 0;
+}
@@ -57,6 +57,7 @@
 #include "append.h"
 #include "assert.h"
 #include "bsearch.h"
+#include "byteorder64.h"
 #include "charset.h"
 #include "crc32.h"
 #include "dlist.h"
@@ -70,6 +71,7 @@
 #include "mboxname.h"
 #include "message.h"
 #include "parseaddr.h"
+#include "prometheus.h"
 #include "search_engines.h"
 #include "seen.h"
 #include "strhash.h"
@@ -100,6 +102,44 @@
 
 #define CONVERSATIONS_VERSION 0
 
+/*
+ * Binary B records, written when conversations_record_format is "binary".
+ * All numbers are in network order:
+ *
+ *   magic (1 byte)
+ *   modseq (64 bit)
+ *   num_records, exists, unseen, size (32 bit each)
+ *   ncounts, nfolders, nthreads, nsenders (32 bit each)
+ *   counts (32 bit each)
+ *   folders: number, num_records, exists, unseen (32 bit), modseq (64 bit)
+ *   threads: guid (20 bytes), exists, internaldate, msgid, inreplyto (32 bit)
+ *   subject (string)
+ *   senders: lastseen, exists (32 bit), name, route, mailbox, domain (strings)
+ *
+ * A string is a 32 bit length followed by the bytes and a NUL, or just
+ * CONV_BREC_NOSTRING for NULL.  Everything up to the subject is at a
+ * computable offset, so the totals can be read without parsing.  The
+ * magic byte can never start a text record, which begins with the
+ * decimal CONVERSATIONS_VERSION.
+ */
+#define CONV_BREC_MAGIC         (0x81)
+#define CONV_BREC_MODSEQ        (1)
+#define CONV_BREC_NUMRECORDS    (9)
+#define CONV_BREC_EXISTS        (13)
+#define CONV_BREC_UNSEEN        (17)
+#define CONV_BREC_SIZE          (21)
+#define CONV_BREC_NCOUNTS       (25)
+#define CONV_BREC_NFOLDERS      (29)
+#define CONV_BREC_NTHREADS      (33)
+#define CONV_BREC_NSENDERS      (37)
+#define CONV_BREC_HEADERSIZE    (41)
+#define CONV_BREC_FOLDERSIZE    (24)
+#define CONV_BREC_THREADSIZE    (20 + 16)
+#define CONV_BREC_NOSTRING      (0xffffffff)
+
+#define CONV_IS_BINARY(data, datalen) \
+    ((datalen) && (unsigned char)(data)[0] == CONV_BREC_MAGIC)
+
 static conv_status_t NULLSTATUS = { 0, 0, 0};
 
 static char *convdir = NULL;
@@ -108,6 +148,9 @@ static char *suffix = NULL;
 static int check_msgid(const char *msgid, size_t len, size_t *lenp);
 static int _conversations_parse(const char *data, size_t datalen,
                                 arrayu64_t *cids, time_t *stampp);
+static void conversation_tobuf_text(struct conversations_state *state,
+                                    const conversation_t *conv,
+                                    struct buf *buf);
 static int _conversations_set_key(struct conversations_state *state,
                                   const char *key, size_t keylen,
                                   const arrayu64_t *cids, time_t stamp);
@@ -188,7 +231,14 @@ static int _init_counted(struct conversations_state *state,
     return 0;
 }
 
-EXPORTED int conversations_open_path(const char *fname, const char *userid, struct conversations_state **statep)
+/* Reads made through a shared state each take a read lock of their own,
+ * until something is written and the state's transaction begins. */
+#define READTXN(state) \
+    (((state)->shared && !(state)->txn) ? NULL : &(state)->txn)
+
+static int _conversations_open(const char *fname, const char *userid,
+                               int shared,
+                               struct conversations_state **statep)
 {
     struct conversations_open *open = NULL;
     const char *val = NULL;
@@ -212,12 +262,21 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
     }
 
     open->s.path = xstrdup(fname);
+    open->s.shared = shared;
+    open->s.binary_records =
+        (config_getenum(IMAPOPT_CONVERSATIONS_RECORD_FORMAT) ==
+         IMAP_ENUM_CONVERSATIONS_RECORD_FORMAT_BINARY);
     open->next = open_conversations;
     open_conversations = open;
 
-    /* ensure a write lock immediately, and also load the counted flags */
-    cyrusdb_fetchlock(open->s.db, CFKEY, strlen(CFKEY),
-                      &val, &vallen, &open->s.txn);
+    /* ensure a write lock immediately, unless shared, and also load
+     * the counted flags */
+    if (shared)
+        cyrusdb_fetch(open->s.db, CFKEY, strlen(CFKEY),
+                      &val, &vallen, NULL);
+    else
+        cyrusdb_fetchlock(open->s.db, CFKEY, strlen(CFKEY),
+                          &val, &vallen, &open->s.txn);
     _init_counted(&open->s, val, vallen);
 
     /* we should just read the folder names up front too */
@@ -225,7 +284,7 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
 
     /* if there's a value, parse as a dlist */
     if (!cyrusdb_fetch(open->s.db, FNKEY, strlen(FNKEY),
-                   &val, &vallen, &open->s.txn)) {
+                   &val, &vallen, READTXN(&open->s))) {
         struct dlist *dl = NULL;
         struct dlist *dp;
         dlist_parsemap(&dl, 0, 0, val, vallen);
@@ -243,11 +302,21 @@ EXPORTED int conversations_open_path(const char *fname, const char *userid, stru
     /* create the status cache */
     construct_hash_table(&open->s.folderstatus, open->s.folder_names->count/4+4, 0);
 
+    /* and the write-back cache of changed conversations */
+    open->s.convcache_limit =
+        (size_t)config_getint(IMAPOPT_CONVERSATIONS_CACHE_SIZE) * 1024;
+    construct_hash_table(&open->s.convcache, 1024, 0);
+
     *statep = &open->s;
 
     return 0;
 }
 
+EXPORTED int conversations_open_path(const char *fname, const char *userid, struct conversations_state **statep)
+{
+    return _conversations_open(fname, userid, /*shared*/0, statep);
+}
+
 EXPORTED int conversations_open_user(const char *userid, struct conversations_state **statep)
 {
     char *path = conversations_getuserpath(userid);
@@ -258,6 +327,20 @@ EXPORTED int conversations_open_user(const char *userid, struct conversations_st
     return r;
 }
 
+/* Open without taking the write lock, for callers that only read.
+ * Several processes can then read the same user's conversations at
+ * once.  Writing is still allowed, but waits for the lock as usual. */
+EXPORTED int conversations_open_user_shared(const char *userid,
+                                            struct conversations_state **statep)
+{
+    char *path = conversations_getuserpath(userid);
+    int r;
+    if (!path) return IMAP_MAILBOX_BADNAME;
+    r = _conversations_open(path, userid, /*shared*/1, statep);
+    free(path);
+    return r;
+}
+
 EXPORTED int conversations_open_mbox(const char *mboxname, struct conversations_state **statep)
 {
     char *path = conversations_getmboxpath(mboxname);
@@ -319,6 +402,7 @@ static void _conv_remove(struct conversations_state *state)
                 strarray_free(cur->s.counted_flags);
             if (cur->s.folder_names)
                 strarray_free(cur->s.folder_names);
+            conversation_free(cur->s.viewconv);
             free(cur);
             return;
         }
@@ -328,10 +412,27 @@ static void _conv_remove(struct conversations_state *state)
     fatal("unknown conversation db closed", EC_SOFTWARE);
 }
 
+static void _free_cached(void *data)
+{
+    struct buf *rec = (struct buf *)data;
+
+    buf_free(rec);
+    free(rec);
+}
+
+static void conversations_dropcache(struct conversations_state *state)
+{
+    free_hash_table(&state->convcache, _free_cached);
+    prometheus_apply_delta(CYRUS_CONVERSATIONS_CACHE_BYTES,
+                           -(double)state->convcache_bytes);
+    state->convcache_bytes = 0;
+}
+
 static void conversations_abortcache(struct conversations_state *state)
 {
     /* still gotta clean up */
     free_hash_table(&state->folderstatus, free);
+    conversations_dropcache(state);
 }
 
 static void commitstatus_cb(const char *key, void *data, void *rock)
@@ -350,6 +451,96 @@ static void conversations_commitcache(struct conversations_state *state)
 {
     hash_enumerate(&state->folderstatus, commitstatus_cb, state);
     free_hash_table(&state->folderstatus, free);
+    conversations_dropcache(state);
+}
+
+struct flush_rock {
+    struct conversations_state *state;
+    struct buf text;
+    unsigned int nwritten;
+    int r;
+};
+
+static void flushcached_cb(const char *key, void *data, void *rock)
+{
+    struct flush_rock *frock = (struct flush_rock *)rock;
+    struct conversations_state *state = frock->state;
+    struct buf *rec = (struct buf *)data;
+    conversation_t *conv = NULL;
+    const char *val = rec->s;
+    size_t vallen = rec->len;
+    int r;
+
+    if (frock->r) return;
+
+    /* cached records are binary, but may have to be written as text */
+    if (vallen && !state->binary_records) {
+        r = conversation_parse(state, val, vallen, &conv);
+        if (r) goto done;
+        buf_reset(&frock->text);
+        conversation_tobuf_text(state, conv, &frock->text);
+        conversation_free(conv);
+        val = frock->text.s;
+        vallen = frock->text.len;
+    }
+
+    if (vallen)
+        r = cyrusdb_store(state->db, key, strlen(key), val, vallen, &state->txn);
+    else
+        r = cyrusdb_delete(state->db, key, strlen(key), &state->txn, /*force*/1);
+
+ done:
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: conversations failed to write %s %s: %s",
+               state->path, key, cyrusdb_strerror(r));
+        frock->r = IMAP_IOERROR;
+    }
+    frock->nwritten++;
+}
+
+/* Write every cached conversation to the database and empty the cache */
+static int conversations_flushcache(struct conversations_state *state,
+                                    int evicting)
+{
+    struct flush_rock frock = { state, BUF_INITIALIZER, 0, 0 };
+
+    if (!state->convcache_bytes) return 0;
+
+    hash_enumerate(&state->convcache, flushcached_cb, &frock);
+    buf_free(&frock.text);
+
+    prometheus_apply_delta(CYRUS_CONVERSATIONS_CACHE_WRITES_TOTAL,
+                           frock.nwritten);
+    if (evicting)
+        prometheus_apply_delta(CYRUS_CONVERSATIONS_CACHE_EVICTIONS_TOTAL,
+                               frock.nwritten);
+
+    conversations_dropcache(state);
+    construct_hash_table(&state->convcache, 1024, 0);
+
+    return frock.r;
+}
+
+/* Forget any cached change to 'key', which is about to be written
+ * directly */
+static void conversations_uncache(struct conversations_state *state,
+                                  const char *key, size_t keylen)
+{
+    char *k;
+    struct buf *rec;
+
+    if (!state->convcache_bytes) return;
+
+    k = xstrndup(key, keylen);
+    rec = hash_del(k, &state->convcache);
+    if (rec) {
+        size_t size = rec->len + keylen + sizeof(struct buf);
+        state->convcache_bytes -= size;
+        prometheus_apply_delta(CYRUS_CONVERSATIONS_CACHE_BYTES, -(double)size);
+        _free_cached(rec);
+    }
+
+    free(k);
 }
 
 EXPORTED int conversations_abort(struct conversations_state **statep)
@@ -383,12 +574,21 @@ EXPORTED int conversations_commit(struct conversations_state **statep)
 
     *statep = NULL;
 
-    /* commit cache, writes to to DB */
-    conversations_commitcache(state);
+    /* write back the changed conversations, then the folder status */
+    r = conversations_flushcache(state, /*evicting*/0);
+    if (r) {
+        conversations_abortcache(state);
+    }
+    else {
+        /* commit cache, writes to to DB */
+        conversations_commitcache(state);
+    }
 
     /* finally it's safe to commit the DB itself */
     if (state->db) {
-        if (state->txn)
+        if (state->txn && r)
+            cyrusdb_abort(state->db, state->txn);
+        else if (state->txn)
             r = cyrusdb_commit(state->db, state->txn);
         cyrusdb_close(state->db);
     }
@@ -568,7 +768,7 @@ EXPORTED int conversations_get_msgid(struct conversations_state *state,
     r = cyrusdb_fetch(state->db,
                       msgid, keylen,
                       &data, &datalen,
-                      &state->txn);
+                      READTXN(state));
 
     if (r == CYRUSDB_NOTFOUND)
         return 0; /* not an error, but nothing more to do */
@@ -580,6 +780,65 @@ EXPORTED int conversations_get_msgid(struct conversations_state *state,
     return r;
 }
 
+struct getmsgids_rock {
+    conversations_msgid_cb *cb;
+    void *rock;
+    arrayu64_t cids;
+    struct buf msgid;
+};
+
+static int getmsgids_cb(void *rock,
+                        const char *key, size_t keylen,
+                        const char *data, size_t datalen)
+{
+    struct getmsgids_rock *grock = (struct getmsgids_rock *)rock;
+    int r;
+
+    arrayu64_truncate(&grock->cids, 0);
+    r = _conversations_parse(data, datalen, &grock->cids, NULL);
+    if (r) return r;
+
+    buf_setmap(&grock->msgid, key, keylen);
+    return grock->cb(buf_cstring(&grock->msgid), &grock->cids, grock->rock);
+}
+
+EXPORTED int conversations_get_msgids(struct conversations_state *state,
+                                      const strarray_t *msgids,
+                                      conversations_msgid_cb *cb, void *rock)
+{
+    struct getmsgids_rock grock = {
+        cb, rock, ARRAYU64_INITIALIZER, BUF_INITIALIZER
+    };
+    strarray_t *sorted;
+    struct buf *keys;
+    int i;
+    int r = 0;
+
+    for (i = 0; i < strarray_size(msgids); i++) {
+        r = check_msgid(strarray_nth(msgids, i), 0, NULL);
+        if (r) return r;
+    }
+
+    /* in database order, so they're all found in one pass */
+    sorted = strarray_dup(msgids);
+    strarray_sort(sorted, cmpstringp_raw);
+    strarray_uniq(sorted);
+
+    keys = xzmalloc(strarray_size(sorted) * sizeof(struct buf));
+    for (i = 0; i < strarray_size(sorted); i++)
+        buf_init_ro_cstr(&keys[i], strarray_nth(sorted, i));
+
+    r = cyrusdb_fetchmany(state->db, keys, strarray_size(sorted),
+                          getmsgids_cb, &grock, READTXN(state));
+
+    free(keys);
+    strarray_free(sorted);
+    arrayu64_fini(&grock.cids);
+    buf_free(&grock.msgid);
+
+    return r;
+}
+
 /*
  * Normalise a subject string, to a form which can be used for deciding
  * whether a message belongs in the same conversation as it's antecedent
@@ -759,18 +1018,16 @@ EXPORTED int conversation_setstatus(struct conversations_state *state,
     return 0;
 }
 
-EXPORTED int conversation_store(struct conversations_state *state,
-                       const char *key, int keylen,
-                       conversation_t *conv)
+static void conversation_tobuf_text(struct conversations_state *state,
+                                    const conversation_t *conv,
+                                    struct buf *buf)
 {
     struct dlist *dl, *n, *nn;
-    struct buf buf = BUF_INITIALIZER;
     const conv_folder_t *folder;
     const conv_sender_t *sender;
     const conv_thread_t *thread;
     int version = CONVERSATIONS_VERSION;
     int i;
-    int r;
 
     dl = dlist_newlist(NULL, NULL);
     dlist_setnum64(dl, "MODSEQ", conv->modseq);
@@ -830,15 +1087,187 @@ EXPORTED int conversation_store(struct conversations_state *state,
         if (thread->inreplyto) dlist_setnum32(nn, "INREPLYTO", thread->inreplyto);
     }
 
-    buf_printf(&buf, "%d ", version);
-    dlist_printbuf(dl, 0, &buf);
+    buf_printf(buf, "%d ", version);
+    dlist_printbuf(dl, 0, buf);
     dlist_free(&dl);
+}
+
+static void brec_putstring(struct buf *buf, const char *s)
+{
+    size_t len;
+
+    if (!s) {
+        buf_appendbit32(buf, CONV_BREC_NOSTRING);
+        return;
+    }
+
+    len = strlen(s);
+    buf_appendbit32(buf, len);
+    buf_appendmap(buf, s, len + 1);
+}
+
+static void conversation_tobuf_binary(struct conversations_state *state,
+                                      const conversation_t *conv,
+                                      struct buf *buf)
+{
+    const conv_folder_t *folder;
+    const conv_sender_t *sender;
+    const conv_thread_t *thread;
+    char guidbuf[MESSAGE_GUID_SIZE];
+    uint32_t ncounts = 0, nfolders = 0, nthreads = 0, nsenders = 0;
+    uint32_t i;
+
+    if (state->counted_flags)
+        ncounts = state->counted_flags->count;
+    for (folder = conv->folders ; folder ; folder = folder->next)
+        if (folder->num_records) nfolders++;
+    for (thread = conv->thread ; thread ; thread = thread->next)
+        if (thread->exists) nthreads++;
+    /* same limit as the text format */
+    for (sender = conv->senders ; sender ; sender = sender->next)
+        if (sender->exists && ++nsenders >= 99) break;
+
+    buf_putc(buf, CONV_BREC_MAGIC);
+    buf_appendbit64(buf, conv->modseq);
+    buf_appendbit32(buf, conv->num_records);
+    buf_appendbit32(buf, conv->exists);
+    buf_appendbit32(buf, conv->unseen);
+    buf_appendbit32(buf, conv->size);
+    buf_appendbit32(buf, ncounts);
+    buf_appendbit32(buf, nfolders);
+    buf_appendbit32(buf, nthreads);
+    buf_appendbit32(buf, nsenders);
+
+    for (i = 0; i < ncounts; i++)
+        buf_appendbit32(buf, conv->counts[i]);
+
+    for (folder = conv->folders ; folder ; folder = folder->next) {
+        if (!folder->num_records)
+            continue;
+        buf_appendbit32(buf, folder->number);
+        buf_appendbit32(buf, folder->num_records);
+        buf_appendbit32(buf, folder->exists);
+        buf_appendbit32(buf, folder->unseen);
+        buf_appendbit64(buf, folder->modseq);
+    }
+
+    for (thread = conv->thread ; thread ; thread = thread->next) {
+        if (!thread->exists)
+            continue;
+        message_guid_export(&thread->guid, guidbuf);
+        buf_appendmap(buf, guidbuf, MESSAGE_GUID_SIZE);
+        buf_appendbit32(buf, thread->exists);
+        buf_appendbit32(buf, thread->internaldate);
+        buf_appendbit32(buf, thread->msgid);
+        buf_appendbit32(buf, thread->inreplyto);
+    }
+
+    brec_putstring(buf, conv->subject);
 
-    if (_sanity_check_counts(conv)) {
+    i = 0;
+    for (sender = conv->senders ; sender && i < nsenders ; sender = sender->next) {
+        if (!sender->exists)
+            continue;
+        i++;
+        buf_appendbit32(buf, sender->lastseen);
+        buf_appendbit32(buf, sender->exists);
+        brec_putstring(buf, sender->name);
+        brec_putstring(buf, sender->route);
+        brec_putstring(buf, sender->mailbox);
+        brec_putstring(buf, sender->domain);
+    }
+}
+
+static void conversation_audit_store(struct conversations_state *state,
+                                     const char *key, int keylen,
+                                     const conversation_t *conv)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    if (_sanity_check_counts((conversation_t *)conv)) {
+        conversation_tobuf_text(state, conv, &buf);
         syslog(LOG_ERR, "IOERROR: conversations_audit on store: %s %.*s %.*s",
                state->path, keylen, key, (int)buf.len, buf.s);
+        buf_free(&buf);
+    }
+}
+
+/* Record a changed conversation in the write-back cache, or its removal
+ * if 'conv' is NULL.  Records are cached in binary whatever the
+ * configured format, so loading them again is cheap. */
+static int conversation_cache(struct conversations_state *state,
+                              const char *key, int keylen,
+                              const conversation_t *conv)
+{
+    char *k = xstrndup(key, keylen);
+    struct buf *rec = hash_lookup(k, &state->convcache);
+    size_t oldsize = 0;
+    size_t size;
+
+    if (rec) {
+        oldsize = rec->len + keylen + sizeof(struct buf);
+        buf_reset(rec);
+    }
+    else {
+        rec = xzmalloc(sizeof(struct buf));
+        hash_insert(k, rec, &state->convcache);
+    }
+    free(k);
+
+    /* an empty record means delete */
+    if (conv) {
+        conversation_audit_store(state, key, keylen, conv);
+        conversation_tobuf_binary(state, conv, rec);
+    }
+
+    size = rec->len + keylen + sizeof(struct buf);
+    state->convcache_bytes += size - oldsize;
+    prometheus_apply_delta(CYRUS_CONVERSATIONS_CACHE_BYTES,
+                           (double)size - (double)oldsize);
+    prometheus_increment(CYRUS_CONVERSATIONS_CACHE_STORES_TOTAL);
+
+    if (state->convcache_bytes > state->convcache_limit)
+        return conversations_flushcache(state, /*evicting*/1);
+
+    return 0;
+}
+
+/* Fetch a B record, preferring a cached change */
+static int conversation_fetch(struct conversations_state *state,
+                              const char *key,
+                              const char **datap, size_t *datalenp)
+{
+    struct buf *rec = NULL;
+
+    if (state->convcache_bytes)
+        rec = hash_lookup(key, &state->convcache);
+
+    if (rec) {
+        if (!rec->len) return CYRUSDB_NOTFOUND;
+        *datap = rec->s;
+        *datalenp = rec->len;
+        return CYRUSDB_OK;
     }
 
+    return cyrusdb_fetch(state->db, key, strlen(key), datap, datalenp,
+                         READTXN(state));
+}
+
+EXPORTED int conversation_store(struct conversations_state *state,
+                       const char *key, int keylen,
+                       conversation_t *conv)
+{
+    struct buf buf = BUF_INITIALIZER;
+    int r;
+
+    conversation_audit_store(state, key, keylen, conv);
+    conversations_uncache(state, key, keylen);
+
+    if (state->binary_records)
+        conversation_tobuf_binary(state, conv, &buf);
+    else
+        conversation_tobuf_text(state, conv, &buf);
+
     r = cyrusdb_store(state->db, key, keylen, buf.s, buf.len, &state->txn);
 
     buf_free(&buf);
@@ -899,7 +1328,12 @@ static int _conversation_save(struct conversations_state *state,
         }
     }
 
-    if (conv->num_records) {
+    if (state->convcache_limit) {
+        /* written at commit; a removed conversation is cached as empty */
+        r = conversation_cache(state, key, keylen,
+                               conv->num_records ? conv : NULL);
+    }
+    else if (conv->num_records) {
         r = conversation_store(state, key, keylen, conv);
     }
     else {
@@ -1009,7 +1443,7 @@ EXPORTED int conversation_getstatus(struct conversations_state *state,
     r = cyrusdb_fetch(state->db,
                       key, strlen(key),
                       &data, &datalen,
-                      &state->txn);
+                      READTXN(state));
 
     if (r == CYRUSDB_NOTFOUND) {
         /* not existing is not an error */
@@ -1089,6 +1523,154 @@ static conv_thread_t *parse_thread(struct dlist *dl)
     return res;
 }
 
+static uint32_t brec_get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static int brec_getstring(const char **pp, const char *end, const char **sp)
+{
+    uint32_t len;
+
+    if (end - *pp < 4) return IMAP_MAILBOX_BADFORMAT;
+    len = brec_get32(*pp);
+    *pp += 4;
+
+    if (len == CONV_BREC_NOSTRING) {
+        *sp = NULL;
+        return 0;
+    }
+
+    /* the string and its NUL must both fit */
+    if ((size_t)(end - *pp) <= len || (*pp)[len])
+        return IMAP_MAILBOX_BADFORMAT;
+
+    *sp = *pp;
+    *pp += len + 1;
+    return 0;
+}
+
+/* Check a binary record as far as the subject, and set up a view of it.
+ * The senders that follow start at *restp. */
+static int brec_view(conv_view_t *view, const char *data, size_t datalen,
+                     const char **restp)
+{
+    const char *p = data + CONV_BREC_HEADERSIZE;
+    const char *end = data + datalen;
+    uint64_t fixed;
+    int r;
+
+    memset(view, 0, sizeof(*view));
+
+    if (datalen < CONV_BREC_HEADERSIZE || !CONV_IS_BINARY(data, datalen))
+        return IMAP_MAILBOX_BADFORMAT;
+
+    view->ncounts = brec_get32(data + CONV_BREC_NCOUNTS);
+    fixed = (uint64_t)view->ncounts * 4 +
+            (uint64_t)brec_get32(data + CONV_BREC_NFOLDERS) * CONV_BREC_FOLDERSIZE +
+            (uint64_t)brec_get32(data + CONV_BREC_NTHREADS) * CONV_BREC_THREADSIZE;
+    if (fixed > (uint64_t)(end - p))
+        return IMAP_MAILBOX_BADFORMAT;
+    p += fixed;
+
+    r = brec_getstring(&p, end, &view->subject);
+    if (r) return r;
+
+    view->base = data;
+    view->len = datalen;
+    if (restp) *restp = p;
+
+    return 0;
+}
+
+static int conversation_parse_binary(struct conversations_state *state,
+                                     const char *data, size_t datalen,
+                                     conversation_t **convp)
+{
+    const char *end = data + datalen;
+    const char *p, *rest;
+    const char *strs[4];
+    conv_view_t view;
+    conversation_t *conv;
+    conv_folder_t *folder;
+    conv_thread_t **threadp;
+    uint32_t nfolders, nthreads, nsenders;
+    uint32_t i, j;
+    int r;
+
+    r = brec_view(&view, data, datalen, &rest);
+    if (r) return r;
+
+    /* check the senders before building anything */
+    nsenders = brec_get32(data + CONV_BREC_NSENDERS);
+    for (p = rest, i = 0; i < nsenders; i++) {
+        if (end - p < 8) return IMAP_MAILBOX_BADFORMAT;
+        p += 8;
+        for (j = 0; j < 4; j++) {
+            r = brec_getstring(&p, end, &strs[j]);
+            if (r) return r;
+        }
+    }
+    if (p != end) return IMAP_MAILBOX_BADFORMAT;
+
+    conv = conversation_new(state);
+
+    conv->modseq = conv_view_modseq(&view);
+    conv->num_records = conv_view_num_records(&view);
+    conv->exists = conv_view_exists(&view);
+    conv->unseen = conv_view_unseen(&view);
+    conv->size = conv_view_size(&view);
+    if (state->counted_flags) {
+        for (i = 0; i < (uint32_t)state->counted_flags->count; i++)
+            conv->counts[i] = conv_view_count(&view, i);
+    }
+
+    p = data + CONV_BREC_HEADERSIZE + view.ncounts * 4;
+    nfolders = brec_get32(data + CONV_BREC_NFOLDERS);
+    for (i = 0; i < nfolders; i++, p += CONV_BREC_FOLDERSIZE) {
+        folder = conversation_get_folder(conv, brec_get32(p), 1);
+        if (!folder)
+            continue;
+        folder->num_records = brec_get32(p + 4);
+        folder->exists = brec_get32(p + 8);
+        folder->unseen = brec_get32(p + 12);
+        folder->modseq = align_ntohll(p + 16);
+        folder->prev_exists = folder->exists;
+    }
+
+    nthreads = brec_get32(data + CONV_BREC_NTHREADS);
+    threadp = &conv->thread;
+    for (i = 0; i < nthreads; i++, p += CONV_BREC_THREADSIZE) {
+        conv_thread_t *thread = *threadp = xzmalloc(sizeof(conv_thread_t));
+        threadp = &thread->next;
+        message_guid_import(&thread->guid, p);
+        thread->exists = brec_get32(p + 20);
+        thread->internaldate = brec_get32(p + 24);
+        thread->msgid = brec_get32(p + 28);
+        thread->inreplyto = brec_get32(p + 32);
+    }
+
+    conv->subject = xstrdupnull(view.subject);
+
+    for (p = rest, i = 0; i < nsenders; i++) {
+        uint32_t lastseen = brec_get32(p);
+        uint32_t exists = brec_get32(p + 4);
+        p += 8;
+        for (j = 0; j < 4; j++)
+            brec_getstring(&p, end, &strs[j]);
+        conversation_update_sender(conv, strs[0], strs[1], strs[2], strs[3],
+                                   lastseen, exists);
+    }
+
+    conv->prev_unseen = conv->unseen;
+
+    conv->dirty = 0;
+    *convp = conv;
+    return 0;
+}
+
 EXPORTED int conversation_parse(struct conversations_state *state,
                        const char *data, size_t datalen,
                        conversation_t **convp)
@@ -1105,6 +1687,9 @@ EXPORTED int conversation_parse(struct conversations_state *state,
 
     *convp = NULL;
 
+    if (CONV_IS_BINARY(data, datalen))
+        return conversation_parse_binary(state, data, datalen, convp);
+
     r = parsenum(data, &rest, datalen, &version);
     if (r) return IMAP_MAILBOX_BADFORMAT;
 
@@ -1216,10 +1801,7 @@ EXPORTED int conversation_load(struct conversations_state *state,
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
-    r = cyrusdb_fetch(state->db,
-                  bkey, strlen(bkey),
-                  &data, &datalen,
-                  &state->txn);
+    r = conversation_fetch(state, bkey, &data, &datalen);
 
     if (r == CYRUSDB_NOTFOUND) {
         *convp = NULL;
@@ -1237,17 +1819,137 @@ EXPORTED int conversation_load(struct conversations_state *state,
     }
 
     if (_sanity_check_counts(*convp)) {
+        struct buf buf = BUF_INITIALIZER;
+        conversation_totext(state, data, datalen, &buf);
         syslog(LOG_ERR, "IOERROR: conversations_audit on load: %s %s %.*s",
-               state->path, bkey, (int)datalen, data);
+               state->path, bkey, (int)buf.len, buf.s);
+        buf_free(&buf);
+    }
+
+    return 0;
+}
+
+EXPORTED int conversation_view(struct conversations_state *state,
+                               conversation_id_t cid,
+                               conv_view_t *view)
+{
+    const char *data;
+    size_t datalen;
+    char bkey[CONVERSATION_ID_STRMAX+2];
+    int r;
+
+    memset(view, 0, sizeof(*view));
+
+    snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
+    r = conversation_fetch(state, bkey, &data, &datalen);
+
+    if (r == CYRUSDB_NOTFOUND) {
+        return 0;
+    } else if (r != CYRUSDB_OK) {
+        return r;
+    }
+    xstats_inc(CONV_VIEW);
+
+    /* a text record not yet rewritten: the accessors read the parsed
+     * values, which the state keeps until the next view */
+    if (!CONV_IS_BINARY(data, datalen)) {
+        conversation_free(state->viewconv);
+        state->viewconv = NULL;
+
+        r = conversation_parse(state, data, datalen, &state->viewconv);
+        if (!r) {
+            view->conv = state->viewconv;
+            view->ncounts = state->counted_flags ? state->counted_flags->count : 0;
+            view->subject = state->viewconv->subject;
+            return 0;
+        }
+    }
+
+    if (!r) r = brec_view(view, data, datalen, NULL);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: conversations invalid conversation "
+               CONV_FMT, cid);
+        memset(view, 0, sizeof(*view));
+    }
+
+    return 0;
+}
+
+EXPORTED modseq_t conv_view_modseq(const conv_view_t *view)
+{
+    if (view->conv) return view->conv->modseq;
+    return view->base ? align_ntohll(view->base + CONV_BREC_MODSEQ) : 0;
+}
+
+EXPORTED uint32_t conv_view_num_records(const conv_view_t *view)
+{
+    if (view->conv) return view->conv->num_records;
+    return view->base ? brec_get32(view->base + CONV_BREC_NUMRECORDS) : 0;
+}
+
+EXPORTED uint32_t conv_view_exists(const conv_view_t *view)
+{
+    if (view->conv) return view->conv->exists;
+    return view->base ? brec_get32(view->base + CONV_BREC_EXISTS) : 0;
+}
+
+EXPORTED uint32_t conv_view_unseen(const conv_view_t *view)
+{
+    if (view->conv) return view->conv->unseen;
+    return view->base ? brec_get32(view->base + CONV_BREC_UNSEEN) : 0;
+}
+
+EXPORTED uint32_t conv_view_size(const conv_view_t *view)
+{
+    if (view->conv) return view->conv->size;
+    return view->base ? brec_get32(view->base + CONV_BREC_SIZE) : 0;
+}
+
+/* the count for the idx'th counted flag */
+EXPORTED uint32_t conv_view_count(const conv_view_t *view, int idx)
+{
+    if (idx < 0 || (uint32_t)idx >= view->ncounts)
+        return 0;
+    if (view->conv)
+        return view->conv->counts ? view->conv->counts[idx] : 0;
+    if (!view->base)
+        return 0;
+    return brec_get32(view->base + CONV_BREC_HEADERSIZE + 4 * idx);
+}
+
+EXPORTED const char *conv_view_subject(const conv_view_t *view)
+{
+    return view->subject;
+}
+
+EXPORTED int conversation_totext(struct conversations_state *state,
+                                 const char *data, size_t datalen,
+                                 struct buf *buf)
+{
+    conversation_t *conv = NULL;
+    int r;
+
+    buf_reset(buf);
+
+    if (!CONV_IS_BINARY(data, datalen)) {
+        buf_appendmap(buf, data, datalen);
+        return 0;
     }
 
+    r = conversation_parse_binary(state, data, datalen, &conv);
+    if (r) return r;
+
+    conversation_tobuf_text(state, conv, buf);
+    conversation_free(conv);
+
     return 0;
 }
 
 /* Parse just enough of the B record to retrieve the modseq.
  * Fortunately the modseq is the first field after the record version
  * number, given the way that _conversation_save() and dlist works.  See
- * _conversation_load() for the full shebang. */
+ * _conversation_load() for the full shebang.  Binary records keep it at
+ * a fixed offset. */
 static int _conversation_load_modseq(const char *data, int datalen,
                                      modseq_t *modseqp)
 {
@@ -1256,6 +1958,13 @@ static int _conversation_load_modseq(const char *data, int datalen,
     bit64 version = ~0ULL;
     int r;
 
+    if (CONV_IS_BINARY(data, datalen)) {
+        if (datalen < CONV_BREC_HEADERSIZE)
+            return IMAP_MAILBOX_BADFORMAT;
+        *modseqp = align_ntohll(data + CONV_BREC_MODSEQ);
+        return 0;
+    }
+
     r = parsenum(p, &p, (end-p), &version);
     if (r || version != CONVERSATIONS_VERSION)
         return IMAP_MAILBOX_BADFORMAT;
@@ -1281,10 +1990,7 @@ EXPORTED int conversation_get_modseq(struct conversations_state *state,
     int r;
 
     snprintf(bkey, sizeof(bkey), "B" CONV_FMT, cid);
-    r = cyrusdb_fetch(state->db,
-                  bkey, strlen(bkey),
-                  &data, &datalen,
-                  &state->txn);
+    r = conversation_fetch(state, bkey, &data, &datalen);
 
     if (r == CYRUSDB_NOTFOUND) {
         *modseqp = 0;
@@ -2349,6 +3055,9 @@ EXPORTED int conversations_zero_counts(struct conversations_state *state)
 {
     int r = 0;
 
+    r = conversations_flushcache(state, /*evicting*/0);
+    if (r) return r;
+
     /* wipe B counts */
     r = cyrusdb_foreach(state->db, "B", 1, NULL, zero_b_cb,
                         state, &state->txn);
@@ -2395,18 +3104,91 @@ static int cleanup_b_cb(void *rock,
 
 EXPORTED int conversations_cleanup_zero(struct conversations_state *state)
 {
+    int r = conversations_flushcache(state, /*evicting*/0);
+    if (r) return r;
+
     /* check B counts */
     return cyrusdb_foreach(state->db, "B", 1, NULL, cleanup_b_cb,
                            state, &state->txn);
 }
 
+static int convert_b_cb(void *rock,
+                        const char *key,
+                        size_t keylen,
+                        const char *val,
+                        size_t vallen)
+{
+    struct conversations_state *state = (struct conversations_state *)rock;
+    conversation_t *conv = NULL;
+    int r;
+
+    /* already in the wanted format */
+    if (!CONV_IS_BINARY(val, vallen) == !state->binary_records)
+        return 0;
+
+    r = conversation_parse(state, val, vallen, &conv);
+    if (r) {
+        syslog(LOG_ERR, "IOERROR: conversations invalid record %.*s",
+               (int)keylen, key);
+        return 0;
+    }
+
+    r = conversation_store(state, key, keylen, conv);
+    conversation_free(conv);
+
+    return r;
+}
+
+EXPORTED int conversations_convert_records(struct conversations_state *state)
+{
+    int r = conversations_flushcache(state, /*evicting*/0);
+    if (r) return r;
+
+    return cyrusdb_foreach(state->db, "B", 1, NULL, convert_b_cb,
+                           state, &state->txn);
+}
+
+struct dump_rock {
+    struct conversations_state *state;
+    struct buf buf;
+    FILE *fp;
+};
+
+static int dump_cb(void *rock,
+                   const char *key,
+                   size_t keylen,
+                   const char *val,
+                   size_t vallen)
+{
+    struct dump_rock *drock = (struct dump_rock *)rock;
+
+    /* binary B records are dumped as text, so undump can read them */
+    if (keylen && key[0] == 'B' &&
+        !conversation_totext(drock->state, val, vallen, &drock->buf)) {
+        val = drock->buf.s;
+        vallen = drock->buf.len;
+    }
+
+    fprintf(drock->fp, "%.*s\t%.*s\n", (int)keylen, key, (int)vallen, val);
+
+    return 0;
+}
+
 EXPORTED void conversations_dump(struct conversations_state *state, FILE *fp)
 {
-    cyrusdb_dumpfile(state->db, "", 0, fp, &state->txn);
+    struct dump_rock drock = { state, BUF_INITIALIZER, fp };
+
+    conversations_flushcache(state, /*evicting*/0);
+    cyrusdb_foreach(state->db, "", 0, NULL, dump_cb, &drock, &state->txn);
+    buf_free(&drock.buf);
 }
 
 EXPORTED int conversations_truncate(struct conversations_state *state)
 {
+    /* nothing cached survives a truncate */
+    conversations_dropcache(state);
+    construct_hash_table(&state->convcache, 1024, 0);
+
     return cyrusdb_truncate(state->db, &state->txn);
 }
 
@@ -71,6 +71,12 @@ struct conversations_state {
     strarray_t *folder_names;
     hash_table folderstatus;
     char *path;
+    int binary_records;         /* write B records in binary */
+    int shared;                 /* no write lock until the first write */
+    struct conversation *viewconv; /* backing for views of text records */
+    hash_table convcache;       /* changed B records, written at commit */
+    size_t convcache_bytes;
+    size_t convcache_limit;
 };
 
 struct conversations_open {
@@ -132,6 +138,20 @@ struct conv_status {
 };
 #define CONV_STATUS_INIT {0, 0, 0}
 
+/* A read-only view of a B record, giving the totals without building
+ * a conversation_t.  Binary records are read in place and text records
+ * are parsed once, so a view is only valid until the next operation on
+ * the database. */
+typedef struct conv_view conv_view_t;
+
+struct conv_view {
+    const char      *base;
+    size_t          len;
+    uint32_t        ncounts;
+    const char      *subject;
+    const conversation_t *conv; /* parsed text record, if not binary */
+};
+
 struct conversation {
     modseq_t        modseq;
     uint32_t        num_records;
@@ -160,6 +180,8 @@ extern int conversations_open_path(const char *path, const char *userid,
                                    struct conversations_state **statep);
 extern int conversations_open_user(const char *username,
                                    struct conversations_state **statep);
+extern int conversations_open_user_shared(const char *username,
+                                          struct conversations_state **statep);
 extern int conversations_open_mbox(const char *mboxname,
                                    struct conversations_state **statep);
 extern struct conversations_state *conversations_get_path(const char *path);
@@ -177,6 +199,13 @@ extern int conversations_add_msgid(struct conversations_state *state,
 extern int conversations_get_msgid(struct conversations_state *state,
                                    const char *msgid,
                                    arrayu64_t *cids);
+/* look up many msgids in one pass, calling 'cb' with the CIDs of each
+ * one which is in the database, in database order */
+typedef int conversations_msgid_cb(const char *msgid, const arrayu64_t *cids,
+                                   void *rock);
+extern int conversations_get_msgids(struct conversations_state *state,
+                                    const strarray_t *msgids,
+                                    conversations_msgid_cb *cb, void *rock);
 extern conv_folder_t *conversation_get_folder(conversation_t *conv,
                                               int number, int create_flag);
 
@@ -222,6 +251,25 @@ extern int conversation_parse(struct conversations_state *state,
 extern int conversation_store(struct conversations_state *state,
                                const char *key, int keylen,
                                conversation_t *conv);
+/* Fill 'buf' with the text form of a B record in either format */
+extern int conversation_totext(struct conversations_state *state,
+                               const char *data, size_t datalen,
+                               struct buf *buf);
+/* Rewrite every B record in the configured format */
+extern int conversations_convert_records(struct conversations_state *state);
+
+/* Zero-copy B record access.  A missing conversation gives an
+ * empty view, for which all the totals are zero. */
+extern int conversation_view(struct conversations_state *state,
+                             conversation_id_t cid,
+                             conv_view_t *view);
+extern modseq_t conv_view_modseq(const conv_view_t *view);
+extern uint32_t conv_view_num_records(const conv_view_t *view);
+extern uint32_t conv_view_exists(const conv_view_t *view);
+extern uint32_t conv_view_unseen(const conv_view_t *view);
+extern uint32_t conv_view_size(const conv_view_t *view);
+extern uint32_t conv_view_count(const conv_view_t *view, int idx);
+extern const char *conv_view_subject(const conv_view_t *view);
 /* Update the internal data about a conversation, enforcing
  * consistency rules (e.g. the conversation's modseq is the
  * maximum of all the per-folder modseqs).  Sets conv->dirty
@@ -70,7 +70,8 @@
 /* config.c stuff */
 const int config_need_data = CONFIG_NEED_PARTITION_DATA;
 
-enum { UNKNOWN, DUMP, UNDUMP, ZERO, BUILD, RECALC, AUDIT, CHECKFOLDERS };
+enum { UNKNOWN, DUMP, UNDUMP, ZERO, BUILD, RECALC, AUDIT, CHECKFOLDERS,
+       CONVERT };
 
 int verbose = 0;
 
@@ -373,6 +374,8 @@ static unsigned int diff_records(struct conversations_state *a,
     unsigned int ndiffs = 0;
     int ra, rb;
     struct cursor ca, cb;
+    struct buf texta = BUF_INITIALIZER;
+    struct buf textb = BUF_INITIALIZER;
     int keydelta;
     int delta;
 
@@ -405,7 +408,19 @@ static unsigned int diff_records(struct conversations_state *a,
 
         /* both exist an are the same key */
         delta = blob_compare(ca.data, ca.datalen, cb.data, cb.datalen);
-        if (delta) {
+        if (delta && ca.key[0] == 'B') {
+            /* the records may just be in different formats */
+            conversation_totext(a, ca.data, ca.datalen, &texta);
+            conversation_totext(b, cb.data, cb.datalen, &textb);
+            delta = blob_compare(texta.s, texta.len, textb.s, textb.len);
+            if (delta && verbose)
+                printf("REAL: \"%.*s\" data \"%.*s\"\n"
+                       "TEMP: \"%.*s\" data \"%.*s\"\n",
+                       (int)ca.keylen, ca.key, (int)texta.len, texta.s,
+                       (int)cb.keylen, cb.key, (int)textb.len, textb.s);
+            if (delta) ndiffs++;
+        }
+        else if (delta) {
             ndiffs++;
             if (verbose)
                 printf("REAL: \"%.*s\" data \"%.*s\"\n"
@@ -418,6 +433,9 @@ static unsigned int diff_records(struct conversations_state *a,
         rb = next_diffable_record(&cb);
     }
 
+    buf_free(&texta);
+    buf_free(&textb);
+
     return ndiffs;
 }
 
@@ -577,6 +595,39 @@ next:
     return 0;
 }
 
+static int do_convert(const char *fname, const char *userid)
+{
+    struct conversations_state *state = NULL;
+    int r;
+
+    r = conversations_open_path(fname, userid, &state);
+    if (r) {
+        fprintf(stderr, "Failed to open conversations database %s: %s\n",
+                fname, error_message(r));
+        return -1;
+    }
+
+    r = conversations_convert_records(state);
+    if (r) {
+        fprintf(stderr, "Failed to convert conversations database %s: %s\n",
+                fname, error_message(r));
+        conversations_abort(&state);
+        return -1;
+    }
+
+    r = conversations_commit(&state);
+    if (r) {
+        fprintf(stderr, "Failed to commit conversations database %s: %s\n",
+                fname, error_message(r));
+        return -1;
+    }
+
+    if (verbose)
+        printf("%s converted\n", userid);
+
+    return 0;
+}
+
 int do_checkfolders(const char *userid)
 {
     int r;
@@ -792,6 +843,11 @@ static int do_user(const char *userid, void *rock __attribute__((unused)))
             r = EC_NOINPUT;
         break;
 
+    case CONVERT:
+        if (do_convert(fname, userid))
+            r = EC_NOINPUT;
+        break;
+
     case UNKNOWN:
         fatal("UNKNOWN MODE", EC_SOFTWARE);
     }
@@ -809,7 +865,7 @@ int main(int argc, char **argv)
     int r = 0;
     int recursive = 0;
 
-    while ((c = getopt(argc, argv, "durzsAbvRFC:T:")) != EOF) {
+    while ((c = getopt(argc, argv, "durzsAbcvRFC:T:")) != EOF) {
         switch (c) {
         case 'd':
             if (mode != UNKNOWN)
@@ -857,6 +913,12 @@ int main(int argc, char **argv)
             mode = CHECKFOLDERS;
             break;
 
+        case 'c':
+            if (mode != UNKNOWN)
+                usage(argv[0]);
+            mode = CONVERT;
+            break;
+
         case 'v':
             verbose++;
             break;
@@ -916,6 +978,7 @@ static int usage(const char *name)
     fprintf(stderr, "    -R             recalculate all counts\n");
     fprintf(stderr, "    -A             audit conversations DB counts\n");
     fprintf(stderr, "    -F             check folder names\n");
+    fprintf(stderr, "    -c             rewrite records in the configured format\n");
     fprintf(stderr, "    -T dir         store temporary data for audit in dir\n");
     fprintf(stderr, "\n");
     fprintf(stderr, "    -r             recursive mode: username is a prefix\n");
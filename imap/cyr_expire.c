@@ -75,6 +75,8 @@
 #include "mboxevent.h"
 #include "mboxlist.h"
 #include "conversations.h"
+#include "cyrusdb.h"
+#include "sync_support.h"
 #include "util.h"
 #include "xmalloc.h"
 #include "strarray.h"
@@ -145,6 +147,11 @@ struct delete_rock {
     bool skip_annotate;
 };
 
+struct guiddb_rock {
+    strarray_t stale;
+    unsigned long entries_seen;
+};
+
 /* The global context */
 struct cyr_expire_ctx {
     struct arguments args;
@@ -152,6 +159,7 @@ struct cyr_expire_ctx {
     struct conversations_rock crock;
     struct delete_rock drock;
     struct expire_rock erock;
+    struct guiddb_rock grock;
 };
 
 static const struct cyr_expire_ctx zero_ctx;
@@ -192,6 +200,7 @@ static void cyr_expire_init(const char *progname, struct cyr_expire_ctx *ctx)
 
     construct_hash_table(&ctx->erock.table, 10000, 1);
     strarray_init(&ctx->drock.to_delete);
+    strarray_init(&ctx->grock.stale);
     construct_hash_table(&ctx->crock.seen, 100, 1);
 
     cyrus_init(ctx->args.altconfig, progname, 0, 0);
@@ -212,6 +221,7 @@ static void cyr_expire_cleanup(struct cyr_expire_ctx *ctx)
     free_hash_table(&ctx->erock.table, free);
     free_hash_table(&ctx->crock.seen, NULL);
     strarray_fini(&ctx->drock.to_delete);
+    strarray_fini(&ctx->grock.stale);
 
     duplicate_done();
     sasl_done();
@@ -614,6 +624,42 @@ done:
     return 0;
 }
 
+/* does the GUID lookup entry 'data' refer to a file which has gone? */
+static int guiddb_stale(const char *data, size_t datalen)
+{
+    struct stat sbuf;
+    const char *sp;
+    char *fname;
+    int stale;
+
+    /* the value is "<archived> <file name>" */
+    sp = memchr(data, ' ', datalen);
+    if (!sp) return 1;
+
+    fname = xstrndup(sp + 1, data + datalen - (sp + 1));
+    stale = (stat(fname, &sbuf) < 0 && errno == ENOENT);
+    free(fname);
+
+    return stale;
+}
+
+static int guiddb_cb(void *rock,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen)
+{
+    struct guiddb_rock *grock = (struct guiddb_rock *) rock;
+
+    if (sigquit)
+        return 1;
+
+    grock->entries_seen++;
+
+    if (guiddb_stale(data, datalen))
+        strarray_appendm(&grock->stale, xstrndup(key, keylen));
+
+    return 0;
+}
+
 static void sighandler(int sig __attribute((unused)))
 {
     sigquit = 1;
@@ -763,6 +809,80 @@ static int do_delete(struct cyr_expire_ctx *ctx)
     return ret;
 }
 
+/*
+ * A replica with sync_guid_lookup set records where it stored every
+ * message it was sent, and only drops an entry when a lookup finds the
+ * file gone.  Sweep out the entries for files which have gone since.
+ */
+static int do_guiddb_prune(struct cyr_expire_ctx *ctx)
+{
+    struct guiddb_rock *grock = &ctx->grock;
+    struct db *db = NULL;
+    struct txn *tid = NULL;
+    char *fname;
+    int i, r;
+
+    if (!config_getswitch(IMAPOPT_SYNC_GUID_LOOKUP))
+        return 0;
+
+    fname = strconcat(config_dir, FNAME_SYNCGUIDDB, (char *)NULL);
+    r = cyrusdb_open(config_getstring(IMAPOPT_SYNC_GUID_DB),
+                     fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s",
+               fname, cyrusdb_strerror(r));
+        goto done;
+    }
+
+    verbosep("Pruning GUID lookup db %s\n", fname);
+
+    /* check the files without holding the database locked */
+    r = cyrusdb_foreach(db, "", 0, NULL, guiddb_cb, grock, NULL);
+    if (r && !sigquit) {
+        syslog(LOG_ERR, "DBERROR: reading %s: %s",
+               fname, cyrusdb_strerror(r));
+    }
+
+    /* whatever was found stale is still stale if we were interrupted,
+     * unless the message has been stored again since */
+    r = 0;
+    for (i = 0; i < grock->stale.count; i++) {
+        const char *key = grock->stale.data[i];
+        const char *data;
+        size_t datalen;
+
+        r = cyrusdb_fetchlock(db, key, strlen(key), &data, &datalen, &tid);
+        if (r == CYRUSDB_NOTFOUND) {
+            r = 0;
+            continue;
+        }
+        if (!r && guiddb_stale(data, datalen))
+            r = cyrusdb_delete(db, key, strlen(key), &tid, /*force*/1);
+        if (r) break;
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: pruning %s: %s",
+               fname, cyrusdb_strerror(r));
+        if (tid) cyrusdb_abort(db, tid);
+    }
+    else if (tid) {
+        r = cyrusdb_commit(db, tid);
+    }
+
+    if (!r) {
+        syslog(LOG_NOTICE, "Pruned %d of %lu GUID lookup entries",
+               grock->stale.count, grock->entries_seen);
+        verbosep("Pruned %d of %lu GUID lookup entries\n",
+                 grock->stale.count, grock->entries_seen);
+    }
+
+    cyrusdb_close(db);
+
+done:
+    free(fname);
+    return r;
+}
+
 static int do_duplicate_prune(struct cyr_expire_ctx *ctx)
 {
     int ret = 0;
@@ -861,7 +981,7 @@ static int parse_args(int argc, char *argv[], struct arguments *args)
 
 int main(int argc, char *argv[])
 {
-    int r = 0;
+    int r = 0, r2;
     struct cyr_expire_ctx ctx = zero_ctx;
 
     progname = basename(argv[0]);
@@ -912,6 +1032,14 @@ int main(int argc, char *argv[])
     /* purge deliver.db entries of expired messages */
     r = do_duplicate_prune(&ctx);
 
+    if (sigquit)
+        goto finish;
+
+    /* purge sync_guid.db entries of removed messages, without losing
+     * an error from the deliver.db prune */
+    r2 = do_guiddb_prune(&ctx);
+    if (!r) r = r2;
+
  finish:
     cyr_expire_cleanup(&ctx);
     exit(r);
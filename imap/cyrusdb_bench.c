@@ -0,0 +1,205 @@
+/* cyrusdb_bench.c -- measure cyrusdb commit throughput with concurrent writers
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <errno.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include "cyrusdb.h"
+#include "exitcodes.h"
+#include "global.h"
+#include "libcyr_cfg.h"
+#include "util.h"
+#include "xmalloc.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-C altconfig] [-b backend] [-w writers]"
+                    " [-n commits] [-d delay] <db file>\n", name);
+    fprintf(stderr, "Each of <writers> processes makes <commits> single-key"
+                    " commits, first with\ngroup commit off and then on, waiting up to"
+                    " <delay> microseconds\nfor more commits to join each"
+                    " fsync.\n");
+    exit(EC_USAGE);
+}
+
+static int writer(const char *backend, const char *fname, int id, int commits)
+{
+    struct db *db = NULL;
+    char key[64];
+    int r, i;
+
+    r = cyrusdb_open(backend, fname, 0, &db);
+    if (r) return r;
+
+    for (i = 0; i < commits; i++) {
+        snprintf(key, sizeof(key), "user.writer%d.%08d", id, i);
+        r = cyrusdb_store(db, key, strlen(key), key, strlen(key), NULL);
+        if (r) break;
+    }
+
+    cyrusdb_close(db);
+
+    return r;
+}
+
+/* returns commits per second, or a negative number on failure */
+static double run(const char *backend, const char *fname,
+                  int writers, int commits, int group, int delay)
+{
+    struct db *db = NULL;
+    struct timeval start, end;
+    pid_t *pids = xzmalloc(writers * sizeof(pid_t));
+    int failed = 0;
+    int status;
+    int r, i;
+
+    unlink(fname);
+    r = cyrusdb_open(backend, fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        fprintf(stderr, "can't create %s: %s\n", fname, cyrusdb_strerror(r));
+        free(pids);
+        return -1;
+    }
+    cyrusdb_close(db);
+
+    libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_GROUPCOMMIT, group);
+    libcyrus_config_setint(CYRUSOPT_TWOSKIP_GROUPCOMMIT_DELAY, delay);
+
+    gettimeofday(&start, NULL);
+
+    for (i = 0; i < writers; i++) {
+        pids[i] = fork();
+        if (pids[i] < 0) {
+            perror("fork");
+            failed++;
+            break;
+        }
+        if (!pids[i])
+            _exit(writer(backend, fname, i, commits) ? 1 : 0);
+    }
+
+    for (i = 0; i < writers && pids[i] > 0; i++) {
+        if (waitpid(pids[i], &status, 0) < 0
+            || !WIFEXITED(status) || WEXITSTATUS(status))
+            failed++;
+    }
+
+    gettimeofday(&end, NULL);
+
+    free(pids);
+
+    if (failed) {
+        fprintf(stderr, "%d writer%s failed\n", failed, failed == 1 ? "" : "s");
+        return -1;
+    }
+
+    return (double) writers * commits / timesub(&start, &end);
+}
+
+int main(int argc, char **argv)
+{
+    const char *alt_config = NULL;
+    const char *backend = "twoskip";
+    const char *fname;
+    int writers = 8;
+    int commits = 200;
+    int delay = 0;
+    double before, after;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "C:b:w:n:d:")) != EOF) {
+        switch (opt) {
+        case 'C': /* alt config file */
+            alt_config = optarg;
+            break;
+        case 'b':
+            backend = optarg;
+            break;
+        case 'w':
+            writers = atoi(optarg);
+            break;
+        case 'n':
+            commits = atoi(optarg);
+            break;
+        case 'd':
+            delay = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind + 1 != argc || writers < 1 || commits < 1 || delay < 0)
+        usage(argv[0]);
+
+    fname = argv[optind];
+
+    cyrus_init(alt_config, "cyrusdb_bench", 0, 0);
+
+    printf("%s: %d writer%s x %d commits\n", backend, writers,
+           writers == 1 ? "" : "s", commits);
+
+    before = run(backend, fname, writers, commits, 0, 0);
+    if (before < 0) fatal("benchmark failed", EC_SOFTWARE);
+    printf("group commit off: %10.1f commits/sec\n", before);
+
+    after = run(backend, fname, writers, commits, 1, delay);
+    if (after < 0) fatal("benchmark failed", EC_SOFTWARE);
+    printf("group commit on:  %10.1f commits/sec (x%.2f)\n",
+           after, after / before);
+
+    unlink(fname);
+
+    cyrus_done();
+
+    return 0;
+}
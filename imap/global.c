@@ -72,6 +72,7 @@
 #include "libcyr_cfg.h"
 #include "mboxlist.h"
 #include "mutex.h"
+#include "prometheus.h"
 #include "prot.h" /* for PROT_BUFSIZE */
 #include "strarray.h"
 #include "userdeny.h"
@@ -179,6 +180,23 @@ static void cyrus_modules_done()
     }
 }
 
+static void checkpoint_stats(const char *fname __attribute__((unused)),
+                             double pause)
+{
+    prometheus_increment(CYRUS_DB_CHECKPOINTS_TOTAL);
+    prometheus_apply_delta(CYRUS_DB_CHECKPOINT_PAUSE_SECONDS_TOTAL, pause);
+}
+
+static void bloom_stats(const char *fname __attribute__((unused)),
+                        unsigned long checks, unsigned long negatives,
+                        unsigned long false_positives)
+{
+    prometheus_apply_delta(CYRUS_DB_BLOOM_CHECKS_TOTAL, checks);
+    prometheus_apply_delta(CYRUS_DB_BLOOM_NEGATIVES_TOTAL, negatives);
+    prometheus_apply_delta(CYRUS_DB_BLOOM_FALSE_POSITIVES_TOTAL,
+                           false_positives);
+}
+
 /* Called before a cyrus application starts (but after command line parameters
  * are read) */
 EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flags, int config_need_data)
@@ -370,9 +388,20 @@ EXPORTED int cyrus_init(const char *alt_config, const char *ident, unsigned flag
                                   config_getswitch(IMAPOPT_SQL_USESSL));
         libcyrus_config_setswitch(CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
                                   config_getswitch(IMAPOPT_SKIPLIST_ALWAYS_CHECKPOINT));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_GROUPCOMMIT,
+                                  config_getswitch(IMAPOPT_TWOSKIP_GROUPCOMMIT));
+        libcyrus_config_setint(CYRUSOPT_TWOSKIP_GROUPCOMMIT_DELAY,
+                               config_getint(IMAPOPT_TWOSKIP_GROUPCOMMIT_DELAY));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+                                  config_getswitch(IMAPOPT_TWOSKIP_SNAPSHOT_READS));
+        libcyrus_config_setswitch(CYRUSOPT_TWOSKIP_BLOOM,
+                                  config_getswitch(IMAPOPT_TWOSKIP_BLOOM));
 
         /* Not until all configuration parameters are set! */
         libcyrus_init();
+
+        cyrusdb_set_checkpoint_hook(&checkpoint_stats);
+        cyrusdb_set_bloom_hook(&bloom_stats);
     }
 
     /* debug lock timing */
@@ -864,6 +893,13 @@ EXPORTED const char *session_id(void)
     return (const char *)session_id_buf;
 }
 
+/* Reinstate a session id previously returned by session_id() */
+EXPORTED void session_set_id(const char *id)
+{
+    strlcpy(session_id_buf, id, MAX_SESSIONID_SIZE);
+    if (!session_id_count) session_id_count = 1;
+}
+
 /* parse sessionid out of protocol answers */
 EXPORTED void parse_sessionid(const char *str, char *sessionid)
 {
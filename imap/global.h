@@ -180,6 +180,7 @@ extern int charset_snippet_flags;
 /* Session ID */
 extern void session_new_id(void);
 extern const char *session_id(void);
+extern void session_set_id(const char *id);
 extern void parse_sessionid(const char *str, char *sessionid);
 
 /* Capability suppression */
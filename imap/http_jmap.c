@@ -43,6 +43,12 @@
 
 #include <config.h>
 
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
 #include <sasl/sasl.h>
 #include <sasl/saslutil.h>
 
@@ -51,8 +57,11 @@
 #include <openssl/rand.h>
 #endif /* HAVE_SSL */
 
+#include "annotate.h"
 #include "append.h"
+#include "charset.h"
 #include "cyrusdb.h"
+#include "exitcodes.h"
 #include "hash.h"
 #include "httpd.h"
 #include "http_dav.h"
@@ -60,8 +69,10 @@
 #include "mboxname.h"
 #include "msgrecord.h"
 #include "proxy.h"
+#include "retry.h"
 #include "times.h"
 #include "syslog.h"
+#include "workerpool.h"
 #include "xstrlcpy.h"
 
 /* generated headers are not necessarily in current directory */
@@ -83,6 +94,9 @@ static time_t compile_time;
 
 static json_t *jmap_capabilities = NULL;
 
+/* Workers to run read-only method calls side by side */
+static struct workerpool *jmap_workers = NULL;
+
 /* HTTP method handlers */
 static int jmap_get(struct transaction_t *txn, void *params);
 static int jmap_post(struct transaction_t *txn, void *params);
@@ -91,6 +105,8 @@ static int jmap_post(struct transaction_t *txn, void *params);
 static void jmap_init(struct buf *serverinfo);
 static int  jmap_need_auth(struct transaction_t *txn);
 static int  jmap_auth(const char *userid);
+static void jmap_reset(void);
+static void jmap_shutdown(void);
 
 static int  jmap_settings(struct transaction_t *txn);
 static int  jmap_initreq(jmap_req_t *req);
@@ -110,7 +126,7 @@ struct namespace_t namespace_jmap = {
     jmap_need_auth, /*authschemes*/0,
     /*mbtype*/0, 
     (ALLOW_READ | ALLOW_POST),
-    &jmap_init, &jmap_auth, NULL, NULL, NULL, /*bearer*/NULL,
+    &jmap_init, &jmap_auth, &jmap_reset, &jmap_shutdown, NULL, /*bearer*/NULL,
     {
         { NULL,                 NULL },                 /* ACL          */
         { NULL,                 NULL },                 /* BIND         */
@@ -316,6 +332,17 @@ static int jmap_auth(const char *userid __attribute__((unused)))
     return 0;
 }
 
+/* Dismiss the workers, which work as the user */
+static void jmap_reset(void)
+{
+    workerpool_finish(&jmap_workers);
+}
+
+static void jmap_shutdown(void)
+{
+    jmap_reset();
+}
+
 /* Perform a GET/HEAD request */
 static int jmap_get(struct transaction_t *txn,
                     void *params __attribute__((unused)))
@@ -586,6 +613,619 @@ static int validate_request(struct transaction_t *txn, json_t *req)
     return 0;
 }
 
+/*
+ * Streaming JSON response writer.
+ *
+ * Method responses are serialised as each call returns and held until
+ * more than PROT_BUFSIZE is pending, at which point the response header
+ * goes out and the body continues chunked.  A response that fits in the
+ * buffer is sent with a Content-Length as before, and a request that
+ * fails before anything is sent still gets its HTTP error status.
+ *
+ * A call that streams its own response does so with the conversations
+ * lock and its mailboxes held, so nothing it writes goes to the client
+ * until it has returned: output that overflows the buffer meanwhile is
+ * spooled to a temporary file, sent once the call has committed, and
+ * thrown away if the call fails.
+ */
+struct jmap_stream {
+    struct transaction_t *txn;
+    struct buf buf;             /* output not yet sent */
+    size_t flags;               /* json_dump_callback() flags */
+    int started;                /* response header has been sent */
+    size_t nitems;              /* method responses written */
+    size_t nelems;              /* elements written to the open array */
+    int held;                   /* a call is running - send nothing */
+    size_t mark;                /* buffered output from before the call */
+    size_t mark_nitems;         /* nitems from before the call */
+    int spoolfd;                /* held output that overflowed buf */
+    size_t spoollen;
+    int spoolerr;               /* spooling failed */
+};
+
+#define JMAP_STREAM_INITIALIZER \
+    { NULL, BUF_INITIALIZER, 0, 0, 0, 0, 0, 0, 0, -1, 0, 0 }
+
+static void jmap_stream_send(struct jmap_stream *s,
+                             const char *base, size_t len, int last)
+{
+    struct transaction_t *txn = s->txn;
+
+    if (!s->started) {
+        /* Too much to hold on to - switch to a chunked body */
+        if (!last) txn->flags.te |= TE_CHUNKED;
+
+        write_body(HTTP_OK, txn, base, len);
+        s->started = 1;
+    }
+    else {
+        if (len) write_body(0, txn, base, len);
+
+        /* End of output */
+        if (last) write_body(0, txn, NULL, 0);
+    }
+}
+
+static void jmap_stream_flush(struct jmap_stream *s, int last)
+{
+    jmap_stream_send(s, buf_base(&s->buf), buf_len(&s->buf), last);
+    buf_reset(&s->buf);
+}
+
+/* Move held output out of the buffer and into the spool file */
+static void jmap_stream_spool(struct jmap_stream *s)
+{
+    if (s->spoolerr) {
+        /* it's all going to be thrown away */
+        buf_truncate(&s->buf, s->spoollen ? 0 : s->mark);
+        return;
+    }
+
+    if (s->spoolfd < 0) {
+        s->spoolfd = create_tempfile(config_getstring(IMAPOPT_TEMP_PATH));
+        if (s->spoolfd < 0) {
+            syslog(LOG_ERR, "IOERROR: jmap: can't create spool file: %m");
+            s->spoolerr = 1;
+            return;
+        }
+    }
+
+    if (retry_write(s->spoolfd, buf_base(&s->buf), buf_len(&s->buf)) < 0) {
+        syslog(LOG_ERR, "IOERROR: jmap: can't write spool file: %m");
+        s->spoolerr = 1;
+        return;
+    }
+
+    s->spoollen += buf_len(&s->buf);
+    buf_reset(&s->buf);
+}
+
+/* Start holding output while a method call runs */
+static void jmap_stream_hold(struct jmap_stream *s)
+{
+    s->held = 1;
+    s->mark = buf_len(&s->buf);
+    s->mark_nitems = s->nitems;
+}
+
+/* Forget the output of the method call that just failed */
+static void jmap_stream_discard(struct jmap_stream *s)
+{
+    if (s->spoollen) {
+        /* the buffered output from before the call went first */
+        if (ftruncate(s->spoolfd, s->mark) < 0 ||
+            lseek(s->spoolfd, s->mark, SEEK_SET) < 0) {
+            syslog(LOG_ERR, "IOERROR: jmap: can't truncate spool file: %m");
+        }
+        s->spoollen = s->mark;
+        buf_reset(&s->buf);
+    }
+    else if (buf_len(&s->buf) > s->mark) {
+        buf_truncate(&s->buf, s->mark);
+    }
+
+    s->nitems = s->mark_nitems;
+    s->held = 0;
+    s->spoolerr = 0;
+}
+
+/* Send the output of the method call that just succeeded.
+ * Returns nonzero, having discarded it, if it was lost */
+static int jmap_stream_release(struct jmap_stream *s)
+{
+    char data[PROT_BUFSIZE];
+    off_t off = 0;
+    ssize_t n;
+
+    if (s->spoolerr) {
+        jmap_stream_discard(s);
+        return IMAP_IOERROR;
+    }
+
+    s->held = 0;
+    if (!s->spoollen) return 0;
+
+    while ((size_t) off < s->spoollen) {
+        n = pread(s->spoolfd, data, sizeof(data), off);
+        if (n <= 0) {
+            syslog(LOG_ERR, "IOERROR: jmap: can't read spool file: %m");
+            /* the call's output may already be partly sent, so there
+               is no well-formed way to carry on with this response */
+            fatal("can't read JMAP spool file", EC_IOERR);
+        }
+        jmap_stream_send(s, data, n, 0);
+        off += n;
+    }
+
+    if (ftruncate(s->spoolfd, 0) < 0 || lseek(s->spoolfd, 0, SEEK_SET) < 0) {
+        syslog(LOG_ERR, "IOERROR: jmap: can't truncate spool file: %m");
+        close(s->spoolfd);
+        s->spoolfd = -1;
+    }
+    s->spoollen = 0;
+
+    return 0;
+}
+
+static int jmap_stream_write(const char *buffer, size_t size, void *rock)
+{
+    struct jmap_stream *s = (struct jmap_stream *) rock;
+
+    buf_appendmap(&s->buf, buffer, size);
+    if (buf_len(&s->buf) > PROT_BUFSIZE) {
+        if (s->held) jmap_stream_spool(s);
+        else jmap_stream_flush(s, 0);
+    }
+
+    return 0;
+}
+
+static void jmap_stream_puts(struct jmap_stream *s, const char *str)
+{
+    jmap_stream_write(str, strlen(str), s);
+}
+
+static void jmap_stream_json(struct jmap_stream *s, json_t *val)
+{
+    json_dump_callback(val, &jmap_stream_write, s, s->flags|JSON_ENCODE_ANY);
+}
+
+/* Write the members of object obj, each preceded by a comma unless
+ * it is the first member of its object */
+static void jmap_stream_members(struct jmap_stream *s,
+                                json_t *obj, int first)
+{
+    const char *key;
+    json_t *val;
+
+    json_object_foreach(obj, key, val) {
+        if (!first) jmap_stream_puts(s, ",");
+        first = 0;
+
+        json_t *jkey = json_string(key);
+        jmap_stream_json(s, jkey);
+        json_decref(jkey);
+        jmap_stream_puts(s, ":");
+        jmap_stream_json(s, val);
+    }
+}
+
+static void jmap_stream_item(struct jmap_stream *s, json_t *item)
+{
+    if (s->nitems++) jmap_stream_puts(s, ",");
+    jmap_stream_json(s, item);
+}
+
+EXPORTED void jmap_stream_begin(jmap_req_t *req, const char *name,
+                                json_t *args, const char *key)
+{
+    struct jmap_stream *s = req->stream;
+    json_t *jstr;
+
+    if (s->nitems++) jmap_stream_puts(s, ",");
+    jmap_stream_puts(s, "[");
+    jstr = json_string(name);
+    jmap_stream_json(s, jstr);
+    json_decref(jstr);
+    jmap_stream_puts(s, ",{");
+    jmap_stream_members(s, args, 1);
+    if (json_object_size(args)) jmap_stream_puts(s, ",");
+    jstr = json_string(key);
+    jmap_stream_json(s, jstr);
+    json_decref(jstr);
+    jmap_stream_puts(s, ":[");
+
+    s->nelems = 0;
+}
+
+EXPORTED void jmap_stream_append(jmap_req_t *req, json_t *val)
+{
+    struct jmap_stream *s = req->stream;
+
+    if (s->nelems++) jmap_stream_puts(s, ",");
+    jmap_stream_json(s, val);
+    json_decref(val);
+}
+
+EXPORTED void jmap_stream_end(jmap_req_t *req, json_t *args)
+{
+    struct jmap_stream *s = req->stream;
+    json_t *jtag = json_string(req->tag);
+
+    jmap_stream_puts(s, "]");
+    jmap_stream_members(s, args, 0);
+    jmap_stream_puts(s, "},");
+    jmap_stream_json(s, jtag);
+    jmap_stream_puts(s, "]");
+    json_decref(jtag);
+}
+
+/* What a method call needs from the request it is part of */
+struct jmap_callrock {
+    struct transaction_t *txn;
+    json_t *resp;
+    struct jmap_idmap *idmap;
+    hash_table *accounts;
+    hash_table *mboxrights;
+    int shared;                 /* open conversations without locking */
+    struct jmap_stream *stream; /* where the call may stream its response */
+};
+
+/* Run method call mc, appending its response to crock->resp.
+ * Returns an HTTP status if the whole request has failed. */
+static int jmap_call(json_t *mc, struct jmap_callrock *crock)
+{
+    struct transaction_t *txn = crock->txn;
+    json_t *resp = crock->resp;
+    const jmap_method_t *mp;
+    const char *name = json_string_value(json_array_get(mc, 0));
+    json_t *args = json_array_get(mc, 1), *arg;
+    const char *tag = json_string_value(json_array_get(mc, 2));
+    char *inboxname = NULL;
+    int ret = 0, r = 0;
+
+    /* Find the message processor */
+    if (!(mp = find_methodproc(name))) {
+        json_array_append(resp, json_pack("[s {s:s} s]",
+                    "error", "type", "unknownMethod", tag));
+        return 0;
+    }
+
+    /* Determine account */
+    const char *accountid = httpd_userid;
+    arg = json_object_get(args, "accountId");
+    if (arg && arg != json_null()) {
+        if ((accountid = json_string_value(arg)) == NULL) {
+            json_t *err = json_pack("{s:s, s:[s]}",
+                    "type", "invalidArguments", "arguments", "accountId");
+            json_array_append(resp, json_pack("[s,o,s]", "error", err, tag));
+            return 0;
+        }
+        /* Check if any shared mailbox is accessible */
+        if (!hash_lookup(accountid, crock->accounts)) {
+            r = mymblist(httpd_userid, accountid, httpd_authstate,
+                         crock->mboxrights, is_accessible, NULL, 0/*all*/);
+            if (r != IMAP_OK_COMPLETED) {
+                json_t *err = json_pack("{s:s}", "type", "accountNotFound");
+                json_array_append_new(resp,
+                                      json_pack("[s,o,s]", "error", err, tag));
+                return 0;
+            }
+            hash_insert(accountid, (void*)1, crock->accounts);
+        }
+    }
+    inboxname = mboxname_user_mbox(accountid, NULL);
+
+    /* Pre-process result references */
+    if (process_resultrefs(args, resp)) {
+        json_array_append_new(resp, json_pack("[s,{s:s},s]",
+                    "error", "type", "resultReference", tag));
+        goto done;
+    }
+
+    struct conversations_state *cstate = NULL;
+    if (crock->shared)
+        r = conversations_open_user_shared(accountid, &cstate);
+    else
+        r = conversations_open_user(accountid, &cstate);
+    if (r) {
+        txn->error.desc = error_message(r);
+        ret = HTTP_SERVER_ERROR;
+        goto done;
+    }
+
+    struct jmap_req req;
+    req.userid = httpd_userid;
+    req.accountid = accountid;
+    req.inboxname = inboxname;
+    req.cstate = cstate;
+    req.authstate = httpd_authstate;
+    req.args = args;
+    req.response = resp;
+    req.tag = tag;
+    req.idmap = crock->idmap;
+    req.txn = txn;
+    req.mboxrights = crock->mboxrights;
+    req.is_shared_account = strcmp(accountid, httpd_userid);
+    req.stream = crock->stream;
+    req.readonly = crock->shared;
+
+    /* Initialize request context */
+    jmap_initreq(&req);
+
+    /* Read the modseq counters again, just in case something changed. */
+    r = mboxname_read_counters(inboxname, &req.counters);
+
+    /* Call the message processor. */
+    if (!r) r = mp->proc(&req);
+
+    /* Finalize request context */
+    jmap_finireq(&req);
+
+    if (r) {
+        conversations_abort(&req.cstate);
+        txn->error.desc = error_message(r);
+        ret = HTTP_SERVER_ERROR;
+        goto done;
+    }
+    conversations_commit(&req.cstate);
+
+done:
+    free(inboxname);
+    return ret;
+}
+
+/*
+ * Running independent method calls in parallel (jmap_parallel_calls).
+ *
+ * A run of read-only method calls, none of which refers to the result
+ * of another in the run, is shared out between workers which the httpd
+ * process keeps for as long as it serves the same user, so a run costs
+ * a round trip on a pipe per call rather than a fork.  Each call goes
+ * out with its references to earlier results already resolved.  The
+ * workers don't take the conversations write lock, and the responses
+ * are put back in call order, so the response is just what a serial
+ * run would have made.  Any call a worker doesn't answer is run by the
+ * parent itself.
+ */
+
+/* Does mc refer to the result of the call(s) tagged tag? */
+static int jmap_call_refers_tag(json_t *mc, const char *tag)
+{
+    json_t *args = json_array_get(mc, 1), *ref;
+    const char *arg;
+
+    json_object_foreach(args, arg, ref) {
+        if (*arg != '#') continue;
+
+        if (!strcmpsafe(json_string_value(json_object_get(ref, "resultOf")),
+                        tag))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Does mc refer to the result of any of calls first..last-1? */
+static int jmap_call_refers(json_t *mc, json_t *calls,
+                            size_t first, size_t last)
+{
+    size_t i;
+
+    for (i = first; i < last; i++) {
+        json_t *tag = json_array_get(json_array_get(calls, i), 2);
+        if (json_string_value(tag) &&
+            jmap_call_refers_tag(mc, json_string_value(tag)))
+            return 1;
+    }
+
+    return 0;
+}
+
+/* Does any call from calls[first] on refer to the result of tag? */
+static int jmap_tag_referenced(const char *tag, json_t *calls, size_t first)
+{
+    size_t i;
+
+    for (i = first; tag && i < json_array_size(calls); i++) {
+        if (jmap_call_refers_tag(json_array_get(calls, i), tag)) return 1;
+    }
+
+    return 0;
+}
+
+/* How many calls from first on can run side by side? */
+static size_t jmap_batch_size(json_t *calls, size_t first)
+{
+    size_t i;
+
+    for (i = first; i < json_array_size(calls); i++) {
+        json_t *mc = json_array_get(calls, i);
+        const jmap_method_t *mp =
+            find_methodproc(json_string_value(json_array_get(mc, 0)));
+
+        if (!mp || !(mp->flags & JMAP_READ_ONLY))
+            break;
+        if (jmap_call_refers(mc, calls, first, i))
+            break;
+    }
+
+    return i - first;
+}
+
+/* Let go of the client connections inherited from the parent, so that
+   the parent closing one closes it */
+static void jmap_worker_closesockets(void)
+{
+    int fd, maxfd = sysconf(_SC_OPEN_MAX);
+    int nullfd = open("/dev/null", O_RDWR);
+
+    for (fd = 0; fd < maxfd; fd++) {
+        struct sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+
+        if (fd == nullfd) continue;
+        if (getsockname(fd, (struct sockaddr *) &addr, &len) < 0) continue;
+        if (addr.ss_family == AF_UNIX) continue;    /* syslog and such */
+
+        if (fd <= 2 && nullfd >= 0) dup2(nullfd, fd);
+        else close(fd);
+    }
+
+    if (nullfd >= 0) close(nullfd);
+}
+
+static int jmap_worker_setup(void *rock)
+{
+    struct jmap_callrock *crock = rock;
+
+    jmap_worker_closesockets();
+
+    crock->shared = 1;
+    crock->stream = NULL;
+
+    return 0;
+}
+
+static int jmap_worker_run(int job __attribute__((unused)),
+                           const struct buf *in, struct buf *out, void *rock)
+{
+    struct jmap_callrock *crock = rock;
+    json_t *mc;
+    char *dump;
+    int r;
+
+    mc = json_loadb(in->s, in->len, 0, NULL);
+    if (!mc) return IMAP_INTERNAL;
+
+    /* nothing carries over from the last call, which may have been
+       for another request */
+    json_array_clear(crock->resp);
+    free_hash_table(crock->accounts, NULL);
+    construct_hash_table(crock->accounts, 8, 0);
+    free_hash_table(crock->mboxrights, free);
+    construct_hash_table(crock->mboxrights, 64, 0);
+
+    r = jmap_call(mc, crock);
+    json_decref(mc);
+    if (r) return r;
+
+    dump = json_dumps(crock->resp, JSON_PRESERVE_ORDER|JSON_COMPACT);
+    if (!dump) return IMAP_INTERNAL;
+
+    buf_appendcstr(out, dump);
+    free(dump);
+
+    return 0;
+}
+
+static void jmap_worker_cleanup(int r __attribute__((unused)),
+                                void *rock __attribute__((unused)))
+{
+    mboxlist_close();
+    annotatemore_close();
+}
+
+static const struct workerpool_ops jmap_worker_ops = {
+    jmap_worker_setup,
+    jmap_worker_run,
+    jmap_worker_cleanup
+};
+
+static int jmap_idmap_isempty(struct jmap_idmap *idmap)
+{
+    return !hash_numrecords(&idmap->mailboxes) &&
+        !hash_numrecords(&idmap->messages) &&
+        !hash_numrecords(&idmap->calendars) &&
+        !hash_numrecords(&idmap->calendarevents) &&
+        !hash_numrecords(&idmap->contactgroups) &&
+        !hash_numrecords(&idmap->contacts);
+}
+
+static int jmap_call_parallel(json_t *calls, size_t first, size_t count,
+                              int n, struct jmap_callrock *crock)
+{
+    json_t **results = xzmalloc(count * sizeof(json_t *));
+    struct buf buf = BUF_INITIALIZER;
+    int base = -1, lost = 0, job, r, ret = 0;
+    size_t i;
+
+    /* The workers only know the ids created before they were started,
+       which is none */
+    if (!jmap_workers && jmap_idmap_isempty(crock->idmap)) {
+        /* the workers open their own databases */
+        mboxlist_close();
+        annotatemore_close();
+
+        jmap_workers = workerpool_start("jmap", n, 0, WORKERPOOL_PERSIST,
+                                        &jmap_worker_ops, crock);
+    }
+
+    if (jmap_workers && jmap_idmap_isempty(crock->idmap)) {
+        for (i = 0; i < count; i++) {
+            json_t *mc = json_deep_copy(json_array_get(calls, first + i));
+            char *dump;
+
+            /* the workers don't have the earlier responses; a reference
+               which can't be resolved fails the same way in a worker */
+            process_resultrefs(json_array_get(mc, 1), crock->resp);
+            dump = json_dumps(mc, JSON_PRESERVE_ORDER|JSON_COMPACT);
+            json_decref(mc);
+            if (!dump) continue;
+
+            buf_initm(&buf, dump, strlen(dump));
+            job = workerpool_submit(jmap_workers, &buf);
+            if (base < 0) base = job;
+            buf_free(&buf);
+        }
+
+        while ((r = workerpool_next(jmap_workers, -1, &job, &buf))
+               != WORKERPOOL_DONE) {
+            json_t *out;
+
+            if (job < base || job >= base + (int) count) continue;
+            if (r) {
+                lost = 1;
+                continue;
+            }
+
+            out = json_loadb(buf.s, buf.len, 0, NULL);
+            if (out && !json_is_array(out)) {
+                json_decref(out);
+                out = NULL;
+            }
+            results[job - base] = out;
+        }
+
+        /* start afresh next time */
+        if (lost) workerpool_finish(&jmap_workers);
+    }
+
+    /* collect the responses in call order */
+    for (i = 0; i < count; i++) {
+        json_t *item;
+        size_t j;
+
+        if (!results[i]) {
+            ret = jmap_call(json_array_get(calls, first + i), crock);
+            if (ret) break;
+            continue;
+        }
+
+        json_array_foreach(results[i], j, item) {
+            json_array_append(crock->resp, item);
+        }
+    }
+
+    for (i = 0; i < count; i++) {
+        if (results[i]) json_decref(results[i]);
+    }
+    free(results);
+    buf_free(&buf);
+
+    return ret;
+}
+
 /* Perform a POST request */
 static int jmap_post(struct transaction_t *txn,
                      void *params __attribute__((unused)))
@@ -599,9 +1239,9 @@ static int jmap_post(struct transaction_t *txn,
         HASH_TABLE_INITIALIZER,
         HASH_TABLE_INITIALIZER
     };
-    size_t i, flags = JSON_PRESERVE_ORDER;
+    size_t i;
     int ret;
-    char *buf, *inboxname = NULL;
+    struct jmap_stream stream = JMAP_STREAM_INITIALIZER;
     hash_table accounts = HASH_TABLE_INITIALIZER;
     hash_table mboxrights = HASH_TABLE_INITIALIZER;
     strarray_t methods = STRARRAY_INITIALIZER;
@@ -634,6 +1274,11 @@ static int jmap_post(struct transaction_t *txn,
         ret = HTTP_SERVER_ERROR;
         goto done;
     }
+    txn->resp_body.type = "application/json; charset=utf-8";
+    stream.txn = txn;
+    stream.flags = JSON_PRESERVE_ORDER |
+        (config_httpprettytelemetry ? JSON_INDENT(2) : JSON_COMPACT);
+    jmap_stream_puts(&stream, "{\"methodResponses\":[");
 
     /* Allocate map to store uids */
     construct_hash_table(&idmap.mailboxes, 64, 0);
@@ -646,122 +1291,88 @@ static int jmap_post(struct transaction_t *txn,
     construct_hash_table(&accounts, 8, 0);
     construct_hash_table(&mboxrights, 64, 0);
 
+    json_t *calls = json_object_get(req, "methodCalls");
+    int nworkers = config_getint(IMAPOPT_JMAP_PARALLEL_CALLS);
+
+    /* tell syslog which methods were called (before any output,
+       since the request is logged with the response header) */
+    for (i = 0; i < json_array_size(calls); i++) {
+        json_t *mc = json_array_get(calls, i);
+        strarray_append(&methods, json_string_value(json_array_get(mc, 0)));
+    }
+    spool_cache_header(xstrdup(":jmap"),
+                       strarray_join(&methods, ","), txn->req_hdrs);
+
     /* Process each method call in the request */
-    json_t *mc;
-    json_array_foreach(json_object_get(req, "methodCalls"), i, mc) {
-        const jmap_method_t *mp;
-        const char *name = json_string_value(json_array_get(mc, 0));
-        json_t *args = json_array_get(mc, 1), *arg;
-        const char *tag = json_string_value(json_array_get(mc, 2));
-        int r = 0;
-
-        strarray_append(&methods, name);
-
-        /* Find the message processor */
-        if (!(mp = find_methodproc(name))) {
-            json_array_append(resp, json_pack("[s {s:s} s]",
-                        "error", "type", "unknownMethod", tag));
-            continue;
+    struct jmap_callrock crock = {
+        txn, resp, &idmap, &accounts, &mboxrights, 0 /*shared*/, NULL
+    };
+
+    for (i = 0; i < json_array_size(calls); ) {
+        size_t j, base = json_array_size(resp), count = 1;
+        json_t *mc = json_array_get(calls, i);
+
+        if (nworkers > 1) {
+            count = jmap_batch_size(calls, i);
+            if (!count) count = 1;
         }
 
-        /* Determine account */
-        const char *accountid = httpd_userid;
-        arg = json_object_get(args, "accountId");
-        if (arg && arg != json_null()) {
-            if ((accountid = json_string_value(arg)) == NULL) {
-                json_t *err = json_pack("{s:s, s:[s]}",
-                        "type", "invalidArguments", "arguments", "accountId");
-                json_array_append(resp, json_pack("[s,o,s]", "error", err, tag));
-                continue;
-            }
-            /* Check if any shared mailbox is accessible */
-            if (!hash_lookup(accountid, &accounts)) {
-                r = mymblist(httpd_userid, accountid, httpd_authstate,
-                             &mboxrights, is_accessible, NULL, 0/*all*/);
-                if (r != IMAP_OK_COMPLETED) {
-                    json_t *err = json_pack("{s:s}", "type", "accountNotFound");
-                    json_array_append_new(resp,
-                                          json_pack("[s,o,s]", "error", err, tag));
-                    continue;
+        if (count > 1) {
+            crock.stream = NULL;
+            ret = jmap_call_parallel(calls, i, count, nworkers, &crock);
+        }
+        else {
+            /* A response that no later call refers to can be streamed */
+            const char *tag = json_string_value(json_array_get(mc, 2));
+            crock.stream = jmap_tag_referenced(tag, calls, i + 1) ?
+                NULL : &stream;
+            if (crock.stream) {
+                /* Nothing goes out until the call has let go of
+                   its locks, and nothing at all if it fails */
+                jmap_stream_hold(&stream);
+                ret = jmap_call(mc, &crock);
+                if (ret) {
+                    jmap_stream_discard(&stream);
+                }
+                else if (jmap_stream_release(&stream)) {
+                    txn->error.desc = error_message(IMAP_IOERROR);
+                    ret = HTTP_SERVER_ERROR;
                 }
-                hash_insert(accountid, (void*)1, &accounts);
             }
+            else ret = jmap_call(mc, &crock);
         }
-        free(inboxname);
-        inboxname = mboxname_user_mbox(accountid, NULL);
-
-        /* Pre-process result references */
-        if (process_resultrefs(args, resp)) {
-            json_array_append_new(resp, json_pack("[s,{s:s},s]",
-                        "error", "type", "resultReference", tag));
-            continue;
-        }
-
-        struct conversations_state *cstate = NULL;
-        r = conversations_open_user(accountid, &cstate);
-        if (r) {
-            txn->error.desc = error_message(r);
-            ret = HTTP_SERVER_ERROR;
-            goto done;
+        if (ret) {
+            /* Too late to fail the request - report it in the response */
+            if (!stream.started) goto done;
+
+            syslog(LOG_ERR, "jmap_post: %s failed after response started: %s",
+                   json_string_value(json_array_get(mc, 0)),
+                   txn->error.desc ? txn->error.desc : "unknown error");
+            json_array_append_new(resp,
+                    json_pack("[s,{s:s},s]", "error", "type", "serverError",
+                              json_string_value(json_array_get(mc, 2))));
+            i = json_array_size(calls);
+            ret = 0;
         }
-
-        struct jmap_req req;
-        req.userid = httpd_userid;
-        req.accountid = accountid;
-        req.inboxname = inboxname;
-        req.cstate = cstate;
-        req.authstate = httpd_authstate;
-        req.args = args;
-        req.response = resp;
-        req.tag = tag;
-        req.idmap = &idmap;
-        req.txn = txn;
-        req.mboxrights = &mboxrights;
-        req.is_shared_account = strcmp(accountid, httpd_userid);
-
-        /* Initialize request context */
-        jmap_initreq(&req);
-
-        /* Read the modseq counters again, just in case something changed. */
-        r = mboxname_read_counters(inboxname, &req.counters);
-        if (r) goto done;
-
-        /* Call the message processor. */
-        r = mp->proc(&req);
-
-        /* Finalize request context */
-        jmap_finireq(&req);
-
-        if (r) {
-            conversations_abort(&req.cstate);
-            txn->error.desc = error_message(r);
-            ret = HTTP_SERVER_ERROR;
-            goto done;
+        else i += count;
+
+        /* Write out the new responses, and free those no later call
+           refers to */
+        for (j = base; j < json_array_size(resp); ) {
+            json_t *item = json_array_get(resp, j);
+
+            jmap_stream_item(&stream, item);
+            if (jmap_tag_referenced(json_string_value(json_array_get(item, 2)),
+                                    calls, i))
+                j++;
+            else
+                json_array_remove(resp, j);
         }
-        conversations_commit(&req.cstate);
     }
 
-    /* tell syslog which methods were called */
-    spool_cache_header(xstrdup(":jmap"),
-                       strarray_join(&methods, ","), txn->req_hdrs);
-
-
-    /* Dump JSON object into a text buffer */
-    json_t *res = json_pack("{s:O}", "methodResponses", resp);
-    flags |= (config_httpprettytelemetry ? JSON_INDENT(2) : JSON_COMPACT);
-    buf = json_dumps(res, flags);
-    json_decref(res);
-
-    if (!buf) {
-        txn->error.desc = "Error dumping JSON response object";
-        ret = HTTP_SERVER_ERROR;
-        goto done;
-    }
-
-    /* Output the JSON object */
-    txn->resp_body.type = "application/json; charset=utf-8";
-    write_body(HTTP_OK, txn, buf, strlen(buf));
-    free(buf);
+    /* Output the rest of the JSON object */
+    jmap_stream_puts(&stream, "]}");
+    jmap_stream_flush(&stream, 1);
 
   done:
     free_hash_table(&idmap.mailboxes, free);
@@ -772,9 +1383,10 @@ static int jmap_post(struct transaction_t *txn,
     free_hash_table(&idmap.contacts, free);
     free_hash_table(&accounts, NULL);
     free_hash_table(&mboxrights, free);
-    free(inboxname);
     if (req) json_decref(req);
     if (resp) json_decref(resp);
+    buf_free(&stream.buf);
+    if (stream.spoolfd >= 0) close(stream.spoolfd);
     strarray_fini(&methods);
 
     syslog(LOG_DEBUG, ">>>> jmap_post: Exit\n");
@@ -980,6 +1592,91 @@ done:
 }
 
 
+/* Encoded bytes decoded at a time by write_decoded() */
+#define DECODE_CHUNK  (64 * 1024)
+
+/* Send a base64 or quoted-printable body part decoded, a chunk at a
+ * time, as a chunked response.  The decoded length isn't known until
+ * the whole part has been decoded, so a Range request costs an extra
+ * decoding pass to count it; multiple ranges get the whole part. */
+static void write_decoded(struct transaction_t *txn, long code,
+                          const char *base, size_t len, int encoding)
+{
+    struct buf buf = BUF_INITIALIZER;
+    struct range *range = NULL;
+    unsigned long first = 0, last = ULONG_MAX, pos = 0;
+    charset_decoder *dec;
+    size_t i, n;
+
+    if (code == HTTP_PARTIAL) {
+        unsigned long total = 0;
+
+        dec = charset_decoder_new(encoding, &buf);
+        for (i = 0; i < len; i += n) {
+            n = MIN(DECODE_CHUNK, len - i);
+            charset_decoder_write(dec, base + i, n);
+            total += buf_len(&buf);
+            buf_reset(&buf);
+        }
+        charset_decoder_flush(dec);
+        total += buf_len(&buf);
+        buf_reset(&buf);
+        charset_decoder_free(&dec);
+
+        code = parse_ranges(*spool_getheader(txn->req_hdrs, "Range"),
+                            total, &range);
+        txn->resp_body.len = total;
+
+        if (code == HTTP_PARTIAL && range->next) {
+            /* Multiple ranges - send the whole part */
+            while (range) {
+                struct range *next = range->next;
+                free(range);
+                range = next;
+            }
+            code = HTTP_OK;
+        }
+        else if (code == HTTP_PARTIAL) {
+            first = range->first;
+            last = range->last;
+        }
+    }
+
+    /* Content-Range comes from resp_body.range and .len */
+    txn->resp_body.range = range;
+    txn->flags.te |= TE_CHUNKED;
+    write_body(code, txn, NULL, 0);
+
+    if (txn->meth == METH_HEAD) return;
+
+    if (code != HTTP_BAD_RANGE) {
+        dec = charset_decoder_new(encoding, &buf);
+        for (i = 0; pos <= last; i += n) {
+            size_t from, to;
+
+            n = MIN(DECODE_CHUNK, len - i);
+            if (n) charset_decoder_write(dec, base + i, n);
+            else charset_decoder_flush(dec);
+
+            /* Send whatever part of this chunk falls in the range */
+            from = first > pos ? MIN(first - pos, buf_len(&buf)) : 0;
+            to = last - pos < buf_len(&buf) ? last - pos + 1 : buf_len(&buf);
+            if (to > from) write_body(0, txn, buf_base(&buf) + from, to - from);
+
+            pos += buf_len(&buf);
+            buf_reset(&buf);
+
+            if (!n) break;
+        }
+        charset_decoder_free(&dec);
+    }
+
+    /* End of output */
+    write_body(0, txn, NULL, 0);
+
+    buf_free(&buf);
+}
+
 EXPORTED int jmap_download(struct transaction_t *txn)
 {
     const char *userid = txn->req_tgt.resource;
@@ -1041,6 +1738,8 @@ EXPORTED int jmap_download(struct transaction_t *txn)
     req.tag = NULL;
     req.idmap = NULL;
     req.txn = txn;
+    req.stream = NULL;
+    req.readonly = 0;
 
     jmap_initreq(&req);
 
@@ -1051,10 +1750,10 @@ EXPORTED int jmap_download(struct transaction_t *txn)
     struct body *body = NULL;
     const struct body *part = NULL;
     struct buf msg_buf = BUF_INITIALIZER;
-    char *decbuf = NULL;
     char *ctype = NULL;
     strarray_t headers = STRARRAY_INITIALIZER;
-    int res = 0;
+    time_t lastmod = 0;
+    int res = 0, precond;
 
     /* Find part containing blob */
     r = jmap_findblob(&req, blobid, &mbox, &mr, &body, &part);
@@ -1064,6 +1763,34 @@ EXPORTED int jmap_download(struct transaction_t *txn)
         goto done;
     }
 
+    /* Blobs never change, so the blobid is a strong validator
+       (kept static, as it goes out with the response after we return) */
+    static char etag[42];
+    strlcpy(etag, blobid, sizeof(etag));
+    msgrecord_get_internaldate(mr, &lastmod);
+    txn->flags.ranges = 1;
+
+    /* Check any preconditions, including range request */
+    precond = check_precond(txn, etag, lastmod);
+
+    switch (precond) {
+    case HTTP_OK:
+    case HTTP_PARTIAL:
+    case HTTP_NOT_MODIFIED:
+        /* Fill in ETag and Last-Modified */
+        txn->resp_body.etag = etag;
+        txn->resp_body.lastmod = lastmod;
+
+        if (precond != HTTP_NOT_MODIFIED) break;
+
+        GCC_FALLTHROUGH
+
+    default:
+        /* We failed a precondition - don't perform the request */
+        res = precond;
+        goto done;
+    }
+
     /* Map the message into memory */
     r = msgrecord_get_body(mr, &msg_buf);
     if (r) {
@@ -1075,6 +1802,7 @@ EXPORTED int jmap_download(struct transaction_t *txn)
     // default with no part is the whole message
     const char *base = msg_buf.s;
     size_t len = msg_buf.len;
+    int encoding = ENCODING_NONE;
     txn->resp_body.type = "message/rfc822";
 
     if (part) {
@@ -1102,17 +1830,20 @@ EXPORTED int jmap_download(struct transaction_t *txn)
         }
 
         // binary decode if needed
-        int encoding = part->charset_enc & 0xff;
-        base = charset_decode_mimebody(base, len, encoding, &decbuf, &len);
+        encoding = part->charset_enc & 0xff;
     }
 
-    txn->resp_body.len = len;
     txn->resp_body.fname = name;
 
-    write_body(HTTP_OK, txn, base, len);
+    if (encoding == ENCODING_QP || encoding == ENCODING_BASE64) {
+        write_decoded(txn, precond, base, len, encoding);
+    }
+    else {
+        /* Straight from the mapped message, with any Range */
+        write_body(precond, txn, base, len);
+    }
 
  done:
-    free(decbuf);
     free(ctype);
     strarray_fini(&headers);
     if (mbox) jmap_closembox(&req, &mbox);
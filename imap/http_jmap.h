@@ -80,11 +80,18 @@ typedef struct jmap_req {
     ptrarray_t *mboxes;
     int is_shared_account;
     hash_table *mboxrights;
+    struct jmap_stream *stream;         /* NULL unless streaming allowed */
+    int readonly;                       /* running alongside other calls,
+                                           mustn't write anything */
 } jmap_req_t;
 
+/* Method flags */
+#define JMAP_READ_ONLY  (1<<0)  /* may run alongside other read-only calls */
+
 typedef struct {
     const char *name;
     int (*proc)(struct jmap_req *req);
+    int flags;
 } jmap_method_t;
 
 /* Protocol implementations */
@@ -113,6 +120,20 @@ extern int  jmap_myrights(jmap_req_t *req, const mbentry_t *mbentry);
 extern int  jmap_myrights_byname(jmap_req_t *req, const char *mboxname);
 extern void jmap_myrights_delete(jmap_req_t *req, const char *mboxname);
 
+/* Streamed method responses.
+ *
+ * A method whose req->stream is set may write its response piecewise
+ * rather than appending it to req->response, so that a large list need
+ * never be held in memory whole.  jmap_stream_begin() writes the method
+ * name and the members of args and opens an array member named key;
+ * jmap_stream_append() writes one array element and releases it;
+ * jmap_stream_end() closes the array and writes the members of args
+ * followed by the tag. */
+extern void jmap_stream_begin(jmap_req_t *req, const char *name,
+                              json_t *args, const char *key);
+extern void jmap_stream_append(jmap_req_t *req, json_t *val);
+extern void jmap_stream_end(jmap_req_t *req, json_t *args);
+
 /* Blob services */
 extern int jmap_upload(struct transaction_t *txn);
 extern int jmap_download(struct transaction_t *txn);
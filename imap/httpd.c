@@ -96,6 +96,7 @@
 
 /* generated headers are not necessarily in current directory */
 #include "imap/http_err.h"
+#include "master/service.h"
 
 #ifdef WITH_DAV
 #include "http_dav.h"
@@ -314,6 +315,42 @@ int config_httpprettytelemetry;
 static time_t compile_time;
 struct buf serverinfo = BUF_INITIALIZER;
 
+/* An HTTP connection, and the per-connection state which lives
+   in the globals above while the connection is being served */
+struct httpd_client {
+    struct http_connection conn;
+    struct auth_scheme_t *auth_scheme;
+    char *clienthost;
+    char *localip;
+    char *remoteip;
+
+    /* saved while parked */
+    char sessionid[MAX_SESSIONID_SIZE];
+    struct protstream *in;
+    struct protstream *out;
+    sasl_conn_t *saslconn;
+    struct saslprops_t saslprops;
+    int logfd;
+    unsigned avail_auth_schemes;
+    int tls_required;
+    char *authid;
+    char *userid;
+    char *extrafolder;
+    char *extradomain;
+    struct auth_state *authstate;
+    int userisadmin;
+    int userisproxyadmin;
+    int userisanonymous;
+    struct backend *backend_current;
+    struct backend **backend_cached;
+};
+
+/* idle connections parked with the service skeleton */
+static int httpd_idle_max = 0;
+
+/* user for whom the namespaces' auth hooks last ran */
+static char *namespace_userid = NULL;
+
 int ignorequota = 0;
 int apns_enabled = 0;
 
@@ -368,11 +405,13 @@ void shut_down(int code) __attribute__ ((noreturn));
 /* Enable the resetting of a sasl_conn_t */
 static int reset_saslconn(sasl_conn_t **conn);
 
-static void cmdloop(struct http_connection *conn);
+static int cmdloop(struct httpd_client *client);
+static int namespace_setuser(const char *userid);
+static int can_park(struct transaction_t *txn);
+static int park_connection(struct httpd_client *client);
+static void resume_connection(int fd, int timedout, void *rock);
 static int parse_expect(struct transaction_t *txn);
 static int parse_connection(struct transaction_t *txn);
-static int parse_ranges(const char *hdr, unsigned long len,
-                        struct range **ranges);
 static int proxy_authz(const char **authzid, struct transaction_t *txn);
 static int auth_success(struct transaction_t *txn, const char *userid);
 static int http_auth(const char *creds, struct transaction_t *txn);
@@ -485,6 +524,8 @@ static void httpd_reset(struct http_connection *conn)
         if (namespaces[i]->enabled && namespaces[i]->reset)
             namespaces[i]->reset();
     }
+    free(namespace_userid);
+    namespace_userid = NULL;
 
     /* Reset available authentication schemes */
     avail_auth_schemes = 0;
@@ -681,6 +722,11 @@ int service_init(int argc __attribute__((unused)),
 
     compile_time = calc_compile_time(__TIME__, __DATE__);
 
+    httpd_idle_max = config_getint(IMAPOPT_HTTPIDLECONNECTIONS);
+    if (httpd_idle_max < 0) httpd_idle_max = 0;
+    if (httpd_idle_max > 1000) httpd_idle_max = 1000;
+    service_park_limit(httpd_idle_max);
+
     return 0;
 }
 
@@ -692,6 +738,41 @@ static void sigalrm_handler(int sig __attribute__((unused)))
     gotsigalrm = 1;
 }
 
+/* Setup the signal handler for keepalive heartbeat */
+static void keepalive_init(void)
+{
+    httpd_keepalive = config_getint(IMAPOPT_HTTPKEEPALIVE);
+    if (httpd_keepalive < 0) httpd_keepalive = 0;
+    if (httpd_keepalive) {
+        struct sigaction action;
+
+        sigemptyset(&action.sa_mask);
+        action.sa_flags = 0;
+#ifdef SA_RESTART
+        action.sa_flags |= SA_RESTART;
+#endif
+        action.sa_handler = sigalrm_handler;
+        if (sigaction(SIGALRM, &action, NULL) < 0) {
+            syslog(LOG_ERR, "unable to install signal handler for %d: %m", SIGALRM);
+            httpd_keepalive = 0;
+        }
+    }
+}
+
+/* Close the connection being served and free its state */
+static void end_connection(struct httpd_client *client)
+{
+    /* cleanup */
+    signal(SIGALRM, SIG_IGN);
+    httpd_reset(&client->conn);
+
+    httpd_localip = httpd_remoteip = NULL;
+    free(client->clienthost);
+    free(client->localip);
+    free(client->remoteip);
+    free(client);
+}
+
 
 /*
  * run for each accepted connection
@@ -705,19 +786,29 @@ int service_main(int argc __attribute__((unused)),
     int mechcount = 0;
     size_t mechlen;
     struct auth_scheme_t *scheme;
-    struct http_connection http_conn;
+    struct httpd_client *client;
 
     session_new_id();
 
     signals_poll();
 
+    /* Drop any per-user state left behind by a parked connection */
+    namespace_setuser(NULL);
+
     httpd_in = prot_new(0, 0);
     httpd_out = prot_new(1, 1);
     protgroup_insert(protin, httpd_in);
 
+    client = xzmalloc(sizeof(struct httpd_client));
+
     /* Find out name of client host */
     httpd_clienthost = get_clienthost(0, &httpd_localip, &httpd_remoteip);
 
+    /* Keep our own copies, which outlive the next connection */
+    httpd_clienthost = client->clienthost = xstrdup(httpd_clienthost);
+    httpd_localip = client->localip = xstrdupnull(httpd_localip);
+    httpd_remoteip = client->remoteip = xstrdupnull(httpd_remoteip);
+
     if (httpd_localip && httpd_remoteip) {
         buf_setcstr(&saslprops.ipremoteport, httpd_remoteip);
         buf_setcstr(&saslprops.iplocalport, httpd_localip);
@@ -779,12 +870,11 @@ int service_main(int argc __attribute__((unused)),
     prot_setflushonread(httpd_in, httpd_out);
 
     /* Setup HTTP connection */
-    memset(&http_conn, 0, sizeof(struct http_connection));
-    http_conn.pin = httpd_in;
-    http_conn.pout = httpd_out;
+    client->conn.pin = httpd_in;
+    client->conn.pout = httpd_out;
 
     /* Create XML parser context */
-    if (!(http_conn.xml = xmlNewParserCtxt())) {
+    if (!(client->conn.xml = xmlNewParserCtxt())) {
         fatal("Unable to create XML parser", EC_TEMPFAIL);
     }
 
@@ -793,40 +883,200 @@ int service_main(int argc __attribute__((unused)),
     if (https == 1) {
         int r, http2 = 0;
 
-        r = starttls(NULL, &http_conn.tls_ctx, &http2);
-        if (!r && http2) r = http2_start_session(&http_conn, NULL);
+        r = starttls(NULL, &client->conn.tls_ctx, &http2);
+        if (!r && http2) r = http2_start_session(&client->conn, NULL);
         if (r) shut_down(0);
     }
 
-    /* Setup the signal handler for keepalive heartbeat */
-    httpd_keepalive = config_getint(IMAPOPT_HTTPKEEPALIVE);
-    if (httpd_keepalive < 0) httpd_keepalive = 0;
-    if (httpd_keepalive) {
-        struct sigaction action;
+    keepalive_init();
 
-        sigemptyset(&action.sa_mask);
-        action.sa_flags = 0;
-#ifdef SA_RESTART
-        action.sa_flags |= SA_RESTART;
-#endif
-        action.sa_handler = sigalrm_handler;
-        if (sigaction(SIGALRM, &action, NULL) < 0) {
-            syslog(LOG_ERR, "unable to install signal handler for %d: %m", SIGALRM);
-            httpd_keepalive = 0;
+    if (cmdloop(client)) {
+        /* Parked until the client sends its next request */
+        return 0;
+    }
+
+    /* Closing connection */
+    end_connection(client);
+
+    return 0;
+}
+
+
+/*
+ * Idle connections
+ *
+ * Rather than block in cmdloop() waiting for the next request on a
+ * persistent connection, we can park the connection with the service
+ * skeleton and return, so that this process can accept new connections
+ * and serve any other parked connection that becomes active.  The TLS,
+ * HTTP/2 and SASL contexts and any backend connections stay in this
+ * process; what we have to swap is the socket on stdin/stdout and the
+ * per-connection globals.  Once httpidleconnections are parked, the
+ * skeleton stops accepting new connections until one of them closes.
+ */
+
+/* Make the namespaces' per-user state (set up by their auth hooks)
+   belong to 'userid', which may be NULL */
+static int namespace_setuser(const char *userid)
+{
+    int i;
+
+    if (!strcmpsafe(userid, namespace_userid)) return 0;
+
+    for (i = 0; namespaces[i]; i++) {
+        if (namespaces[i]->enabled && namespaces[i]->reset)
+            namespaces[i]->reset();
+    }
+    free(namespace_userid);
+    namespace_userid = NULL;
+
+    if (!userid) return 0;
+
+    for (i = 0; namespaces[i]; i++) {
+        if (namespaces[i]->enabled && namespaces[i]->auth) {
+            int ret = namespaces[i]->auth(userid);
+            if (ret) return ret;
         }
     }
+    namespace_userid = xstrdup(userid);
 
-    cmdloop(&http_conn);
+    return 0;
+}
 
-    /* Closing connection */
+/* Can we give up on the current connection until it has more input? */
+static int can_park(struct transaction_t *txn)
+{
+    struct protgroup *ready = NULL;
+    struct timeval notime = { 0, 0 };
+    int n;
+
+    /* Only park if we would otherwise block */
+    n = prot_select(protin, PROT_NO_FD, &ready, NULL, &notime);
+    if (ready) protgroup_free(ready);
+
+    return (n == 0);
+}
+
+/* Park the current connection, moving its per-connection globals into
+   'client'.  Returns 0 if parked, -1 if we have to keep serving it. */
+static int park_connection(struct httpd_client *client)
+{
+    int fd, devnull;
+
+    fd = dup(0);
+    if (fd < 0) return -1;
+
+    if (service_park(fd, httpd_timeout, &resume_connection, client)) {
+        close(fd);
+        return -1;
+    }
+
+    /* Replace the socket on stdin/stdout/stderr */
+    devnull = open("/dev/null", O_RDWR, 0);
+    if (devnull == -1) {
+        fatal("open() on /dev/null failed", EC_TEMPFAIL);
+    }
+    dup2(devnull, 0);
+    dup2(devnull, 1);
+    dup2(devnull, 2);
+    if (devnull > 2) close(devnull);
 
-    /* cleanup */
     signal(SIGALRM, SIG_IGN);
-    httpd_reset(&http_conn);
+
+    strlcpy(client->sessionid, session_id(), sizeof(client->sessionid));
+    client->in = httpd_in;
+    client->out = httpd_out;
+    client->saslconn = httpd_saslconn;
+    client->saslprops = saslprops;
+    client->logfd = httpd_logfd;
+    client->avail_auth_schemes = avail_auth_schemes;
+    client->tls_required = httpd_tls_required;
+    client->authid = httpd_authid;
+    client->userid = httpd_userid;
+    client->extrafolder = httpd_extrafolder;
+    client->extradomain = httpd_extradomain;
+    client->authstate = httpd_authstate;
+    client->userisadmin = httpd_userisadmin;
+    client->userisproxyadmin = httpd_userisproxyadmin;
+    client->userisanonymous = httpd_userisanonymous;
+    client->backend_current = backend_current;
+    client->backend_cached = backend_cached;
+
+    protgroup_reset(protin);
+    httpd_in = httpd_out = NULL;
+    httpd_saslconn = NULL;
+    memset(&saslprops, 0, sizeof(struct saslprops_t));
+    httpd_logfd = -1;
+    avail_auth_schemes = 0;
+    httpd_tls_required = 0;
+    httpd_authid = httpd_userid = NULL;
+    httpd_extrafolder = httpd_extradomain = NULL;
+    httpd_authstate = NULL;
+    httpd_userisadmin = httpd_userisproxyadmin = 0;
+    httpd_userisanonymous = 1;
+    httpd_clienthost = "[local]";
+    httpd_localip = httpd_remoteip = NULL;
+    backend_current = NULL;
+    backend_cached = NULL;
 
     return 0;
 }
 
+/* Called by the service skeleton when a parked connection has input */
+static void resume_connection(int fd, int timedout, void *rock)
+{
+    struct httpd_client *client = (struct httpd_client *) rock;
+    int r;
+
+    if ((dup2(fd, 0) < 0) || (dup2(fd, 1) < 0) || (dup2(fd, 2) < 0)) {
+        syslog(LOG_ERR, "can't duplicate parked socket: %m");
+        fatal("can't duplicate parked socket", EC_OSERR);
+    }
+    close(fd);
+
+    session_set_id(client->sessionid);
+    httpd_in = client->in;
+    httpd_out = client->out;
+    httpd_saslconn = client->saslconn;
+    saslprops = client->saslprops;
+    httpd_logfd = client->logfd;
+    avail_auth_schemes = client->avail_auth_schemes;
+    httpd_tls_required = client->tls_required;
+    httpd_authid = client->authid;
+    httpd_userid = client->userid;
+    httpd_extrafolder = client->extrafolder;
+    httpd_extradomain = client->extradomain;
+    httpd_authstate = client->authstate;
+    httpd_userisadmin = client->userisadmin;
+    httpd_userisproxyadmin = client->userisproxyadmin;
+    httpd_userisanonymous = client->userisanonymous;
+    httpd_clienthost = client->clienthost;
+    httpd_localip = client->localip;
+    httpd_remoteip = client->remoteip;
+    backend_current = client->backend_current;
+    backend_cached = client->backend_cached;
+
+    protgroup_insert(protin, httpd_in);
+
+    proc_register(config_ident, httpd_clienthost, httpd_userid, NULL, NULL);
+
+    if (timedout) {
+        syslog(LOG_DEBUG, "idle connection from %s timed out",
+               httpd_clienthost);
+    }
+    else if ((r = namespace_setuser(httpd_userid))) {
+        syslog(LOG_ERR, "unable to resume session for %s: %s",
+               httpd_userid, error_message(r));
+    }
+    else {
+        keepalive_init();
+
+        if (cmdloop(client)) return;
+    }
+
+    end_connection(client);
+}
+
 
 /* Called by service API to shut down the service */
 void service_abort(int error)
@@ -1664,14 +1914,17 @@ EXPORTED void transaction_free(struct transaction_t *txn)
 
 /*
  * Top-level command loop parsing
+ *
+ * Returns 1 if the connection was parked, 0 if it is to be closed.
  */
-static void cmdloop(struct http_connection *conn)
+static int cmdloop(struct httpd_client *client)
 {
     struct transaction_t txn;
 
     /* Start with an empty (clean) transaction */
     memset(&txn, 0, sizeof(struct transaction_t));
-    txn.conn = conn;
+    txn.conn = &client->conn;
+    txn.auth_chal.scheme = client->auth_scheme;
 
     /* Pre-allocate our working buffer */
     buf_ensure(&txn.buf, 1024);
@@ -1712,6 +1965,14 @@ static void cmdloop(struct http_connection *conn)
 
             signals_poll();
 
+            /* If we can't park, just wait for this one as usual */
+            if (httpd_idle_max && can_park(&txn) &&
+                !park_connection(client)) {
+                client->auth_scheme = txn.auth_chal.scheme;
+                transaction_free(&txn);
+                return 1;
+            }
+
         } while (!proxy_check_input(protin, httpd_in, httpd_out,
                                     backend_current ? backend_current->in : NULL,
                                     NULL, 0));
@@ -1743,7 +2004,7 @@ static void cmdloop(struct http_connection *conn)
         else if (txn.flags.conn & CONN_CLOSE) {
             /* Memory cleanup */
             transaction_free(&txn);
-            return;
+            return 0;
         }
 
         continue;
@@ -3410,12 +3671,15 @@ static int auth_success(struct transaction_t *txn, const char *userid)
     buf_reset(&txn->buf);
 
     /* Do any namespace specific post-auth processing */
+    free(namespace_userid);
+    namespace_userid = NULL;
     for (i = 0; namespaces[i]; i++) {
         if (namespaces[i]->enabled && namespaces[i]->auth) {
             int ret = namespaces[i]->auth(httpd_userid);
             if (ret) return ret;
         }
     }
+    namespace_userid = xstrdup(httpd_userid);
 
     return 0;
 }
@@ -3791,8 +4055,8 @@ static unsigned etag_match(const char *hdr[], const char *etag)
 }
 
 
-static int parse_ranges(const char *hdr, unsigned long len,
-                        struct range **ranges)
+EXPORTED int parse_ranges(const char *hdr, unsigned long len,
+                          struct range **ranges)
 {
     int ret = HTTP_BAD_RANGE;
     struct range *new, *tail = *ranges = NULL;
@@ -537,6 +537,8 @@ extern int meth_trace(struct transaction_t *txn, void *params);
 extern int etagcmp(const char *hdr, const char *etag);
 extern int check_precond(struct transaction_t *txn,
                          const char *etag, time_t lastmod);
+extern int parse_ranges(const char *hdr, unsigned long len,
+                        struct range **ranges);
 
 extern int examine_request(struct transaction_t *txn);
 extern int client_need_auth(struct transaction_t *txn, int sasl_result);
@@ -0,0 +1,304 @@
+/* httpd_bench.c -- measure httpd memory use against idle connections
+ *
+ * Copyright (c) 1994-2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+
+#include <config.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#include <ctype.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/types.h>
+
+#include "exitcodes.h"
+#include "retry.h"
+#include "util.h"
+#include "xmalloc.h"
+
+static void usage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-p port] [-n connections] [-s step]"
+                    " [-c command] [-u request-target] [host]\n", name);
+    fprintf(stderr, "Opens up to <connections> persistent connections to"
+                    " the HTTP server on\n<host> (default localhost),"
+                    " making one request on each and leaving it\nidle,"
+                    " and every <step> connections reports the number and"
+                    " memory use of\nthe running <command> (default httpd)"
+                    " processes.  Run it against a server\nwith"
+                    " httpidleconnections set and unset to compare the"
+                    " two.  Linux only.\n");
+    exit(EC_USAGE);
+}
+
+static int connect_to(const char *host, const char *port)
+{
+    struct addrinfo hints, *res, *ai;
+    int fd = -1, r;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+
+    r = getaddrinfo(host, port, &hints, &res);
+    if (r) {
+        fprintf(stderr, "%s:%s: %s\n", host, port, gai_strerror(r));
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (fd < 0) continue;
+        if (!connect(fd, ai->ai_addr, ai->ai_addrlen)) break;
+        close(fd);
+        fd = -1;
+    }
+    if (fd < 0) perror("connect");
+
+    freeaddrinfo(res);
+
+    return fd;
+}
+
+/* Make a request on 'fd' and read the whole response.
+ * Returns 0 on success. */
+static int request(int fd, const char *host, const char *target)
+{
+    struct buf buf = BUF_INITIALIZER;
+    const char *hdrs, *end, *p;
+    size_t hdrlen, need = 0;
+    int chunked = 0, r = -1;
+    char data[4096];
+    ssize_t n;
+
+    buf_printf(&buf, "%s %s HTTP/1.1\r\nHost: %s\r\n"
+               "User-Agent: httpd_bench\r\n\r\n",
+               strcmp(target, "*") ? "GET" : "OPTIONS", target, host);
+    if (retry_write(fd, buf.s, buf.len) < 0) goto done;
+    buf_reset(&buf);
+
+    /* read the header */
+    while (!(end = memmem(buf.s, buf.len, "\r\n\r\n", 4))) {
+        n = read(fd, data, sizeof(data));
+        if (n <= 0) goto done;
+        buf_appendmap(&buf, data, n);
+    }
+
+    hdrlen = end + 4 - buf.s;
+    hdrs = buf_cstring(&buf);
+    end = hdrs + hdrlen - 4;
+    if (strncmp(hdrs, "HTTP/1.1 ", 9) || hdrs[9] >= '4') {
+        fprintf(stderr, "unexpected response: %.*s\n",
+                (int) strcspn(hdrs, "\r\n"), hdrs);
+        goto done;
+    }
+    for (p = strstr(hdrs, "\r\n"); p && p < end; p = strstr(p + 2, "\r\n")) {
+        if (!strncasecmp(p + 2, "Content-Length:", 15))
+            need = strtoul(p + 17, NULL, 10);
+        else if (!strncasecmp(p + 2, "Transfer-Encoding:", 18))
+            chunked = 1;
+    }
+    need += hdrlen;
+
+    /* read the body: we don't care what it is, just where it ends */
+    for (;;) {
+        if (chunked) {
+            /* last-chunk, with no trailer */
+            if (buf.len == hdrlen + 5 &&
+                !memcmp(buf.s + hdrlen, "0\r\n\r\n", 5)) break;
+            if (buf.len >= hdrlen + 7 &&
+                !memcmp(buf.s + buf.len - 7, "\r\n0\r\n\r\n", 7)) break;
+        }
+        else if (buf.len >= need) break;
+
+        n = read(fd, data, sizeof(data));
+        if (n <= 0) goto done;
+        buf_appendmap(&buf, data, n);
+    }
+    r = 0;
+
+  done:
+    buf_free(&buf);
+    return r;
+}
+
+/* Add up the memory use of all the processes running 'command' */
+static int measure(const char *command, unsigned long *rss, unsigned long *pss)
+{
+    DIR *dir = opendir("/proc");
+    struct dirent *dirent;
+    char path[64], line[256];
+    int nprocs = 0;
+
+    *rss = *pss = 0;
+    if (!dir) return -1;
+
+    while ((dirent = readdir(dir))) {
+        FILE *f;
+
+        if (!isdigit(dirent->d_name[0])) continue;
+
+        snprintf(path, sizeof(path), "/proc/%s/comm", dirent->d_name);
+        if (!(f = fopen(path, "r"))) continue;
+        if (!fgets(line, sizeof(line), f)) line[0] = '\0';
+        fclose(f);
+        line[strcspn(line, "\n")] = '\0';
+        if (strcmp(line, command)) continue;
+
+        /* Rss counts shared pages in full for every process;
+         * Pss splits them among the processes sharing them */
+        snprintf(path, sizeof(path), "/proc/%s/smaps_rollup", dirent->d_name);
+        if (!(f = fopen(path, "r"))) continue;
+        while (fgets(line, sizeof(line), f)) {
+            if (!strncmp(line, "Rss:", 4))
+                *rss += strtoul(line + 4, NULL, 10);
+            else if (!strncmp(line, "Pss:", 4))
+                *pss += strtoul(line + 4, NULL, 10);
+        }
+        fclose(f);
+        nprocs++;
+    }
+    closedir(dir);
+
+    return nprocs;
+}
+
+int main(int argc, char **argv)
+{
+    const char *host = "localhost";
+    const char *port = "http";
+    const char *command = "httpd";
+    const char *target = "*";
+    int max = 1000, step = 100;
+    int *fds, nfds = 0, failed = 0;
+    unsigned long rss, pss, basepss;
+    struct timeval start, end;
+    struct rlimit rl;
+    int opt, i, nprocs;
+
+    while ((opt = getopt(argc, argv, "p:n:s:c:u:")) != EOF) {
+        switch (opt) {
+        case 'p':
+            port = optarg;
+            break;
+        case 'n':
+            max = atoi(optarg);
+            break;
+        case 's':
+            step = atoi(optarg);
+            break;
+        case 'c':
+            command = optarg;
+            break;
+        case 'u':
+            target = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+
+    if (optind < argc) host = argv[optind++];
+    if (optind != argc || max < 1 || step < 1) usage(argv[0]);
+
+    /* we need a descriptor per connection */
+    if (!getrlimit(RLIMIT_NOFILE, &rl) && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
+    }
+
+    fds = xzmalloc(max * sizeof(int));
+
+    nprocs = measure(command, &rss, &pss);
+    if (nprocs < 0) fatal("can't read /proc", EC_OSFILE);
+    basepss = pss;
+
+    printf("%11s %9s %11s %11s %11s\n",
+           "connections", "processes", "rss (kB)", "pss (kB)", "kB/conn");
+    printf("%11d %9d %11lu %11lu %11s\n", 0, nprocs, rss, pss, "-");
+
+    while (nfds < max) {
+        int fd = connect_to(host, port);
+
+        if (fd < 0 || request(fd, host, target)) {
+            if (fd >= 0) close(fd);
+            fprintf(stderr, "connection %d failed\n", nfds + 1);
+            break;
+        }
+        fds[nfds++] = fd;
+
+        if (nfds % step && nfds < max) continue;
+
+        /* give the server a moment to settle */
+        sleep(1);
+        nprocs = measure(command, &rss, &pss);
+        printf("%11d %9d %11lu %11lu %11lu\n",
+               nfds, nprocs, rss, pss,
+               pss > basepss ? (pss - basepss) / nfds : 0);
+        fflush(stdout);
+    }
+
+    /* every connection should still be served */
+    gettimeofday(&start, NULL);
+    for (i = 0; i < nfds; i++) {
+        if (request(fds[i], host, target)) failed++;
+    }
+    gettimeofday(&end, NULL);
+
+    printf("%d request%s on idle connections in %.3f sec",
+           nfds, nfds == 1 ? "" : "s", timesub(&start, &end));
+    if (failed) printf(", %d failed", failed);
+    printf("\n");
+
+    for (i = 0; i < nfds; i++) close(fds[i]);
+    free(fds);
+
+    return failed ? EC_SOFTWARE : 0;
+}
@@ -288,6 +288,7 @@ EXPORTED void index_close(struct index_state **stateptr)
     index_release(state);
 
     free(state->map);
+    uidhash_fini(&state->uidhash);
     free(state->mboxname);
     free(state->userid);
     for (i = 0; i < MAX_USER_FLAGS; i++)
@@ -894,6 +895,8 @@ EXPORTED int index_check(struct index_state *state, int usinguid, int printuid)
         }
 
         state->exists = 0;
+        uidhash_reset(&state->uidhash);
+        state->uidhash_msgno = 0;
         return IMAP_MAILBOX_NONEXISTENT;
     }
 
@@ -3088,11 +3091,27 @@ EXPORTED int index_copy_remote(struct index_state *state, char *sequence,
  */
 EXPORTED uint32_t index_finduid(struct index_state *state, uint32_t uid)
 {
+    unsigned minrecords = config_getint(IMAPOPT_MAILBOX_UIDHASH_MINRECORDS);
     unsigned low = 1;
     unsigned high = state->exists;
     unsigned mid;
     unsigned miduid;
 
+    /* exact matches from the hash, if the mailbox is big enough,
+     * after catching up with any messages added by index_refresh */
+    if (minrecords && state->exists >= minrecords) {
+        if (!state->uidhash_msgno)
+            uidhash_reserve(&state->uidhash, state->exists);
+        while (state->uidhash_msgno < state->exists) {
+            state->uidhash_msgno++;
+            uidhash_insert(&state->uidhash,
+                           state->map[state->uidhash_msgno-1].uid,
+                           state->uidhash_msgno);
+        }
+        mid = uidhash_lookup(&state->uidhash, uid);
+        if (mid) return mid;
+    }
+
     while (low <= high) {
         mid = (high - low)/2 + low;
         miduid = index_getuid(state, mid);
@@ -3696,6 +3715,12 @@ static void index_tellexpunge(struct index_state *state)
         msgno++;
     }
 
+    /* msgnos have moved */
+    if (state->exists < exists) {
+        uidhash_reset(&state->uidhash);
+        state->uidhash_msgno = 0;
+    }
+
     /* report all vanished if we're doing it this way */
     if (vanishedlist->len) {
         char *vanished = seqset_cstring(vanishedlist);
@@ -5080,7 +5105,7 @@ MsgData **index_msgdata_load(struct index_state *state,
     struct mailbox *mailbox = state->mailbox;
     struct index_record record;
     struct conversations_state *cstate = NULL;
-    conversation_t *conv = NULL;
+    conv_view_t conv;
 
     if (!n) return NULL;
 
@@ -5114,7 +5139,6 @@ MsgData **index_msgdata_load(struct index_state *state,
 
         did_cache = did_env = did_conv = 0;
         tmpenv = NULL;
-        conv = NULL; /* XXX: use a hash to avoid re-reading? */
 
         for (j = 0; sortcrit[j].key; j++) {
             label = sortcrit[j].key;
@@ -5155,9 +5179,10 @@ MsgData **index_msgdata_load(struct index_state *state,
                 label == SORT_CONVEXISTS || label == SORT_CONVSIZE) && !did_conv) {
                 if (!cstate) cstate = conversations_get_mbox(index_mboxname(state));
                 assert(cstate);
-                if (conversation_load(cstate, record.cid, &conv))
+                /* only the totals are needed, so don't parse the whole
+                 * record.  XXX: use a hash to avoid re-reading? */
+                if (conversation_view(cstate, record.cid, &conv))
                     continue;
-                if (!conv) conv = conversation_new(cstate);
                 did_conv++;
             }
 
@@ -5231,18 +5256,18 @@ MsgData **index_msgdata_load(struct index_state *state,
                 const char *name = sortcrit[j].args.flag.name;
                 int idx = strarray_find_case(cstate->counted_flags, name, 0);
                 /* flag exists in the conversation at all */
-                if (idx >= 0 && conv->counts[idx] > 0 && j < 31)
+                if (idx >= 0 && conv_view_count(&conv, idx) > 0 && j < 31)
                     cur->hasconvflag |= (1<<j);
                 break;
             }
             case SORT_CONVEXISTS:
-                cur->convexists = conv->exists;
+                cur->convexists = conv_view_exists(&conv);
                 break;
             case SORT_CONVSIZE:
-                cur->convsize = conv->size;
+                cur->convsize = conv_view_size(&conv);
                 break;
             case SORT_CONVMODSEQ:
-                cur->convmodseq = conv->modseq;
+                cur->convmodseq = conv_view_modseq(&conv);
                 break;
             case SORT_RELEVANCY:
                 /* for now all messages have relevancy=100 */
@@ -5251,7 +5276,6 @@ MsgData **index_msgdata_load(struct index_state *state,
         }
 
         free(tmpenv);
-        conversation_free(conv);
     }
 
     return ptrs;
@@ -5650,6 +5674,12 @@ void index_msgdata_sort(MsgData **msgdata, int n, const struct sortcrit *sortcri
     qsort(msgdata, n, sizeof(MsgData *), index_sort_compare_qsort);
 }
 
+EXPORTED int index_msgdata_compare(MsgData *md1, MsgData *md2,
+                                   const struct sortcrit *sortcrit)
+{
+    return index_sort_compare(md1, md2, sortcrit);
+}
+
 /*
  * Free an array of MsgData* as built by index_msgdata_load()
  */
@@ -60,6 +60,7 @@
 #include "message_guid.h"
 #include "sequence.h"
 #include "strarray.h"
+#include "uidhash.h"
 
 /* Special "sort criteria" to load message-id and references/in-reply-to
  * into msgdata array for threaders that need them.
@@ -135,6 +136,8 @@ struct index_state {
     uint32_t want_mbtype;
     int want_expunged;
     unsigned num_expunged;
+    uidhash_t uidhash;  /* UID to msgno, covers 1 to uidhash_msgno */
+    unsigned uidhash_msgno;
 };
 
 struct copyargs {
@@ -321,6 +324,8 @@ void freesearchargs(struct searchargs *s);
 char *sortcrit_as_string(const struct sortcrit *sortcrit);
 void freesortcrit(struct sortcrit *s);
 void index_msgdata_sort(MsgData **msgdata, int n, const struct sortcrit *sortcrit);
+int index_msgdata_compare(MsgData *md1, MsgData *md2,
+                          const struct sortcrit *sortcrit);
 void index_msgdata_free(MsgData **, unsigned int);
 MsgData **index_msgdata_load(struct index_state *state, unsigned *msgno_list, int n,
                              const struct sortcrit *sortcrit,
@@ -1260,6 +1260,8 @@ struct getcalendarevents_rock {
     struct hash_table *props;
     struct mailbox *mailbox;
     int check_acl;
+    size_t nfound;              /* events found so far */
+    int streaming;              /* write events to req->stream */
 };
 
 static int getcalendarevents_cb(void *vrock, struct caldav_data *cdata)
@@ -1363,7 +1365,11 @@ static int getcalendarevents_cb(void *vrock, struct caldav_data *cdata)
     json_object_set_new(obj, "id", json_string(cdata->ical_uid));
 
     /* Add JMAP event to response */
-    json_array_append_new(rock->found, obj);
+    if (rock->streaming)
+        jmap_stream_append(rock->req, obj);
+    else
+        json_array_append_new(rock->found, obj);
+    rock->nfound++;
 
 done:
     if (ical) icalcomponent_free(ical);
@@ -1379,6 +1385,8 @@ static int getCalendarEvents(struct jmap_req *req)
         NULL            /*props*/,
         NULL            /*mailbox*/,
         strcmp(req->accountid, req->userid) /*checkacl*/,
+        0               /*nfound*/,
+        0               /*streaming*/
     };
     int r = 0;
 
@@ -1413,6 +1421,16 @@ static int getCalendarEvents(struct jmap_req *req)
         goto done;
     }
 
+    /* Write each event out as soon as it is converted */
+    if (req->stream) {
+        json_t *args = json_pack("{s:o s:s}",
+                                 "state", jmap_getstate(req, MBTYPE_CALENDAR),
+                                 "accountId", req->accountid);
+        jmap_stream_begin(req, "CalendarEvent/get", args, "list");
+        json_decref(args);
+        rock.streaming = 1;
+    }
+
     json_t *want = json_object_get(req->args, "ids");
     json_t *notfound = json_array();
     if (want) {
@@ -1424,9 +1442,9 @@ static int getCalendarEvents(struct jmap_req *req)
                 id = hash_lookup(id + 1, &req->idmap->calendarevents);
             }
             if (!id) continue;
-            size_t nfound = json_array_size(rock.found);
+            size_t nfound = rock.nfound;
             r = caldav_get_events(db, NULL, id, &getcalendarevents_cb, &rock);
-            if (r || nfound == json_array_size(rock.found)) {
+            if (r || nfound == rock.nfound) {
                 json_array_append_new(notfound, json_string(id));
             }
         }
@@ -1435,18 +1453,26 @@ static int getCalendarEvents(struct jmap_req *req)
         if (r) goto done;
     }
 
+    if (!json_array_size(notfound)) {
+        json_decref(notfound);
+        notfound = json_null();
+    }
+
+    if (rock.streaming) {
+        json_t *args = json_pack("{s:o}", "notFound", notfound);
+        jmap_stream_end(req, args);
+        json_decref(args);
+        rock.streaming = 0;
+        goto done;
+    }
+
     json_t *events = json_pack("{}");
     json_object_set_new(events, "state", jmap_getstate(req, MBTYPE_CALENDAR));
 
     json_incref(rock.found);
     json_object_set_new(events, "accountId", json_string(req->accountid));
     json_object_set_new(events, "list", rock.found);
-    if (json_array_size(notfound)) {
-        json_object_set_new(events, "notFound", notfound);
-    } else {
-        json_decref(notfound);
-        json_object_set_new(events, "notFound", json_null());
-    }
+    json_object_set_new(events, "notFound", notfound);
 
     json_t *item = json_pack("[]");
     json_array_append_new(item, json_string("CalendarEvent/get"));
@@ -1456,6 +1482,12 @@ static int getCalendarEvents(struct jmap_req *req)
     json_array_append_new(req->response, item);
 
 done:
+    if (rock.streaming) {
+        /* Close the response even if the request failed */
+        json_t *args = json_pack("{s:n}", "notFound");
+        jmap_stream_end(req, args);
+        json_decref(args);
+    }
     if (rock.props) {
         free_hash_table(rock.props, NULL);
         free(rock.props);
@@ -58,6 +58,7 @@
 #include "http_dav.h"
 #include "http_jmap.h"
 #include "http_proxy.h"
+#include "jmap_querycache.h"
 #include "json_support.h"
 #include "mailbox.h"
 #include "mappedfile.h"
@@ -120,28 +121,29 @@ static int getEmailSubmissionsListUpdates(jmap_req_t *req);
  * but the search window handling is also a good candidate.
  */
 
+/* Email/query isn't JMAP_READ_ONLY: it keeps the query cache up to date */
 jmap_method_t jmap_mail_methods[] = {
-    { "Mailbox/get",                  &getMailboxes },
-    { "Mailbox/set",                  &setMailboxes },
-    { "Mailbox/changes",              &getMailboxesUpdates },
-    { "Mailbox/query",                &getMailboxesList },
-    { "Mailbox/queryChanges",         &getMailboxesListUpdates },
-    { "Email/query",                  &getEmailsList },
-    { "Email/queryChanges",           &getEmailsListUpdates },
-    { "Email/get",                    &getEmails },
-    { "Email/set",                    &setEmails },
-    { "Email/changes",                &getEmailsUpdates },
-    { "Email/import",                 &importEmails },
-    { "SearchSnippet/get",            &getSearchSnippets },
-    { "Thread/get",                   &getThreads },
-    { "Thread/changes",               &getThreadsUpdates },
-    { "Identity/get",                 &getIdentities },
-    { "EmailSubmission/get",          &getEmailSubmissions },
-    { "EmailSubmission/set",          &setEmailSubmissions },
-    { "EmailSubmission/changes",      &getEmailSubmissionsUpdates },
-    { "EmailSubmission/query",        &getEmailSubmissionsList },
-    { "EmailSubmission/queryChanges", &getEmailSubmissionsListUpdates },
-    { NULL,                           NULL}
+    { "Mailbox/get",                  &getMailboxes,                   JMAP_READ_ONLY },
+    { "Mailbox/set",                  &setMailboxes,                   0 },
+    { "Mailbox/changes",              &getMailboxesUpdates,            JMAP_READ_ONLY },
+    { "Mailbox/query",                &getMailboxesList,               JMAP_READ_ONLY },
+    { "Mailbox/queryChanges",         &getMailboxesListUpdates,        JMAP_READ_ONLY },
+    { "Email/query",                  &getEmailsList,                  0 },
+    { "Email/queryChanges",           &getEmailsListUpdates,           JMAP_READ_ONLY },
+    { "Email/get",                    &getEmails,                      JMAP_READ_ONLY },
+    { "Email/set",                    &setEmails,                      0 },
+    { "Email/changes",                &getEmailsUpdates,               JMAP_READ_ONLY },
+    { "Email/import",                 &importEmails,                   0 },
+    { "SearchSnippet/get",            &getSearchSnippets,              JMAP_READ_ONLY },
+    { "Thread/get",                   &getThreads,                     JMAP_READ_ONLY },
+    { "Thread/changes",               &getThreadsUpdates,              JMAP_READ_ONLY },
+    { "Identity/get",                 &getIdentities,                  JMAP_READ_ONLY },
+    { "EmailSubmission/get",          &getEmailSubmissions,            JMAP_READ_ONLY },
+    { "EmailSubmission/set",          &setEmailSubmissions,            0 },
+    { "EmailSubmission/changes",      &getEmailSubmissionsUpdates,     JMAP_READ_ONLY },
+    { "EmailSubmission/query",        &getEmailSubmissionsList,        JMAP_READ_ONLY },
+    { "EmailSubmission/queryChanges", &getEmailSubmissionsListUpdates, JMAP_READ_ONLY },
+    { NULL,                           NULL,                            0 }
 };
 
 /* NULL terminated list of supported getEmailsList sort fields */
@@ -4413,6 +4415,82 @@ static void update_removed(json_t *target, const char *msgid)
     json_array_append_new(target, json_string(msgid));
 }
 
+/* Bring the cached result of an immutable query up to date, searching
+ * only for what changed since it was stored, or build it from scratch.
+ * The result includes expunged messages. */
+static int jmapmsg_search_cached(jmap_req_t *req, struct index_state *state,
+                                 json_t *filter, json_t *sort,
+                                 const struct sortcrit *sortcrit,
+                                 struct jmap_queryresult **resp)
+{
+    struct jmap_querycache *qc = NULL;
+    struct jmap_queryresult *res = NULL;
+    struct searchargs *searchargs = NULL;
+    search_query_t *query = NULL;
+    json_t *jkey;
+    char *key;
+    int r;
+
+    r = jmap_querycache_open(req->accountid, &qc);
+    if (r) return r;
+
+    /* The cache key is the canonical form of filter and sort */
+    jkey = json_pack("{}");
+    if (JNOTNULL(filter)) json_object_set(jkey, "filter", filter);
+    if (JNOTNULL(sort)) json_object_set(jkey, "sort", sort);
+    key = json_dumps(jkey, JSON_COMPACT|JSON_SORT_KEYS);
+    json_decref(jkey);
+
+    r = jmap_querycache_get(qc, key, &res);
+    if (r && r != CYRUSDB_NOTFOUND) {
+        r = IMAP_IOERROR;
+        goto done;
+    }
+    r = 0;
+
+    if (res && jmap_queryresult_isstale(res, req->counters.mailfoldersmodseq))
+        jmap_queryresult_free(&res);
+    if (!res)
+        res = jmap_queryresult_new(req->counters.mailfoldersmodseq);
+
+    if (res->modseq < req->counters.mailmodseq) {
+        searchargs = new_searchargs(NULL/*tag*/, GETSEARCH_CHARSET_FIRST,
+                                    &jmap_namespace, req->accountid,
+                                    req->authstate, 0);
+        searchargs->root = buildsearch(req, filter, NULL);
+
+        query = search_query_new(state, searchargs);
+        query->sortcrit = sortcrit;
+        query->multiple = 1;
+        query->need_ids = 1;
+        query->verbose = 1;
+        query->want_expunged = 1;
+        query->sincemodseq = res->modseq;
+
+        r = search_query_run(query);
+        if (r) goto done;
+
+        jmap_queryresult_apply(res, (MsgData **) query->merged_msgdata.data,
+                               query->merged_msgdata.count, sortcrit);
+        res->modseq = req->counters.mailmodseq;
+
+        /* The result is good even if it can't be saved, or mustn't
+           be by a call running alongside others */
+        if (!req->readonly) jmap_querycache_put(qc, key, res);
+    }
+
+    *resp = res;
+    res = NULL;
+
+done:
+    jmap_queryresult_free(&res);
+    if (query) search_query_free(query);
+    if (searchargs) freesearchargs(searchargs);
+    jmap_querycache_close(&qc);
+    free(key);
+    return r;
+}
+
 static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
                           struct getmsglist_window *window, int want_expunged,
                           size_t *total, size_t *total_threads,
@@ -4423,9 +4501,12 @@ static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
     hashu64_table cids = HASHU64_TABLE_INITIALIZER;
     struct index_state *state = NULL;
     search_query_t *query = NULL;
+    struct jmap_queryresult *cached = NULL;
+    ptrarray_t *msgdata;
     struct sortcrit *sortcrit = NULL;
     struct searchargs *searchargs = NULL;
     struct index_init init;
+    int use_cache = 0;
     int foundupto = 0;
     char *msgid = NULL;
     int i, r;
@@ -4448,22 +4529,7 @@ static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
     searchargs = new_searchargs(NULL/*tag*/, GETSEARCH_CHARSET_FIRST,
                                 &jmap_namespace, req->accountid, req->authstate, 0);
     searchargs->root = buildsearch(req, filter, NULL);
-
-    /* Run the search query */
-    memset(&init, 0, sizeof(init));
-    init.userid = req->accountid;
-    init.authstate = req->authstate;
-    init.want_expunged = want_expunged;
-
-    r = index_open(req->inboxname, &init, &state);
-    if (r) goto done;
-
-    query = search_query_new(state, searchargs);
-    query->sortcrit = sortcrit = buildsort(sort);
-    query->multiple = 1;
-    query->need_ids = 1;
-    query->verbose = 1;
-    query->want_expunged = want_expunged;
+    sortcrit = buildsort(sort);
 
     if (search_is_mutable(sortcrit, searchargs)) {
         if (window->sincemodseq) {
@@ -4473,14 +4539,41 @@ static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
     }
     else {
         window->cancalcupdates = 1;
+        /* Only the account owner's results are cached, and only
+         * if flag changes can't change what they are */
+        use_cache = !req->is_shared_account &&
+                    config_getint(IMAPOPT_JMAP_QUERYCACHE_MAX) > 0;
     }
 
+    /* Run the search query */
+    memset(&init, 0, sizeof(init));
+    init.userid = req->accountid;
+    init.authstate = req->authstate;
+    init.want_expunged = want_expunged || use_cache;
 
-    r = search_query_run(query);
+    r = index_open(req->inboxname, &init, &state);
     if (r) goto done;
 
+    if (use_cache) {
+        r = jmapmsg_search_cached(req, state, filter, sort, sortcrit, &cached);
+        if (r) goto done;
+        msgdata = &cached->msgdata;
+    }
+    else {
+        query = search_query_new(state, searchargs);
+        query->sortcrit = sortcrit;
+        query->multiple = 1;
+        query->need_ids = 1;
+        query->verbose = 1;
+        query->want_expunged = want_expunged;
+
+        r = search_query_run(query);
+        if (r) goto done;
+        msgdata = &query->merged_msgdata;
+    }
+
     /* Initialize window state */
-    window->mdcount = query->merged_msgdata.count;
+    window->mdcount = msgdata->count;
     window->anchor_pos = (size_t)-1;
     window->highestmodseq = 0;
 
@@ -4488,12 +4581,12 @@ static int jmapmsg_search(jmap_req_t *req, json_t *filter, json_t *sort,
     construct_hash_table(&ids, window->mdcount + 1, 0);
 
     memset(&cids, 0, sizeof(hashu64_table));
-    construct_hashu64_table(&cids, query->merged_msgdata.count/4+4,0);
+    construct_hashu64_table(&cids, msgdata->count/4+4,0);
 
     *total_threads = 0;
 
-    for (i = 0 ; i < query->merged_msgdata.count ; i++) {
-        MsgData *md = ptrarray_nth(&query->merged_msgdata, i);
+    for (i = 0 ; i < msgdata->count ; i++) {
+        MsgData *md = ptrarray_nth(msgdata, i);
         search_folder_t *folder = md->folder;
         json_t *msg = NULL;
         size_t idcount = json_array_size(*messageids);
@@ -4735,6 +4828,7 @@ done:
     free_hashu64_table(&cids, NULL);
     if (sortcrit) freesortcrit(sortcrit);
     if (query) search_query_free(query);
+    jmap_queryresult_free(&cached);
     if (searchargs) freesearchargs(searchargs);
     if (state) {
         state->mailbox = NULL;
@@ -5645,6 +5739,7 @@ static int getEmails(jmap_req_t *req)
     size_t i;
     json_t *ids, *val, *properties, *res, *item;
     hash_table *props = NULL;
+    int streaming = 0;
 
     /* ids */
     ids = json_object_get(req->args, "ids");
@@ -5682,6 +5777,16 @@ static int getEmails(jmap_req_t *req)
     }
     json_decref(invalid);
 
+    /* Write each message out as soon as it is converted */
+    if (req->stream) {
+        res = json_pack("{s:o s:s}",
+                        "state", jmap_getstate(req, 0/*mbtype*/),
+                        "accountId", req->accountid);
+        jmap_stream_begin(req, "Email/get", res, "list");
+        json_decref(res);
+        streaming = 1;
+    }
+
     /* Lookup and convert ids */
     json_array_foreach(ids, i, val) {
         const char *id = json_string_value(val);
@@ -5718,7 +5823,9 @@ doneloop:
             continue;
         }
         if (mboxname) free(mboxname);
-        if (msg) {
+        if (msg && streaming) {
+            jmap_stream_append(req, msg);
+        } else if (msg) {
             json_array_append_new(list, msg);
         } else {
             json_array_append_new(notfound, json_string(id));
@@ -5732,6 +5839,8 @@ doneloop:
         notfound = json_null();
     }
 
+    if (streaming) goto done;
+
     res = json_pack("{}");
     json_object_set_new(res, "state", jmap_getstate(req, 0/*mbtype*/));
     json_object_set_new(res, "accountId", json_string(req->accountid));
@@ -5746,6 +5855,13 @@ doneloop:
     json_array_append_new(req->response, item);
 
 done:
+    if (streaming) {
+        /* Close the response even if the request failed */
+        res = json_pack("{s:O}", "notFound",
+                        json_array_size(notfound) ? notfound : json_null());
+        jmap_stream_end(req, res);
+        json_decref(res);
+    }
     if (props) {
         free_hash_table(props, NULL);
         free(props);
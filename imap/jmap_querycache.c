@@ -0,0 +1,851 @@
+/* jmap_querycache.c -- Persistent cache of JMAP Email/query results
+ *
+ * Copyright (c) 1994-2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#include <config.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <netinet/in.h>
+
+#include "arrayu64.h"
+#include "byteorder64.h"
+#include "cyrusdb.h"
+#include "global.h"
+#include "jmap_querycache.h"
+#include "mailbox.h"
+#include "message_guid.h"
+#include "strarray.h"
+#include "user.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/* generated headers are not necessarily in current directory */
+#include "imap/imap_err.h"
+
+#define FNAME_JMAPQUERY "jmapquery"
+
+/*
+ * Each cached result is stored as a head record under its key, and
+ * its message records in chunks of about JMAP_QC_CHUNK, each under
+ * the key, JMAP_QC_SEP and the chunk id in hex:
+ *
+ *  head:  "JQC2" modseq(64) foldersmodseq(64) lastupdated(64)
+ *         nfolders(32) nmsgs(32) nextchunk(32) nchunks(32)
+ *         nfolders * string
+ *         nchunks * { id(32) count(32) }
+ *  chunk: count * { folder(32) uid(32) cid(64) system_flags(32)
+ *                   guid(20) modseq(64) internaldate(64) size(64)
+ *                   from:string to:string xsubj:string }
+ *
+ * where a string is its length(32) and bytes, or a length of
+ * JMAP_QC_NOSTRING for NULL.  All integers are in network order.
+ *
+ * A changed chunk is written under a new id and the old one deleted,
+ * so the chunks a head names never change - a reader just has to
+ * try again if a writer replaced one between reading the head and
+ * the chunk.  Keys are JSON, which never contains JMAP_QC_SEP.
+ */
+#define JMAP_QC_MAGIC       "JQC2"
+#define JMAP_QC_SEP         '\x1f'
+#define JMAP_QC_NOSTRING    0xffffffff
+#define JMAP_QC_HEADER      (4+8+8+8+4+4+4+4)
+#define JMAP_QC_CHUNKREF    (4+4)
+#define JMAP_QC_MSGDATA     (4+4+8+4+MESSAGE_GUID_SIZE+8+8+8)
+
+/* records per chunk; a chunk is split once it has twice as many */
+#define JMAP_QC_CHUNK       256
+
+/* rebuild rather than carry more tombstones than this */
+#define JMAP_QC_MAXEXPUNGED 1024
+
+struct jmap_querycache {
+    struct db *db;
+    char *userid;
+};
+
+struct jmap_querychunk {
+    uint32_t id;
+    int count;
+    int dirty;              /* needs writing, under a new id */
+};
+
+static const struct sortcrit *the_sortcrit;
+
+EXPORTED int jmap_querycache_open(const char *userid,
+                                  struct jmap_querycache **qcp)
+{
+    char *fname = user_hash_meta(userid, FNAME_JMAPQUERY);
+    struct db *db = NULL;
+    int r;
+
+    r = cyrusdb_open(config_getstring(IMAPOPT_JMAP_QUERYCACHE_DB),
+                     fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        syslog(LOG_ERR, "jmap_querycache: cannot open %s: %s",
+               fname, cyrusdb_strerror(r));
+        free(fname);
+        return IMAP_IOERROR;
+    }
+    free(fname);
+
+    *qcp = xzmalloc(sizeof(struct jmap_querycache));
+    (*qcp)->db = db;
+    (*qcp)->userid = xstrdup(userid);
+
+    return 0;
+}
+
+EXPORTED void jmap_querycache_close(struct jmap_querycache **qcp)
+{
+    struct jmap_querycache *qc = *qcp;
+
+    if (!qc) return;
+
+    cyrusdb_close(qc->db);
+    free(qc->userid);
+    free(qc);
+    *qcp = NULL;
+}
+
+EXPORTED struct jmap_queryresult *jmap_queryresult_new(modseq_t foldersmodseq)
+{
+    struct jmap_queryresult *res = xzmalloc(sizeof(struct jmap_queryresult));
+
+    res->foldersmodseq = foldersmodseq;
+
+    return res;
+}
+
+static void qc_msgdata_free(MsgData *md)
+{
+    free(md->from);
+    free(md->to);
+    free(md->xsubj);
+    free(md);
+}
+
+EXPORTED void jmap_queryresult_free(struct jmap_queryresult **resp)
+{
+    struct jmap_queryresult *res = *resp;
+    int i;
+
+    if (!res) return;
+
+    for (i = 0; i < res->msgdata.count; i++)
+        qc_msgdata_free(ptrarray_nth(&res->msgdata, i));
+    ptrarray_fini(&res->msgdata);
+
+    for (i = 0; i < res->folders.count; i++) {
+        search_folder_t *folder = ptrarray_nth(&res->folders, i);
+        free(folder->mboxname);
+        free(folder);
+    }
+    ptrarray_fini(&res->folders);
+
+    for (i = 0; i < res->chunks.count; i++)
+        free(ptrarray_nth(&res->chunks, i));
+    ptrarray_fini(&res->chunks);
+
+    free(res);
+    *resp = NULL;
+}
+
+EXPORTED int jmap_queryresult_isstale(const struct jmap_queryresult *res,
+                                      modseq_t foldersmodseq)
+{
+    /* a folder was created, renamed or deleted */
+    if (res->foldersmodseq != foldersmodseq)
+        return 1;
+
+    /* expunged records are kept until the next rebuild, so that
+     * Email/queryChanges can report them */
+    if (res->nexpunged > JMAP_QC_MAXEXPUNGED &&
+        res->nexpunged > (unsigned) res->msgdata.count / 2)
+        return 1;
+
+    return 0;
+}
+
+static search_folder_t *qc_folder(struct jmap_queryresult *res,
+                                  const char *mboxname)
+{
+    search_folder_t *folder;
+    int i;
+
+    /* accounts have tens of folders, not thousands */
+    for (i = 0; i < res->folders.count; i++) {
+        folder = ptrarray_nth(&res->folders, i);
+        if (!strcmp(folder->mboxname, mboxname))
+            return folder;
+    }
+
+    folder = xzmalloc(sizeof(search_folder_t));
+    folder->mboxname = xstrdup(mboxname);
+    folder->id = res->folders.count;
+    ptrarray_append(&res->folders, folder);
+
+    return folder;
+}
+
+/* Sort order of cached records: the query's own, then by folder and
+ * uid so that every record has exactly one place in the list. */
+static int qc_compare(MsgData *md1, MsgData *md2,
+                      const struct sortcrit *sortcrit)
+{
+    int r = index_msgdata_compare(md1, md2, sortcrit);
+
+    if (!r) r = md1->folder->id - md2->folder->id;
+    if (!r) r = (md1->uid > md2->uid) - (md1->uid < md2->uid);
+
+    return r;
+}
+
+static int qc_compare_qsort(const void *v1, const void *v2)
+{
+    MsgData *md1 = *(MsgData **)v1;
+    MsgData *md2 = *(MsgData **)v2;
+
+    return qc_compare(md1, md2, the_sortcrit);
+}
+
+/* Find md in the sorted list, or where it would go */
+static int qc_find(ptrarray_t *list, MsgData *md,
+                   const struct sortcrit *sortcrit, int *posp)
+{
+    int lo = 0, hi = list->count;
+
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        int r = qc_compare(ptrarray_nth(list, mid), md, sortcrit);
+        if (!r) {
+            *posp = mid;
+            return 1;
+        }
+        if (r < 0) lo = mid + 1;
+        else hi = mid;
+    }
+
+    *posp = lo;
+    return 0;
+}
+
+/* The chunk holding record pos of the list, where the last chunk
+ * also takes anything appended after it */
+static struct jmap_querychunk *qc_chunk_at(struct jmap_queryresult *res,
+                                           int pos)
+{
+    int i;
+
+    for (i = 0; i < res->chunks.count - 1; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+        if (pos < chunk->count) return chunk;
+        pos -= chunk->count;
+    }
+
+    return ptrarray_tail(&res->chunks);
+}
+
+static struct jmap_querychunk *qc_chunk_new(int count)
+{
+    struct jmap_querychunk *chunk = xzmalloc(sizeof(struct jmap_querychunk));
+
+    chunk->count = count;
+    chunk->dirty = 1;
+
+    return chunk;
+}
+
+/* Cover a new result with chunks, and split those grown too big */
+static void qc_chunk_split(struct jmap_queryresult *res)
+{
+    ptrarray_t split = PTRARRAY_INITIALIZER;
+    int i;
+
+    if (!res->chunks.count && res->msgdata.count)
+        ptrarray_append(&res->chunks, qc_chunk_new(res->msgdata.count));
+
+    for (i = 0; i < res->chunks.count; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+
+        if (chunk->count <= 2 * JMAP_QC_CHUNK) {
+            ptrarray_append(&split, chunk);
+            continue;
+        }
+
+        while (chunk->count > JMAP_QC_CHUNK) {
+            int n = chunk->count < 2 * JMAP_QC_CHUNK ?
+                    chunk->count : JMAP_QC_CHUNK;
+            ptrarray_append(&split, qc_chunk_new(n));
+            chunk->count -= n;
+        }
+        if (chunk->count) {
+            chunk->dirty = 1;
+            ptrarray_append(&split, chunk);
+        }
+        else free(chunk);
+    }
+
+    ptrarray_fini(&res->chunks);
+    res->chunks = split;
+}
+
+EXPORTED void jmap_queryresult_apply(struct jmap_queryresult *res,
+                                     MsgData **msgdata, int n,
+                                     const struct sortcrit *sortcrit)
+{
+    ptrarray_t added = PTRARRAY_INITIALIZER;
+    ptrarray_t merged = PTRARRAY_INITIALIZER;
+    ptrarray_t grown = PTRARRAY_INITIALIZER;
+    int i, j, pos;
+
+    for (i = 0; i < n; i++) {
+        MsgData *md = xzmalloc(sizeof(MsgData));
+
+        /* msgno is only meaningful within one search, and must not
+         * affect the order of cached records */
+        md->folder = qc_folder(res, msgdata[i]->folder->mboxname);
+        md->uid = msgdata[i]->uid;
+        md->cid = msgdata[i]->cid;
+        md->system_flags = msgdata[i]->system_flags;
+        message_guid_copy(&md->guid, &msgdata[i]->guid);
+        md->modseq = msgdata[i]->modseq;
+        md->internaldate = msgdata[i]->internaldate;
+        md->size = msgdata[i]->size;
+        md->from = xstrdupnull(msgdata[i]->from);
+        md->to = xstrdupnull(msgdata[i]->to);
+        md->xsubj = xstrdupnull(msgdata[i]->xsubj);
+
+        if (md->system_flags & FLAG_EXPUNGED)
+            res->nexpunged++;
+
+        /* the sort keys of a record never change, so a changed
+         * record replaces its old self in place */
+        if (qc_find(&res->msgdata, md, sortcrit, &pos)) {
+            MsgData *old = ptrarray_nth(&res->msgdata, pos);
+            if (old->system_flags & FLAG_EXPUNGED)
+                res->nexpunged--;
+            qc_msgdata_free(old);
+            res->msgdata.data[pos] = md;
+            qc_chunk_at(res, pos)->dirty = 1;
+        }
+        else {
+            ptrarray_append(&added, md);
+        }
+    }
+
+    if (!added.count) goto done;
+
+    the_sortcrit = sortcrit;
+    qsort(added.data, added.count, sizeof(MsgData *), qc_compare_qsort);
+
+    /* merge the new records in */
+    if (!res->msgdata.count) {
+        ptrarray_fini(&res->msgdata);
+        res->msgdata = added;
+        memset(&added, 0, sizeof(ptrarray_t));
+        goto done;
+    }
+
+    for (i = 0, j = 0; i < res->msgdata.count || j < added.count; ) {
+        if (j == added.count ||
+            (i < res->msgdata.count &&
+             qc_compare(ptrarray_nth(&res->msgdata, i),
+                        ptrarray_nth(&added, j), sortcrit) < 0)) {
+            ptrarray_append(&merged, ptrarray_nth(&res->msgdata, i++));
+        }
+        else {
+            /* it goes into the chunk of the record it lands before */
+            ptrarray_append(&grown, qc_chunk_at(res, i));
+            ptrarray_append(&merged, ptrarray_nth(&added, j++));
+        }
+    }
+    ptrarray_fini(&res->msgdata);
+    res->msgdata = merged;
+
+    for (i = 0; i < grown.count; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&grown, i);
+        chunk->count++;
+        chunk->dirty = 1;
+    }
+
+done:
+    qc_chunk_split(res);
+    ptrarray_fini(&grown);
+    ptrarray_fini(&added);
+}
+
+static void qc_putstring(struct buf *buf, const char *s)
+{
+    size_t len;
+
+    if (!s) {
+        buf_appendbit32(buf, JMAP_QC_NOSTRING);
+        return;
+    }
+
+    len = strlen(s);
+    buf_appendbit32(buf, len);
+    buf_appendmap(buf, s, len);
+}
+
+static void qc_encode_head(const struct jmap_queryresult *res,
+                           struct buf *buf)
+{
+    int i;
+
+    buf_appendmap(buf, JMAP_QC_MAGIC, 4);
+    buf_appendbit64(buf, res->modseq);
+    buf_appendbit64(buf, res->foldersmodseq);
+    buf_appendbit64(buf, res->lastupdated);
+    buf_appendbit32(buf, res->folders.count);
+    buf_appendbit32(buf, res->msgdata.count);
+    buf_appendbit32(buf, res->nextchunk);
+    buf_appendbit32(buf, res->chunks.count);
+
+    for (i = 0; i < res->folders.count; i++) {
+        search_folder_t *folder = ptrarray_nth(&res->folders, i);
+        qc_putstring(buf, folder->mboxname);
+    }
+
+    for (i = 0; i < res->chunks.count; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+        buf_appendbit32(buf, chunk->id);
+        buf_appendbit32(buf, chunk->count);
+    }
+}
+
+static void qc_encode_chunk(const struct jmap_queryresult *res,
+                            int first, int count, struct buf *buf)
+{
+    char guidbuf[MESSAGE_GUID_SIZE];
+    int i;
+
+    for (i = first; i < first + count; i++) {
+        MsgData *md = ptrarray_nth(&res->msgdata, i);
+
+        buf_appendbit32(buf, md->folder->id);
+        buf_appendbit32(buf, md->uid);
+        buf_appendbit64(buf, md->cid);
+        buf_appendbit32(buf, md->system_flags);
+        message_guid_export(&md->guid, guidbuf);
+        buf_appendmap(buf, guidbuf, MESSAGE_GUID_SIZE);
+        buf_appendbit64(buf, md->modseq);
+        buf_appendbit64(buf, md->internaldate);
+        buf_appendbit64(buf, md->size);
+        qc_putstring(buf, md->from);
+        qc_putstring(buf, md->to);
+        qc_putstring(buf, md->xsubj);
+    }
+}
+
+static uint32_t qc_get32(const char *p)
+{
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return ntohl(v);
+}
+
+static int qc_getstring(const char **pp, const char *end, char **sp)
+{
+    uint32_t len;
+
+    if (end - *pp < 4) return IMAP_MAILBOX_BADFORMAT;
+    len = qc_get32(*pp);
+    *pp += 4;
+
+    if (len == JMAP_QC_NOSTRING) {
+        *sp = NULL;
+        return 0;
+    }
+
+    if ((size_t)(end - *pp) < len) return IMAP_MAILBOX_BADFORMAT;
+
+    *sp = xstrndup(*pp, len);
+    *pp += len;
+    return 0;
+}
+
+/* Decode a head, leaving the chunks it names to be read */
+static int qc_decode_head(const char *data, size_t datalen,
+                          struct jmap_queryresult **resp)
+{
+    struct jmap_queryresult *res;
+    const char *p = data, *end = data + datalen;
+    uint32_t nfolders, nmsgs, nchunks, total = 0, i;
+    int r = IMAP_MAILBOX_BADFORMAT;
+
+    if (datalen < JMAP_QC_HEADER || memcmp(data, JMAP_QC_MAGIC, 4))
+        return IMAP_MAILBOX_BADFORMAT;
+
+    res = jmap_queryresult_new(align_ntohll(data + 12));
+    res->modseq = align_ntohll(data + 4);
+    res->lastupdated = align_ntohll(data + 20);
+    nfolders = qc_get32(data + 28);
+    nmsgs = qc_get32(data + 32);
+    res->nextchunk = qc_get32(data + 36);
+    nchunks = qc_get32(data + 40);
+    p += JMAP_QC_HEADER;
+
+    for (i = 0; i < nfolders; i++) {
+        search_folder_t *folder = xzmalloc(sizeof(search_folder_t));
+        folder->id = i;
+        ptrarray_append(&res->folders, folder);
+        if (qc_getstring(&p, end, &folder->mboxname) || !folder->mboxname)
+            goto done;
+    }
+
+    if ((size_t)(end - p) != (size_t) nchunks * JMAP_QC_CHUNKREF) goto done;
+
+    for (i = 0; i < nchunks; i++) {
+        struct jmap_querychunk *chunk = xzmalloc(sizeof(struct jmap_querychunk));
+        ptrarray_append(&res->chunks, chunk);
+        chunk->id = qc_get32(p);
+        chunk->count = qc_get32(p + 4);
+        p += JMAP_QC_CHUNKREF;
+
+        if (chunk->count <= 0 || chunk->id >= res->nextchunk) goto done;
+        total += chunk->count;
+    }
+
+    if (total != nmsgs) goto done;
+
+    *resp = res;
+    res = NULL;
+    r = 0;
+
+done:
+    jmap_queryresult_free(&res);
+    return r;
+}
+
+/* Append the count records of a chunk to res */
+static int qc_decode_chunk(struct jmap_queryresult *res, int count,
+                           const char *data, size_t datalen)
+{
+    const char *p = data, *end = data + datalen;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        MsgData *md;
+        uint32_t folder;
+
+        if (end - p < JMAP_QC_MSGDATA) return IMAP_MAILBOX_BADFORMAT;
+
+        folder = qc_get32(p);
+        if (folder >= (uint32_t) res->folders.count)
+            return IMAP_MAILBOX_BADFORMAT;
+
+        md = xzmalloc(sizeof(MsgData));
+        ptrarray_append(&res->msgdata, md);
+
+        md->folder = ptrarray_nth(&res->folders, folder);
+        md->uid = qc_get32(p + 4);
+        md->cid = align_ntohll(p + 8);
+        md->system_flags = qc_get32(p + 16);
+        message_guid_import(&md->guid, p + 20);
+        p += 20 + MESSAGE_GUID_SIZE;
+        md->modseq = align_ntohll(p);
+        md->internaldate = align_ntohll(p + 8);
+        md->size = align_ntohll(p + 16);
+        p += 24;
+
+        if (qc_getstring(&p, end, &md->from) ||
+            qc_getstring(&p, end, &md->to) ||
+            qc_getstring(&p, end, &md->xsubj))
+            return IMAP_MAILBOX_BADFORMAT;
+
+        if (md->system_flags & FLAG_EXPUNGED)
+            res->nexpunged++;
+    }
+
+    if (p != end) return IMAP_MAILBOX_BADFORMAT;
+
+    return 0;
+}
+
+static void qc_chunkkey(struct buf *buf, const char *key, uint32_t id)
+{
+    buf_setcstr(buf, key);
+    buf_putc(buf, JMAP_QC_SEP);
+    buf_printf(buf, "%08x", id);
+}
+
+static int qc_read(struct jmap_querycache *qc, const char *key,
+                   struct jmap_queryresult **resp)
+{
+    struct jmap_queryresult *res = NULL;
+    struct buf chunkkey = BUF_INITIALIZER;
+    const char *data = NULL;
+    size_t datalen = 0;
+    int i, r;
+
+    r = cyrusdb_fetch(qc->db, key, strlen(key), &data, &datalen, NULL);
+    if (!r) r = qc_decode_head(data, datalen, &res);
+
+    for (i = 0; !r && i < res->chunks.count; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+
+        qc_chunkkey(&chunkkey, key, chunk->id);
+        r = cyrusdb_fetch(qc->db, chunkkey.s, chunkkey.len,
+                          &data, &datalen, NULL);
+        if (!r) r = qc_decode_chunk(res, chunk->count, data, datalen);
+    }
+
+    if (!r) {
+        *resp = res;
+        res = NULL;
+    }
+
+    jmap_queryresult_free(&res);
+    buf_free(&chunkkey);
+    return r;
+}
+
+EXPORTED int jmap_querycache_get(struct jmap_querycache *qc, const char *key,
+                                 struct jmap_queryresult **resp)
+{
+    int r;
+
+    r = qc_read(qc, key, resp);
+
+    /* a chunk may have been replaced after we read the head */
+    if (r == CYRUSDB_NOTFOUND)
+        r = qc_read(qc, key, resp);
+
+    if (r == IMAP_MAILBOX_BADFORMAT) {
+        /* treat it as missing, it will be rebuilt and replaced */
+        syslog(LOG_WARNING, "jmap_querycache: %s: bad record for %s",
+               qc->userid, key);
+        return CYRUSDB_NOTFOUND;
+    }
+
+    return r;
+}
+
+struct chunks_rock {
+    strarray_t keys;
+    const ptrarray_t *keep;
+};
+
+static int chunks_cb(void *rock,
+                     const char *key, size_t keylen,
+                     const char *data __attribute__((unused)),
+                     size_t datalen __attribute__((unused)))
+{
+    struct chunks_rock *crock = rock;
+    const char *sep = memchr(key, JMAP_QC_SEP, keylen);
+    int i;
+
+    if (crock->keep && sep) {
+        char *idstr = xstrndup(sep + 1, keylen - (sep + 1 - key));
+        uint32_t id = strtoul(idstr, NULL, 16);
+
+        free(idstr);
+        for (i = 0; i < crock->keep->count; i++) {
+            struct jmap_querychunk *chunk = ptrarray_nth(crock->keep, i);
+            if (chunk->id == id) return 0;
+        }
+    }
+
+    strarray_appendm(&crock->keys, xstrndup(key, keylen));
+
+    return 0;
+}
+
+/* Delete the chunks of key which are not in keep, or all of them */
+static int qc_delete_chunks(struct jmap_querycache *qc, const char *key,
+                            const ptrarray_t *keep, struct txn **tid)
+{
+    struct chunks_rock crock = { STRARRAY_INITIALIZER, keep };
+    struct buf prefix = BUF_INITIALIZER;
+    int i, r;
+
+    buf_setcstr(&prefix, key);
+    buf_putc(&prefix, JMAP_QC_SEP);
+
+    r = cyrusdb_foreach(qc->db, prefix.s, prefix.len, NULL,
+                        chunks_cb, &crock, tid);
+
+    for (i = 0; !r && i < crock.keys.count; i++) {
+        const char *chunkkey = strarray_nth(&crock.keys, i);
+        r = cyrusdb_delete(qc->db, chunkkey, strlen(chunkkey), tid, 1);
+    }
+
+    strarray_fini(&crock.keys);
+    buf_free(&prefix);
+
+    return r;
+}
+
+struct prune_rock {
+    strarray_t keys;
+    arrayu64_t stamps;
+};
+
+static int prune_cb(void *rock,
+                    const char *key, size_t keylen,
+                    const char *data, size_t datalen)
+{
+    struct prune_rock *prock = rock;
+
+    /* just the heads */
+    if (memchr(key, JMAP_QC_SEP, keylen)) return 0;
+
+    strarray_appendm(&prock->keys, xstrndup(key, keylen));
+    arrayu64_append(&prock->stamps, datalen >= JMAP_QC_HEADER &&
+                    !memcmp(data, JMAP_QC_MAGIC, 4) ?
+                    align_ntohll(data + 20) : 0);
+
+    return 0;
+}
+
+/* Remove the least recently updated results beyond the limit */
+static int qc_prune(struct jmap_querycache *qc, struct txn **tid, int max)
+{
+    struct prune_rock prock = { STRARRAY_INITIALIZER, ARRAYU64_INITIALIZER };
+    int r;
+
+    r = cyrusdb_foreach(qc->db, "", 0, NULL, prune_cb, &prock, tid);
+
+    while (!r && prock.keys.count > max) {
+        int i, oldest = 0;
+
+        for (i = 1; i < prock.keys.count; i++) {
+            if (arrayu64_nth(&prock.stamps, i) <
+                arrayu64_nth(&prock.stamps, oldest))
+                oldest = i;
+        }
+
+        r = cyrusdb_delete(qc->db, prock.keys.data[oldest],
+                           strlen(prock.keys.data[oldest]), tid, 1);
+        if (!r) r = qc_delete_chunks(qc, prock.keys.data[oldest], NULL, tid);
+        free(strarray_remove(&prock.keys, oldest));
+        arrayu64_remove(&prock.stamps, oldest);
+    }
+
+    strarray_fini(&prock.keys);
+    arrayu64_fini(&prock.stamps);
+
+    return r;
+}
+
+EXPORTED int jmap_querycache_put(struct jmap_querycache *qc, const char *key,
+                                 struct jmap_queryresult *res)
+{
+    struct jmap_queryresult *stored = NULL;
+    struct buf buf = BUF_INITIALIZER;
+    struct buf chunkkey = BUF_INITIALIZER;
+    struct txn *tid = NULL;
+    const char *data = NULL;
+    size_t datalen = 0;
+    int i, first;
+    int r;
+
+    r = cyrusdb_fetchlock(qc->db, key, strlen(key), &data, &datalen, &tid);
+    if (r == CYRUSDB_NOTFOUND)
+        r = 0;
+    else if (!r && !qc_decode_head(data, datalen, &stored) &&
+             stored->modseq > res->modseq &&
+             stored->foldersmodseq == res->foldersmodseq) {
+        /* somebody else stored a more recent result meanwhile */
+        goto done;
+    }
+    if (r) goto done;
+
+    /* if somebody else stored a result since ours was read, the
+     * chunks we didn't change may have been replaced too */
+    if (stored && stored->nextchunk != res->nextchunk) {
+        for (i = 0; i < res->chunks.count; i++) {
+            struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+            chunk->dirty = 1;
+        }
+        res->nextchunk = stored->nextchunk;
+    }
+
+    for (i = 0, first = 0; !r && i < res->chunks.count; i++) {
+        struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+
+        if (chunk->dirty) {
+            chunk->id = res->nextchunk++;
+            buf_reset(&buf);
+            qc_encode_chunk(res, first, chunk->count, &buf);
+            qc_chunkkey(&chunkkey, key, chunk->id);
+            r = cyrusdb_store(qc->db, chunkkey.s, chunkkey.len,
+                              buf.s, buf.len, &tid);
+        }
+        first += chunk->count;
+    }
+    if (!r) r = qc_delete_chunks(qc, key, &res->chunks, &tid);
+    if (r) goto done;
+
+    res->lastupdated = time(NULL);
+    buf_reset(&buf);
+    qc_encode_head(res, &buf);
+
+    r = cyrusdb_store(qc->db, key, strlen(key), buf.s, buf.len, &tid);
+    if (!r) r = qc_prune(qc, &tid, config_getint(IMAPOPT_JMAP_QUERYCACHE_MAX));
+
+done:
+    if (tid) {
+        if (r) cyrusdb_abort(qc->db, tid);
+        else r = cyrusdb_commit(qc->db, tid);
+    }
+    if (r) {
+        syslog(LOG_ERR, "jmap_querycache: %s: cannot store %s: %s",
+               qc->userid, key, cyrusdb_strerror(r));
+        r = IMAP_IOERROR;
+    }
+    else {
+        /* the stored chunks now match ours */
+        for (i = 0; i < res->chunks.count; i++) {
+            struct jmap_querychunk *chunk = ptrarray_nth(&res->chunks, i);
+            chunk->dirty = 0;
+        }
+    }
+    jmap_queryresult_free(&stored);
+    buf_free(&chunkkey);
+    buf_free(&buf);
+
+    return r;
+}
@@ -0,0 +1,96 @@
+/* jmap_querycache.h -- Persistent cache of JMAP Email/query results
+ *
+ * Copyright (c) 1994-2018 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ *
+ */
+
+#ifndef JMAP_QUERYCACHE_H
+#define JMAP_QUERYCACHE_H
+
+#include <time.h>
+
+#include "index.h"
+#include "ptrarray.h"
+#include "search_query.h"
+
+/* A cached query result: every message record matching the query,
+ * including expunged ones, in sort order.  The MsgData carry only the
+ * record identity and the fields needed to sort and report them; their
+ * folders are the search_folder_t in folders, which only have a name. */
+struct jmap_queryresult {
+    modseq_t modseq;            /* changes up to here have been applied */
+    modseq_t foldersmodseq;     /* mailfoldersmodseq the result was built at */
+    time_t lastupdated;
+    ptrarray_t folders;         /* search_folder_t */
+    ptrarray_t msgdata;         /* MsgData, sorted */
+    unsigned nexpunged;
+    /* msgdata is stored in chunks, so that bringing the result up
+     * to date only rewrites the chunks which changed */
+    ptrarray_t chunks;          /* private to jmap_querycache.c */
+    uint32_t nextchunk;
+};
+
+struct jmap_querycache;
+
+extern int jmap_querycache_open(const char *userid,
+                                struct jmap_querycache **qcp);
+extern void jmap_querycache_close(struct jmap_querycache **qcp);
+
+/* Returns CYRUSDB_NOTFOUND if nothing usable is cached for key */
+extern int jmap_querycache_get(struct jmap_querycache *qc, const char *key,
+                               struct jmap_queryresult **resp);
+/* Stores res under key, unless a newer result is already stored */
+extern int jmap_querycache_put(struct jmap_querycache *qc, const char *key,
+                               struct jmap_queryresult *res);
+
+extern struct jmap_queryresult *jmap_queryresult_new(modseq_t foldersmodseq);
+extern void jmap_queryresult_free(struct jmap_queryresult **resp);
+
+/* Merge the records found by a search for changes since res->modseq,
+ * sorted or not, into res.  Records already in res are replaced. */
+extern void jmap_queryresult_apply(struct jmap_queryresult *res,
+                                   MsgData **msgdata, int n,
+                                   const struct sortcrit *sortcrit);
+
+/* Should res be rebuilt from scratch rather than brought up to date? */
+extern int jmap_queryresult_isstale(const struct jmap_queryresult *res,
+                                    modseq_t foldersmodseq);
+
+#endif /* JMAP_QUERYCACHE_H */
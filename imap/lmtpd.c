@@ -89,6 +89,7 @@
 #include "prometheus.h"
 #include "prot.h"
 #include "proxy.h"
+#include "sync_log.h"
 #include "telemetry.h"
 #include "times.h"
 #include "tls.h"
@@ -754,6 +755,9 @@ int deliver(message_data_t *msgdata, char *authuser,
     mydata.authuser = authuser;
     mydata.authstate = authstate;
 
+    /* log the whole delivery's replication events in one write */
+    sync_log_batch_begin();
+
     /* loop through each recipient, attempting delivery for each */
     for (n = 0; n < nrcpts; n++) {
         const mbname_t *mbname = msg_getrcpt(msgdata, n);
@@ -806,6 +810,8 @@ int deliver(message_data_t *msgdata, char *authuser,
         mboxlist_entry_free(&mbentry);
     }
 
+    sync_log_batch_end();
+
     if (dlist) {
         struct dest *d;
 
@@ -105,6 +105,7 @@
 #include "statuscache.h"
 #include "strarray.h"
 #include "sync_log.h"
+#include "workerpool.h"
 #include "xmalloc.h"
 #include "xstrlcpy.h"
 #include "xstrlcat.h"
@@ -142,6 +143,7 @@ struct mailbox_repack {
     int old_version;
     int newindex_fd;
     ptrarray_t caches;
+    char *block;    /* version 14 block being filled */
 };
 
 static struct MsgFlagMap msgflagmap[] = {
@@ -440,7 +442,7 @@ EXPORTED struct buf *cacheitem_buf(const struct index_record *record, int field)
  * records which point into the map, so you can't free it while
  * you still have them around! */
 static int cache_parserecord(struct mappedfile *cachefile, uint64_t cache_offset,
-                             struct cacherecord *crec)
+                             int nfields, struct cacherecord *crec)
 {
     const struct buf *buf = mappedfile_buf(cachefile);
     size_t buf_size = mappedfile_size(cachefile);
@@ -450,7 +452,10 @@ static int cache_parserecord(struct mappedfile *cachefile, uint64_t cache_offset
 
     offset = cache_offset;
 
-    for (cache_ent = 0; cache_ent < NUM_CACHE_FIELDS; cache_ent++) {
+    /* fields added after this record was written are empty */
+    memset(crec->item, 0, sizeof(crec->item));
+
+    for (cache_ent = 0; cache_ent < nfields; cache_ent++) {
         cacheitem = buf->s + offset;
 
         /* bounds checking */
@@ -679,7 +684,9 @@ static int mailbox_cacherecord_internal(struct mailbox *mailbox,
         goto err;
 
     /* try to parse the cache record */
-    r = cache_parserecord(cachefile, record->cache_offset, &backdoor->crec);
+    r = cache_parserecord(cachefile, record->cache_offset,
+                          CACHE_NUM_FIELDS(record->cache_version),
+                          &backdoor->crec);
     if (r) goto err;
 
     /* old-style record */
@@ -859,6 +866,12 @@ static void mailbox_release_resources(struct mailbox *mailbox)
     mailbox->index_locktype = 0; /* lock was released by closing fd */
     if (mailbox->index_base)
         map_free(&mailbox->index_base, &mailbox->index_len);
+    bv_free(&mailbox->index_checked);
+
+    /* a reopened index may have been repacked */
+    uidhash_reset(&mailbox->uidhash);
+    mailbox->uidhash_recno = 0;
+    mailbox->uidhash_lastuid = 0;
 
     /* release caches */
     for (i = 0; i < mailbox->caches.count; i++) {
@@ -1166,6 +1179,7 @@ EXPORTED void mailbox_close(struct mailbox **mailboxptr)
     free(mailbox->acl);
     free(mailbox->uniqueid);
     free(mailbox->quotaroot);
+    uidhash_fini(&mailbox->uidhash);
 
     for (flag = 0; flag < MAX_USER_FLAGS; flag++) {
         free(mailbox->flagname[flag]);
@@ -1505,6 +1519,173 @@ EXPORTED struct entryattlist *mailbox_extract_annots(const struct mailbox *mailb
     return annots;
 }
 
+/*
+ * The columns of a version 14 index block, each a byte range of the
+ * version 13 record.  Fields which get scanned come first, and modseq
+ * leads so that its column stays 8 byte aligned.
+ */
+static const struct index_column {
+    unsigned offset;
+    unsigned len;
+} index_columns[] = {
+    { OFFSET_MODSEQ, 8 },
+    { OFFSET_UID, 4 },
+    { OFFSET_SYSTEM_FLAGS, 4 },
+    { OFFSET_INTERNALDATE, 4 },
+    { OFFSET_SIZE, 4 },
+    { OFFSET_SENTDATE, 4 },
+    { OFFSET_HEADER_SIZE, OFFSET_SYSTEM_FLAGS - OFFSET_HEADER_SIZE },
+    { OFFSET_USER_FLAGS, OFFSET_MODSEQ - OFFSET_USER_FLAGS },
+    { OFFSET_THRID, INDEX_RECORD_SIZE - OFFSET_THRID },
+    { 0, 0 }
+};
+
+#define INDEX_BLOCK_COLUMNS \
+    (sizeof(index_columns) / sizeof(index_columns[0]) - 1)
+
+/*
+ * Size of a version 14 block, column CRCs and all
+ */
+static size_t index_block_size(const struct index_header *i)
+{
+    return INDEX_BLOCK_HEADER_SIZE + INDEX_BLOCK_RECORDS * i->record_size;
+}
+
+/*
+ * Size of the file space used by 'num_records' records
+ */
+static size_t index_records_size(const struct index_header *i,
+                                 uint32_t num_records)
+{
+    if (i->minor_version >= 14) {
+        num_records += INDEX_BLOCK_RECORDS - 1;
+        return (size_t)(num_records / INDEX_BLOCK_RECORDS) * index_block_size(i);
+    }
+
+    return (size_t)num_records * i->record_size;
+}
+
+/*
+ * Offset in the index file of the block holding record 'recno'
+ */
+static size_t index_block_offset(const struct index_header *i, uint32_t recno)
+{
+    uint32_t block = (recno - 1) / INDEX_BLOCK_RECORDS;
+
+    return i->start_offset + (size_t)block * index_block_size(i);
+}
+
+/*
+ * Offset in the index file of the field at 'field' (one of the
+ * OFFSET_* values) in record 'recno'
+ */
+static size_t index_field_offset(const struct index_header *i,
+                                 uint32_t recno, unsigned field)
+{
+    const struct index_column *col;
+    uint32_t slot = (recno - 1) % INDEX_BLOCK_RECORDS;
+    size_t offset;
+
+    if (i->minor_version < 14)
+        return i->start_offset + (size_t)(recno - 1) * i->record_size + field;
+
+    offset = index_block_offset(i, recno) + INDEX_BLOCK_HEADER_SIZE;
+    for (col = index_columns; col->len; col++) {
+        if (field >= col->offset && field < col->offset + col->len)
+            break;
+        offset += INDEX_BLOCK_RECORDS * col->len;
+    }
+    assert(col->len);
+
+    return offset + slot * col->len + (field - col->offset);
+}
+
+/*
+ * Copy record 'slot' out of the columns of 'block' into 'buf'
+ */
+static void index_gather_record(const char *block, uint32_t slot,
+                                unsigned char *buf)
+{
+    const struct index_column *col;
+
+    block += INDEX_BLOCK_HEADER_SIZE;
+    for (col = index_columns; col->len; col++) {
+        memcpy(buf + col->offset, block + slot * col->len, col->len);
+        block += INDEX_BLOCK_RECORDS * col->len;
+    }
+}
+
+/*
+ * Copy 'buf' into the columns of record 'slot' in 'block'
+ */
+static void index_scatter_record(const unsigned char *buf, uint32_t slot,
+                                 char *block)
+{
+    const struct index_column *col;
+
+    block += INDEX_BLOCK_HEADER_SIZE;
+    for (col = index_columns; col->len; col++) {
+        memcpy(block + slot * col->len, buf + col->offset, col->len);
+        block += INDEX_BLOCK_RECORDS * col->len;
+    }
+}
+
+/*
+ * Fill in the CRCs of each column at the start of 'block'
+ */
+static void index_block_setcrcs(char *block)
+{
+    const struct index_column *col;
+    const char *base = block + INDEX_BLOCK_HEADER_SIZE;
+    int n;
+
+    memset(block, 0, INDEX_BLOCK_HEADER_SIZE);
+    for (n = 0, col = index_columns; col->len; n++, col++) {
+        *((bit32 *)(block + 4*n)) =
+            htonl(crc32_map(base, INDEX_BLOCK_RECORDS * col->len));
+        base += INDEX_BLOCK_RECORDS * col->len;
+    }
+}
+
+/*
+ * Check the CRC of the column holding 'field' in the version 14 block of
+ * 'recno', so that the field can be read straight from the map.  Each
+ * column of a block is checked once per mapping of the index.
+ */
+static int index_column_valid(struct mailbox *mailbox, uint32_t recno,
+                              unsigned field)
+{
+    const struct index_header *i = &mailbox->i;
+    const struct index_column *col;
+    const char *block = mailbox->index_base + index_block_offset(i, recno);
+    const char *base = block + INDEX_BLOCK_HEADER_SIZE;
+    uint32_t bit;
+    int n;
+
+    for (n = 0, col = index_columns; col->len; n++, col++) {
+        if (field >= col->offset && field < col->offset + col->len)
+            break;
+        base += INDEX_BLOCK_RECORDS * col->len;
+    }
+    assert(col->len);
+
+    /* a pair of bits for each column: checked, and found good */
+    bit = 2 * ((recno - 1) / INDEX_BLOCK_RECORDS * INDEX_BLOCK_COLUMNS + n);
+    if (bv_isset(&mailbox->index_checked, bit))
+        return bv_isset(&mailbox->index_checked, bit + 1);
+
+    bv_set(&mailbox->index_checked, bit);
+    if (crc32_map(base, INDEX_BLOCK_RECORDS * col->len) !=
+        ntohl(*((bit32 *)(block + 4*n)))) {
+        syslog(LOG_ERR, "IOERROR: %s column CRC mismatch in the block of "
+               "record %u, reading whole records", mailbox->name, recno);
+        return 0;
+    }
+
+    bv_set(&mailbox->index_checked, bit + 1);
+    return 1;
+}
+
 static int mailbox_buf_to_index_header(const char *buf, size_t len,
                                        struct index_header *i)
 {
@@ -1534,6 +1715,7 @@ static int mailbox_buf_to_index_header(const char *buf, size_t len,
         break;
     case 12:
     case 13:
+    case 14:
         minlen = 128;
         break;
     default:
@@ -1543,6 +1725,9 @@ static int mailbox_buf_to_index_header(const char *buf, size_t len,
         return IMAP_MAILBOX_BADFORMAT;
     i->start_offset = ntohl(*((bit32 *)(buf+OFFSET_START_OFFSET)));
     i->record_size = ntohl(*((bit32 *)(buf+OFFSET_RECORD_SIZE)));
+    /* the columns have to add up */
+    if (i->minor_version >= 14 && i->record_size != INDEX_RECORD_SIZE)
+        return IMAP_MAILBOX_BADFORMAT;
     i->num_records = ntohl(*((bit32 *)(buf+OFFSET_NUM_RECORDS)));
     i->last_appenddate = ntohl(*((bit32 *)(buf+OFFSET_LAST_APPENDDATE)));
     i->last_uid = ntohl(*((bit32 *)(buf+OFFSET_LAST_UID)));
@@ -1602,7 +1787,7 @@ static int mailbox_refresh_index_map(struct mailbox *mailbox)
     /* check if we need to extend the mmaped space for the index file
      * (i.e. new records appended since last read) */
     need_size = mailbox->i.start_offset +
-                mailbox->i.num_records * mailbox->i.record_size;
+                index_records_size(&mailbox->i, mailbox->i.num_records);
     if (mailbox->index_size < need_size) {
         if (fstat(mailbox->index_fd, &sbuf) == -1)
             return IMAP_IOERROR;
@@ -1618,6 +1803,7 @@ static int mailbox_refresh_index_map(struct mailbox *mailbox)
     map_refresh(mailbox->index_fd, 1, &mailbox->index_base,
                 &mailbox->index_len, mailbox->index_size,
                 "index", mailbox->name);
+    bv_clearall(&mailbox->index_checked);
 
     return 0;
 }
@@ -1645,6 +1831,7 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
     map_refresh(mailbox->index_fd, 1, &mailbox->index_base,
                 &mailbox->index_len, mailbox->index_size,
                 "index", mailbox->name);
+    bv_clearall(&mailbox->index_checked);
 
     r = mailbox_buf_to_index_header(mailbox->index_base, mailbox->index_len,
                                     &mailbox->i);
@@ -1656,6 +1843,55 @@ static int mailbox_read_index_header(struct mailbox *mailbox)
     return 0;
 }
 
+/*
+ * Read the index header of mailbox 'name' without opening or locking
+ * the mailbox.  The read may race with a writer, but the header CRC
+ * catches a torn read, so a successful return is a consistent (if
+ * possibly already stale) snapshot.  Index versions without a header
+ * CRC are refused.
+ */
+EXPORTED int mailbox_peek_index_header(const char *name,
+                                       struct index_header *i)
+{
+    mbentry_t *mbentry = NULL;
+    char buf[INDEX_HEADER_SIZE];
+    char *fname = NULL;
+    ssize_t n;
+    int fd = -1;
+    int r;
+
+    r = mboxlist_lookup(name, &mbentry, NULL);
+    if (r) return r;
+
+    if (mbentry->mbtype & (MBTYPE_REMOTE | MBTYPE_MOVING)) {
+        r = IMAP_MAILBOX_NOTSUPPORTED;
+        goto done;
+    }
+
+    fname = mbentry_metapath(mbentry, META_INDEX, 0);
+    fd = open(fname, O_RDONLY, 0);
+    if (fd == -1) {
+        r = (errno == ENOENT) ? IMAP_MAILBOX_NONEXISTENT : IMAP_IOERROR;
+        goto done;
+    }
+
+    n = pread(fd, buf, sizeof(buf), 0);
+    if (n < 0) {
+        r = IMAP_IOERROR;
+        goto done;
+    }
+
+    r = mailbox_buf_to_index_header(buf, n, i);
+    if (!r && i->minor_version < 12)
+        r = IMAP_MAILBOX_BADFORMAT;
+
+done:
+    if (fd != -1) close(fd);
+    mboxlist_entry_free(&mbentry);
+    free(fname);
+    return r;
+}
+
 /*
  * Read an index record from a mapped index file
  */
@@ -1778,7 +2014,89 @@ static int _store_change(struct mailbox *mailbox, struct index_record *record, i
     return 0;
 }
 
-static int _commit_one(struct mailbox *mailbox, struct index_change *change)
+/*
+ * Read the version 14 block holding 'recno' into 'block' from the file,
+ * which may have been written since it was mapped.  A block past the end
+ * of the file is all zero.
+ */
+static int mailbox_read_index_block(struct mailbox *mailbox, uint32_t recno,
+                                    char *block)
+{
+    size_t size = index_block_size(&mailbox->i);
+    ssize_t n;
+
+    if (lseek(mailbox->index_fd, index_block_offset(&mailbox->i, recno),
+              SEEK_SET) == -1) {
+        syslog(LOG_ERR, "IOERROR: seeking index block for record %u of %s: %m",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    n = retry_read(mailbox->index_fd, block, size);
+    if (n < 0) {
+        syslog(LOG_ERR, "IOERROR: reading index block for record %u of %s: %m",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+    if ((size_t)n < size)
+        memset(block + n, 0, size - n);
+
+    return 0;
+}
+
+/*
+ * Write 'block' back as the version 14 block holding 'recno', with the
+ * CRCs of its columns brought up to date
+ */
+static int mailbox_write_index_block(struct mailbox *mailbox, uint32_t recno,
+                                     char *block)
+{
+    size_t size = index_block_size(&mailbox->i);
+
+    index_block_setcrcs(block);
+
+    if (lseek(mailbox->index_fd, index_block_offset(&mailbox->i, recno),
+              SEEK_SET) == -1) {
+        syslog(LOG_ERR, "IOERROR: seeking index block for record %u of %s: %m",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    if (retry_write(mailbox->index_fd, block, size) != (ssize_t)size) {
+        syslog(LOG_ERR, "IOERROR: writing index block for record %u of %s: %m",
+               recno, mailbox->name);
+        return IMAP_IOERROR;
+    }
+
+    return 0;
+}
+
+/*
+ * Write the record in 'buf' to the columns of 'recno' in a version 14
+ * index, rewriting its whole block
+ */
+static int mailbox_write_index_columns(struct mailbox *mailbox, uint32_t recno,
+                                       const unsigned char *buf)
+{
+    char *block = xmalloc(index_block_size(&mailbox->i));
+    int r;
+
+    r = mailbox_read_index_block(mailbox, recno, block);
+    if (!r) {
+        index_scatter_record(buf, (recno - 1) % INDEX_BLOCK_RECORDS, block);
+        r = mailbox_write_index_block(mailbox, recno, block);
+    }
+    free(block);
+
+    return r;
+}
+
+/*
+ * Write out one change.  For version 14 the record goes into 'block',
+ * which holds its block and gets written by the caller.
+ */
+static int _commit_one(struct mailbox *mailbox, struct index_change *change,
+                       char *block)
 {
     indexbuffer_t ibuf;
     unsigned char *buf = ibuf.buf;
@@ -1788,19 +2106,24 @@ static int _commit_one(struct mailbox *mailbox, struct index_change *change)
 
     mailbox_index_record_to_buf(&change->record, mailbox->i.minor_version, buf);
 
-    offset = mailbox->i.start_offset + ((recno-1) * mailbox->i.record_size);
-
-    /* any failure here is a disaster! */
-    if (lseek(mailbox->index_fd, offset, SEEK_SET) == -1) {
-        syslog(LOG_ERR, "IOERROR: seeking index record %u for %s: %m",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
+    if (mailbox->i.minor_version >= 14) {
+        index_scatter_record(buf, (recno - 1) % INDEX_BLOCK_RECORDS, block);
     }
+    else {
+        offset = mailbox->i.start_offset + ((recno-1) * mailbox->i.record_size);
 
-    if (retry_write(mailbox->index_fd, buf, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE) {
-        syslog(LOG_ERR, "IOERROR: writing index record %u for %s: %m",
-               recno, mailbox->name);
-        return IMAP_IOERROR;
+        /* any failure here is a disaster! */
+        if (lseek(mailbox->index_fd, offset, SEEK_SET) == -1) {
+            syslog(LOG_ERR, "IOERROR: seeking index record %u for %s: %m",
+                   recno, mailbox->name);
+            return IMAP_IOERROR;
+        }
+
+        if (retry_write(mailbox->index_fd, buf, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE) {
+            syslog(LOG_ERR, "IOERROR: writing index record %u for %s: %m",
+                   recno, mailbox->name);
+            return IMAP_IOERROR;
+        }
     }
 
     /* audit logging */
@@ -1858,7 +2181,9 @@ static int change_compar(const void *a, const void *b)
 static int _commit_changes(struct mailbox *mailbox)
 {
     uint32_t i;
-    int r;
+    char *block = NULL;
+    uint32_t blockrecno = 0;    /* first recno of 'block' */
+    int r = 0;
 
     if (!mailbox->index_change_count) return 0;
     mailbox->i.dirty = 1;
@@ -1869,15 +2194,40 @@ static int _commit_changes(struct mailbox *mailbox)
     qsort(mailbox->index_changes, mailbox->index_change_count,
           sizeof(struct index_change), change_compar);
 
+    if (mailbox->i.minor_version >= 14)
+        block = xmalloc(index_block_size(&mailbox->i));
+
     for (i = 1; i <= mailbox->index_change_count; i++) {
-        r = _commit_one(mailbox, &mailbox->index_changes[i-1]);
-        if (r) return r; /* DAMN, we're screwed */
+        struct index_change *change = &mailbox->index_changes[i-1];
+
+        /* version 14 blocks are rewritten once for all their changes */
+        if (block) {
+            uint32_t recno = change->record.recno;
+            uint32_t first = recno - (recno - 1) % INDEX_BLOCK_RECORDS;
+
+            if (first != blockrecno) {
+                if (blockrecno)
+                    r = mailbox_write_index_block(mailbox, blockrecno, block);
+                if (!r)
+                    r = mailbox_read_index_block(mailbox, first, block);
+                if (r) break;
+                blockrecno = first;
+            }
+        }
+
+        r = _commit_one(mailbox, change, block);
+        if (r) break;
     }
+    if (!r && blockrecno)
+        r = mailbox_write_index_block(mailbox, blockrecno, block);
+    free(block);
+    if (r) return r; /* DAMN, we're screwed */
 
     _cleanup_changes(mailbox);
 
     /* recalculate the size */
-    mailbox->index_size = mailbox->i.start_offset + (mailbox->i.num_records * mailbox->i.record_size);
+    mailbox->index_size = mailbox->i.start_offset +
+                          index_records_size(&mailbox->i, mailbox->i.num_records);
 
     r = mailbox_refresh_index_map(mailbox);
     if (r) return r;
@@ -1892,8 +2242,9 @@ static int mailbox_read_index_record(struct mailbox *mailbox,
                                      uint32_t recno,
                                      struct index_record *record)
 {
+    indexbuffer_t ibuf;
     const char *buf;
-    unsigned offset;
+    size_t offset;
     int r;
     struct index_change *change = _find_change(mailbox, recno);
 
@@ -1902,16 +2253,24 @@ static int mailbox_read_index_record(struct mailbox *mailbox,
         return 0;
     }
 
-    offset = mailbox->i.start_offset + (recno-1) * mailbox->i.record_size;
+    offset = mailbox->i.start_offset + index_records_size(&mailbox->i, recno);
 
-    if (offset + mailbox->i.record_size > mailbox->index_size) {
+    if (offset > mailbox->index_size) {
         syslog(LOG_ERR,
                "IOERROR: index record %u for %s past end of file",
                recno, mailbox->name);
         return IMAP_IOERROR;
     }
 
-    buf = mailbox->index_base + offset;
+    if (mailbox->i.minor_version >= 14) {
+        index_gather_record(mailbox->index_base +
+                            index_block_offset(&mailbox->i, recno),
+                            (recno - 1) % INDEX_BLOCK_RECORDS, ibuf.buf);
+        buf = (const char *)ibuf.buf;
+    }
+    else {
+        buf = mailbox->index_base + index_field_offset(&mailbox->i, recno, 0);
+    }
 
     r = mailbox_buf_to_index_record(buf, mailbox->i.minor_version, record);
 
@@ -2025,12 +2384,65 @@ static uint32_t mailbox_getuid(struct mailbox *mailbox, uint32_t recno)
 }
 
 
+/*
+ * Look up the recno of 'uid' in the UID hash, first adding any
+ * committed records which have been appended since it was last used.
+ * Returns 1 if the hash knows the answer, and sets 'recnop' to the
+ * recno or to zero if there is no such UID.  Returns 0 if the mailbox
+ * is too small to bother, or the UID may be in an uncommitted append.
+ */
+static int mailbox_uidhash_find(struct mailbox *mailbox, uint32_t uid,
+                                uint32_t *recnop)
+{
+    uint32_t minrecords = config_getint(IMAPOPT_MAILBOX_UIDHASH_MINRECORDS);
+    struct index_change *change;
+    uint32_t recno;
+    size_t offset;
+
+    if (!minrecords || mailbox->i.num_records < minrecords)
+        return 0;
+
+    if (!mailbox->uidhash_recno)
+        uidhash_reserve(&mailbox->uidhash, mailbox->i.num_records);
+
+    while (mailbox->uidhash_recno < mailbox->i.num_records) {
+        recno = mailbox->uidhash_recno + 1;
+
+        /* not on disk yet */
+        change = _find_change(mailbox, recno);
+        if (change && (change->flags & CHANGE_ISAPPEND))
+            break;
+
+        if (mailbox->i.start_offset +
+            index_records_size(&mailbox->i, recno) > mailbox->index_size)
+            break;
+
+        /* the UID column has to be sound, or we'll look the hard way */
+        if (mailbox->i.minor_version >= 14 &&
+            !index_column_valid(mailbox, recno, OFFSET_UID))
+            break;
+
+        offset = index_field_offset(&mailbox->i, recno, OFFSET_UID);
+        mailbox->uidhash_lastuid =
+            ntohl(*((bit32 *)(mailbox->index_base + offset)));
+        uidhash_insert(&mailbox->uidhash, mailbox->uidhash_lastuid, recno);
+        mailbox->uidhash_recno = recno;
+    }
+
+    if (uid > mailbox->uidhash_lastuid)
+        return 0;
+
+    *recnop = uidhash_lookup(&mailbox->uidhash, uid);
+    return 1;
+}
+
 /*
  * Returns the recno of the message with UID 'uid'.
  * If no message with UID 'uid', returns the message with
  * the highest UID not greater than 'uid'.
+ * Binary search only, see mailbox_finduid().
  */
-static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
+static uint32_t mailbox_finduid_bsearch(struct mailbox *mailbox, uint32_t uid)
 {
     uint32_t low = 1;
     uint32_t high = mailbox->i.num_records;
@@ -2050,6 +2462,17 @@ static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
     return high;
 }
 
+/* As mailbox_finduid_bsearch(), trying the UID hash first */
+static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
+{
+    uint32_t recno;
+
+    if (mailbox_uidhash_find(mailbox, uid, &recno) && recno)
+        return recno;
+
+    return mailbox_finduid_bsearch(mailbox, uid);
+}
+
 /*
  * Perform a binary search on the mailbox index file to read the record
  * for uid 'uid' into 'record'.  If 'oldrecord' is not NULL then it is
@@ -2060,7 +2483,12 @@ static uint32_t mailbox_finduid(struct mailbox *mailbox, uint32_t uid)
 EXPORTED int mailbox_find_index_record(struct mailbox *mailbox, uint32_t uid,
                                        struct index_record *record)
 {
-    uint32_t recno = mailbox_finduid(mailbox, uid);
+    uint32_t recno;
+
+    /* one hash lookup: if it knows, its answer stands, even if
+     * that's "no such UID" */
+    if (!mailbox_uidhash_find(mailbox, uid, &recno))
+        recno = mailbox_finduid_bsearch(mailbox, uid);
     /* no records? */
     if (!recno) return IMAP_NOTFOUND;
 
@@ -2639,6 +3067,44 @@ static bit32 mailbox_index_record_to_buf(struct index_record *record, int versio
 }
 
 
+/*
+ * Write the index of 'mailbox' to 'fd' as a version 13 file, one record
+ * after another, for peers which don't understand the columnar layout.
+ */
+EXPORTED int mailbox_index_write_rows(struct mailbox *mailbox, int fd)
+{
+    struct index_header i = mailbox->i;
+    struct index_record record;
+    indexbuffer_t ibuf;
+    uint32_t recno;
+    int r;
+
+    i.minor_version = MAILBOX_ROWS_MINOR_VERSION;
+    i.start_offset = INDEX_HEADER_SIZE;
+    i.record_size = INDEX_RECORD_SIZE;
+
+    mailbox_index_header_to_buf(&i, ibuf.buf);
+    if (retry_write(fd, ibuf.buf, INDEX_HEADER_SIZE) != INDEX_HEADER_SIZE)
+        goto fail;
+
+    for (recno = 1; recno <= i.num_records; recno++) {
+        r = mailbox_read_index_record(mailbox, recno, &record);
+        if (r) return r;
+
+        mailbox_index_record_to_buf(&record, i.minor_version, ibuf.buf);
+        if (retry_write(fd, ibuf.buf, INDEX_RECORD_SIZE) != INDEX_RECORD_SIZE)
+            goto fail;
+    }
+
+    return 0;
+
+fail:
+    syslog(LOG_ERR, "IOERROR: writing version %d index for %s: %m",
+           i.minor_version, mailbox->name);
+    return IMAP_IOERROR;
+}
+
+
 static void mailbox_quota_dirty(struct mailbox *mailbox)
 {
     /* track quota use */
@@ -3807,6 +4273,7 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
         repack->i.record_size = 96;
         break;
     case 13:
+    case 14:
         repack->i.start_offset = 128;
         repack->i.record_size = 104;
         break;
@@ -3849,6 +4316,9 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
             repack->seqset = seqset_init(mailbox->i.last_uid, SEQ_MERGE);
     }
 
+    if (version >= 14)
+        repack->block = xzmalloc(index_block_size(&repack->i));
+
     /* zero out some values */
     repack->i.num_records = 0;
     repack->i.quota_mailbox_used = 0;
@@ -3880,6 +4350,25 @@ static int mailbox_repack_setup(struct mailbox *mailbox, int version,
     return IMAP_IOERROR;
 }
 
+/*
+ * Write out the version 14 block being filled, the tail of a partial
+ * block is left zeroed
+ */
+static int mailbox_repack_flush(struct mailbox_repack *repack)
+{
+    size_t blocksize = index_block_size(&repack->i);
+    int n;
+
+    index_block_setcrcs(repack->block);
+    n = retry_write(repack->newindex_fd, repack->block, blocksize);
+    if (n == -1)
+        return IMAP_IOERROR;
+
+    memset(repack->block, 0, blocksize);
+
+    return 0;
+}
+
 static int mailbox_repack_add(struct mailbox_repack *repack,
                               struct index_record *record)
 {
@@ -3902,6 +4391,15 @@ static int mailbox_repack_add(struct mailbox_repack *repack,
 
     /* write the index record out */
     mailbox_index_record_to_buf(record, repack->i.minor_version, buf);
+    if (repack->i.minor_version >= 14) {
+        /* columns are written a whole block at a time */
+        index_scatter_record(buf, repack->i.num_records % INDEX_BLOCK_RECORDS,
+                             repack->block);
+        repack->i.num_records++;
+        if (!(repack->i.num_records % INDEX_BLOCK_RECORDS))
+            return mailbox_repack_flush(repack);
+        return 0;
+    }
     n = retry_write(repack->newindex_fd, buf, repack->i.record_size);
     if (n == -1)
         return IMAP_IOERROR;
@@ -3919,6 +4417,7 @@ static void mailbox_repack_abort(struct mailbox_repack **repackptr)
     if (!repack) return; /* safe against double-free */
 
     seqset_free(repack->seqset);
+    free(repack->block);
 
     /* close and remove index */
     xclose(repack->newindex_fd);
@@ -3977,6 +4476,12 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
         seen_freedata(&sd);
     }
 
+    /* the last block isn't full yet */
+    if (repack->block && (repack->i.num_records % INDEX_BLOCK_RECORDS)) {
+        if (mailbox_repack_flush(repack))
+            goto fail;
+    }
+
     /* rewrite the header with updated details */
     mailbox_index_header_to_buf(&repack->i, buf);
 
@@ -4031,6 +4536,7 @@ HIDDEN int mailbox_repack_commit(struct mailbox_repack **repackptr)
     strarray_fini(&cachefiles);
 
     seqset_free(repack->seqset);
+    free(repack->block);
     free(repack->userid);
     free(repack);
     *repackptr = NULL;
@@ -4656,7 +5162,8 @@ EXPORTED int mailbox_create(const char *name,
 
     /* init non-zero fields */
     mailbox_index_dirty(mailbox);
-    mailbox->i.minor_version = MAILBOX_MINOR_VERSION;
+    mailbox->i.minor_version = config_getswitch(IMAPOPT_MAILBOX_COLUMNAR_INDEX) ?
+                               MAILBOX_MINOR_VERSION : MAILBOX_ROWS_MINOR_VERSION;
     mailbox->i.start_offset = INDEX_HEADER_SIZE;
     mailbox->i.record_size = INDEX_RECORD_SIZE;
     mailbox->i.options = options;
@@ -5792,11 +6299,198 @@ static int records_match(const char *mboxname,
     return match;
 }
 
+/*
+ * Parallel message parsing for reconstruct.
+ *
+ * Parsing the message files is what makes reconstructing a big mailbox
+ * slow.  A parse pool parses a list of files known in advance in an
+ * ordered worker pool, so the reconstruct itself, which stays the only
+ * writer of the index, gets the results back in list (and so UID)
+ * order.
+ *
+ * Anything the pool can't supply is parsed in the usual way.
+ */
+
+static int reconstruct_workers = 0;
+
+EXPORTED void mailbox_set_reconstruct_workers(int nworkers)
+{
+    reconstruct_workers = nworkers;
+}
+
+/* don't bother forking for fewer files than this */
+#define PARSE_POOL_MIN 64
+
+struct parse_result {
+    uint32_t uid;
+    int r;
+    struct index_record record;
+    size_t cachelen;
+};
+
+struct parse_pool {
+    struct mailbox *mailbox;
+    struct found_uid *items;
+    unsigned nitems;
+    unsigned next;              /* the next result to be read */
+    struct workerpool *workers;
+    struct buf result;
+    struct buf cache;           /* cache record of the last result */
+};
+
+static int parse_pool_run(int job, const struct buf *in __attribute__((unused)),
+                          struct buf *out, void *rock)
+{
+    struct parse_pool *pool = rock;
+    const struct found_uid *item = &pool->items[job];
+    struct parse_result res;
+    struct index_record fake;
+
+    memset(&res, 0, sizeof(res));
+    memset(&fake, 0, sizeof(fake));
+    fake.uid = item->uid;
+    if (item->isarchive) fake.system_flags |= FLAG_ARCHIVED;
+
+    res.uid = item->uid;
+    res.r = message_parse(mailbox_record_fname(pool->mailbox, &fake),
+                          &res.record);
+    if (!res.r) res.cachelen = res.record.crec.len;
+
+    buf_appendmap(out, (const char *)&res, sizeof(res));
+    if (res.cachelen)
+        buf_appendmap(out, res.record.crec.buf->s + res.record.crec.offset,
+                      res.cachelen);
+
+    return 0;
+}
+
+static const struct workerpool_ops parse_pool_ops = {
+    NULL, parse_pool_run, NULL
+};
+
+static struct parse_pool *parse_pool_start(struct mailbox *mailbox,
+                                           const struct found_uid *items,
+                                           unsigned nitems)
+{
+    struct parse_pool *pool;
+
+    if (reconstruct_workers < 2 || nitems < PARSE_POOL_MIN)
+        return NULL;
+
+#if defined ENABLE_OBJECTSTORE
+    /* files have to be fetched one at a time */
+    if (config_getswitch(IMAPOPT_OBJECT_STORAGE_ENABLED))
+        return NULL;
+#endif
+
+    pool = xzmalloc(sizeof(struct parse_pool));
+    pool->mailbox = mailbox;
+    pool->items = xmemdup(items, nitems * sizeof(struct found_uid));
+    pool->nitems = nitems;
+    pool->workers = workerpool_start("reconstruct", reconstruct_workers,
+                                     nitems, WORKERPOOL_ORDERED,
+                                     &parse_pool_ops, pool);
+    if (!pool->workers) {
+        free(pool->items);
+        free(pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+/*
+ * Fill in the parsed fields of 'record' for the file for 'uid' from
+ * the pool.  Results for files before it are discarded.
+ *
+ * Returns the result of message_parse(), or -1 if the pool has no
+ * result for this file.  The cache record remains valid until the next
+ * call.
+ */
+static int parse_pool_get(struct parse_pool *pool, uint32_t uid,
+                          int isarchive, struct index_record *record)
+{
+    struct parse_result res;
+
+    while (pool->next < pool->nitems) {
+        const struct found_uid *item = &pool->items[pool->next++];
+        int match, job;
+
+        if (item->uid > uid) {
+            pool->next--;
+            break;
+        }
+        match = (item->uid == uid && item->isarchive == !!isarchive);
+
+        /* results for other files are just discarded */
+        if (workerpool_next(pool->workers, -1, &job, &pool->result) || !match)
+            continue;
+
+        if (pool->result.len < sizeof(res))
+            continue;
+        memcpy(&res, pool->result.s, sizeof(res));
+        if (res.uid != item->uid ||
+            pool->result.len != sizeof(res) + res.cachelen)
+            continue;
+
+        if (res.r) return res.r;
+
+        /* the fields which message_create_record() fills in */
+        record->sentdate = res.record.sentdate;
+        record->gmtime = res.record.gmtime;
+        record->size = res.record.size;
+        record->header_size = res.record.header_size;
+        record->content_lines = res.record.content_lines;
+        message_guid_copy(&record->guid, &res.record.guid);
+        record->cache_offset = 0;
+        record->cache_version = res.record.cache_version;
+        record->cache_crc = res.record.cache_crc;
+        record->crec = res.record.crec;
+        buf_setmap(&pool->cache, pool->result.s + sizeof(res), res.cachelen);
+        record->crec.buf = &pool->cache;
+        record->crec.offset = 0;
+
+        return 0;
+    }
+
+    return -1;
+}
+
+static void parse_pool_done(struct parse_pool **poolp)
+{
+    struct parse_pool *pool = *poolp;
+
+    if (!pool) return;
+
+    workerpool_finish(&pool->workers);
+    buf_free(&pool->result);
+    buf_free(&pool->cache);
+    free(pool->items);
+    free(pool);
+    *poolp = NULL;
+}
+
+/* parse the message file for 'record', using the pool if it has it */
+static int reconstruct_parse(struct parse_pool *pool, const char *fname,
+                             struct index_record *record)
+{
+    int r = -1;
+
+    if (pool)
+        r = parse_pool_get(pool, record->uid,
+                           record->system_flags & FLAG_ARCHIVED, record);
+    if (r < 0)
+        r = message_parse(fname, record);
+
+    return r;
+}
+
 static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
                                               struct index_record *record,
                                               bit32 *valid_user_flags,
                                               int flags, int have_file,
-                                              struct found_uids *discovered)
+                                              struct found_uids *discovered,
+                                              struct parse_pool *pool)
 {
     const char *fname = mailbox_record_fname(mailbox, record);
     int r = 0;
@@ -5870,7 +6564,7 @@ static int mailbox_reconstruct_compare_update(struct mailbox *mailbox,
         /* set NULL in case parse finds a new value */
         record->internaldate = 0;
 
-        r = message_parse(fname, record);
+        r = reconstruct_parse(pool, fname, record);
         if (r) goto out;
 
         /* unchanged, keep the old value */
@@ -6029,7 +6723,7 @@ out:
 
 
 static int mailbox_reconstruct_append(struct mailbox *mailbox, uint32_t uid, int isarchive,
-                                      int flags)
+                                      int flags, struct parse_pool *pool)
 {
     /* XXX - support archived */
     const char *fname;
@@ -6040,6 +6734,10 @@ static int mailbox_reconstruct_append(struct mailbox *mailbox, uint32_t uid, int
 
     memset(&record, 0, sizeof(struct index_record));
 
+    /* take this file's result from the pool even if it's not used,
+     * or the following files would miss theirs */
+    int parsed = pool ? parse_pool_get(pool, uid, isarchive, &record) : -1;
+
     int remove_temp_spool_file = 0;
     int object_storage_enabled = 0;
 #if defined ENABLE_OBJECTSTORE
@@ -6094,7 +6792,7 @@ static int mailbox_reconstruct_append(struct mailbox *mailbox, uint32_t uid, int
         goto out;
     }
 
-    r = message_parse(fname, &record);
+    r = parsed >= 0 ? parsed : message_parse(fname, &record);
     if (r) goto out;
 
     if (isarchive)
@@ -6237,6 +6935,9 @@ static int mailbox_wipe_index_record(struct mailbox *mailbox,
 
     mailbox_index_record_to_buf(record, mailbox->i.minor_version, buf);
 
+    if (mailbox->i.minor_version >= 14)
+        return mailbox_write_index_columns(mailbox, record->recno, buf);
+
     offset = mailbox->i.start_offset +
              (record->recno-1) * mailbox->i.record_size;
 
@@ -6338,6 +7039,8 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     struct found_uids discovered = FOUND_UIDS_INITIALIZER;
     struct found_uids annots = FOUND_UIDS_INITIALIZER;
     struct found_uids delannots = FOUND_UIDS_INITIALIZER;
+    struct found_uids toappend = FOUND_UIDS_INITIALIZER;
+    struct parse_pool *pool = NULL;
     struct index_header old_header;
     int have_file;
     uint32_t last_seen_uid = 0;
@@ -6399,6 +7102,14 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     r = find_annots(mailbox, &annots);
     if (r) goto close;
 
+    /* re-parsing every file?  parse the ones with records in parallel */
+    if (flags & RECONSTRUCT_ALWAYS_PARSE) {
+        unsigned n = 0;
+        while (n < files.nused && files.found[n].uid <= mailbox->i.last_uid)
+            n++;
+        pool = parse_pool_start(mailbox, files.found, n);
+    }
+
     uint32_t recno;
     struct index_record record;
     for (recno = 1; recno <= mailbox->i.num_records; recno++) {
@@ -6468,22 +7179,35 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
         r = mailbox_reconstruct_compare_update(mailbox, &record,
                                                valid_user_flags,
                                                flags, have_file,
-                                               &discovered);
+                                               &discovered, pool);
         if (r) goto close;
     }
 
+    parse_pool_done(&pool);
+
     /* add discovered messages before last_uid to the list in order */
     while (files.pos < files.nused && files.found[files.pos].uid <= mailbox->i.last_uid) {
         add_found(&discovered, files.found[files.pos].uid, files.found[files.pos].isarchive);
         files.pos++;
     }
 
+    /* every file from here on gets parsed, in this order */
+    for (i = files.pos; i < (int)files.nused; i++)
+        add_found(&toappend, files.found[i].uid, files.found[i].isarchive);
+    for (i = discovered.pos; i < (int)discovered.nused; i++) {
+        if (discovered.found[i].uid)
+            add_found(&toappend, discovered.found[i].uid,
+                      discovered.found[i].isarchive);
+    }
+    pool = parse_pool_start(mailbox, toappend.found, toappend.nused);
+
     /* messages AFTER last_uid can keep the same UID (see also, restore
      * from lost .index file) - so don't bother moving those */
     while (files.pos < files.nused) {
         uint32_t uid = files.found[files.pos].uid;
         r = mailbox_reconstruct_append(mailbox, files.found[files.pos].uid,
-                                       files.found[files.pos].isarchive, flags);
+                                       files.found[files.pos].isarchive, flags,
+                                       pool);
         if (r) goto close;
         files.pos++;
 
@@ -6510,11 +7234,14 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     /* handle new list - note, we don't copy annotations for these */
     while (discovered.pos < discovered.nused) {
         r = mailbox_reconstruct_append(mailbox, discovered.found[discovered.pos].uid,
-                                       discovered.found[discovered.pos].isarchive, flags);
+                                       discovered.found[discovered.pos].isarchive, flags,
+                                       pool);
         if (r) goto close;
         discovered.pos++;
     }
 
+    parse_pool_done(&pool);
+
     if (delannots.nused) {
         r = reconstruct_delannots(mailbox, &delannots, flags);
         if (r) goto close;
@@ -6556,8 +7283,10 @@ EXPORTED int mailbox_reconstruct(const char *name, int flags)
     }
 
 close:
+    parse_pool_done(&pool);
     mailbox_iter_done(&iter);
     free_found(&files);
+    free_found(&toappend);
     free_found(&discovered);
     free_found(&annots);
     free_found(&delannots);
@@ -6591,9 +7320,59 @@ EXPORTED void mailbox_iter_startuid(struct mailbox_iter *iter, uint32_t uid)
     iter->recno = uid ? mailbox_finduid(mailbox, uid-1) : 0;
 }
 
+/*
+ * Check the uid, system_flags and modseq columns of a version 14
+ * record, to skip it without reading the whole record.  Records with
+ * uncommitted changes, and columns which fail their CRC check, always
+ * get read.
+ */
+static int mailbox_iter_canskip(struct mailbox_iter *iter)
+{
+    struct mailbox *mailbox = iter->mailbox;
+    const struct index_header *i = &mailbox->i;
+    const char *base = mailbox->index_base;
+    uint32_t recno = iter->recno;
+
+    if (i->minor_version < 14)
+        return 0;
+
+    if (!iter->changedsince && !iter->skipflags)
+        return 0;
+
+    if (i->start_offset + index_records_size(i, recno) > mailbox->index_size)
+        return 0;
+
+    if (mailbox->index_change_count && _find_change(mailbox, recno))
+        return 0;
+
+    if (!index_column_valid(mailbox, recno, OFFSET_UID))
+        return 0;
+    if (!*((bit32 *)(base + index_field_offset(i, recno, OFFSET_UID))))
+        return 1;
+
+    if (iter->skipflags) {
+        if (!index_column_valid(mailbox, recno, OFFSET_SYSTEM_FLAGS))
+            return 0;
+        if (ntohl(*((bit32 *)(base + index_field_offset(i, recno, OFFSET_SYSTEM_FLAGS))))
+            & iter->skipflags)
+            return 1;
+    }
+
+    if (iter->changedsince) {
+        if (!index_column_valid(mailbox, recno, OFFSET_MODSEQ))
+            return 0;
+        if (ntohll(*((bit64 *)(base + index_field_offset(i, recno, OFFSET_MODSEQ))))
+            <= iter->changedsince)
+            return 1;
+    }
+
+    return 0;
+}
+
 EXPORTED const message_t *mailbox_iter_step(struct mailbox_iter *iter)
 {
     for (iter->recno++; iter->recno <= iter->num_records; iter->recno++) {
+        if (mailbox_iter_canskip(iter)) continue;
         message_unref(&iter->msg);
         iter->msg = message_new_from_mailbox(iter->mailbox, iter->recno);
         const struct index_record *record = msg_record(iter->msg);
@@ -48,6 +48,7 @@
 #include <limits.h>
 #include <config.h>
 
+#include "bitvector.h"
 #include "byteorder64.h"
 #include "conversations.h"
 #include "message_guid.h"
@@ -55,6 +56,7 @@
 #include "ptrarray.h"
 #include "quota.h"
 #include "sequence.h"
+#include "uidhash.h"
 #include "util.h"
 
 #define MAX_MAILBOX_NAME 490
@@ -74,8 +76,10 @@
  * make sure all the mailbox upgrade and downgrade code in mailbox.c is
  * changed to be able to convert both backwards and forwards between the
  * new version and all supported previous versions */
-#define MAILBOX_MINOR_VERSION   13
-#define MAILBOX_CACHE_MINOR_VERSION 6
+#define MAILBOX_MINOR_VERSION   14
+/* the last version which stores index records one after another */
+#define MAILBOX_ROWS_MINOR_VERSION 13
+#define MAILBOX_CACHE_MINOR_VERSION 7
 
 #define FNAME_HEADER "/cyrus.header"
 #define FNAME_INDEX "/cyrus.index"
@@ -108,7 +112,10 @@ enum meta_filename {
 #define LOCK_NONBLOCK   4   /* flag to OR in */
 #define LOCK_NONBLOCKING (LOCK_NONBLOCK|LOCK_EXCLUSIVE)
 
-#define NUM_CACHE_FIELDS 10
+#define NUM_CACHE_FIELDS 11
+/* number of fields in a cache record written with cache version v;
+ * version 7 added CACHE_BODYTREE */
+#define CACHE_NUM_FIELDS(v) ((v) >= 7 ? NUM_CACHE_FIELDS : 10)
 
 struct cacheitem {
     size_t offset;
@@ -278,6 +285,15 @@ struct mailbox {
     struct index_change *index_changes;
     uint32_t index_change_alloc;
     uint32_t index_change_count;
+
+    /* version 14 columns whose CRCs have been checked since the index
+     * was last mapped, and whether they passed, see index_column_valid() */
+    bitvector_t index_checked;
+
+    /* UID to recno lookups, covers records 1 to uidhash_recno */
+    uidhash_t uidhash;
+    uint32_t uidhash_recno;
+    uint32_t uidhash_lastuid;
 };
 
 #define ITER_SKIP_UNLINKED (1<<0)
@@ -365,6 +381,18 @@ struct mailbox_iter {
 #define INDEX_HEADER_SIZE (OFFSET_HEADER_CRC+4)
 #define INDEX_RECORD_SIZE (OFFSET_RECORD_CRC+4)
 
+/* From version 14 the records are stored in blocks of this many, and
+ * within a block each field (modseq, uid, system_flags...) is stored
+ * contiguously for all the records, so scans over one field only touch
+ * that field's pages.  A record has the same fields and CRC as version
+ * 13, it's just spread across the columns of its block.  The file
+ * always holds whole blocks, the unused tail of the last one is zero.
+ * Each block starts with a CRC32 of each of its columns, so a scan over
+ * one field can trust that column without checking whole records; the
+ * CRCs are padded to keep the columns 8 byte aligned. */
+#define INDEX_BLOCK_RECORDS 64
+#define INDEX_BLOCK_HEADER_SIZE 40
+
 typedef enum _MsgFlags {
     FLAG_ANSWERED           = (1<<0),
     FLAG_FLAGGED            = (1<<1),
@@ -448,7 +476,8 @@ enum {
     CACHE_TO,
     CACHE_CC,
     CACHE_BCC,
-    CACHE_SUBJECT
+    CACHE_SUBJECT,
+    CACHE_BODYTREE
 };
 
 /* Cached envelope token positions */
@@ -530,6 +559,8 @@ struct carddav_db *mailbox_open_carddav(struct mailbox *mailbox);
 struct webdav_db *mailbox_open_webdav(struct mailbox *mailbox);
 
 /* reading bits and pieces */
+extern int mailbox_peek_index_header(const char *name,
+                                     struct index_header *i);
 extern int mailbox_refresh_index_header(struct mailbox *mailbox);
 extern int mailbox_write_header(struct mailbox *mailbox, int force);
 extern void mailbox_index_dirty(struct mailbox *mailbox);
@@ -606,9 +637,12 @@ extern int mailbox_rename_cleanup(struct mailbox **mailboxptr, int isinbox);
 extern int mailbox_copyfile(const char *from, const char *to, int nolink);
 
 extern int mailbox_reconstruct(const char *name, int flags);
+/* parse message files in this many processes when reconstructing */
+extern void mailbox_set_reconstruct_workers(int nworkers);
 extern void mailbox_make_uniqueid(struct mailbox *mailbox);
 
 extern int mailbox_setversion(struct mailbox *mailbox, int version);
+extern int mailbox_index_write_rows(struct mailbox *mailbox, int fd);
 
 extern int mailbox_index_recalc(struct mailbox *mailbox);
 
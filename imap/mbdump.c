@@ -177,6 +177,29 @@ static void header_set_num_records(char *buf, unsigned int nrecords)
     *((bit32 *)(buf+OFFSET_NUM_RECORDS)) = htonl(nrecords);
 }
 
+/* create a version 13 cyrus.index from a columnar one */
+static int dump_index_rows(struct mailbox *mailbox, int first, int sync,
+                           struct protstream *pin, struct protstream *pout)
+{
+    char oldname[MAX_MAILBOX_PATH];
+    int oldindex_fd;
+    int r;
+
+    snprintf(oldname, MAX_MAILBOX_PATH, "%s.OLD",
+             mailbox_meta_fname(mailbox, META_INDEX));
+
+    oldindex_fd = open(oldname, O_RDWR|O_TRUNC|O_CREAT, 0666);
+    if (oldindex_fd == -1) return IMAP_IOERROR;
+
+    r = mailbox_index_write_rows(mailbox, oldindex_fd);
+    close(oldindex_fd);
+
+    if (!r) r = dump_file(first, sync, pin, pout, oldname, "cyrus.index", NULL, 0);
+    unlink(oldname);
+
+    return r;
+}
+
 /* create a downgraded index file in cyrus.index.  We don't copy back
  * expunged messages, sorry */
 static int dump_index(struct mailbox *mailbox, int oldversion,
@@ -214,6 +237,10 @@ static int dump_index(struct mailbox *mailbox, int oldversion,
         header_size = 96;
         record_size = 88;
     }
+    else if (oldversion == MAILBOX_ROWS_MINOR_VERSION) {
+        /* same records, just not in columns */
+        return dump_index_rows(mailbox, first, sync, pin, pout);
+    }
     else {
         return IMAP_MAILBOX_BADFORMAT;
     }
@@ -552,7 +579,7 @@ EXPORTED int dump_mailbox(const char *tag, struct mailbox *mailbox, uint32_t uid
             break;
         }
 
-        if (df->metaname == META_INDEX && oldversion < MAILBOX_MINOR_VERSION) {
+        if (df->metaname == META_INDEX && oldversion < mailbox->i.minor_version) {
             expunged_seq = seqset_init(mailbox->i.last_uid, SEQ_SPARSE);
             syslog(LOG_NOTICE, "%s downgrading index to version %d for XFER",
                    mailbox->name, oldversion);
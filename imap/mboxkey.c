@@ -354,7 +354,7 @@ EXPORTED int mboxkey_delete_user(const char *user)
     }
 
     /* erp! */
-    r = unlink(fname);
+    r = cyrusdb_unlinkfile(fname);
     if (r < 0 && errno == ENOENT) {
         syslog(LOG_DEBUG, "cannot unlink %s: %m", fname);
         /* but maybe the user just never read anything? */
@@ -1895,6 +1895,7 @@ EXPORTED int message_write_cache(struct index_record *record, const struct body
     message_write_searchaddr(&ib[CACHE_CC], body->cc);
     message_write_searchaddr(&ib[CACHE_BCC], body->bcc);
     message_write_nstring(&ib[CACHE_SUBJECT], subject);
+    message_write_bodytree(&ib[CACHE_BODYTREE], body);
 
     free(subject);
 
@@ -1946,6 +1947,21 @@ static void message_write_envelope(struct buf *buf, const struct body *body)
     buf_putc(buf, ')');
 }
 
+/*
+ * 0-part multiparts are illegal, they are presented as this 0-length
+ * text part instead.
+ */
+static const struct body *message_zerotextbody(void)
+{
+    static struct body zerotextbody;
+
+    if (!zerotextbody.type) {
+        message_parse_type(DEFAULT_CONTENT_TYPE, &zerotextbody);
+    }
+
+    return &zerotextbody;
+}
+
 /*
  * Write the BODY (if 'newformat' is zero) or BODYSTRUCTURE
  * (if 'newformat' is nonzero) for 'body' to 'buf'.
@@ -1960,12 +1976,7 @@ EXPORTED void message_write_body(struct buf *buf, const struct body *body,
 
         /* 0-part multiparts are illegal--convert to 0-len text parts */
         if (body->numparts == 0) {
-            static struct body zerotextbody;
-
-            if (!zerotextbody.type) {
-                message_parse_type(DEFAULT_CONTENT_TYPE, &zerotextbody);
-            }
-            message_write_body(buf, &zerotextbody, newformat);
+            message_write_body(buf, message_zerotextbody(), newformat);
             return;
         }
 
@@ -2230,6 +2241,170 @@ EXPORTED void message_write_xdrstring(struct buf *buf, const struct buf *s)
     buf_appendmap(buf, "\0\0\0", padlen);
 }
 
+/*
+ * Binary body structure (CACHE_BODYTREE), see message.h.
+ *
+ * Numbers are 32 bit network order.  String references are offsets
+ * from the start of the field, 0 meaning NIL, and point at NUL
+ * terminated strings.  Parameter list references point at a 4-byte
+ * aligned count followed by that many attribute, value string
+ * reference pairs.
+ */
+
+#define BODYTREE_NUMWORDS BODYTREE_CONTENT_GUID
+#define BODYTREE_NODE_SIZE (4*BODYTREE_NUMWORDS + MESSAGE_GUID_SIZE)
+#define BODYTREE_NODE(bt, node) ((bt)->base + 4 + (node) * BODYTREE_NODE_SIZE)
+
+/* a parsed message/rfc822 has its subpart but no numparts */
+static int bodytree_numparts(const struct body *body)
+{
+    if (!strcmp(body->type, "MESSAGE") && !strcmp(body->subtype, "RFC822"))
+        return body->subpart ? 1 : 0;
+    return body->numparts;
+}
+
+static uint32_t bodytree_count(const struct body *body)
+{
+    uint32_t n = 1;
+    int i;
+
+    for (i = 0; i < bodytree_numparts(body); i++)
+        n += bodytree_count(&body->subpart[i]);
+
+    return n;
+}
+
+static void bodytree_setword(struct buf *buf, size_t pos, uint32_t val)
+{
+    *((bit32 *)(buf->s + pos)) = htonl(val);
+}
+
+static uint32_t bodytree_putstr(struct buf *strings, uint32_t base,
+                                const char *s)
+{
+    uint32_t ref;
+
+    if (!s) return 0;
+
+    ref = base + buf_len(strings);
+    buf_appendcstr(strings, s);
+    buf_putc(strings, '\0');
+
+    return ref;
+}
+
+static uint32_t bodytree_putparams(struct buf *strings, uint32_t base,
+                                   const struct param *params)
+{
+    const struct param *param;
+    uint32_t n = 0;
+    size_t pos;
+
+    if (!params) return 0;
+
+    for (param = params; param; param = param->next)
+        n++;
+
+    /* align the list, then reserve it before filling in the strings */
+    buf_appendmap(strings, "\0\0\0", (4 - (buf_len(strings) & 3)) & 3);
+    pos = buf_len(strings);
+    buf_appendbit32(strings, n);
+    for (param = params; param; param = param->next) {
+        buf_appendbit32(strings, 0);
+        buf_appendbit32(strings, 0);
+    }
+
+    for (param = params, n = 0; param; param = param->next, n++) {
+        uint32_t ref;
+
+        ref = bodytree_putstr(strings, base, param->attribute);
+        bodytree_setword(strings, pos + 4 + 8*n, ref);
+        ref = bodytree_putstr(strings, base, param->value);
+        bodytree_setword(strings, pos + 8 + 8*n, ref);
+    }
+
+    return base + pos;
+}
+
+static void bodytree_putnode(struct buf *nodes, struct buf *strings,
+                             uint32_t base, const struct body *body,
+                             uint32_t *nodenum)
+{
+    const struct body *desc = body;
+    uint32_t word[BODYTREE_NUMWORDS];
+    char guidbuf[MESSAGE_GUID_SIZE];
+    size_t pos = buf_len(nodes);
+    int ismultipart = !strcmp(body->type, "MULTIPART");
+    int numparts = bodytree_numparts(body);
+    int i;
+
+    /* 0-part multiparts are illegal--convert to 0-len text parts,
+     * the same as the BODYSTRUCTURE does */
+    if (ismultipart && !numparts) {
+        desc = message_zerotextbody();
+        ismultipart = 0;
+    }
+
+    memset(word, 0, sizeof(word));
+    word[BODYTREE_NUMPARTS] = numparts;
+    word[BODYTREE_HEADER_OFFSET] = body->header_offset;
+    word[BODYTREE_HEADER_SIZE] = body->header_size;
+    word[BODYTREE_CONTENT_OFFSET] = body->content_offset;
+    word[BODYTREE_CONTENT_SIZE] = body->content_size;
+    word[BODYTREE_CONTENT_LINES] = body->content_lines;
+    word[BODYTREE_TYPE] = bodytree_putstr(strings, base, desc->type);
+    word[BODYTREE_SUBTYPE] = bodytree_putstr(strings, base, desc->subtype);
+    word[BODYTREE_PARAMS] = bodytree_putparams(strings, base, desc->params);
+    if (!ismultipart) {
+        word[BODYTREE_ID] = bodytree_putstr(strings, base, body->id);
+        word[BODYTREE_DESCRIPTION] =
+            bodytree_putstr(strings, base, body->description);
+        word[BODYTREE_ENCODING] = bodytree_putstr(strings, base,
+            body->encoding ? body->encoding : "7BIT");
+        word[BODYTREE_MD5] = bodytree_putstr(strings, base, body->md5);
+    }
+    word[BODYTREE_DISPOSITION] =
+        bodytree_putstr(strings, base, body->disposition);
+    word[BODYTREE_DISPOSITION_PARAMS] =
+        bodytree_putparams(strings, base, body->disposition_params);
+    word[BODYTREE_LOCATION] = bodytree_putstr(strings, base, body->location);
+
+    for (i = 0; i < BODYTREE_NUMWORDS; i++)
+        buf_appendbit32(nodes, word[i]);
+    message_guid_export(&body->content_guid, guidbuf);
+    buf_appendmap(nodes, guidbuf, MESSAGE_GUID_SIZE);
+
+    (*nodenum)++;
+
+    for (i = 0; i < numparts; i++)
+        bodytree_putnode(nodes, strings, base, &body->subpart[i], nodenum);
+
+    /* now we know where this subtree ends */
+    bodytree_setword(nodes, pos + 4*BODYTREE_NEXT, *nodenum);
+}
+
+/*
+ * Write the binary body structure for 'body' to 'buf'.
+ */
+EXPORTED void message_write_bodytree(struct buf *buf, const struct body *body)
+{
+    struct buf nodes = BUF_INITIALIZER;
+    struct buf strings = BUF_INITIALIZER;
+    uint32_t nnodes = bodytree_count(body);
+    uint32_t base = 4 + nnodes * BODYTREE_NODE_SIZE;
+    uint32_t nodenum = 0;
+
+    bodytree_putnode(&nodes, &strings, base, body, &nodenum);
+    assert(nodenum == nnodes);
+
+    buf_appendbit32(buf, nnodes);
+    buf_append(buf, &nodes);
+    buf_append(buf, &strings);
+
+    buf_free(&nodes);
+    buf_free(&strings);
+}
+
 /*
  * Write the text 's' to 'buf', converting to lower case as we go.
  */
@@ -3241,6 +3416,40 @@ static int getconvmailbox(const char *mboxname, struct mailbox **mailboxptr)
     return r;
 }
 
+struct match_msgid_rock {
+    struct conversations_state *state;
+    const strarray_t *msgids;
+    const arrayu64_t *hdrs;
+    const char *subject;
+    arrayu64_t *matchlist;
+};
+
+static int match_msgid_cb(const char *msgid, const arrayu64_t *cids,
+                          void *rock)
+{
+    struct match_msgid_rock *mrock = (struct match_msgid_rock *)rock;
+    conversation_t *conv = NULL;
+    int i = arrayu64_nth(mrock->hdrs,
+                         strarray_find(mrock->msgids, msgid, 0));
+    int j;
+    int r = 0;
+
+    for (j = 0; j < cids->count; j++) {
+        conversation_id_t cid = arrayu64_nth(cids, j);
+        conversation_free(conv);
+        conv = NULL;
+        r = conversation_load(mrock->state, cid, &conv);
+        if (r) break;
+        /* [IRIS-1576] if X-ME-Message-ID says the messages are
+        * linked, ignore any difference in Subject: header fields. */
+        if (!conv || i == 3 || !strcmpsafe(conv->subject, mrock->subject))
+            arrayu64_add(mrock->matchlist, cid);
+    }
+
+    conversation_free(conv);
+    return r;
+}
+
 /*
  * Update the conversations database for the given
  * mailbox, to account for the given message.
@@ -3256,13 +3465,13 @@ EXPORTED int message_update_conversations(struct conversations_state *state,
     char *c_refs = NULL, *c_env = NULL, *c_me_msgid = NULL;
     struct buf msubject = BUF_INITIALIZER;
     strarray_t msgidlist = STRARRAY_INITIALIZER;
+    arrayu64_t msgidhdrs = ARRAYU64_INITIALIZER;
     arrayu64_t matchlist = ARRAYU64_INITIALIZER;
-    arrayu64_t cids = ARRAYU64_INITIALIZER;
+    struct match_msgid_rock mrock;
     int mustkeep = 0;
     conversation_t *conv = NULL;
     const char *msubj = NULL;
     int i;
-    int j;
     int r = 0;
     char *msgid = NULL;
     struct mailbox *local_mailbox = NULL;
@@ -3354,29 +3563,20 @@ EXPORTED int message_update_conversations(struct conversations_state *state,
             }
 
             strarray_appendm(&msgidlist, msgid);
-
-            /* Lookup the conversations database to work out which
-             * conversation ids that message belongs to. */
-            r = conversations_get_msgid(state, msgid, &cids);
-            if (r) goto out;
-
-            for (j = 0; j < cids.count; j++) {
-                conversation_id_t cid = arrayu64_nth(&cids, j);
-                conversation_free(conv);
-                conv = NULL;
-                r = conversation_load(state, cid, &conv);
-                if (r) goto out;
-                /* [IRIS-1576] if X-ME-Message-ID says the messages are
-                * linked, ignore any difference in Subject: header fields. */
-                if (!conv || i == 3 || !strcmpsafe(conv->subject, msubj))
-                    arrayu64_add(&matchlist, cid);
-            }
-
-            conversation_free(conv);
-            conv = NULL;
+            arrayu64_append(&msgidhdrs, i);
         }
     }
 
+    /* Lookup the conversations database to work out which
+     * conversation ids those messages belong to, all at once. */
+    mrock.state = state;
+    mrock.msgids = &msgidlist;
+    mrock.hdrs = &msgidhdrs;
+    mrock.subject = msubj;
+    mrock.matchlist = &matchlist;
+    r = conversations_get_msgids(state, &msgidlist, &match_msgid_cb, &mrock);
+    if (r) goto out;
+
     /* calculate the CID if needed */
     if (!record->silent) {
         /* match for GUID, it always has the same CID */
@@ -3478,8 +3678,8 @@ EXPORTED int message_update_conversations(struct conversations_state *state,
 out:
     free(msgid);
     strarray_fini(&msgidlist);
+    arrayu64_fini(&msgidhdrs);
     arrayu64_fini(&matchlist);
-    arrayu64_fini(&cids);
     free(c_refs);
     free(c_env);
     free(c_me_msgid);
@@ -4122,6 +4322,270 @@ static int parse_bodystructure_sections(const char **cachestrp, const char *cach
     return 0;
 }
 
+static int bodytree_checkstr(const struct bodytree *bt, uint32_t ref)
+{
+    uint32_t strbase = 4 + bt->nnodes * BODYTREE_NODE_SIZE;
+
+    if (!ref) return 0;
+    if (ref < strbase || ref >= bt->len) return -1;
+    if (!memchr(bt->base + ref, '\0', bt->len - ref)) return -1;
+
+    return 0;
+}
+
+static int bodytree_checkparams(const struct bodytree *bt, uint32_t ref)
+{
+    uint32_t n, i;
+
+    if (!ref) return 0;
+    if ((ref & 3) || ref < 4 + bt->nnodes * BODYTREE_NODE_SIZE) return -1;
+    if ((uint64_t)ref + 4 > bt->len) return -1;
+
+    n = CACHE_ITEM_BIT32(bt->base + ref);
+    if ((uint64_t)ref + 4 + 8 * (uint64_t)n > bt->len) return -1;
+
+    for (i = 0; i < 2*n; i++) {
+        if (bodytree_checkstr(bt, CACHE_ITEM_BIT32(bt->base + ref + 4 + 4*i)))
+            return -1;
+    }
+
+    return 0;
+}
+
+/*
+ * Set up 'bt' to read the binary body structure at 'base', checking
+ * all of it so that the accessors can trust what they read.
+ */
+EXPORTED int bodytree_init(struct bodytree *bt, const char *base, size_t len)
+{
+    uint32_t node, child, i;
+
+    memset(bt, 0, sizeof(struct bodytree));
+
+    if (len < 4) return IMAP_MAILBOX_BADFORMAT;
+
+    bt->base = base;
+    bt->len = len;
+    bt->nnodes = CACHE_ITEM_BIT32(base);
+
+    if (!bt->nnodes || bt->nnodes > (len - 4) / BODYTREE_NODE_SIZE)
+        goto bad;
+
+    for (node = 0; node < bt->nnodes; node++) {
+        const char *p = BODYTREE_NODE(bt, node);
+        uint32_t next = CACHE_ITEM_BIT32(p + 4*BODYTREE_NEXT);
+
+        if (next <= node || next > bt->nnodes)
+            goto bad;
+
+        /* the children have to exactly fill the subtree */
+        child = node + 1;
+        for (i = 0; i < CACHE_ITEM_BIT32(p + 4*BODYTREE_NUMPARTS); i++) {
+            if (child >= next) goto bad;
+            child = CACHE_ITEM_BIT32(BODYTREE_NODE(bt, child) + 4*BODYTREE_NEXT);
+        }
+        if (child != next) goto bad;
+
+        for (i = BODYTREE_TYPE; i <= BODYTREE_LOCATION; i++) {
+            uint32_t ref = CACHE_ITEM_BIT32(p + 4*i);
+            int r = (i == BODYTREE_PARAMS || i == BODYTREE_DISPOSITION_PARAMS)
+                  ? bodytree_checkparams(bt, ref)
+                  : bodytree_checkstr(bt, ref);
+            if (r) goto bad;
+        }
+
+        /* there must be a type */
+        if (!CACHE_ITEM_BIT32(p + 4*BODYTREE_TYPE) ||
+            !CACHE_ITEM_BIT32(p + 4*BODYTREE_SUBTYPE))
+            goto bad;
+    }
+
+    /* the root's subtree is the whole tree */
+    if (CACHE_ITEM_BIT32(BODYTREE_NODE(bt, 0) + 4*BODYTREE_NEXT) != bt->nnodes)
+        goto bad;
+
+    return 0;
+
+bad:
+    memset(bt, 0, sizeof(struct bodytree));
+    return IMAP_MAILBOX_BADFORMAT;
+}
+
+EXPORTED uint32_t bodytree_num(const struct bodytree *bt, uint32_t node,
+                               enum bodytree_field field)
+{
+    assert(node < bt->nnodes && field < BODYTREE_TYPE);
+    return CACHE_ITEM_BIT32(BODYTREE_NODE(bt, node) + 4*field);
+}
+
+EXPORTED const char *bodytree_str(const struct bodytree *bt, uint32_t node,
+                                  enum bodytree_field field)
+{
+    uint32_t ref;
+
+    assert(node < bt->nnodes);
+    assert(field >= BODYTREE_TYPE && field <= BODYTREE_LOCATION);
+    assert(field != BODYTREE_PARAMS && field != BODYTREE_DISPOSITION_PARAMS);
+
+    ref = CACHE_ITEM_BIT32(BODYTREE_NODE(bt, node) + 4*field);
+    return ref ? bt->base + ref : NULL;
+}
+
+EXPORTED uint32_t bodytree_nparams(const struct bodytree *bt, uint32_t node,
+                                   enum bodytree_field field)
+{
+    uint32_t ref;
+
+    assert(node < bt->nnodes);
+    assert(field == BODYTREE_PARAMS || field == BODYTREE_DISPOSITION_PARAMS);
+
+    ref = CACHE_ITEM_BIT32(BODYTREE_NODE(bt, node) + 4*field);
+    return ref ? CACHE_ITEM_BIT32(bt->base + ref) : 0;
+}
+
+/*
+ * Return the attribute of the i'th parameter in the list 'field' of
+ * 'node', and its value in 'valuep'.
+ */
+EXPORTED const char *bodytree_param(const struct bodytree *bt, uint32_t node,
+                                    enum bodytree_field field, uint32_t i,
+                                    const char **valuep)
+{
+    const char *list;
+    uint32_t attr, value;
+
+    assert(i < bodytree_nparams(bt, node, field));
+
+    list = bt->base + CACHE_ITEM_BIT32(BODYTREE_NODE(bt, node) + 4*field);
+    attr = CACHE_ITEM_BIT32(list + 4 + 8*i);
+    value = CACHE_ITEM_BIT32(list + 8 + 8*i);
+
+    if (valuep) *valuep = value ? bt->base + value : NULL;
+    return attr ? bt->base + attr : NULL;
+}
+
+EXPORTED void bodytree_guid(const struct bodytree *bt, uint32_t node,
+                            struct message_guid *guid)
+{
+    assert(node < bt->nnodes);
+    message_guid_import(guid, BODYTREE_NODE(bt, node) + 4*BODYTREE_CONTENT_GUID);
+}
+
+static struct param *bodytree_to_params(const struct bodytree *bt,
+                                        uint32_t node,
+                                        enum bodytree_field field)
+{
+    struct param *params = NULL;
+    struct param **prev = &params;
+    uint32_t i, n = bodytree_nparams(bt, node, field);
+
+    for (i = 0; i < n; i++) {
+        const char *value = NULL;
+        const char *attr = bodytree_param(bt, node, field, i, &value);
+        struct param *param = xzmalloc(sizeof(struct param));
+
+        param->attribute = xstrdupnull(attr);
+        param->value = xstrdupnull(value);
+        *prev = param;
+        prev = &param->next;
+    }
+
+    return params;
+}
+
+/* message_parse_charset() for 'node' of the binary body structure */
+static void bodytree_parse_charset(const struct bodytree *bt, uint32_t node,
+                                   int *e_ptr, charset_t *c_ptr)
+{
+    struct body body;
+
+    memset(&body, 0, sizeof(struct body));
+    body.type = (char *)bodytree_str(bt, node, BODYTREE_TYPE);
+    body.subtype = (char *)bodytree_str(bt, node, BODYTREE_SUBTYPE);
+    body.encoding = (char *)bodytree_str(bt, node, BODYTREE_ENCODING);
+    body.params = bodytree_to_params(bt, node, BODYTREE_PARAMS);
+
+    message_parse_charset(&body, e_ptr, c_ptr);
+
+    param_free(&body.params);
+}
+
+/*
+ * Fill in 'body' from 'node' of the binary body structure and all the
+ * parts under it, as parse_bodystructure_part() and
+ * parse_bodystructure_sections() would from the text form.
+ */
+EXPORTED int bodytree_to_body(const struct bodytree *bt, uint32_t node,
+                              struct body *body)
+{
+    uint32_t child;
+    charset_t charset;
+    int encoding;
+    int i;
+
+    memset(body, 0, sizeof(struct body));
+
+    body->type = xstrdupnull(bodytree_str(bt, node, BODYTREE_TYPE));
+    body->subtype = xstrdupnull(bodytree_str(bt, node, BODYTREE_SUBTYPE));
+    body->params = bodytree_to_params(bt, node, BODYTREE_PARAMS);
+    if (strcmpsafe(body->type, "MULTIPART")) {
+        /* the text form puts the Content-ID in message_id too */
+        body->message_id = xstrdupnull(bodytree_str(bt, node, BODYTREE_ID));
+        body->description =
+            xstrdupnull(bodytree_str(bt, node, BODYTREE_DESCRIPTION));
+        body->encoding = xstrdupnull(bodytree_str(bt, node, BODYTREE_ENCODING));
+        body->md5 = xstrdupnull(bodytree_str(bt, node, BODYTREE_MD5));
+    }
+    /* disposition and its params are left unset, as the text form skips
+     * them; callers wanting them use the bodytree_* accessors */
+    body->location = xstrdupnull(bodytree_str(bt, node, BODYTREE_LOCATION));
+
+    body->header_offset = bodytree_num(bt, node, BODYTREE_HEADER_OFFSET);
+    body->header_size = bodytree_num(bt, node, BODYTREE_HEADER_SIZE);
+    body->content_offset = bodytree_num(bt, node, BODYTREE_CONTENT_OFFSET);
+    body->content_size = bodytree_num(bt, node, BODYTREE_CONTENT_SIZE);
+    if (!strcmpsafe(body->type, "TEXT") ||
+        (!strcmpsafe(body->type, "MESSAGE") &&
+         !strcmpsafe(body->subtype, "RFC822")))
+        body->content_lines = bodytree_num(bt, node, BODYTREE_CONTENT_LINES);
+    bodytree_guid(bt, node, &body->content_guid);
+
+    /* what the section cache item records for each part */
+    message_parse_charset(body, &encoding, &charset);
+    body->charset_enc = encoding;
+    if (charset != CHARSET_UNKNOWN_CHARSET)
+        body->charset_id = xstrdup(charset_name(charset));
+    charset_free(&charset);
+
+    body->numparts = bodytree_num(bt, node, BODYTREE_NUMPARTS);
+    if (!body->numparts) return 0;
+
+    body->subpart = xzmalloc(body->numparts * sizeof(struct body));
+    for (i = 0, child = node + 1; i < body->numparts; i++) {
+        bodytree_to_body(bt, child, &body->subpart[i]);
+        child = bodytree_num(bt, child, BODYTREE_NEXT);
+    }
+
+    return 0;
+}
+
+/*
+ * Find the binary body structure in the cache record of 'm', if it was
+ * written with one.  Returns non-zero if there is none to be had.
+ */
+static int message_get_bodytree(message_t *m, struct bodytree *bt)
+{
+    if (message_need(m, M_CACHE))
+        return IMAP_NOTFOUND;
+
+    if (m->record.cache_version < 7 ||
+        !cacheitem_size(&m->record, CACHE_BODYTREE))
+        return IMAP_NOTFOUND;
+
+    return bodytree_init(bt, cacheitem_base(&m->record, CACHE_BODYTREE),
+                         cacheitem_size(&m->record, CACHE_BODYTREE));
+}
+
 static int message_parse_cbodystructure(message_t *m)
 {
     struct protstream *prot = NULL;
@@ -4133,6 +4597,18 @@ static int message_parse_cbodystructure(message_t *m)
     /* We're reading the cache - double check we have it */
     assert(m->have & M_CACHE);
 
+    /* no need to tokenise anything if we have the binary form */
+    if (m->record.cache_version >= 7) {
+        struct bodytree bt;
+
+        if (!message_get_bodytree(m, &bt)) {
+            m->body = xzmalloc(sizeof(struct body));
+            return bodytree_to_body(&bt, 0, m->body);
+        }
+        syslog(LOG_ERR, "IOERROR: bad binary body structure for %s %u, "
+               "falling back to text", m->mailbox->name, m->record.uid);
+    }
+
     prot = prot_readmap(cacheitem_base(&m->record, CACHE_BODYSTRUCTURE),
                         cacheitem_size(&m->record, CACHE_BODYSTRUCTURE));
     if (!prot)
@@ -4282,6 +4758,64 @@ static int body_foreach_section(struct body *body, struct message *message,
 }
 
 
+/* body_foreach_section() over the binary body structure, whose nodes
+ * are already in preorder */
+static int bodytree_foreach_section(const struct bodytree *bt,
+                                    struct message *message,
+                                    int (*proc)(int isbody, charset_t charset,
+                                        int encoding,
+                                        const char *type, const char *subtype,
+                                        const struct param *type_params,
+                                        const char *disposition,
+                                        const struct param *disposition_params,
+                                        struct buf *data, void *rock),
+                                    void *rock)
+{
+    struct buf data = BUF_INITIALIZER;
+    uint32_t node;
+    int r = 0;
+
+    for (node = 0; !r && node < bt->nnodes; node++) {
+        const char *type = bodytree_str(bt, node, BODYTREE_TYPE);
+        const char *subtype = bodytree_str(bt, node, BODYTREE_SUBTYPE);
+        struct param *params = bodytree_to_params(bt, node, BODYTREE_PARAMS);
+        uint32_t header_size = bodytree_num(bt, node, BODYTREE_HEADER_SIZE);
+
+        if (header_size) {
+            struct param *disposition_params =
+                bodytree_to_params(bt, node, BODYTREE_DISPOSITION_PARAMS);
+
+            buf_init_ro(&data, message->map.s +
+                        bodytree_num(bt, node, BODYTREE_HEADER_OFFSET),
+                        header_size);
+            r = proc(/*isbody*/0, CHARSET_UNKNOWN_CHARSET, 0, type, subtype,
+                     params, bodytree_str(bt, node, BODYTREE_DISPOSITION),
+                     disposition_params, &data, rock);
+            buf_free(&data);
+            param_free(&disposition_params);
+        }
+
+        if (!r) {
+            charset_t charset = CHARSET_UNKNOWN_CHARSET;
+            int encoding = 0;
+
+            if (!strcmpsafe(type, "TEXT"))
+                bodytree_parse_charset(bt, node, &encoding, &charset);
+            buf_init_ro(&data, message->map.s +
+                        bodytree_num(bt, node, BODYTREE_CONTENT_OFFSET),
+                        bodytree_num(bt, node, BODYTREE_CONTENT_SIZE));
+            r = proc(/*isbody*/1, charset, encoding, type, subtype,
+                     params, NULL, NULL, &data, rock);
+            buf_free(&data);
+            charset_free(&charset);
+        }
+
+        param_free(&params);
+    }
+
+    return r;
+}
+
 /*-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-*/
 
 /*
@@ -4301,7 +4835,18 @@ EXPORTED int message_foreach_section(message_t *m,
                                      void *rock),
                          void *rock)
 {
-    int r = message_need(m, M_CACHEBODY|M_MAP);
+    struct bodytree bt;
+    int r;
+
+    /* walk the binary body structure in place if we haven't
+     * already got a body */
+    if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+        r = message_need(m, M_MAP);
+        if (r) return r;
+        return bodytree_foreach_section(&bt, m, proc, rock);
+    }
+
+    r = message_need(m, M_CACHEBODY|M_MAP);
     if (r) return r;
     return body_foreach_section(m->body, m, proc, rock);
 }
@@ -4313,7 +4858,24 @@ EXPORTED int message_foreach_section(message_t *m,
  */
 EXPORTED int message_get_leaf_types(message_t *m, strarray_t *types)
 {
-    int r = message_need(m, M_CACHEBODY);
+    struct bodytree bt;
+    uint32_t node;
+    int r;
+
+    /* walk the binary body structure in place if we haven't
+     * already got a body */
+    if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+        for (node = 0; node < bt.nnodes; node++) {
+            const char *type = bodytree_str(&bt, node, BODYTREE_TYPE);
+            if (strcmp(type, "MULTIPART") && strcmp(type, "MESSAGE")) {
+                strarray_append(types, type);
+                strarray_append(types, bodytree_str(&bt, node, BODYTREE_SUBTYPE));
+            }
+        }
+        return 0;
+    }
+
+    r = message_need(m, M_CACHEBODY);
     if (r) return r;
     body_get_leaf_types(m->body, types);
     return 0;
@@ -4687,9 +5249,22 @@ EXPORTED int message_get_field(message_t *m, const char *hdr, int flags, struct
     }
     else {
         char *headers = NULL;
-        int r = message_need(m, M_MAP|M_CACHEBODY);
-        if (r) return r;
-        headers = xstrndup(m->map.s + m->body->header_offset, m->body->header_size);
+        struct bodytree bt;
+        int r;
+
+        if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+            r = message_need(m, M_MAP);
+            if (r) return r;
+            headers = xstrndup(m->map.s +
+                               bodytree_num(&bt, 0, BODYTREE_HEADER_OFFSET),
+                               bodytree_num(&bt, 0, BODYTREE_HEADER_SIZE));
+        }
+        else {
+            r = message_need(m, M_MAP|M_CACHEBODY);
+            if (r) return r;
+            headers = xstrndup(m->map.s + m->body->header_offset,
+                               m->body->header_size);
+        }
         strarray_append(&want, hdr);
         message_pruneheader(headers, &want, NULL);
         buf_appendcstr(&raw, headers);
@@ -4746,7 +5321,15 @@ EXPORTED int message_foreach_header(const char *headers, size_t len,
 
 EXPORTED int message_get_type(message_t *m, const char **strp)
 {
-    int r = message_need(m, M_CACHEBODY);
+    struct bodytree bt;
+    int r;
+
+    if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+        *strp = bodytree_str(&bt, 0, BODYTREE_TYPE);
+        return 0;
+    }
+
+    r = message_need(m, M_CACHEBODY);
     if (r) return r;
     *strp = m->body->type;
     return 0;
@@ -4754,7 +5337,15 @@ EXPORTED int message_get_type(message_t *m, const char **strp)
 
 EXPORTED int message_get_subtype(message_t *m, const char **strp)
 {
-    int r = message_need(m, M_CACHEBODY);
+    struct bodytree bt;
+    int r;
+
+    if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+        *strp = bodytree_str(&bt, 0, BODYTREE_SUBTYPE);
+        return 0;
+    }
+
+    r = message_need(m, M_CACHEBODY);
     if (r) return r;
     *strp = m->body->subtype;
     return 0;
@@ -4762,7 +5353,17 @@ EXPORTED int message_get_subtype(message_t *m, const char **strp)
 
 EXPORTED int message_get_encoding(message_t *m, int *encp)
 {
-    int r = message_need(m, M_CACHEBODY);
+    struct bodytree bt;
+    int r;
+
+    if (!(m->have & M_CACHEBODY) && !message_get_bodytree(m, &bt)) {
+        charset_t charset = CHARSET_UNKNOWN_CHARSET;
+        bodytree_parse_charset(&bt, 0, encp, &charset);
+        charset_free(&charset);
+        return 0;
+    }
+
+    r = message_need(m, M_CACHEBODY);
     if (r) return r;
     *encp = m->body->charset_enc;
     return 0;
@@ -176,6 +176,7 @@ extern void message_write_nstring_map(struct buf *buf, const char *s, unsigned i
 extern void message_write_body(struct buf *buf, const struct body *body,
                                   int newformat);
 extern void message_write_xdrstring(struct buf *buf, const struct buf *s);
+extern void message_write_bodytree(struct buf *buf, const struct body *body);
 extern int message_write_cache P((struct index_record *record, const struct body *body));
 
 extern int message_create_record P((struct index_record *message_index,
@@ -190,6 +191,61 @@ extern char *parse_nstring(char **str);
 extern void message_read_bodystructure(const struct index_record *record,
                                        struct body **body);
 
+/*
+ * Binary body structure, as stored in the CACHE_BODYTREE cache field.
+ *
+ * The field is a count of nodes followed by that many fixed size nodes,
+ * one per body part in depth first order, followed by the strings and
+ * parameter lists they refer to.  The first child of node n is node
+ * n+1, and BODYTREE_NEXT gives the node after the whole subtree of n,
+ * so siblings are found without descending.  All of it is read in
+ * place; bodytree_init() checks every reference once so the accessors
+ * don't have to.
+ */
+struct bodytree {
+    const char *base;
+    size_t len;
+    uint32_t nnodes;
+};
+
+/* node fields, in on-disk order */
+enum bodytree_field {
+    BODYTREE_NEXT = 0,
+    BODYTREE_NUMPARTS,
+    BODYTREE_HEADER_OFFSET,
+    BODYTREE_HEADER_SIZE,
+    BODYTREE_CONTENT_OFFSET,
+    BODYTREE_CONTENT_SIZE,
+    BODYTREE_CONTENT_LINES,
+    /* strings */
+    BODYTREE_TYPE,
+    BODYTREE_SUBTYPE,
+    BODYTREE_PARAMS,                /* parameter list */
+    BODYTREE_ID,
+    BODYTREE_DESCRIPTION,
+    BODYTREE_ENCODING,
+    BODYTREE_MD5,
+    BODYTREE_DISPOSITION,
+    BODYTREE_DISPOSITION_PARAMS,    /* parameter list */
+    BODYTREE_LOCATION,
+    BODYTREE_CONTENT_GUID           /* MESSAGE_GUID_SIZE bytes */
+};
+
+extern int bodytree_init(struct bodytree *bt, const char *base, size_t len);
+extern uint32_t bodytree_num(const struct bodytree *bt, uint32_t node,
+                             enum bodytree_field field);
+extern const char *bodytree_str(const struct bodytree *bt, uint32_t node,
+                                enum bodytree_field field);
+extern uint32_t bodytree_nparams(const struct bodytree *bt, uint32_t node,
+                                 enum bodytree_field field);
+extern const char *bodytree_param(const struct bodytree *bt, uint32_t node,
+                                  enum bodytree_field field, uint32_t i,
+                                  const char **valuep);
+extern void bodytree_guid(const struct bodytree *bt, uint32_t node,
+                          struct message_guid *guid);
+extern int bodytree_to_body(const struct bodytree *bt, uint32_t node,
+                            struct body *body);
+
 extern int message_update_conversations(struct conversations_state *, struct mailbox *, struct index_record *, conversation_t **);
 
 extern int message_foreach_header(const char *headers, size_t len,
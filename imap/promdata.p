@@ -86,3 +86,14 @@ metric counter cyrus_lmtp_sieve_keep_total              The number of sieve KEEP
 metric counter cyrus_lmtp_sieve_notify_total            The number of sieve NOTIFYs
 metric counter cyrus_lmtp_sieve_autorespond_total       The number of sieve AUTORESPONDs considered
 metric counter cyrus_lmtp_sieve_autorespond_sent_total  The number of sieve AUTORESPONDs sent
+
+metric counter cyrus_db_checkpoints_total               The total number of database checkpoints
+metric counter cyrus_db_checkpoint_pause_seconds_total  The total time database checkpoints locked out other processes
+metric counter cyrus_db_bloom_checks_total              The number of database fetches checked against a bloom filter
+metric counter cyrus_db_bloom_negatives_total           The number of database fetches a bloom filter showed to be missing
+metric counter cyrus_db_bloom_false_positives_total     The number of database fetches a bloom filter passed which were missing
+
+metric counter cyrus_conversations_cache_stores_total       The number of conversation changes taken by the write-back cache
+metric counter cyrus_conversations_cache_writes_total       The number of conversation records written from the write-back cache
+metric counter cyrus_conversations_cache_evictions_total    The number of conversation records written early because the cache was full
+metric gauge   cyrus_conversations_cache_bytes              The size of the conversation write-back caches
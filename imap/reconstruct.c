@@ -97,6 +97,7 @@
 #include "quota.h"
 #include "seen.h"
 #include "util.h"
+#include "workerpool.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -111,6 +112,7 @@ static struct namespace recon_namespace;
 
 struct reconstruct_rock {
     strarray_t *discovered;
+    strarray_t *pending;        /* left for the workers with -j */
     hash_table visited;
 };
 
@@ -121,12 +123,17 @@ static const char *progname = NULL;
 static void do_mboxlist(void);
 static int do_reconstruct_p(const mbentry_t *mbentry, void *rock);
 static int do_reconstruct(struct findall_data *data, void *rock);
+static void reconstruct_done(const char *name, int r,
+                             struct reconstruct_rock *rrock);
+static void do_parallel(const strarray_t *names,
+                        struct reconstruct_rock *rrock);
 static void usage(void);
 
 extern cyrus_acl_canonproc_t mboxlist_ensureOwnerRights;
 
 static int reconstruct_flags = RECONSTRUCT_MAKE_CHANGES | RECONSTRUCT_DO_STAT;
 static int setversion = 0;
+static int nworkers = 0;
 
 int main(int argc, char **argv)
 {
@@ -139,13 +146,13 @@ int main(int argc, char **argv)
     struct buf buf = BUF_INITIALIZER;
     char *alt_config = NULL;
     char *start_part = NULL;
-    struct reconstruct_rock rrock = { NULL, HASH_TABLE_INITIALIZER };
+    struct reconstruct_rock rrock = { NULL, NULL, HASH_TABLE_INITIALIZER };
 
     progname = basename(argv[0]);
 
     construct_hash_table(&unqid_table, 2047, 1);
 
-    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMoOnV:u")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:kp:rmfsxgGqRUMoOnV:uj:P:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -226,6 +233,17 @@ int main(int argc, char **argv)
                 setversion = atoi(optarg);
             break;
 
+        case 'j':
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage();
+            break;
+
+        case 'P':
+            i = atoi(optarg);
+            if (i < 1) usage();
+            mailbox_set_reconstruct_workers(i);
+            break;
+
         default:
             usage();
         }
@@ -300,6 +318,7 @@ int main(int argc, char **argv)
 
     /* set up reconstruct rock */
     if (fflag) rrock.discovered = strarray_new();
+    if (nworkers > 1) rrock.pending = strarray_new();
     construct_hash_table(&rrock.visited, 2047, 1); /* XXX magic numbers */
 
     /* Normal Operation */
@@ -347,6 +366,15 @@ int main(int argc, char **argv)
         }
     }
 
+    /* reconstruct what we found in parallel */
+    if (rrock.pending) {
+        strarray_t *pending = rrock.pending;
+
+        rrock.pending = NULL;
+        do_parallel(pending, &rrock);
+        strarray_free(pending);
+    }
+
     /* examine our list to see if we discovered anything */
     while (rrock.discovered && rrock.discovered->count) {
         char *name = strarray_shift(rrock.discovered);
@@ -405,6 +433,8 @@ static void usage(void)
     fprintf(stderr, "-M                 prefer mailboxes.db over cyrus.header\n");
     fprintf(stderr, "-V <version>       Change the cyrus.index minor version to the version specified\n");
     fprintf(stderr, "-u                 give usernames instead of mailbox prefixes\n");
+    fprintf(stderr, "-j <workers>       reconstruct this many mailboxes at once\n");
+    fprintf(stderr, "-P <workers>       parse message files in this many processes\n");
 
     fprintf(stderr, "\n");
 
@@ -433,9 +463,6 @@ static int do_reconstruct(struct findall_data *data, void *rock)
     if (!data) return 0;
     struct reconstruct_rock *rrock = (struct reconstruct_rock *) rock;
     int r;
-    char *other;
-    struct mailbox *mailbox = NULL;
-    char outpath[MAX_MAILBOX_PATH];
     const char *name = NULL;
 
     /* ignore partial matches */
@@ -448,17 +475,41 @@ static int do_reconstruct(struct findall_data *data, void *rock)
     /* don't repeat */
     if (hash_lookup(name, &rrock->visited)) return 0;
 
+    if (rrock->pending) {
+        /* the workers reconstruct it, and we finish it off later */
+        strarray_append(rrock->pending, name);
+        hash_insert(name, &rrock, &rrock->visited);
+        return 0;
+    }
+
     r = mailbox_reconstruct(name, reconstruct_flags);
+    reconstruct_done(name, r, rrock);
+
+    return 0;
+}
+
+/*
+ * Everything after the mailbox itself is reconstructed: uniqueid
+ * clashes, version changes and looking for mailboxes missing from
+ * mailboxes.db.  Always done in order, by the parent.
+ */
+static void reconstruct_done(const char *name, int r,
+                             struct reconstruct_rock *rrock)
+{
+    char *other;
+    struct mailbox *mailbox = NULL;
+    char outpath[MAX_MAILBOX_PATH];
+
     if (r) {
         com_err(name, r, "%s",
                 (r == IMAP_IOERROR) ? error_message(errno) : "Failed to reconstruct mailbox");
-        return 0;
+        return;
     }
 
     r = mailbox_open_iwl(name, &mailbox);
     if (r) {
         com_err(name, r, "Failed to open after reconstruct");
-        return 0;
+        return;
     }
 
     other = hash_lookup(mailbox->uniqueid, &unqid_table);
@@ -499,16 +550,16 @@ static int do_reconstruct(struct findall_data *data, void *rock)
         struct stat sbuf;
 
         ptr = strstr(outpath, "cyrus.header");
-        if (!ptr) return 0;
+        if (!ptr) return;
         *ptr = 0;
 
         r = chdir(outpath);
-        if (r) return 0;
+        if (r) return;
 
         /* we recurse down this directory to see if there's any mailboxes
            under this not in the mailboxes database */
         dirp = opendir(".");
-        if (!dirp) return 0;
+        if (!dirp) return;
 
         while ((dirent = readdir(dirp)) != NULL) {
             /* mailbox directories never have a dot in them */
@@ -547,10 +598,97 @@ static int do_reconstruct(struct findall_data *data, void *rock)
      * we don't care about the value, it just needs to be a non-NULL pointer
      */
     hash_insert(name, &rrock, &rrock->visited);
+}
+
+/*
+ * Reconstructing mailboxes in parallel (-j).
+ *
+ * The workers only run mailbox_reconstruct().  Everything else happens
+ * in the parent afterwards, in the original order, so it sees the same
+ * mailboxes in the same order as a serial run.
+ */
+static int reconstruct_worker_setup(void *rock __attribute__((unused)))
+{
+    /* keep the workers' lines apart */
+    setvbuf(stdout, NULL, _IOLBF, 0);
+    return 0;
+}
+
+static int reconstruct_worker_run(int job,
+                                  const struct buf *in __attribute__((unused)),
+                                  struct buf *out, void *rock)
+{
+    const strarray_t *names = rock;
+    int r;
+
+    signals_poll();
+
+    r = mailbox_reconstruct(strarray_nth(names, job), reconstruct_flags);
+    buf_appendmap(out, (const char *)&r, sizeof(r));
 
     return 0;
 }
 
+static void reconstruct_worker_cleanup(int r __attribute__((unused)),
+                                       void *rock __attribute__((unused)))
+{
+    partlist_local_done();
+    cyrus_done();
+}
+
+static const struct workerpool_ops reconstruct_worker_ops = {
+    reconstruct_worker_setup,
+    reconstruct_worker_run,
+    reconstruct_worker_cleanup
+};
+
+static void do_parallel(const strarray_t *names,
+                        struct reconstruct_rock *rrock)
+{
+    struct workerpool *pool;
+    struct buf out = BUF_INITIALIZER;
+    int *results = NULL;
+    char *done = NULL;
+    int i;
+
+    if (!names->count) return;
+
+    results = xzmalloc(names->count * sizeof(int));
+    done = xzmalloc(names->count);
+
+    /* the workers open their own databases */
+    mboxlist_close();
+
+    pool = workerpool_start("reconstruct", nworkers, names->count, 0,
+                            &reconstruct_worker_ops, (void *) names);
+    if (pool) {
+        while (workerpool_next(pool, -1, &i, &out) != WORKERPOOL_DONE) {
+            if (out.len != sizeof(int)) continue;
+            memcpy(&results[i], out.s, sizeof(int));
+            done[i] = 1;
+            buf_reset(&out);
+        }
+        workerpool_finish(&pool);
+    }
+
+    /* finish off in order, doing anything a worker didn't here */
+    for (i = 0; i < names->count; i++) {
+        const char *name = strarray_nth(names, i);
+        int r = results[i];
+
+        signals_poll();
+
+        if (!done[i])
+            r = mailbox_reconstruct(name, reconstruct_flags);
+
+        reconstruct_done(name, r, rrock);
+    }
+
+    buf_free(&out);
+    free(results);
+    free(done);
+}
+
 /*
  * Reconstruct the mailboxes list.
  */
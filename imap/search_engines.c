@@ -192,7 +192,7 @@ static int flush_batch(search_text_receiver_t *rx,
 
 EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
                                    struct mailbox *mailbox,
-                                   int flags)
+                                   int flags, unsigned *nindexed)
 {
     int r = 0;                  /* Using IMAP_* not SQUAT_* return codes here */
     int r2;
@@ -201,6 +201,8 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
     ptrarray_t batch = PTRARRAY_INITIALIZER;
     const message_t *msg;
 
+    if (nindexed) *nindexed = 0;
+
     r = rx->begin_mailbox(rx, mailbox, flags);
     if (r) goto done;
 
@@ -228,8 +230,11 @@ EXPORTED int search_update_mailbox(search_text_receiver_t *rx,
     }
     mailbox_iter_done(&iter);
 
-    if (batch.count)
+    if (batch.count) {
+        unsigned count = batch.count;
         r = flush_batch(rx, mailbox, &batch);
+        if (!r && nindexed) *nindexed = count;
+    }
 
  done:
     ptrarray_fini(&batch);
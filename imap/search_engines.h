@@ -163,9 +163,10 @@ extern void search_end_search(search_builder_t *);
 #define SEARCH_UPDATE_BATCH (1<<2)
 #define SEARCH_UPDATE_XAPINDEXED (1<<3)
 search_text_receiver_t *search_begin_update(int verbose);
+/* nindexed, if given, is set to the number of messages indexed */
 int search_update_mailbox(search_text_receiver_t *rx,
                           struct mailbox *mailbox,
-                          int flags);
+                          int flags, unsigned *nindexed);
 int search_end_update(search_text_receiver_t *rx);
 search_text_receiver_t *search_begin_snippets(void *internalised,
                                               int verbose,
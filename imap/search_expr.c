@@ -58,6 +58,7 @@
 #include "annotate.h"
 #include "global.h"
 #include "lsort.h"
+#include "ptrarray.h"
 #include "xstrlcpy.h"
 #include "xmalloc.h"
 
@@ -749,12 +750,15 @@ static int internalise(search_expr_t *e, void *rock)
     return 0;
 }
 
+static void text_scan_internalise(search_expr_t *e);
+
 /*
  * Prepare the given expression for use with the given mailbox.
  */
 EXPORTED void search_expr_internalise(struct index_state *state, search_expr_t *e)
 {
     search_expr_apply(e, internalise, state);
+    text_scan_internalise(e);
 }
 
 /*
@@ -1815,21 +1819,20 @@ static int search_convflags_match(message_t *m,
 {
     struct conv_rock *rock = (struct conv_rock *)internalised;
     conversation_id_t cid = NULLCONVERSATION;
-    conversation_t *conv = NULL;
+    conv_view_t conv;
     int r = 0; /* invalid flag name */
 
     if (!rock->cstate) return 0;
 
     message_get_cid(m, &cid);
-    if (conversation_load(rock->cstate, cid, &conv)) return 0;
-    if (!conv) return 0;
+    if (conversation_view(rock->cstate, cid, &conv)) return 0;
+    if (!conv.base) return 0;
 
     if (rock->num == 0)
-        r = !conv->unseen;
+        r = !conv_view_unseen(&conv);
     else if (rock->num > 0)
-        r = !!conv->counts[rock->num-1];
+        r = !!conv_view_count(&conv, rock->num-1);
 
-    conversation_free(conv);
     return r;
 }
 
@@ -1858,19 +1861,15 @@ static int search_convmodseq_match(message_t *m, const union search_value *v,
 {
     struct conv_rock *rock = (struct conv_rock *)internalised;
     conversation_id_t cid = NULLCONVERSATION;
-    conversation_t *conv = NULL;
-    int r;
+    conv_view_t conv;
 
     if (!rock->cstate) return 0;
 
     message_get_cid(m, &cid);
-    if (conversation_load(rock->cstate, cid, &conv)) return 0;
-    if (!conv) return 0;
-
-    r = (v->u == conv->modseq);
+    if (conversation_view(rock->cstate, cid, &conv)) return 0;
+    if (!conv.base) return 0;
 
-    conversation_free(conv);
-    return r;
+    return (v->u == conv_view_modseq(&conv));
 }
 
 static void conv_rock_new(struct mailbox *mailbox,
@@ -1977,6 +1976,167 @@ static int search_percent_unserialise(struct protstream *prot, union search_valu
  * Search part of a message for a substring.
  */
 
+/*
+ * All the non-empty TEXT and BODY terms of an expression, compiled
+ * into one automaton so that each message is decoded and scanned just
+ * once however many terms there are.  The results are kept for the
+ * last message scanned, keyed on its GUID.
+ */
+struct text_scan
+{
+    int refcount;
+    comp_mpat *pat;
+    bitvector_t found;          /* in any part but the top-level header */
+    bitvector_t hdrfound;       /* in the top-level header */
+    struct message_guid guid;   /* message the results are for */
+    int valid;
+};
+
+/* internalised form of a TEXT or BODY term */
+struct text_term
+{
+    comp_pat *pat;
+    struct text_scan *scan;     /* if shared with other terms */
+    int idx;                    /* our pattern number in scan */
+};
+
+static void text_scan_unref(struct text_scan *scan)
+{
+    if (!scan || --scan->refcount) return;
+
+    charset_free_mpat(scan->pat);
+    bv_free(&scan->found);
+    bv_free(&scan->hdrfound);
+    free(scan);
+}
+
+struct text_scan_rock
+{
+    struct text_scan *scan;
+    int toplevel;
+};
+
+static int text_scan_cb(int isbody, charset_t charset, int encoding,
+                        const char *type __attribute__((unused)),
+                        const char *subtype __attribute__((unused)),
+                        const struct param *type_params __attribute__((unused)),
+                        const char *disposition __attribute__((unused)),
+                        const struct param *disposition_params __attribute__((unused)),
+                        struct buf *data, void *rock)
+{
+    struct text_scan_rock *tr = (struct text_scan_rock *)rock;
+    struct text_scan *scan = tr->scan;
+
+    if (!isbody) {
+        /* header-like */
+        if (tr->toplevel) {
+            /* kept apart, as BODY doesn't look at it */
+            tr->toplevel = 0;
+            charset_search_mimeheader_mpat(scan->pat, &scan->hdrfound,
+                                           buf_cstring(data), charset_flags);
+            return 0;
+        }
+        return charset_search_mimeheader_mpat(scan->pat, &scan->found,
+                                              buf_cstring(data), charset_flags);
+    }
+
+    /* body-like */
+    if (charset == CHARSET_UNKNOWN_CHARSET) return 0;
+    /* exit early once every term has been found */
+    return charset_searchfile_mpat(scan->pat, &scan->found,
+                                   data->s, data->len,
+                                   charset, encoding, charset_flags);
+}
+
+static int text_scan_match(struct text_scan *scan, message_t *m,
+                           int idx, int skipheader)
+{
+    const struct message_guid *guid = NULL;
+
+    if (message_get_guid(m, &guid) || message_guid_isnull(guid))
+        guid = NULL;
+
+    if (!scan->valid || !guid || !message_guid_equal(guid, &scan->guid)) {
+        struct text_scan_rock tr = { scan, 1 };
+
+        bv_clearall(&scan->found);
+        bv_clearall(&scan->hdrfound);
+        message_foreach_section(m, text_scan_cb, &tr);
+
+        scan->valid = (guid != NULL);
+        if (guid) message_guid_copy(&scan->guid, guid);
+    }
+
+    return bv_isset(&scan->found, idx) ||
+           (!skipheader && bv_isset(&scan->hdrfound, idx));
+}
+
+static int search_text_match(message_t *m, const union search_value *v,
+                             void *internalised, void *data1);
+
+static int collect_text_terms(search_expr_t *e, void *rock)
+{
+    ptrarray_t *terms = (ptrarray_t *)rock;
+
+    if (e->attr && e->attr->match == search_text_match &&
+        e->internalised && e->value.s && e->value.s[0])
+        ptrarray_append(terms, e);
+
+    return 0;
+}
+
+/*
+ * Compile all the TEXT and BODY terms of the freshly internalised
+ * expression 'e' into one shared scan.  Not worth it for one term.
+ */
+static void text_scan_internalise(search_expr_t *e)
+{
+    ptrarray_t terms = PTRARRAY_INITIALIZER;
+    strarray_t pats = STRARRAY_INITIALIZER;
+    struct text_scan *scan;
+    int i;
+
+    search_expr_apply(e, collect_text_terms, &terms);
+
+    if (terms.count > 1) {
+        scan = xzmalloc(sizeof(struct text_scan));
+
+        for (i = 0; i < terms.count; i++) {
+            search_expr_t *t = ptrarray_nth(&terms, i);
+            struct text_term *tt = t->internalised;
+
+            strarray_append(&pats, t->value.s);
+            text_scan_unref(tt->scan);
+            tt->scan = scan;
+            tt->idx = i;
+            scan->refcount++;
+        }
+
+        scan->pat = charset_compile_mpat(&pats);
+        strarray_fini(&pats);
+    }
+
+    ptrarray_fini(&terms);
+}
+
+static void search_text_internalise(struct index_state *state __attribute__((unused)),
+                                    const union search_value *v, void **internalisedp)
+{
+    struct text_term *tt = *internalisedp;
+
+    if (tt) {
+        charset_freepat(tt->pat);
+        text_scan_unref(tt->scan);
+        free(tt);
+        *internalisedp = NULL;
+    }
+    if (v) {
+        tt = xzmalloc(sizeof(struct text_term));
+        tt->pat = charset_compilepat(v->s);
+        *internalisedp = tt;
+    }
+}
+
 struct searchmsg_rock
 {
     const char *substr;
@@ -2018,10 +2178,14 @@ static int searchmsg_cb(int isbody, charset_t charset, int encoding,
 static int search_text_match(message_t *m, const union search_value *v,
                              void *internalised, void *data1)
 {
+    struct text_term *tt = (struct text_term *)internalised;
     struct searchmsg_rock sr;
 
+    if (tt->scan)
+        return text_scan_match(tt->scan, m, tt->idx, (int)(unsigned long)data1);
+
     sr.substr = v->s;
-    sr.pat = (comp_pat *)internalised;
+    sr.pat = tt->pat;
     sr.skipheader = (int)(unsigned long)data1;
     sr.result = 0;
     message_foreach_section(m, searchmsg_cb, &sr);
@@ -2390,7 +2554,7 @@ EXPORTED void search_attr_init(void)
             SEA_FUZZABLE,
             SEARCH_PART_BODY,
             SEARCH_COST_BODY,
-            search_string_internalise,
+            search_text_internalise,
             /*cmp*/NULL,
             search_text_match,
             search_string_serialise,
@@ -2404,7 +2568,7 @@ EXPORTED void search_attr_init(void)
             SEA_FUZZABLE,
             SEARCH_PART_ANY,
             SEARCH_COST_BODY,
-            search_string_internalise,
+            search_text_internalise,
             /*cmp*/NULL,
             search_text_match,
             search_string_serialise,
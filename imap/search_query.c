@@ -491,6 +491,7 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
     if (r) goto out;
 
     if (!state->exists) goto out;
+    if (state->highestmodseq <= query->sincemodseq) goto out;
 
     search_expr_internalise(state, sub->expr);
 
@@ -516,6 +517,9 @@ static void subquery_post_indexed(const char *key, void *data, void *rock)
         if ((im->system_flags & FLAG_EXPUNGED) && !query->want_expunged)
             continue;
 
+        if (im->modseq <= query->sincemodseq)
+            continue;
+
         /* run the search program */
         if (!index_search_evaluate(state, sub->expr, msgno))
             continue;
@@ -668,6 +672,7 @@ static int subquery_run_one_folder(search_query_t *query,
     if (r) goto out;
 
     if (!state->exists) goto out;
+    if (state->highestmodseq <= query->sincemodseq) goto out;
 
     search_expr_internalise(state, e);
 
@@ -685,6 +690,9 @@ static int subquery_run_one_folder(search_query_t *query,
         if ((im->system_flags & FLAG_EXPUNGED) && !query->want_expunged)
             continue;
 
+        if (im->modseq <= query->sincemodseq)
+            continue;
+
         /* run the search program */
         if (!index_search_evaluate(state, e, msgno))
             continue;
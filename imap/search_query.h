@@ -104,6 +104,9 @@ struct search_query {
     int want_expunged;
     uint32_t want_mbtype;
     int verbose;
+    /* if non-zero, only report messages changed after this modseq;
+     * folders with no such changes are skipped without a scan */
+    modseq_t sincemodseq;
 
     /*
      * A query comprises multiple sub-queries logically ORed together.
@@ -414,7 +414,7 @@ HIDDEN int seen_delete_user(const char *user)
                user);
     }
 
-    if (unlink(fname) && errno != ENOENT) {
+    if (cyrusdb_unlinkfile(fname) && errno != ENOENT) {
         syslog(LOG_ERR, "error unlinking %s: %m", fname);
         r = IMAP_IOERROR;
     }
@@ -435,7 +435,7 @@ HIDDEN int seen_rename_user(const char *olduser, const char *newuser)
     }
 
     cyrus_mkdir(newfname, 0755);
-    if (rename(oldfname, newfname) && errno != ENOENT) {
+    if (cyrusdb_renamefile(oldfname, newfname) && errno != ENOENT) {
         syslog(LOG_ERR, "error renaming %s to %s: %m", oldfname, newfname);
         r = IMAP_IOERROR;
     }
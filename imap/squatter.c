@@ -57,6 +57,7 @@
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/poll.h>
+#include <sys/time.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <syslog.h>
@@ -82,6 +83,7 @@
 #include "index.h"
 #include "message.h"
 #include "util.h"
+#include "workerpool.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -104,9 +106,20 @@ static int running_daemon = 0;
 static int sleepmicroseconds = 0;
 static const char *temp_root_dir = NULL;
 static search_text_receiver_t *rx = NULL;
+static int nworkers = 0;
+
+/* running totals, reported as throughput by the parallel indexer */
+static unsigned indexed_mailboxes = 0;
+static unsigned long indexed_messages = 0;
 
 static const char *name_starts_from = NULL;
 
+/* remembers how far each mailbox has been indexed, see indexed_skip() */
+#define FNAME_SEARCHINDEXED "/search_indexed.db"
+static struct db *indexeddb = NULL;
+/* name, state pairs not yet written, see indexed_flush() */
+static strarray_t indexed_pending = STRARRAY_INITIALIZER;
+
 static void shut_down(int code) __attribute__((noreturn));
 
 static int usage(const char *name)
@@ -127,6 +140,7 @@ static int usage(const char *name)
             "  -i          index incrementally\n"
             "  -N name     index mailbox names starting with name\n"
             "  -S seconds  sleep seconds between indexing mailboxes\n"
+            "  -j workers  index users in parallel with workers processes\n"
             "\n"
             "Index sources:\n"
             "  none        all mailboxes (default)\n"
@@ -144,6 +158,7 @@ static int usage(const char *name)
             "  -X          reindex during compaction\n"
             "  -o          copy db rather compacting\n"
             "  -U          only compact if re-indexing\n"
+            "  -j workers  compact users in parallel with workers processes\n"
             "\n"
             "General options:\n"
             "  -v          be verbose\n"
@@ -185,11 +200,152 @@ static void become_daemon(void)
 
 /* ====================================================================== */
 
+/*
+ * The "indexed" database maps each mailbox name to the uidvalidity,
+ * last_uid and highestmodseq it had when it was last completely
+ * indexed.  It belongs to squatter alone, so consulting it never
+ * contends with imapd, and together with mailbox_peek_index_header()
+ * the rolling indexer can throw away sync log entries for mailboxes
+ * which have nothing new without opening or locking them.
+ *
+ * States are collected in memory and written in one transaction once
+ * the search index they describe has been committed, so a run costs
+ * one commit rather than one per mailbox.  Entries for mailboxes which
+ * no longer exist (deleted, or renamed away) are removed when they
+ * are next looked at.
+ */
+
+static struct db *indexeddb_get(void)
+{
+    char *fname;
+    int r;
+
+    if (indexeddb) return indexeddb;
+
+    fname = strconcat(config_dir, FNAME_SEARCHINDEXED, (char *)NULL);
+    r = cyrusdb_open(config_getstring(IMAPOPT_SEARCH_INDEXED_DB),
+                     fname, CYRUSDB_CREATE, &indexeddb);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s",
+               fname, cyrusdb_strerror(r));
+        indexeddb = NULL;
+    }
+    free(fname);
+
+    return indexeddb;
+}
+
+static void indexed_flush(void)
+{
+    struct db *db;
+    struct txn *tid = NULL;
+    int i, r = 0;
+
+    if (!indexed_pending.count) return;
+
+    db = indexeddb_get();
+    for (i = 0; db && !r && i + 1 < indexed_pending.count; i += 2) {
+        const char *name = strarray_nth(&indexed_pending, i);
+        const char *val = strarray_nth(&indexed_pending, i + 1);
+        r = cyrusdb_store(db, name, strlen(name), val, strlen(val), &tid);
+    }
+    if (tid) {
+        if (r) cyrusdb_abort(db, tid);
+        else r = cyrusdb_commit(db, tid);
+    }
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: storing indexed state: %s",
+               cyrusdb_strerror(r));
+    }
+
+    strarray_truncate(&indexed_pending, 0);
+}
+
+static void indexeddb_close(void)
+{
+    indexed_flush();
+    strarray_fini(&indexed_pending);
+
+    if (!indexeddb) return;
+    cyrusdb_close(indexeddb);
+    indexeddb = NULL;
+}
+
+static void indexed_record(struct mailbox *mailbox)
+{
+    struct buf val = BUF_INITIALIZER;
+
+    buf_printf(&val, "%u %u " MODSEQ_FMT, mailbox->i.uidvalidity,
+               mailbox->i.last_uid, mailbox->i.highestmodseq);
+    strarray_append(&indexed_pending, mailbox->name);
+    strarray_appendm(&indexed_pending, buf_release(&val));
+}
+
+static void indexed_forget(const char *mboxname)
+{
+    struct db *db = indexeddb_get();
+    int r;
+
+    if (!db) return;
+
+    r = cyrusdb_delete(db, mboxname, strlen(mboxname), NULL, /*force*/1);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: removing indexed state for %s: %s",
+               mboxname, cyrusdb_strerror(r));
+    }
+}
+
+/* Return non-zero if an incremental index of mboxname would find
+ * nothing to do.  Any doubt answers zero and the mailbox gets opened. */
+static int indexed_skip(const char *mboxname)
+{
+    struct db *db = indexeddb_get();
+    struct index_header i;
+    struct buf val = BUF_INITIALIZER;
+    const char *data = NULL;
+    size_t datalen = 0;
+    unsigned uidvalidity, last_uid;
+    unsigned long long modseq;
+    int skip = 0;
+    int r;
+
+    if (!db) return 0;
+
+    if (cyrusdb_fetch(db, mboxname, strlen(mboxname),
+                      &data, &datalen, NULL))
+        return 0;
+
+    buf_setmap(&val, data, datalen);
+    if (sscanf(buf_cstring(&val), "%u %u %llu",
+               &uidvalidity, &last_uid, &modseq) != 3)
+        goto done;
+
+    r = mailbox_peek_index_header(mboxname, &i);
+    if (r == IMAP_MAILBOX_NONEXISTENT)
+        indexed_forget(mboxname);
+    if (r)
+        goto done;
+
+    if (i.uidvalidity != uidvalidity)
+        goto done;
+
+    /* either nothing changed at all, or the changes didn't add
+     * any messages (flags, expunges), which incremental indexing
+     * has no use for */
+    if (i.highestmodseq <= modseq || i.last_uid <= last_uid)
+        skip = 1;
+
+done:
+    buf_free(&val);
+    return skip;
+}
+
 /* This is called once for each mailbox we're told to index. */
 static int index_one(const char *name, int blocking)
 {
     mbentry_t *mbentry = NULL;
     struct mailbox *mailbox = NULL;
+    unsigned nindexed = 0;
     int r;
     int flags = 0;
 
@@ -282,6 +438,8 @@ again:
             printf("error opening %s: %s\n", extname, error_message(r));
         }
         syslog(LOG_INFO, "error opening %s: %s\n", extname, error_message(r));
+        if (r == IMAP_MAILBOX_NONEXISTENT)
+            indexed_forget(name);
         free(extname);
 
         return r;
@@ -292,7 +450,14 @@ again:
         printf("Indexing mailbox %s... ", extname);
     }
 
-    r = search_update_mailbox(rx, mailbox, flags);
+    r = search_update_mailbox(rx, mailbox, flags, &nindexed);
+
+    /* a partial batch (IMAP_AGAIN) still indexed messages */
+    indexed_messages += nindexed;
+    if (!r) {
+        indexed_mailboxes++;
+        indexed_record(mailbox);
+    }
 
     mailbox_close(&mailbox);
 
@@ -342,16 +507,13 @@ static void expand_mboxnames(strarray_t *sa, int nmboxnames,
     }
 }
 
-static int do_indexer(const strarray_t *sa)
+/* index the mailboxes sa[first] up to and excluding sa[last] */
+static int index_range(const strarray_t *sa, int first, int last)
 {
     int r = 0;
     int i;
 
-    rx = search_begin_update(verbose);
-    if (rx == NULL)
-        return 0;       /* no indexer defined */
-
-    for (i = 0 ; i < sa->count ; i++) {
+    for (i = first ; i < last ; i++) {
         r = index_one(sa->data[i], /*blocking*/1);
         if (r == IMAP_MAILBOX_NONEXISTENT)
             r = 0;
@@ -362,11 +524,258 @@ static int do_indexer(const strarray_t *sa)
             usleep(sleepmicroseconds);
     }
 
+    return r;
+}
+
+static int do_indexer(const strarray_t *sa)
+{
+    int r = 0;
+
+    rx = search_begin_update(verbose);
+    if (rx == NULL)
+        return 0;       /* no indexer defined */
+
+    r = index_range(sa, 0, sa->count);
+
     search_end_update(rx);
+    indexed_flush();
+
+    return r;
+}
+
+/* ====================================================================== */
+
+/*
+ * Parallel mode (-j).  The mailbox list is cut into groups of
+ * consecutive mailboxes belonging to the same user, because the search
+ * databases are per user and only one process may usefully write them
+ * at a time.  Each group is a job for the worker pool, so a worker
+ * stuck on a huge user doesn't hold up the rest of the queue.
+ */
+
+#define SQUAT_PROGRESS_INTERVAL 10 /* seconds */
+
+struct squat_group {
+    int first;
+    int last;
+};
+
+struct squat_result {
+    int r;
+    unsigned mailboxes;
+    unsigned long messages;
+};
+
+struct squat_job {
+    const char *what;
+    int (*begin)(void *rock);
+    int (*run)(const strarray_t *sa, int first, int last, void *rock);
+    void (*end)(void *rock);
+    void *rock;
+};
+
+struct squat_parallel {
+    const strarray_t *sa;
+    const struct squat_group *groups;
+    const struct squat_job *job;
+};
+
+static struct squat_group *group_by_user(const strarray_t *sa, int *ngroupsp)
+{
+    struct squat_group *groups = xzmalloc((sa->count + 1) * sizeof(*groups));
+    char *prev_userid = NULL;
+    int ngroups = 0;
+    int i;
+
+    for (i = 0 ; i < sa->count ; i++) {
+        char *userid = mboxname_to_userid(sa->data[i]);
+
+        if (!ngroups || !userid || strcmpsafe(prev_userid, userid)) {
+            if (ngroups) groups[ngroups-1].last = i;
+            groups[ngroups++].first = i;
+        }
+
+        free(prev_userid);
+        prev_userid = userid;
+    }
+    if (ngroups) groups[ngroups-1].last = sa->count;
+
+    free(prev_userid);
+    *ngroupsp = ngroups;
+    return groups;
+}
+
+static void report_progress(const char *what, int done, int ngroups,
+                            unsigned mailboxes, unsigned long messages,
+                            const struct timeval *start, int final)
+{
+    struct timeval now;
+    double elapsed;
+
+    gettimeofday(&now, NULL);
+    elapsed = timesub(start, &now);
+
+    if (verbose || final) {
+        printf("%s %d/%d users, %u mailboxes, %lu messages, "
+               "%.1f msgs/sec\n", what, done, ngroups, mailboxes, messages,
+               elapsed > 0 ? messages / elapsed : 0.0);
+    }
+    if (final) {
+        syslog(LOG_NOTICE, "%s %d/%d users, %u mailboxes, %lu messages "
+               "in %.1f seconds (%.1f msgs/sec)", what, done, ngroups,
+               mailboxes, messages, elapsed,
+               elapsed > 0 ? messages / elapsed : 0.0);
+    }
+}
+
+static int squat_worker_setup(void *rock)
+{
+    struct squat_parallel *sp = rock;
+
+    return sp->job->begin ? sp->job->begin(sp->job->rock) : 0;
+}
+
+static int squat_worker_run(int group,
+                            const struct buf *in __attribute__((unused)),
+                            struct buf *out, void *rock)
+{
+    struct squat_parallel *sp = rock;
+    struct squat_result res;
+    unsigned mailboxes = indexed_mailboxes;
+    unsigned long messages = indexed_messages;
+
+    res.r = sp->job->run(sp->sa, sp->groups[group].first,
+                         sp->groups[group].last, sp->job->rock);
+    res.mailboxes = indexed_mailboxes - mailboxes;
+    res.messages = indexed_messages - messages;
+    buf_appendmap(out, (const char *)&res, sizeof(res));
+
+    return 0;
+}
+
+static void squat_worker_cleanup(int r, void *rock)
+{
+    struct squat_parallel *sp = rock;
+
+    if (sp->job->end) sp->job->end(sp->job->rock);
+    shut_down(r ? EC_TEMPFAIL : 0);
+}
+
+static const struct workerpool_ops squat_worker_ops = {
+    squat_worker_setup,
+    squat_worker_run,
+    squat_worker_cleanup
+};
+
+static int do_parallel(const strarray_t *sa, const struct squat_job *job)
+{
+    struct squat_parallel sp = { sa, NULL, job };
+    struct workerpool *pool = NULL;
+    struct squat_group *groups = NULL;
+    struct buf out = BUF_INITIALIZER;
+    struct timeval start, last_report;
+    unsigned mailboxes = 0;
+    unsigned long messages = 0;
+    int ngroups = 0, done = 0;
+    int group, res;
+    int r = 0;
+
+    groups = group_by_user(sa, &ngroups);
+    if (!ngroups) goto out;
+    sp.groups = groups;
+
+    /* the workers open their own databases */
+    mboxlist_close();
+
+    gettimeofday(&start, NULL);
+    last_report = start;
+
+    pool = workerpool_start("squatter", nworkers, ngroups, 0,
+                            &squat_worker_ops, &sp);
+    if (!pool) {
+        r = IMAP_IOERROR;
+        goto out;
+    }
+
+    if (verbose) {
+        printf("%s %d users with %d workers\n", job->what, ngroups,
+               workerpool_nworkers(pool));
+    }
+
+    while ((res = workerpool_next(pool, 1000, &group, &out))
+           != WORKERPOOL_DONE) {
+        struct squat_result sr;
+        struct timeval now;
+
+        gettimeofday(&now, NULL);
+        if (timesub(&last_report, &now) >= SQUAT_PROGRESS_INTERVAL) {
+            report_progress(job->what, done, ngroups,
+                            mailboxes, messages, &start, 0);
+            last_report = now;
+        }
+
+        if (res == WORKERPOOL_TIMEOUT) continue;
+
+        if (res || out.len != sizeof(sr)) {
+            sr.r = IMAP_IOERROR;
+        }
+        else {
+            memcpy(&sr, out.s, sizeof(sr));
+            done++;
+            mailboxes += sr.mailboxes;
+            messages += sr.messages;
+        }
 
+        /* stop handing out work after the first failure */
+        if (sr.r && !r) {
+            r = sr.r;
+            workerpool_stop(pool);
+        }
+    }
+
+    if (workerpool_finish(&pool) && !r)
+        r = IMAP_IOERROR;
+
+    report_progress(job->what, done, ngroups,
+                    mailboxes, messages, &start, 1);
+
+out:
+    buf_free(&out);
+    free(groups);
     return r;
 }
 
+static int index_job_begin(void *rock __attribute__((unused)))
+{
+    rx = search_begin_update(verbose);
+    return 0;
+}
+
+static int index_job_run(const strarray_t *sa, int first, int last,
+                         void *rock __attribute__((unused)))
+{
+    /* no indexer defined */
+    if (!rx) return 0;
+
+    return index_range(sa, first, last);
+}
+
+static void index_job_end(void *rock __attribute__((unused)))
+{
+    if (rx) search_end_update(rx);
+    rx = NULL;
+    indexed_flush();
+}
+
+static int do_parallel_indexer(const strarray_t *sa)
+{
+    struct squat_job job = {
+        "indexed", index_job_begin, index_job_run, index_job_end, NULL
+    };
+
+    return do_parallel(sa, &job);
+}
+
 static int index_single_message(const char *mboxname, uint32_t uid)
 {
     int r;
@@ -597,6 +1006,41 @@ static int do_compact(const strarray_t *mboxnames, const strarray_t *srctiers,
     return r;
 }
 
+struct compact_rock {
+    const strarray_t *srctiers;
+    const char *desttier;
+    int flags;
+};
+
+static int compact_job_run(const strarray_t *sa, int first,
+                           int last __attribute__((unused)), void *rock)
+{
+    struct compact_rock *crock = rock;
+    char *userid = mboxname_to_userid(sa->data[first]);
+    int r = 0;
+
+    if (userid) {
+        r = compact_mbox(userid, crock->srctiers, crock->desttier, crock->flags);
+        free(userid);
+        if (sleepmicroseconds)
+            usleep(sleepmicroseconds);
+    }
+
+    return r;
+}
+
+static int do_parallel_compact(const strarray_t *mboxnames,
+                               const strarray_t *srctiers,
+                               const char *desttier, int flags)
+{
+    struct compact_rock crock = { srctiers, desttier, flags };
+    struct squat_job job = {
+        "compacted", NULL, compact_job_run, NULL, &crock
+    };
+
+    return do_parallel(mboxnames, &job);
+}
+
 static int do_search(const char *query, int single, const strarray_t *mboxnames)
 {
     struct mailbox *mailbox = NULL;
@@ -699,6 +1143,7 @@ static int do_synclogfile(const char *synclogfile)
     }
     search_end_update(rx);
     rx = NULL;
+    indexed_flush();
 
 out:
     strarray_free(folders);
@@ -733,6 +1178,11 @@ static void do_rolling(const char *channel)
             rx = search_begin_update(verbose);
             for (i = 0; i < folders->count; i++) {
                 const char *mboxname = strarray_nth(folders, i);
+                if (indexed_skip(mboxname)) {
+                    if (verbose > 1)
+                        syslog(LOG_INFO, "do_rolling: %s unchanged", mboxname);
+                    continue;
+                }
                 if (verbose > 1)
                     syslog(LOG_INFO, "do_rolling: indexing %s", mboxname);
                 r = index_one(mboxname, /*blocking*/0);
@@ -745,6 +1195,7 @@ static void do_rolling(const char *channel)
             }
             search_end_update(rx);
             rx = NULL;
+            indexed_flush();
         }
 
         strarray_free(folders);
@@ -787,6 +1238,7 @@ static void shut_down(int code)
 {
     if (running_daemon)
         search_stop_daemon(verbose);
+    indexeddb_close();
     seen_done();
 
     cyrus_done();
@@ -816,7 +1268,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:I:N:RUXZT:S:Fc:de:f:mn:riavz:t:ouh")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:I:N:RUXZT:S:Fc:de:f:j:mn:riavz:t:ouh")) != EOF) {
         switch (opt) {
         case 'C':               /* alt config file */
             alt_config = optarg;
@@ -898,6 +1350,11 @@ int main(int argc, char **argv)
             mode = SEARCH;
             break;
 
+        case 'j':               /* parallel workers */
+            nworkers = atoi(optarg);
+            if (nworkers < 1) usage(argv[0]);
+            break;
+
         case 'n':               /* sync channel name (with -R) */
             channel = optarg;
             break;
@@ -963,6 +1420,11 @@ int main(int argc, char **argv)
         init_flags &= ~CYRUSINIT_PERROR;
     }
 
+    if (nworkers > 1 && mode != INDEXER && mode != COMPACT) {
+        /* only whole mailbox lists are worth spreading over workers */
+        usage("squatter");
+    }
+
     if (mode == COMPACT && (!desttier || !srctiers)) {
         /* need both src and dest for compact */
         usage("squatter");
@@ -988,7 +1450,10 @@ int main(int argc, char **argv)
         if (recursive_flag && optind == argc) usage(argv[0]);
         expand_mboxnames(&mboxnames, argc-optind, (const char **)argv+optind, user_mode);
         syslog(LOG_NOTICE, "indexing mailboxes");
-        r = do_indexer(&mboxnames);
+        if (nworkers > 1)
+            r = do_parallel_indexer(&mboxnames);
+        else
+            r = do_indexer(&mboxnames);
         syslog(LOG_NOTICE, "done indexing mailboxes");
         break;
     case INDEXFROM:
@@ -1023,7 +1488,10 @@ int main(int argc, char **argv)
     case COMPACT:
         if (recursive_flag && optind == argc) usage(argv[0]);
         expand_mboxnames(&mboxnames, argc-optind, (const char **)argv+optind, user_mode);
-        r = do_compact(&mboxnames, srctiers, desttier, compact_flags);
+        if (nworkers > 1)
+            r = do_parallel_compact(&mboxnames, srctiers, desttier, compact_flags);
+        else
+            r = do_compact(&mboxnames, srctiers, desttier, compact_flags);
         break;
     }
 
@@ -55,6 +55,7 @@
 #include <sys/types.h>
 #include <fcntl.h>
 #include <syslog.h>
+#include <errno.h>
 #include <string.h>
 #include <sys/wait.h>
 #include <signal.h>
@@ -83,6 +84,7 @@
 #include "xstrlcat.h"
 #include "signals.h"
 #include "cyrusdb.h"
+#include "strhash.h"
 
 /* generated headers are not necessarily in current directory */
 #include "imap/imap_err.h"
@@ -112,11 +114,27 @@ static int no_copyback     = 0;
 
 static char *prev_userid;
 
+/* -j: number of replica connections, each with its own process */
+struct shard {
+    pid_t pid;
+    char *channel;          /* sync log channel this shard reads */
+    char *shutdown_file;
+    struct buf items;
+};
+
+static int nshards = 1;
+static int myshard = -1;
+static struct shard *shards = NULL;
+
+static void stop_shards(int sig);
+
 static void shut_down(int code) __attribute__((noreturn));
 static void shut_down(int code)
 {
     in_shutdown = 1;
 
+    if (shards) stop_shards(SIGTERM);
+
     seen_done();
     cyrus_done();
     exit(code);
@@ -125,7 +143,7 @@ static void shut_down(int code)
 static int usage(const char *name)
 {
     fprintf(stderr,
-            "usage: %s -S <servername> [-C <alt_config>] [-r] [-v] mailbox...\n", name);
+            "usage: %s -S <servername> [-C <alt_config>] [-r] [-v] [-j <n>] mailbox...\n", name);
 
     exit(EC_USAGE);
 }
@@ -305,6 +323,9 @@ static int do_sync(sync_log_reader_t *slr, const char **channelp)
     struct sync_action *action;
     int r = 0;
 
+    /* items deferred for the next run are logged in one write */
+    sync_log_batch_begin();
+
     while (1) {
         r = sync_log_reader_getitem(slr, args);
         if (r == EOF) break;
@@ -542,6 +563,8 @@ static int do_sync(sync_log_reader_t *slr, const char **channelp)
     sync_action_list_free(&sub_list);
     sync_name_list_free(&mboxname_list);
 
+    sync_log_batch_end();
+
     return r;
 }
 
@@ -765,7 +788,10 @@ static void replica_disconnect(void)
     backend_disconnect(sync_backend);
 }
 
-static void do_daemon(const char *channel, const char *sync_shutdown_file,
+/* 'channel' selects the replica configuration, 'logchannel' the sync
+ * log to work from.  They differ only for the shards of a -j client */
+static void do_daemon(const char *channel, const char *logchannel,
+                      const char *sync_shutdown_file,
                       unsigned long timeout, unsigned long min_delta)
 {
     int r = 0;
@@ -775,7 +801,7 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
 
     while (restart) {
         replica_connect(channel);
-        r = do_daemon_work(channel, sync_shutdown_file,
+        r = do_daemon_work(logchannel, sync_shutdown_file,
                            timeout, min_delta, &restart);
         if (r) {
             /* See if we're still connected to the server.
@@ -788,6 +814,296 @@ static void do_daemon(const char *channel, const char *sync_shutdown_file,
     }
 }
 
+/* ====================================================================== */
+
+/*
+ * Sharded replication (-j).  Work is split by user, so that everything
+ * touching one user goes over the same connection in the order it was
+ * logged.  Shared mailboxes are split by their top level name, which
+ * keeps a shared hierarchy together.
+ */
+static int shard_for(const char *userid, const char *mboxname)
+{
+    char *freeme = NULL;
+    unsigned hash;
+
+    if (!userid && mboxname) {
+        userid = freeme = mboxname_to_userid(mboxname);
+        if (!userid) {
+            const char *p = strchr(mboxname, '.');
+            userid = freeme = p ? xstrndup(mboxname, p - mboxname)
+                                : xstrdup(mboxname);
+        }
+    }
+
+    hash = strhash(userid ? userid : "");
+    free(freeme);
+
+    return hash % nshards;
+}
+
+static int shard_for_item(const char *args[3])
+{
+    if (!strcmp(args[0], "USER") || !strcmp(args[0], "UNUSER") ||
+        !strcmp(args[0], "META") || !strcmp(args[0], "SIEVE") ||
+        !strcmp(args[0], "SEEN") || !strcmp(args[0], "SUB") ||
+        !strcmp(args[0], "UNSUB"))
+        return shard_for(args[1], NULL);
+
+    return shard_for(NULL, args[1]);
+}
+
+/* A rename is logged as "MAILBOX old" then "MAILBOX new".  If the two
+ * names belong to different shards, neither shard would see the pair
+ * and the replica would get a delete and a fresh copy instead of a
+ * rename, in either order.  Guess that consecutive items are such a
+ * pair when the first name has gone and the second exists; a wrong
+ * guess only costs a wait. */
+static int shard_isrename(const char *oldname, const char *newname)
+{
+    if (mboxlist_lookup(oldname, NULL, NULL) != IMAP_MAILBOX_NONEXISTENT)
+        return 0;
+
+    return !mboxlist_lookup(newname, NULL, NULL);
+}
+
+/* Write out what has been collected for shard i and wait until the
+ * shard has replicated everything in its log */
+static int shard_drain(int i)
+{
+    char *logname = strconcat(config_dir, "/sync/", shards[i].channel,
+                              "/log", (char *)NULL);
+    char *runname = strconcat(logname, "-run", (char *)NULL);
+    struct stat sbuf;
+    int r = 0;
+
+    sync_log_channel_buf(shards[i].channel, &shards[i].items);
+    buf_reset(&shards[i].items);
+
+    while (!stat(logname, &sbuf) || !stat(runname, &sbuf)) {
+        signals_poll();
+        if (!shards[i].pid || waitpid(shards[i].pid, NULL, WNOHANG)) {
+            syslog(LOG_ERR, "sync_client shard %d exited", i);
+            shards[i].pid = 0;
+            r = IMAP_IOERROR;
+            break;
+        }
+        usleep(100000);    /* 1/10th second */
+    }
+
+    free(runname);
+    free(logname);
+    return r;
+}
+
+static void start_shard(const char *channel, int i,
+                        unsigned long timeout, unsigned long min_delta)
+{
+    struct shard *shard = &shards[i];
+    pid_t pid = fork();
+
+    if (pid == -1) {
+        syslog(LOG_ERR, "sync_client: fork failed: %m");
+        shut_down(1);
+    }
+
+    if (pid) {
+        shard->pid = pid;
+        return;
+    }
+
+    /* child: a normal rolling client working from the shard's log */
+    shards = NULL;
+    myshard = i;
+    do_daemon(channel, shard->channel, shard->shutdown_file,
+              timeout, min_delta);
+    shut_down(0);
+}
+
+/* Stop every shard, by signal if 'sig' is given, otherwise by their
+ * shutdown files so that they finish what they are doing, and wait
+ * for them to exit */
+static void stop_shards(int sig)
+{
+    struct shard *all = shards;
+    int i, fd;
+
+    shards = NULL;  /* don't recurse from shut_down() */
+
+    for (i = 0; i < nshards; i++) {
+        if (!all[i].pid) continue;
+        if (sig) {
+            kill(all[i].pid, sig);
+            continue;
+        }
+        fd = open(all[i].shutdown_file, O_WRONLY|O_CREAT, 0640);
+        if (fd < 0 && errno == ENOENT &&
+            !cyrus_mkdir(all[i].shutdown_file, 0755))
+            fd = open(all[i].shutdown_file, O_WRONLY|O_CREAT, 0640);
+        if (fd < 0) {
+            syslog(LOG_ERR, "Failed to create %s: %m, using SIGTERM",
+                   all[i].shutdown_file);
+            kill(all[i].pid, SIGTERM);
+        }
+        else close(fd);
+    }
+
+    for (i = 0; i < nshards; i++) {
+        if (all[i].pid) waitpid(all[i].pid, NULL, 0);
+        all[i].pid = 0;
+    }
+
+    shards = all;
+}
+
+/*
+ * Rolling replication over 'nshards' connections.  This process only
+ * reads the channel's sync log and appends each item to the log of the
+ * shard which owns it; each shard is a child running the usual rolling
+ * client on its own log.  Items are re-logged before the channel's work
+ * file is removed, so a crash here means at worst replaying some items.
+ */
+static int do_sharded_daemon(const char *channel,
+                             const char *sync_shutdown_file,
+                             unsigned long timeout, unsigned long min_delta)
+{
+    sync_log_reader_t *slr = sync_log_reader_create_with_channel(channel);
+    struct buf buf = BUF_INITIALIZER;
+    struct buf held = BUF_INITIALIZER;
+    const char *args[3];
+    struct stat sbuf;
+    time_t start;
+    int delta;
+    int heldshard = 0;
+    int i, status, r = 0;
+    pid_t pid;
+
+    shards = xzmalloc(nshards * sizeof(struct shard));
+    for (i = 0; i < nshards; i++) {
+        buf_reset(&buf);
+        if (channel) buf_printf(&buf, "%s.", channel);
+        buf_printf(&buf, "shard%d", i);
+        shards[i].channel = buf_release(&buf);
+        shards[i].shutdown_file = strconcat(config_dir, "/sync/",
+                                            shards[i].channel, "/shutdown",
+                                            (char *)NULL);
+        /* left over from an unclean stop */
+        unlink(shards[i].shutdown_file);
+    }
+
+    for (i = 0; i < nshards; i++)
+        start_shard(channel, i, timeout, min_delta);
+
+    while (1) {
+        start = time(NULL);
+
+        signals_poll();
+
+        /* A shard only exits by itself on an error it couldn't recover
+         * from.  Stop the others and exit too, like a single connection
+         * client would, so that we get restarted */
+        pid = waitpid(-1, &status, WNOHANG);
+        if (pid > 0) {
+            for (i = 0; i < nshards; i++) {
+                if (shards[i].pid != pid) continue;
+                syslog(LOG_ERR, "sync_client shard %d exited (status %d)",
+                       i, status);
+                shards[i].pid = 0;
+            }
+            r = IMAP_IOERROR;
+            break;
+        }
+
+        if (sync_shutdown_file && !stat(sync_shutdown_file, &sbuf)) {
+            unlink(sync_shutdown_file);
+            break;
+        }
+
+        r = sync_log_reader_begin(slr);
+        if (r) {
+            r = 0;
+            if (min_delta > 0) {
+                sleep(min_delta);
+            } else {
+                usleep(100000);    /* 1/10th second */
+            }
+            continue;
+        }
+
+        /* each MAILBOX item is held back one step, in case it is the
+         * first half of a rename across shards */
+        while (!r && !sync_log_reader_getitem(slr, args)) {
+            int shard = shard_for_item(args);
+            struct buf *items = &shards[shard].items;
+            int ismailbox = !strcmp(args[0], "MAILBOX") && !args[2];
+
+            if (held.len && ismailbox && shard != heldshard &&
+                shard_isrename(held.s, args[1])) {
+                /* both shards finish what came before, then the old
+                 * name's shard does the rename, and nothing after it
+                 * goes out until that is done */
+                for (i = 0; !r && i < nshards; i++) {
+                    if (i == shard || i == heldshard) r = shard_drain(i);
+                }
+                sync_log_buf(&shards[heldshard].items, "MAILBOX %s\n"
+                             "MAILBOX %s\n", held.s, args[1]);
+                if (!r) r = shard_drain(heldshard);
+                buf_reset(&held);
+                continue;
+            }
+
+            if (held.len) {
+                sync_log_buf(&shards[heldshard].items,
+                             "MAILBOX %s\n", held.s);
+                buf_reset(&held);
+            }
+
+            if (ismailbox) {
+                buf_setcstr(&held, args[1]);
+                heldshard = shard;
+            }
+            else if (args[2])
+                sync_log_buf(items, "%s %s %s\n", args[0], args[1], args[2]);
+            else
+                sync_log_buf(items, "%s %s\n", args[0], args[1]);
+        }
+        if (r) break;
+
+        if (held.len) {
+            sync_log_buf(&shards[heldshard].items, "MAILBOX %s\n", held.s);
+            buf_reset(&held);
+        }
+
+        for (i = 0; i < nshards; i++) {
+            sync_log_channel_buf(shards[i].channel, &shards[i].items);
+            buf_reset(&shards[i].items);
+        }
+
+        r = sync_log_reader_end(slr);
+        if (r) break;
+
+        delta = time(NULL) - start;
+
+        if (((unsigned) delta < min_delta) && ((min_delta-delta) > 0))
+            sleep(min_delta-delta);
+    }
+
+    stop_shards(0);
+
+    for (i = 0; i < nshards; i++) {
+        free(shards[i].channel);
+        free(shards[i].shutdown_file);
+        buf_free(&shards[i].items);
+    }
+    free(shards);
+    shards = NULL;
+
+    buf_free(&held);
+    sync_log_reader_free(slr);
+
+    return r;
+}
+
 static int do_mailbox(const char *mboxname, const char **channelp, unsigned flags)
 {
     struct sync_name_list *list = sync_name_list_create();
@@ -809,6 +1125,10 @@ static int cb_allmbox(const mbentry_t *mbentry, void *rock)
 
     char *userid = mboxname_to_userid(mbentry->name);
 
+    /* with -j, each shard only does its own users */
+    if (myshard >= 0 && shard_for(userid, mbentry->name) != myshard)
+        goto done;
+
     if (userid) {
         /* skip deleted mailboxes only because the are out of order, and you would
          * otherwise have to sync the user twice thanks to our naive logic */
@@ -845,6 +1165,40 @@ done:
     return r;
 }
 
+/* -A over 'nshards' connections, one child process for each */
+static int do_sharded_allusers(const char *channel, const char *prefix)
+{
+    pid_t *pids = xzmalloc(nshards * sizeof(pid_t));
+    int i, status, r = 0;
+
+    for (i = 0; i < nshards; i++) {
+        pids[i] = fork();
+        if (pids[i] == -1) {
+            syslog(LOG_ERR, "sync_client: fork failed: %m");
+            pids[i] = 0;
+            r = 1;
+            break;
+        }
+        if (!pids[i]) {
+            myshard = i;
+            replica_connect(channel);
+            r = mboxlist_allmbox(prefix, cb_allmbox, NULL, 0);
+            replica_disconnect();
+            shut_down(r ? 1 : 0);
+        }
+    }
+
+    for (i = 0; i < nshards; i++) {
+        if (!pids[i]) continue;
+        if (waitpid(pids[i], &status, 0) < 0 ||
+            !WIFEXITED(status) || WEXITSTATUS(status))
+            r = 1;
+    }
+
+    free(pids);
+    return r;
+}
+
 /* ====================================================================== */
 
 static struct sasl_callback mysasl_cb[] = {
@@ -883,7 +1237,7 @@ int main(int argc, char **argv)
 
     setbuf(stdout, NULL);
 
-    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:rRumsozOAp:")) != EOF) {
+    while ((opt = getopt(argc, argv, "C:vlLS:F:f:w:t:d:n:rRumsozOAp:j:")) != EOF) {
         switch (opt) {
         case 'C': /* alt config file */
             alt_config = optarg;
@@ -986,6 +1340,12 @@ int main(int argc, char **argv)
             partition = optarg;
             break;
 
+        case 'j':
+            nshards = atoi(optarg);
+            if (nshards < 1)
+                fatal("The -j option requires a positive number", EC_USAGE);
+            break;
+
         default:
             usage("sync_client");
         }
@@ -994,6 +1354,11 @@ int main(int argc, char **argv)
     if (mode == MODE_UNKNOWN)
         fatal("No replication mode specified", EC_USAGE);
 
+    if (nshards > 1 && mode != MODE_ALLUSER &&
+        (mode != MODE_REPEAT || input_filename))
+        fatal("The -j option is only supported for -A and rolling replication",
+              EC_USAGE);
+
     if (verbose) flags |= SYNC_FLAG_VERBOSE;
     if (verbose_logging) flags |= SYNC_FLAG_LOGGING;
     if (no_copyback) flags |= SYNC_FLAG_NO_COPYBACK;
@@ -1083,6 +1448,12 @@ int main(int argc, char **argv)
         break;
 
     case MODE_ALLUSER:
+        if (nshards > 1) {
+            exit_rc = do_sharded_allusers(channel,
+                                          optind < argc ? argv[optind] : NULL);
+            break;
+        }
+
         /* Open up connection to server */
         replica_connect(channel);
 
@@ -1174,7 +1545,15 @@ int main(int argc, char **argv)
             if (!min_delta)
                 min_delta = sync_get_intconfig(channel, "sync_repeat_interval");
 
-            do_daemon(channel, sync_shutdown_file, timeout, min_delta);
+            if (nshards > 1) {
+                if (do_sharded_daemon(channel, sync_shutdown_file,
+                                      timeout, min_delta))
+                    exit_rc = 1;
+            }
+            else {
+                do_daemon(channel, channel, sync_shutdown_file,
+                          timeout, min_delta);
+            }
         }
 
         break;
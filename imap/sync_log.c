@@ -56,12 +56,15 @@
 #include <string.h>
 #include <syslog.h>
 #include <errno.h>
+#include <arpa/inet.h>
 
 #include "assert.h"
 #include "exitcodes.h"
 #include "sync_log.h"
 #include "global.h"
+#include "crc32.h"
 #include "cyr_lock.h"
+#include "hash.h"
 #include "mailbox.h"
 #include "retry.h"
 #include "util.h"
@@ -77,6 +80,17 @@ static strarray_t *unsuppressable = NULL;
 
 static int sync_log_initialized = 0;
 
+/* items logged between sync_log_batch_begin() and _end() */
+struct sync_log_batch {
+    char *channel;
+    struct buf data;
+    struct sync_log_batch *next;
+};
+
+static int batch_depth = 0;
+static struct sync_log_batch *batches = NULL;
+static hash_table batch_seen = HASH_TABLE_INITIALIZER;
+
 static void done_cb(void *rock __attribute__((unused))) {
     sync_log_done();
 }
@@ -125,6 +139,12 @@ EXPORTED void sync_log_suppress(void)
 
 EXPORTED void sync_log_done(void)
 {
+    /* don't lose anything logged by a batch we never finished */
+    if (batch_depth) {
+        batch_depth = 1;
+        sync_log_batch_end();
+    }
+
     strarray_free(channels);
     channels = NULL;
 
@@ -159,7 +179,7 @@ static int sync_log_enabled(const char *channel)
     return 0;           /* suppressed */
 }
 
-static void sync_log_base(const char *channel, const char *string)
+static void sync_log_base(const char *channel, const char *string, size_t len)
 {
     int fd;
     struct stat sbuffile, sbuffd;
@@ -205,7 +225,7 @@ static void sync_log_base(const char *channel, const char *string)
         return;
     }
 
-    if (retry_write(fd, string, strlen(string)) < 0)
+    if (retry_write(fd, string, len) < 0)
         syslog(LOG_ERR, "write() to %s failed: %s",
                fname, strerror(errno));
 
@@ -303,10 +323,146 @@ static char *va_format(const char *fmt, va_list ap)
     return buf;
 }
 
+/*
+ * Binary records, written when sync_log_format is "binary":
+ *
+ *   magic (1 byte)
+ *   length of type, arg1, arg2 (network order 16 bit each,
+ *                               arg2 is SYNC_LOG_NOARG if absent)
+ *   type, arg1, arg2 (no terminators)
+ *   CRC32 of all of the above (network order 32 bit)
+ *
+ * The magic byte can never start a text line, so a log can hold both
+ * kinds of record, and the CRC lets the reader skip a torn write.
+ */
+#define SYNC_LOG_MAGIC      (0xB5)
+#define SYNC_LOG_NOARG      (0xFFFF)
+#define SYNC_LOG_HEADERSIZE (7)
+#define SYNC_LOG_MAXWORDS   (3)
+
+static void binary_record(struct buf *buf, const char **words, size_t *lens,
+                          int nwords)
+{
+    size_t start = buf->len;
+    uint16_t n;
+    uint32_t crc;
+    int i;
+
+    buf_putc(buf, SYNC_LOG_MAGIC);
+    for (i = 0; i < SYNC_LOG_MAXWORDS; i++) {
+        n = htons(i < nwords ? lens[i] : SYNC_LOG_NOARG);
+        buf_appendmap(buf, (char *)&n, 2);
+    }
+    for (i = 0; i < nwords; i++)
+        buf_appendmap(buf, words[i], lens[i]);
+
+    crc = htonl(crc32_map(buf->s + start, buf->len - start));
+    buf_appendmap(buf, (char *)&crc, 4);
+}
+
+/* the binary equivalent of va_format(): one record per line of 'fmt' */
+static void va_format_binary(struct buf *buf, const char *fmt, va_list ap)
+{
+    const char *words[SYNC_LOG_MAXWORDS];
+    size_t lens[SYNC_LOG_MAXWORDS];
+    char nums[SYNC_LOG_MAXWORDS][32];
+    int nwords = 0;
+    const char *p, *q;
+
+    for (p = fmt; ; p++) {
+        if (!*p || *p == '\n') {
+            if (nwords) binary_record(buf, words, lens, nwords);
+            nwords = 0;
+            if (!*p) break;
+            continue;
+        }
+        if (*p == ' ') continue;
+        if (nwords == SYNC_LOG_MAXWORDS)
+            fatal("too many words in sync log item", EC_SOFTWARE);
+
+        if (*p == '%' && p[1] == 's') {
+            words[nwords] = va_arg(ap, const char *);
+            if (!words[nwords]) words[nwords] = "";
+            lens[nwords] = strlen(words[nwords]);
+            p++;
+        }
+        else if (*p == '%' && p[1] == 'd') {
+            snprintf(nums[nwords], sizeof(nums[nwords]), "%d", va_arg(ap, int));
+            words[nwords] = nums[nwords];
+            lens[nwords] = strlen(nums[nwords]);
+            p++;
+        }
+        else {
+            for (q = p; *q && *q != ' ' && *q != '\n'; q++);
+            words[nwords] = p;
+            lens[nwords] = q - p;
+            p = q - 1;
+        }
+
+        if (lens[nwords] >= SYNC_LOG_NOARG)
+            fatal("word too long", EC_IOERR);
+        nwords++;
+    }
+}
+
+/*
+ * Format an item once, in whichever format is configured.  'key' gets
+ * the text form, which identifies the item within a batch.
+ */
+static void sync_log_format(struct buf *data, struct buf *key,
+                            const char *fmt, va_list ap)
+{
+    va_list ap2;
+
+    va_copy(ap2, ap);
+    buf_setcstr(key, va_format(fmt, ap2));
+    va_end(ap2);
+
+    if (config_getenum(IMAPOPT_SYNC_LOG_FORMAT) == IMAP_ENUM_SYNC_LOG_FORMAT_BINARY)
+        va_format_binary(data, fmt, ap);
+    else
+        buf_append(data, key);
+}
+
+static void sync_log_write(const char *channel, struct buf *data,
+                           const struct buf *key)
+{
+    struct sync_log_batch *batch;
+    char *seenkey;
+
+    if (!batch_depth) {
+        sync_log_base(channel, data->s, data->len);
+        return;
+    }
+
+    /* the same item twice in a batch only needs logging once */
+    seenkey = strconcat(channel ? channel : "", "\n", buf_cstring(key),
+                        (char *)NULL);
+    if (hash_lookup(seenkey, &batch_seen)) {
+        free(seenkey);
+        return;
+    }
+    hash_insert(seenkey, (void *)1, &batch_seen);
+    free(seenkey);
+
+    for (batch = batches; batch; batch = batch->next) {
+        if (!strcmpsafe(batch->channel, channel)) break;
+    }
+    if (!batch) {
+        batch = xzmalloc(sizeof(struct sync_log_batch));
+        batch->channel = xstrdupnull(channel);
+        batch->next = batches;
+        batches = batch;
+    }
+
+    buf_append(&batch->data, data);
+}
+
 EXPORTED void sync_log(const char *fmt, ...)
 {
+    struct buf data = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
     va_list ap;
-    const char *val;
     int i;
 
     init_internal();
@@ -314,28 +470,93 @@ EXPORTED void sync_log(const char *fmt, ...)
     if (!channels) return;
 
     va_start(ap, fmt);
-    val = va_format(fmt, ap);
+    sync_log_format(&data, &key, fmt, ap);
     va_end(ap);
 
     for (i = 0 ; i < channels->count ; i++) {
         const char *channel = channels->data[i];
         if (sync_log_enabled(channel))
-            sync_log_base(channel, val);
+            sync_log_write(channel, &data, &key);
     }
+
+    buf_free(&data);
+    buf_free(&key);
 }
 
 EXPORTED void sync_log_channel(const char *channel, const char *fmt, ...)
 {
+    struct buf data = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
     va_list ap;
-    const char *val;
 
     init_internal();
 
     va_start(ap, fmt);
-    val = va_format(fmt, ap);
+    sync_log_format(&data, &key, fmt, ap);
+    va_end(ap);
+
+    sync_log_write(channel, &data, &key);
+
+    buf_free(&data);
+    buf_free(&key);
+}
+
+/*
+ * Format a log item onto the end of 'buf' rather than writing it out,
+ * so that a caller with many items for one channel can write them all
+ * with a single sync_log_channel_buf().
+ */
+EXPORTED void sync_log_buf(struct buf *buf, const char *fmt, ...)
+{
+    struct buf key = BUF_INITIALIZER;
+    va_list ap;
+
+    va_start(ap, fmt);
+    sync_log_format(buf, &key, fmt, ap);
     va_end(ap);
 
-    sync_log_base(channel, val);
+    buf_free(&key);
+}
+
+EXPORTED void sync_log_channel_buf(const char *channel, struct buf *buf)
+{
+    init_internal();
+
+    if (buf->len)
+        sync_log_base(channel, buf->s, buf->len);
+}
+
+/*
+ * Batching: from sync_log_batch_begin() until the matching
+ * sync_log_batch_end(), items are collected in memory, duplicates are
+ * dropped, and each channel's items are then written with a single
+ * locked append and fsync.  Batches nest; only the outermost end
+ * writes anything.
+ */
+EXPORTED void sync_log_batch_begin(void)
+{
+    if (!batch_depth++)
+        construct_hash_table(&batch_seen, 1024, 0);
+}
+
+EXPORTED void sync_log_batch_end(void)
+{
+    struct sync_log_batch *batch, *next;
+
+    if (!batch_depth) return;
+    if (--batch_depth) return;
+
+    for (batch = batches; batch; batch = next) {
+        next = batch->next;
+        if (batch->data.len)
+            sync_log_base(batch->channel, batch->data.s, batch->data.len);
+        free(batch->channel);
+        buf_free(&batch->data);
+        free(batch);
+    }
+    batches = NULL;
+
+    free_hash_table(&batch_seen, NULL);
 }
 
 /*
@@ -567,12 +788,88 @@ EXPORTED int sync_log_reader_end(sync_log_reader_t *slr)
     return 0;
 }
 
+static int read_binary_word(struct protstream *in, struct buf *buf,
+                            unsigned len)
+{
+    unsigned got = 0;
+    int n;
+
+    buf_reset(buf);
+    buf_ensure(buf, len+1);
+    while (got < len) {
+        n = prot_read(in, buf->s + got, len - got);
+        if (n <= 0) return EOF;
+        got += n;
+    }
+    buf_truncate(buf, len);
+    buf_cstring(buf);
+
+    return 0;
+}
+
+/* Read the rest of a binary record, the magic byte already having been
+ * read.  Returns 1 if the record is good, 0 if it is corrupt, or EOF */
+static int read_binary_item(sync_log_reader_t *slr, int *has_arg2)
+{
+    unsigned char header[SYNC_LOG_HEADERSIZE];
+    unsigned char crcbuf[4];
+    unsigned lens[SYNC_LOG_MAXWORDS];
+    struct buf *words[SYNC_LOG_MAXWORDS] =
+        { &slr->type, &slr->arg1, &slr->arg2 };
+    struct iovec iov[SYNC_LOG_MAXWORDS + 1];
+    uint32_t crc;
+    int i, c;
+
+    header[0] = SYNC_LOG_MAGIC;
+    for (i = 1; i < SYNC_LOG_HEADERSIZE; i++) {
+        if ((c = prot_getc(slr->input)) == EOF) return EOF;
+        header[i] = c;
+    }
+
+    for (i = 0; i < SYNC_LOG_MAXWORDS; i++)
+        lens[i] = (header[1+2*i] << 8) | header[2+2*i];
+    *has_arg2 = (lens[2] != SYNC_LOG_NOARG);
+    for (i = 0; i < SYNC_LOG_MAXWORDS; i++)
+        if (lens[i] == SYNC_LOG_NOARG) lens[i] = 0;
+
+    for (i = 0; i < SYNC_LOG_MAXWORDS; i++) {
+        if (read_binary_word(slr->input, words[i], lens[i])) return EOF;
+    }
+
+    for (i = 0; i < 4; i++) {
+        if ((c = prot_getc(slr->input)) == EOF) return EOF;
+        crcbuf[i] = c;
+    }
+
+    /* the CRC covers the header and the words as they were written */
+    iov[0].iov_base = header;
+    iov[0].iov_len = SYNC_LOG_HEADERSIZE;
+    for (i = 0; i < SYNC_LOG_MAXWORDS; i++) {
+        iov[i+1].iov_base = words[i]->s;
+        iov[i+1].iov_len = lens[i];
+    }
+    crc = crc32_iovec(iov, SYNC_LOG_MAXWORDS + 1);
+
+    if (crc != (((uint32_t) crcbuf[0] << 24) | ((uint32_t) crcbuf[1] << 16) |
+                ((uint32_t) crcbuf[2] << 8) | (uint32_t) crcbuf[3])) {
+        syslog(LOG_ERR, "sync log: bad CRC on record in %s, skipping",
+               slr->work_file ? slr->work_file : "input");
+        return 0;
+    }
+
+    return 1;
+}
+
 /*
  * Read a single log item from a sync log file.  The item will be
  * returned as three constant strings.  The first string is the type of
  * the item (e.g. "MAILBOX") and is always capitalised.  The second and
  * third strings are arguments.
  *
+ * Text and binary records are both understood.  Items are returned as
+ * often as they were logged: duplicates are coalesced by the consumer,
+ * e.g. sync_action_list_add().
+ *
  * Returns 0 on success, EOF when the end of the file is reached, or an
  * IMAP error code on failure.
  */
@@ -587,6 +884,20 @@ EXPORTED int sync_log_reader_getitem(sync_log_reader_t *slr,
         return EOF;
 
     for (;;) {
+        if ((c = prot_getc(slr->input)) == EOF)
+            return EOF;
+
+        if (c == SYNC_LOG_MAGIC) {
+            int has_arg2 = 0;
+            int r = read_binary_item(slr, &has_arg2);
+            if (r == EOF) return EOF;
+            if (!r) continue;
+            arg1s = slr->arg1.s;
+            arg2s = has_arg2 ? slr->arg2.s : NULL;
+            goto gotitem;
+        }
+        prot_ungetc(c, slr->input);
+
         if ((c = getword(slr->input, &slr->type)) == EOF)
             return EOF;
 
@@ -617,10 +928,11 @@ EXPORTED int sync_log_reader_getitem(sync_log_reader_t *slr,
             continue;
         }
 
+    gotitem:
+        ucase(slr->type.s);
         break;
     }
 
-    ucase(slr->type.s);
     args[0] = slr->type.s;
     args[1] = arg1s;
     args[2] = arg2s;
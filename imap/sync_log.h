@@ -46,6 +46,8 @@
 #ifndef INCLUDED_SYNC_LOG_H
 #define INCLUDED_SYNC_LOG_H
 
+#include "util.h"
+
 #define SYNC_LOG_RETRIES (64)
 
 void sync_log_init(void);
@@ -55,6 +57,14 @@ void sync_log_done(void);
 void sync_log(const char *fmt, ...);
 void sync_log_channel(const char *channel, const char *fmt, ...);
 
+/* batched writes: collect items with sync_log_buf(), write them at once */
+void sync_log_buf(struct buf *buf, const char *fmt, ...);
+void sync_log_channel_buf(const char *channel, struct buf *buf);
+
+/* hold everything logged until the batch ends, then write it at once */
+void sync_log_batch_begin(void);
+void sync_log_batch_end(void);
+
 #define sync_log_user(user) \
     sync_log("USER %s\n", user)
 
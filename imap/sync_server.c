@@ -289,6 +289,10 @@ static void dobanner(void)
             prot_printf(sync_out, "* COMPRESS DEFLATE\r\n");
         }
 #endif
+
+        if (config_getswitch(IMAPOPT_SYNC_GUID_LOOKUP)) {
+            prot_printf(sync_out, "* GUIDLOOKUP\r\n");
+        }
     }
 
     prot_printf(sync_out,
@@ -955,7 +959,10 @@ static void cmd_apply(struct dlist *kin, struct sync_reserve_list *reserve_list)
         0 /* local_only */
     };
 
+    /* anything chained on to our own sync log goes out in one write */
+    sync_log_batch_begin();
     const char *resp = sync_apply(kin, reserve_list, &sync_state);
+    sync_log_batch_end();
     prot_printf(sync_out, "%s\r\n", resp);
 }
 
@@ -133,6 +133,7 @@ struct protocol_t csync_protocol =
         { { "SASL", CAPA_AUTH },
           { "STARTTLS", CAPA_STARTTLS },
           { "COMPRESS=DEFLATE", CAPA_COMPRESS },
+          { "GUIDLOOKUP", CAPA_GUIDLOOKUP },
           { NULL, 0 } } },
       { "STARTTLS", "OK", "NO", 1 },
       { "AUTHENTICATE", USHRT_MAX, 0, "OK", "NO", "+ ", "*", NULL, 0 },
@@ -1431,6 +1432,7 @@ struct sync_action_list *sync_action_list_create(void)
     l->head   = NULL;
     l->tail   = NULL;
     l->count  = 0;
+    construct_hash_table(&l->table, 1024, 0);
 
     return(l);
 }
@@ -1439,17 +1441,19 @@ void sync_action_list_add(struct sync_action_list *l,
                           const char *name, const char *user)
 {
     struct sync_action *current;
+    char *key;
 
     if (!name && !user) return;
 
-    for (current = l->head ; current ; current = current->next) {
-        if ((!name || (current->name && !strcmp(current->name, name))) &&
-            (!user || (current->user && !strcmp(current->user, user)))) {
-            current->active = 1;  /* Make sure active */
-            return;
-        } else {
-            /* name and/or user don't match current: no match possible */
-        }
+    /* each list holds one kind of action, so name and user are either
+     * always or never set and the pair identifies the action */
+    key = strconcat(name ? name : "", "\x1f", user ? user : "", (char *)NULL);
+
+    current = hash_lookup(key, &l->table);
+    if (current) {
+        current->active = 1;  /* Make sure active */
+        free(key);
+        return;
     }
 
     current           = xzmalloc(sizeof(struct sync_action));
@@ -1458,6 +1462,9 @@ void sync_action_list_add(struct sync_action_list *l,
     current->user     = xstrdupnull(user);
     current->active   = 1;
 
+    hash_insert(key, current, &l->table);
+    free(key);
+
     if (l->tail)
         l->tail = l->tail->next = current;
     else
@@ -1482,6 +1489,7 @@ void sync_action_list_free(struct sync_action_list **lp)
         free(current);
         current = next;
     }
+    free_hash_table(&l->table, NULL);
     free(l);
     *lp = NULL;
 }
@@ -1824,6 +1832,87 @@ int sync_parse_response(const char *cmd, struct protstream *in,
     return IMAP_PROTOCOL_ERROR;
 }
 
+/*
+ * The GUID lookup database maps the GUID of every message this replica
+ * has been sent to the file it was stored in, so that a message which
+ * was sent for one user can be found for any other.  Entries are never
+ * trusted: a lookup links the file and checks its GUID, and entries for
+ * files which have gone away are removed then.  Nothing else removes
+ * entries here when messages are expunged; cyr_expire sweeps out the
+ * entries for files which have gone.
+ *
+ * Each GUID remembers a single location, the last one stored, so the
+ * database is only a best-effort hint: once that file has been
+ * expunged the GUID is forgotten even if other copies remain, and the
+ * message is simply uploaded again.
+ *
+ * Entries are added in batches, after each mailbox has been updated.
+ */
+static strarray_t guiddb_pending = STRARRAY_INITIALIZER;
+
+static struct db *guiddb_open(void)
+{
+    struct db *db = NULL;
+    char *fname = strconcat(config_dir, FNAME_SYNCGUIDDB, (char *)NULL);
+    int r;
+
+    r = cyrusdb_open(config_getstring(IMAPOPT_SYNC_GUID_DB),
+                     fname, CYRUSDB_CREATE, &db);
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: opening %s: %s",
+               fname, cyrusdb_strerror(r));
+        db = NULL;
+    }
+    free(fname);
+
+    return db;
+}
+
+static void guiddb_flush(void)
+{
+    struct db *db;
+    struct txn *tid = NULL;
+    int i, r = 0;
+
+    if (!guiddb_pending.count) return;
+
+    db = guiddb_open();
+    if (!db) goto done;
+
+    for (i = 0; !r && i + 1 < guiddb_pending.count; i += 2) {
+        const char *key = guiddb_pending.data[i];
+        const char *val = guiddb_pending.data[i+1];
+        r = cyrusdb_store(db, key, strlen(key), val, strlen(val), &tid);
+    }
+
+    if (r) {
+        syslog(LOG_ERR, "DBERROR: updating %s: %s",
+               FNAME_SYNCGUIDDB, cyrusdb_strerror(r));
+        if (tid) cyrusdb_abort(db, tid);
+    }
+    else if (tid) cyrusdb_commit(db, tid);
+
+    cyrusdb_close(db);
+
+done:
+    strarray_truncate(&guiddb_pending, 0);
+}
+
+/* record fname as where guid can be found, replacing any location
+ * remembered before */
+static void guiddb_add(const struct message_guid *guid, int archived,
+                       const char *fname)
+{
+    struct buf buf = BUF_INITIALIZER;
+
+    buf_printf(&buf, "%d %s", archived ? 1 : 0, fname);
+    strarray_append(&guiddb_pending, message_guid_encode(guid));
+    strarray_appendm(&guiddb_pending, buf_release(&buf));
+
+    if (guiddb_pending.count >= 2048)
+        guiddb_flush();
+}
+
 int sync_append_copyfile(struct mailbox *mailbox,
                          struct index_record *record,
                          const struct sync_annot_list *annots,
@@ -1880,6 +1969,10 @@ int sync_append_copyfile(struct mailbox *mailbox,
         return r;
     }
 
+    if (config_getswitch(IMAPOPT_SYNC_GUID_LOOKUP))
+        guiddb_add(&record->guid, record->system_flags & FLAG_ARCHIVED,
+                   destname);
+
  just_write:
     r = mailbox_append_index_record(mailbox, record);
     if (r) return r;
@@ -2293,10 +2386,86 @@ redo:
     mailbox_close(&mailbox);
 }
 
+/* find anything still needed for 'part_list' in the GUID lookup database */
+static void reserve_anywhere(const char *part,
+                             struct sync_msgid_list *part_list)
+{
+    strarray_t stale = STRARRAY_INITIALIZER;
+    struct sync_msgid *item;
+    struct db *db;
+    struct txn *tid = NULL;
+    const char *data;
+    size_t datalen;
+    int i, r;
+
+    guiddb_flush();
+
+    db = guiddb_open();
+    if (!db) return;
+
+    for (item = part_list->head; item; item = item->next) {
+        struct index_record record;
+        const char *key, *fname;
+        const char *stage_msg_path;
+        char *val;
+        int archived;
+
+        if (!part_list->toupload) break;
+        if (!item->need_upload) continue;
+
+        key = message_guid_encode(&item->guid);
+        r = cyrusdb_fetch(db, key, strlen(key), &data, &datalen, NULL);
+        if (r) continue;
+
+        val = xstrndup(data, datalen);
+        archived = (val[0] == '1');
+        fname = strchr(val, ' ');
+        if (!fname) goto stale;
+        fname++;
+
+        /* link first and check what we got, so the file can't change
+         * underneath us */
+        stage_msg_path = dlist_reserve_path(part, archived, 0, &item->guid);
+        if (mailbox_copyfile(fname, stage_msg_path, 0) != 0)
+            goto stale;
+
+        memset(&record, 0, sizeof(struct index_record));
+        if (message_parse(stage_msg_path, &record) ||
+            !message_guid_equal(&record.guid, &item->guid)) {
+            syslog(LOG_ERR, "IOERROR: GUID mismatch on parse for %s",
+                   fname);
+            unlink(stage_msg_path);
+            goto stale;
+        }
+
+        item->size = record.size;
+        item->fname = xstrdup(stage_msg_path);
+        item->is_archive = archived;
+        item->need_upload = 0;
+        part_list->toupload--;
+        free(val);
+        continue;
+
+    stale:
+        strarray_append(&stale, key);
+        free(val);
+    }
+
+    for (i = 0; i < stale.count; i++) {
+        const char *key = stale.data[i];
+        cyrusdb_delete(db, key, strlen(key), &tid, /*force*/1);
+    }
+    if (tid) cyrusdb_commit(db, tid);
+
+    cyrusdb_close(db);
+    strarray_fini(&stale);
+}
+
 int sync_apply_reserve(struct dlist *kl,
                        struct sync_reserve_list *reserve_list,
                        struct sync_state *sstate)
 {
+    uint32_t anywhere = 0;
     struct message_guid *tmpguid;
     struct sync_name_list *folder_names = sync_name_list_create();
     struct sync_msgid_list *part_list;
@@ -2347,6 +2516,11 @@ int sync_apply_reserve(struct dlist *kl,
         folder->mark = 1;
     }
 
+    /* and if the client asked, anywhere else on this server */
+    if (part_list->toupload && config_getswitch(IMAPOPT_SYNC_GUID_LOOKUP) &&
+        dlist_getnum32(kl, "ANYWHERE", &anywhere) && anywhere)
+        reserve_anywhere(partition, part_list);
+
     /* check if we missed any */
     kout = dlist_newlist(NULL, "MISSING");
     for (i = gl->head; i; i = i->next) {
@@ -2836,6 +3010,9 @@ done:
 
     mailbox_close(&mailbox);
 
+    /* after the mailbox is unlocked, so the files are already linked */
+    guiddb_flush();
+
     return r;
 }
 
@@ -4002,7 +4179,7 @@ int sync_reserve_partition(char *partition,
     struct dlist *ki;
     int r = 0;
 
-    if (!replica_folders->head)
+    if (!replica_folders->head && !CAPA(sync_be, CAPA_GUIDLOOKUP))
         return 0; /* nowhere to reserve */
 
     while (msgid) {
@@ -4018,6 +4195,10 @@ int sync_reserve_partition(char *partition,
         for (folder = replica_folders->head; folder; folder = folder->next)
             dlist_setatom(ki, "MBOXNAME", folder->name);
 
+        /* messages for one user are often already there for another */
+        if (CAPA(sync_be, CAPA_GUIDLOOKUP))
+            dlist_setnum32(kl, "ANYWHERE", 1);
+
         ki = dlist_newlist(kl, "GUID");
         for (; msgid; msgid = msgid->next) {
             if (!msgid->need_upload) continue;
@@ -5285,6 +5466,8 @@ static int update_mailbox_once(struct sync_folder *local,
     struct dlist *kl = dlist_newkvlist(NULL, cmd);
     struct dlist *kupload = dlist_newlist(NULL, "MESSAGE");
     annotate_state_t *astate = NULL;
+    int depth, inflight = 0;
+    int r2;
 
     if (local->mailbox) {
         mailbox = local->mailbox;
@@ -5362,14 +5545,28 @@ static int update_mailbox_once(struct sync_folder *local,
     if (flags & SYNC_FLAG_LOGGING)
         syslog(LOG_INFO, "%s %s", cmd, local->name);
 
-    /* upload in small(ish) blocks to avoid timeouts */
-    while (kupload->head) {
-        struct dlist *kul1 = dlist_splice(kupload, 1024);
-        sync_send_apply(kul1, sync_be->out);
-        r = sync_parse_response("MESSAGE", sync_be->in, NULL);
-        dlist_free(&kul1);
-        if (r) goto done; /* abort earlier */
+    /* upload in small(ish) blocks to avoid timeouts.  The blocks don't
+     * depend on each other, so keep up to sync_pipeline_depth of them in
+     * flight rather than waiting a round trip for each.  The replies are
+     * short, so the replica can't block writing them.  IMAP flavour
+     * connections check each reply against the last tag sent, so they
+     * wait for every reply */
+    depth = sync_be->out->userdata ? 1 : config_getint(IMAPOPT_SYNC_PIPELINE_DEPTH);
+    if (depth < 1) depth = 1;
+    while (kupload->head || inflight) {
+        if (kupload->head && !r && inflight < depth) {
+            struct dlist *kul1 = dlist_splice(kupload, 1024);
+            sync_send_apply(kul1, sync_be->out);
+            dlist_free(&kul1);
+            inflight++;
+            continue;
+        }
+        if (!inflight) break;
+        r2 = sync_parse_response("MESSAGE", sync_be->in, NULL);
+        inflight--;
+        if (r2 && !r) r = r2;
     }
+    if (r) goto done; /* abort earlier */
 
     /* close before sending the apply - all data is already read */
     if (!local->mailbox) mailbox_close(&mailbox);
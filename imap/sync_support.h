@@ -48,6 +48,7 @@
 
 #include "backend.h"
 #include "dlist.h"
+#include "hash.h"
 #include "prot.h"
 #include "seen.h"
 #include "mailbox.h"
@@ -59,6 +60,13 @@ extern struct protocol_t csync_protocol;
 #define SYNC_MESSAGE_LIST_HASH_SIZE      (65536)
 #define SYNC_MESSAGE_LIST_MAX_OPEN_FILES (64)
 
+/* csync capability: the replica can find reserved messages in any of its
+ * mailboxes, not just the ones named.  Above the IMAP capability bits, so
+ * it is never set on an IMAP flavour connection */
+#define CAPA_GUIDLOOKUP (1 << MAX_CAPA)
+
+#define FNAME_SYNCGUIDDB "/sync_guid.db"
+
 void sync_printdate(struct protstream *out, time_t time);
 time_t sync_parsedate(const char *s);
 int sync_getflags(struct dlist *kl,
@@ -394,10 +402,13 @@ struct sync_action {
 struct sync_action_list {
     struct sync_action *head, *tail;
     unsigned long count;
+    hash_table table;           /* name and user => struct sync_action */
 };
 
 struct sync_action_list *sync_action_list_create(void);
 
+/* Adding an action which is already on the list just reactivates it:
+ * this is where repeated sync log items are coalesced */
 void sync_action_list_add(struct sync_action_list *l,
                           const char *name, const char *user);
 
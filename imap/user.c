@@ -202,7 +202,7 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
 
     /* delete subscriptions */
     fname = user_hash_subs(userid);
-    (void) unlink(fname);
+    cyrusdb_unlink(config_subscription_db, fname, 0);
     free(fname);
 
     /* delete quotas */
@@ -215,7 +215,7 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
 
     /* delete conversations file */
     fname = conversations_getuserpath(userid);
-    (void) unlink(fname);
+    cyrusdb_unlink(config_conversations_db, fname, 0);
     free(fname);
 
     /* XXX: one could make an argument for keeping the counters
@@ -229,6 +229,11 @@ EXPORTED int user_deletedata(const char *userid, int wipe_user)
     (void) unlink(fname);
     free(fname);
 
+    /* delete JMAP query cache (likewise) */
+    fname = user_hash_meta(userid, "jmapquery");
+    cyrusdb_unlink(config_getstring(IMAPOPT_JMAP_QUERYCACHE_DB), fname, 0);
+    free(fname);
+
     /* delete all the search engine data (if any) */
     search_deluser(userid);
 
@@ -343,6 +348,7 @@ static int user_renamesieve(const char *olduser, const char *newuser)
 EXPORTED int user_renamedata(const char *olduser, const char *newuser)
 {
     struct rename_rock rrock;
+    char *fname;
     int i;
 
     /* get INBOXes */
@@ -368,6 +374,12 @@ EXPORTED int user_renamedata(const char *olduser, const char *newuser)
     /* move sieve scripts */
     user_renamesieve(olduser, newuser);
 
+    /* the JMAP query cache names the old mailboxes, and is rebuilt
+     * on demand anyway, so just drop it rather than move it */
+    fname = user_hash_meta(olduser, "jmapquery");
+    cyrusdb_unlink(config_getstring(IMAPOPT_JMAP_QUERYCACHE_DB), fname, 0);
+    free(fname);
+
     free(oldinbox);
     free(newinbox);
 
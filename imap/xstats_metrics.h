@@ -42,6 +42,7 @@
 X(CONV_LOAD),
 X(CONV_SAVE),
 X(CONV_GET_MODSEQ),
+X(CONV_VIEW),
 X(CONV_NEW),
 X(MSGDATA_LOAD),
 X(MESSAGE_MAP),
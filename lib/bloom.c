@@ -84,7 +84,7 @@ int bloom_init_size(struct bloom * bloom, int entries, double error,
 }
 
 
-EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
+static int bloom_setup(struct bloom * bloom, int entries, double error)
 {
   bloom->ready = 0;
 
@@ -110,6 +110,16 @@ EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
 
   bloom->hashes = (int)ceil(0.693147180559945 * bloom->bpe);  // ln(2)
 
+  return 0;
+}
+
+
+EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
+{
+  if (bloom_setup(bloom, entries, error)) {
+    return 1;
+  }
+
   bloom->bf = (unsigned char *)calloc(bloom->bytes, sizeof(unsigned char));
   if (bloom->bf == NULL) {
     return 1;
@@ -120,6 +130,31 @@ EXPORTED int bloom_init(struct bloom * bloom, int entries, double error)
 }
 
 
+EXPORTED int bloom_init_buffer(struct bloom * bloom, int entries, double error,
+                               unsigned char * bf)
+{
+  if (bloom_setup(bloom, entries, error)) {
+    return 1;
+  }
+
+  bloom->bf = bf;
+  bloom->ready = 2;
+  return 0;
+}
+
+
+EXPORTED int bloom_bytes(int entries, double error)
+{
+  struct bloom bloom;
+
+  if (bloom_setup(&bloom, entries, error)) {
+    return 0;
+  }
+
+  return bloom.bytes;
+}
+
+
 EXPORTED int bloom_check(struct bloom * bloom, const void * buffer, int len)
 {
   return bloom_check_add(bloom, buffer, len, 0);
@@ -146,7 +181,7 @@ void bloom_print(struct bloom * bloom)
 
 EXPORTED void bloom_free(struct bloom * bloom)
 {
-  if (bloom->ready) {
+  if (bloom->ready == 1) {
     free(bloom->bf);
   }
   bloom->ready = 0;
@@ -68,6 +68,30 @@ struct bloom
 int bloom_init(struct bloom * bloom, int entries, double error);
 
 
+/** ***************************************************************************
+ * Initialize the bloom filter like bloom_init(), but over a bit field
+ * supplied by the caller (for example a shared mapping of a file)
+ * rather than allocating one.  The bit field must be at least
+ * bloom_bytes(entries, error) long, and is not freed by bloom_free().
+ *
+ * Return:
+ * -------
+ *     0 - on success
+ *     1 - on failure
+ *
+ */
+int bloom_init_buffer(struct bloom * bloom, int entries, double error,
+                      unsigned char * bf);
+
+
+/** ***************************************************************************
+ * The size in bytes of the bit field for a filter with the given
+ * parameters, or 0 if they are invalid.
+ *
+ */
+int bloom_bytes(int entries, double error);
+
+
 /** ***************************************************************************
  * Deprecated, use bloom_init()
  *
@@ -43,8 +43,15 @@
 #include <config.h>
 #include <stdlib.h>
 #include <string.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#endif
 
 #include "assert.h"
+#include "bitvector.h"
 #include "charset.h"
 #include "xmalloc.h"
 #include "chartable.h"
@@ -116,6 +123,23 @@ struct search_state {
     size_t offset;
 };
 
+/* Aho-Corasick automaton over the bytes of several patterns, compiled
+ * down to a full transition table */
+struct comp_mpat {
+    int npats;
+    int nstates;
+    int *delta;         /* nstates * 256 next states */
+    int *outputs;       /* per state, offset of its list in matches */
+    int *matches;       /* -1 terminated lists of pattern numbers */
+};
+
+struct msearch_state {
+    const comp_mpat *pat;
+    int state;
+    int remaining;      /* patterns not yet found */
+    bitvector_t *found;
+};
+
 enum html_state {
     HDATA,
     HTAGOPEN,
@@ -171,6 +195,7 @@ struct charset_converter {
     int codepoint;
     int mode;
     int num_bits;
+    int asciisafe;    /* US-ASCII maps to itself in the initial table */
 
     /* ICU converter backend state */
     short flush;      /* set if conv should be flushed */
@@ -194,11 +219,16 @@ static void table_reset(struct convert_rock *rock, int to_uni);
 static void table_free(struct convert_rock *rock);
 
 typedef void convertproc_t(struct convert_rock *rock, uint32_t c);
+typedef void convertasciiproc_t(struct convert_rock *rock,
+                                const char *s, size_t len);
 typedef void freeconvert_t(struct convert_rock *rock);
 typedef void flushproc_t(struct convert_rock *rock);
 
 struct convert_rock {
     convertproc_t *f;
+    /* Optional: handle a run of 7-bit bytes at once.  The result must be
+     * the same as calling f once for every byte in the run. */
+    convertasciiproc_t *ascii;
     freeconvert_t *cleanup;
     flushproc_t *flush;
     struct convert_rock *next;
@@ -207,6 +237,9 @@ struct convert_rock {
 
 #define GROWSIZE 100
 
+/* how much input to push through a pipeline between match checks */
+#define CONVERT_BLOCKSIZE 4096
+
 int charset_debug;
 static const char *convert_name(struct convert_rock *rock);
 
@@ -314,21 +347,89 @@ static inline void convert_putc(struct convert_rock *rock, uint32_t c)
     rock->f(rock, c);
 }
 
-static void convert_cat(struct convert_rock *rock, const char *s)
+/* Return the length of the leading run of 7-bit bytes in s */
+static size_t ascii_span(const char *s, size_t len)
 {
-    while (*s) {
-        convert_putc(rock, (unsigned char)*s);
-        s++;
+    size_t i = 0;
+
+#ifdef __SSE2__
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+        if (_mm_movemask_epi8(v)) break;
     }
-    convert_flush(rock);
+#else
+    for (; i + sizeof(uint64_t) <= len; i += sizeof(uint64_t)) {
+        uint64_t w;
+        memcpy(&w, s + i, sizeof(w));
+        if (w & 0x8080808080808080ULL) break;
+    }
+#endif
+
+    while (i < len && !(s[i] & 0x80)) i++;
+
+    return i;
 }
 
-static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
+/* Pass a run of 7-bit bytes to rock, in one call if it can take them */
+static void convert_ascii(struct convert_rock *rock, const char *s, size_t len)
 {
+    if (rock->ascii) {
+        rock->ascii(rock, s, len);
+        return;
+    }
+
     while (len-- > 0) {
         convert_putc(rock, (unsigned char)*s);
         s++;
     }
+}
+
+static void byte2buffer(struct convert_rock *rock, uint32_t c);
+
+/* Feed len bytes into the pipeline.  Runs of 7-bit bytes skip the
+ * per-character path wherever the pipeline allows it. */
+static void convert_putn(struct convert_rock *rock, const char *s, size_t len)
+{
+    if (rock->f == byte2buffer && !charset_debug) {
+        /* a buffer takes any octets as they are */
+        buf_appendmap((struct buf *)rock->state, s, len);
+        return;
+    }
+
+    if (!rock->ascii || charset_debug) {
+        while (len-- > 0) {
+            convert_putc(rock, (unsigned char)*s);
+            s++;
+        }
+        return;
+    }
+
+    while (len) {
+        size_t n = ascii_span(s, len);
+
+        if (n) {
+            rock->ascii(rock, s, n);
+            s += n;
+            len -= n;
+        }
+
+        while (len && (*s & 0x80)) {
+            convert_putc(rock, (unsigned char)*s);
+            s++;
+            len--;
+        }
+    }
+}
+
+static void convert_cat(struct convert_rock *rock, const char *s)
+{
+    convert_putn(rock, s, strlen(s));
+    convert_flush(rock);
+}
+
+static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
+{
+    convert_putn(rock, s, len);
     convert_flush(rock);
 }
 
@@ -336,6 +437,9 @@ static void convert_catn(struct convert_rock *rock, const char *s, size_t len)
 static void qp_flushline(struct convert_rock *rock, int endline)
 {
     struct qp_state *s = (struct qp_state *)rock->state;
+    /* decoding never makes a line longer, except for the CRLF */
+    char out[sizeof(s->buf) + 2];
+    int n = 0;
     int i;
 
     /* strip trailing whitespace: RFC2405 transport-padding */
@@ -343,6 +447,21 @@ static void qp_flushline(struct convert_rock *rock, int endline)
         s->len--;
 
     for (i = 0; i < s->len; i++) {
+        const unsigned char *special;
+        int run;
+
+        /* copy everything up to the next encoded char in one go */
+        special = memchr(s->buf + i, '=', s->len - i);
+        run = (special ? special - s->buf : s->len) - i;
+        if (s->isheader) {
+            const unsigned char *u = memchr(s->buf + i, '_', run);
+            if (u) run = u - (s->buf + i);
+        }
+        memcpy(out + n, s->buf + i, run);
+        n += run;
+        i += run;
+        if (i >= s->len) break;
+
         switch(s->buf[i]) {
         case '=':
             if (i + 1 >= s->len) {
@@ -354,30 +473,29 @@ static void qp_flushline(struct convert_rock *rock, int endline)
                 int val1 = HEXCHAR(s->buf[i+1]);
                 int val2 = HEXCHAR(s->buf[i+2]);
                 if (val1 != XX && val2 != XX) {
-                    convert_putc(rock->next, (val1<<4) + val2);
+                    out[n++] = (val1<<4) + val2;
                     i += 2;
                     break;
                 }
             }
             /* otherwise too close to the end or invalid, just eject
              * a literal '=' and keep going */
-            convert_putc(rock->next, '=');
+            out[n++] = '=';
             break;
         case '_':
             /* underscores are space in headers */
-            convert_putc(rock->next, s->isheader ? ' ' : '_');
-            break;
-        default:
-            convert_putc(rock->next, s->buf[i]);
+            out[n++] = ' ';
             break;
         }
     }
 
     if (endline) {
-        convert_putc(rock->next, '\r');
-        convert_putc(rock->next, '\n');
+        out[n++] = '\r';
+        out[n++] = '\n';
     }
 
+    convert_putn(rock->next, out, n);
+
     s->len = 0;
 }
 
@@ -409,6 +527,123 @@ static void qp2byte(struct convert_rock *rock, uint32_t c)
     }
 }
 
+static void qp2byte_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct qp_state *s = (struct qp_state *)rock->state;
+
+    while (len) {
+        /* buffer up to the next CR or LF, exactly as qp2byte would */
+        size_t n = 0;
+
+        while (n < len && p[n] != '\r' && p[n] != '\n')
+            n++;
+
+        while (n) {
+            size_t room = 999 - s->len;
+            size_t chunk = n < room ? n : room;
+
+            memcpy(s->buf + s->len, p, chunk);
+            s->len += chunk;
+            p += chunk;
+            len -= chunk;
+            n -= chunk;
+            /* really overlength line? just flush now */
+            if (s->len > 998)
+                qp_flushline(rock, 0);
+        }
+
+        if (len) {
+            qp2byte(rock, (unsigned char)*p++);
+            len--;
+        }
+    }
+}
+
+#ifdef __SSSE3__
+/* Decode 16 base64 chars from src into 12 octets at dst, which must
+ * have room for 16.  Returns 0 without writing anything if any of the
+ * chars isn't in the base64 alphabet.  This is the nibble lookup
+ * approach of Wojciech Mula and Alfred Klomp. */
+static int b64_decode16(const char *src, unsigned char *dst)
+{
+    const __m128i lut_lo = _mm_setr_epi8(
+        0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+        0x11, 0x11, 0x13, 0x1A, 0x1B, 0x1B, 0x1B, 0x1A);
+    const __m128i lut_hi = _mm_setr_epi8(
+        0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+        0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+    const __m128i lut_roll = _mm_setr_epi8(
+        0, 16, 19, 4, -65, -65, -71, -71,
+        0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i mask_2f = _mm_set1_epi8(0x2f);
+    __m128i in, hi_nibbles, lo_nibbles, hi, lo, roll;
+
+    in = _mm_loadu_si128((const __m128i *)src);
+    hi_nibbles = _mm_and_si128(_mm_srli_epi32(in, 4), mask_2f);
+    lo_nibbles = _mm_and_si128(in, mask_2f);
+    hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+    lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+
+    /* a char is valid iff its nibble classes don't overlap */
+    if (_mm_movemask_epi8(_mm_cmpeq_epi8(_mm_and_si128(lo, hi),
+                                         _mm_setzero_si128())) != 0xffff)
+        return 0;
+
+    /* map each char to its 6-bit value */
+    roll = _mm_shuffle_epi8(lut_roll,
+                            _mm_add_epi8(_mm_cmpeq_epi8(in, mask_2f),
+                                         hi_nibbles));
+    in = _mm_add_epi8(in, roll);
+
+    /* pack 4 x 6 bits into 3 octets per 32-bit lane, then squeeze */
+    in = _mm_maddubs_epi16(in, _mm_set1_epi32(0x01400140));
+    in = _mm_madd_epi16(in, _mm_set1_epi32(0x00011000));
+    in = _mm_shuffle_epi8(in, _mm_setr_epi8(
+        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1));
+    _mm_storeu_si128((__m128i *)dst, in);
+
+    return 1;
+}
+#endif
+
+/*
+ * Decode the leading run of complete base64 quads in src into dst,
+ * which must have room for (len / 4) * 3 + 4 octets.  Stops at the
+ * first char outside the base64 alphabet (whitespace, padding...) or
+ * when less than a quad is left.  Returns the number of chars
+ * consumed and sets *outlen to the number of octets written.
+ */
+static size_t b64_decode_run(const char *src, size_t len,
+                             unsigned char *dst, size_t *outlen)
+{
+    size_t i = 0, o = 0;
+
+#ifdef __SSSE3__
+    while (len - i >= 16 && b64_decode16(src + i, dst + o)) {
+        i += 16;
+        o += 12;
+    }
+#endif
+
+    while (len - i >= 4) {
+        int a = CHAR64(src[i]);
+        int b = CHAR64(src[i+1]);
+        int c = CHAR64(src[i+2]);
+        int d = CHAR64(src[i+3]);
+
+        /* XX has bit 6 set, valid values never do */
+        if ((a | b | c | d) & 0x40) break;
+
+        dst[o++] = (a << 2) | (b >> 4);
+        dst[o++] = (b << 4) | (c >> 2);
+        dst[o++] = (c << 6) | d;
+        i += 4;
+    }
+
+    *outlen = o;
+    return i;
+}
+
 static void b64_2byte(struct convert_rock *rock, uint32_t c)
 {
     struct b64_state *s = (struct b64_state *)rock->state;
@@ -439,6 +674,31 @@ static void b64_2byte(struct convert_rock *rock, uint32_t c)
     }
 }
 
+static void b64_2byte_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct b64_state *s = (struct b64_state *)rock->state;
+    unsigned char out[(CONVERT_BLOCKSIZE / 4) * 3 + 4];
+
+    while (len) {
+        if (!s->bytesleft) {
+            /* on a quad boundary, decode whole quads in blocks */
+            size_t chunk = len < CONVERT_BLOCKSIZE ? len : CONVERT_BLOCKSIZE;
+            size_t outlen;
+            size_t n = b64_decode_run(p, chunk, out, &outlen);
+
+            if (outlen) convert_putn(rock->next, (const char *)out, outlen);
+            p += n;
+            len -= n;
+            if (n == chunk) continue;
+        }
+        /* whitespace, padding, or a quad split across calls */
+        if (len) {
+            b64_2byte(rock, (unsigned char)*p++);
+            len--;
+        }
+    }
+}
+
 /*
  * This filter unfolds folded RFC2822 header field lines, i.e. it strips
  * a CRLF pair only if the first character after the CRLF is LWS, and
@@ -481,43 +741,73 @@ static void unfold2uni(struct convert_rock *rock, uint32_t c)
     }
 }
 
+static void unfold2uni_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct unfold_state *s = (struct unfold_state *)rock->state;
+
+    while (len) {
+        if (s->state == 0) {
+            /* nothing to unfold up to the next CR */
+            const char *cr = memchr(p, '\r', len);
+            size_t n = cr ? (size_t)(cr - p) : len;
+
+            if (n) convert_ascii(rock->next, p, n);
+            p += n;
+            len -= n;
+            if (!len) break;
+        }
+        unfold2uni(rock, (unsigned char)*p++);
+        len--;
+    }
+}
+
 /*
  * Given a Unicode codepoint, emit one or more Unicode codepoints in
  * search-normalised form (having applied recursive Unicode
  * decomposition, like U+2026 HORIZONTAL ELLIPSIS to the three
  * characters U+2E U+2E U+2E).
  */
+/*
+ * Look up the search form translation of codepoint c in the xlate
+ * table.  Returns 0 if c has no translation, else sets *code.
+ */
+static int searchform_lookup(uint32_t c, int *code)
+{
+    unsigned char table16, table8;
+
+    table16 = chartables_translation_block16[(c>>16) & 0xff];
+
+    /* no translations */
+    if (table16 == 255)
+        return 0;
+
+    table8 = chartables_translation_block8[table16][(c>>8) & 0xff];
+
+    /* no translations */
+    if (table8 == 255)
+        return 0;
+
+    *code = chartables_translation[table8][c & 0xff];
+    return 1;
+}
+
 static void uni2searchform(struct convert_rock *rock, uint32_t c)
 {
     struct canon_state *s = (struct canon_state *)rock->state;
     int i;
     int code;
-    unsigned char table16, table8;
 
     if (c == U_REPLACEMENT) {
         convert_putc(rock->next, c);
         return;
     }
 
-    table16 = chartables_translation_block16[(c>>16) & 0xff];
-
-    /* no translations */
-    if (table16 == 255) {
-        convert_putc(rock->next, c);
-        return;
-    }
-
-    table8 = chartables_translation_block8[table16][(c>>8) & 0xff];
-
     /* no translations */
-    if (table8 == 255) {
+    if (!searchform_lookup(c, &code)) {
         convert_putc(rock->next, c);
         return;
     }
 
-    /* use the xlate table */
-    code = chartables_translation[table8][c & 0xff];
-
     /* case - zero length output */
     if (code == 0) {
         return;
@@ -566,6 +856,66 @@ static void uni2searchform(struct convert_rock *rock, uint32_t c)
     }
 }
 
+/* Search form of each 7-bit character: 0 to drop it, or a 7-bit
+ * replacement, or -1 if it needs the full uni2searchform treatment */
+static signed char searchform_ascii[128];
+static int searchform_ascii_ready;
+
+static void uni2searchform_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct canon_state *s = (struct canon_state *)rock->state;
+    char out[256];
+    size_t i, n = 0;
+
+    if (!searchform_ascii_ready) {
+        for (i = 0; i < 128; i++) {
+            int code;
+            if (searchform_lookup(i, &code) && code >= 0 && code < 128)
+                searchform_ascii[i] = code;
+            else
+                searchform_ascii[i] = -1;
+        }
+        searchform_ascii_ready = 1;
+    }
+
+    for (i = 0; i < len; i++) {
+        int code = searchform_ascii[(unsigned char)p[i]];
+
+        if (code < 0) {
+            if (n) convert_ascii(rock->next, out, n);
+            n = 0;
+            uni2searchform(rock, (unsigned char)p[i]);
+            continue;
+        }
+
+        /* case - zero length output */
+        if (code == 0)
+            continue;
+
+        /* same whitespace rules as uni2searchform */
+        if (code == ' ' || code == '\r' || code == '\n') {
+            if (s->flags & CHARSET_SKIPSPACE)
+                continue;
+            if (s->flags & CHARSET_MERGESPACE) {
+                if (s->seenspace)
+                    continue;
+                s->seenspace = 1;
+                code = ' ';
+            }
+        }
+        else
+            s->seenspace = 0;
+
+        out[n++] = code;
+        if (n == sizeof(out)) {
+            convert_ascii(rock->next, out, n);
+            n = 0;
+        }
+    }
+
+    if (n) convert_ascii(rock->next, out, n);
+}
+
 /*
  * Given a Unicode codepoint, emit one or more Unicode codepoints in
  * HTML form, suitable for generating search snippets.
@@ -661,6 +1011,58 @@ static void byte2search(struct convert_rock *rock, uint32_t c)
     s->offset++;
 }
 
+static void byte2search_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct search_state *s = (struct search_state *)rock->state;
+
+    /* once we've matched, the rest of the input doesn't matter */
+    while (len && !s->havematch) {
+        if (s->max_start && s->starts[0] == -1) {
+            /* no match in progress, skip to the next possible start */
+            const char *hit = memchr(p, s->substr[0], len);
+            size_t skip = hit ? (size_t)(hit - p) : len;
+
+            s->offset += skip;
+            p += skip;
+            len -= skip;
+            if (!len) break;
+        }
+        byte2search(rock, (unsigned char)*p++);
+        len--;
+    }
+}
+
+static inline void msearch_step(struct msearch_state *s, unsigned char b)
+{
+    const int *m;
+
+    s->state = s->pat->delta[s->state * 256 + b];
+
+    for (m = s->pat->matches + s->pat->outputs[s->state]; *m >= 0; m++) {
+        if (!bv_isset(s->found, *m)) {
+            bv_set(s->found, *m);
+            s->remaining--;
+        }
+    }
+}
+
+static void byte2msearch(struct convert_rock *rock, uint32_t c)
+{
+    struct msearch_state *s = (struct msearch_state *)rock->state;
+
+    /* same octet as byte2search looks at */
+    msearch_step(s, (unsigned char)c);
+}
+
+static void byte2msearch_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct msearch_state *s = (struct msearch_state *)rock->state;
+
+    /* once we've found everything, the rest of the input doesn't matter */
+    while (len-- && s->remaining > 0)
+        msearch_step(s, (unsigned char)*p++);
+}
+
 /* Given an octet, append it to a buffer */
 static void byte2buffer(struct convert_rock *rock, uint32_t c)
 {
@@ -669,6 +1071,13 @@ static void byte2buffer(struct convert_rock *rock, uint32_t c)
     buf_putc(buf, c & 0xff);
 }
 
+static void byte2buffer_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct buf *buf = (struct buf *)rock->state;
+
+    buf_appendmap(buf, p, len);
+}
+
 /* Given an octet c and an icu converter, convert c to
  * its Unicode codepoint. During a flush, c is ignored.
  */
@@ -891,6 +1300,19 @@ emit_replacement:
     }
 }
 
+static void utf8_2uni_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct charset_converter *s = (struct charset_converter *)rock->state;
+
+    /* plain ASCII chars, exactly as in utf8_2uni */
+    if (s->bytesleft)       /* incomplete sequence */
+        convert_putc(rock->next, U_REPLACEMENT);
+    s->bytesleft = 0;
+    s->codepoint = 0;
+
+    convert_ascii(rock->next, p, len);
+}
+
 /* Given a Unicode codepoint, emit valid UTF-8 encoded octets */
 static void uni2utf8(struct convert_rock *rock, uint32_t c)
 {
@@ -921,6 +1343,11 @@ static void uni2utf8(struct convert_rock *rock, uint32_t c)
     }
 }
 
+static void uni2utf8_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    convert_ascii(rock->next, p, len);
+}
+
 /* Given an octet which is a codepoint in some 7bit or 8bit character
  * set, or the Unicode replacement character, emit the corresponding
  * Unicode codepoint. */
@@ -942,6 +1369,26 @@ static void table2uni(struct convert_rock *rock, uint32_t c)
     s->curtable = s->initialtable + map->next;
 }
 
+static void table2uni_ascii(struct convert_rock *rock, const char *p, size_t len)
+{
+    struct charset_converter *s = (struct charset_converter *)rock->state;
+
+    while (len) {
+        if (s->asciisafe && s->curtable == s->initialtable) {
+            /* NUL is the only 7-bit char the table may not pass through */
+            const char *nul = memchr(p, 0, len);
+            size_t n = nul ? (size_t)(nul - p) : len;
+
+            if (n) convert_ascii(rock->next, p, n);
+            p += n;
+            len -= n;
+            if (!len) break;
+        }
+        table2uni(rock, (unsigned char)*p++);
+        len--;
+    }
+}
+
 /*
  * The HTML5 standard mandates that certain Unicode code points
  * cannot be generated using &#nnn; numerical character references,
@@ -1500,6 +1947,7 @@ static const char *convert_name(struct convert_rock *rock)
     if (rock->f == b64_2byte) return "b64_2byte";
     if (rock->f == byte2buffer) return "byte2buffer";
     if (rock->f == byte2search) return "byte2search";
+    if (rock->f == byte2msearch) return "byte2msearch";
     if (rock->f == qp2byte) return "qp2byte";
     if (rock->f == striphtml2uni) return "striphtml2uni";
     if (rock->f == unfold2uni) return "unfold2uni";
@@ -1581,6 +2029,7 @@ static void icu_reset(struct convert_rock *rock, int to_uni)
     s->src_next = s->src_base;
 
     rock->f = to_uni ? icu2uni : uni2icu;
+    rock->ascii = NULL;
     rock->flush = icu_flush;
     rock->cleanup = icu_free;
 }
@@ -1594,18 +2043,33 @@ static void table_reset(struct convert_rock *rock, int to_uni)
 {
     struct charset_converter *s = (struct charset_converter *)rock->state;
 
+    s->asciisafe = 0;
     if (chartables_charset_table[s->num].table) {
+        int c;
+
         s->initialtable = chartables_charset_table[s->num].table;
         s->curtable = s->initialtable;
+
+        /* can runs of 7-bit chars pass straight through? */
+        s->asciisafe = 1;
+        for (c = 1; c < 128; c++) {
+            const struct charmap *map = &s->initialtable[0][c];
+            if (map->c != (unsigned) c || map->next != 0) {
+                s->asciisafe = 0;
+                break;
+            }
+        }
     }
     if (strstr(chartables_charset_table[s->num].name, "utf-8")) {
         rock->f = to_uni ? utf8_2uni : uni2utf8;
+        rock->ascii = to_uni ? utf8_2uni_ascii : uni2utf8_ascii;
     } else {
         /* A truly table-based converter may never convert from Unicode
          * to its charmap. This has been implicitly assumed in the existing
          * code, but let's be explicit here. */
         assert(to_uni);
         rock->f = table2uni;
+        rock->ascii = table2uni_ascii;
     }
     s->bytesleft = 0;
     s->codepoint = 0;
@@ -1696,6 +2160,7 @@ static struct convert_rock *qp_init(int isheader, struct convert_rock *next)
     s->isheader = isheader;
     rock->state = (void *)s;
     rock->f = qp2byte;
+    rock->ascii = qp2byte_ascii;
     rock->flush = qp_flush;
     rock->next = next;
     return rock;
@@ -1706,6 +2171,7 @@ static struct convert_rock *b64_init(struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     rock->state = xzmalloc(sizeof(struct b64_state));
     rock->f = b64_2byte;
+    rock->ascii = b64_2byte_ascii;
     rock->next = next;
     return rock;
 }
@@ -1717,6 +2183,7 @@ static struct convert_rock *unfold_init(int skipws, struct convert_rock *next)
     s->skipws = skipws;
     rock->state = s;
     rock->f = unfold2uni;
+    rock->ascii = unfold2uni_ascii;
     rock->next = next;
     return rock;
 }
@@ -1726,10 +2193,13 @@ static struct convert_rock *canon_init(int flags, struct convert_rock *next)
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     struct canon_state *s = xzmalloc(sizeof(struct canon_state));
     s->flags = flags;
-    if ((flags & CHARSET_SNIPPET))
+    if ((flags & CHARSET_SNIPPET)) {
         rock->f = uni2html;
-    else
+    }
+    else {
         rock->f = uni2searchform;
+        rock->ascii = uni2searchform_ascii;
+    }
     rock->state = s;
     rock->next = next;
     return rock;
@@ -1757,6 +2227,33 @@ static struct convert_rock *convert_init(struct charset_converter *s,
     return rock;
 }
 
+static struct convert_rock *msearch_init(const comp_mpat *pat, bitvector_t *found)
+{
+    struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
+    struct msearch_state *s = xzmalloc(sizeof(struct msearch_state));
+    int i;
+
+    s->pat = pat;
+    s->found = found;
+    bv_setsize(found, pat->npats);
+    for (i = 0; i < pat->npats; i++) {
+        if (!bv_isset(found, i))
+            s->remaining++;
+    }
+
+    rock->f = byte2msearch;
+    rock->ascii = byte2msearch_ascii;
+    rock->state = (void *)s;
+
+    return rock;
+}
+
+static inline int msearch_done(struct convert_rock *rock)
+{
+    struct msearch_state *s = (struct msearch_state *)rock->state;
+    return s->remaining <= 0;
+}
+
 static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
     struct convert_rock *rock = xzmalloc(sizeof(struct convert_rock));
     struct search_state *s = xzmalloc(sizeof(struct search_state));
@@ -1776,6 +2273,7 @@ static struct convert_rock *search_init(const char *substr, comp_pat *pat) {
 
     /* set up the rock */
     rock->f = byte2search;
+    rock->ascii = byte2search_ascii;
     rock->cleanup = search_free;
     rock->state = (void *)s;
 
@@ -1790,6 +2288,7 @@ static struct convert_rock *buffer_init(size_t hint)
     if (hint) buf_ensure(buf, hint);
 
     rock->f = byte2buffer;
+    rock->ascii = byte2buffer_ascii;
     rock->cleanup = buffer_free;
     rock->state = (void *)buf;
 
@@ -2163,6 +2662,68 @@ EXPORTED int charset_decode(struct buf *dst, const char *src, size_t len, int en
     return 0;
 }
 
+struct charset_decoder {
+    struct convert_rock *input;
+};
+
+/* Start decoding a body in the given encoding into buffer dst */
+EXPORTED charset_decoder *charset_decoder_new(int encoding, struct buf *dst)
+{
+    struct convert_rock *input;
+    charset_decoder *dec;
+
+    /* set up the conversion path */
+    input = buffer_init(0);
+    buffer_setbuf(input, dst);
+
+    switch (encoding) {
+    case ENCODING_NONE:
+        break;
+
+    case ENCODING_QP:
+        input = qp_init(0, input);
+        break;
+
+    case ENCODING_BASE64:
+        input = b64_init(input);
+        break;
+
+    default:
+        convert_free(input);
+        return NULL;
+    }
+
+    dec = xzmalloc(sizeof(charset_decoder));
+    dec->input = input;
+
+    return dec;
+}
+
+/* Decode the next len bytes of the body, appending to the buffer.
+ * A partial line or quad is held back until more input arrives. */
+EXPORTED void charset_decoder_write(charset_decoder *dec,
+                                    const char *src, size_t len)
+{
+    convert_putn(dec->input, src, len);
+}
+
+/* Decode whatever was held back at the end of the body */
+EXPORTED void charset_decoder_flush(charset_decoder *dec)
+{
+    convert_flush(dec->input);
+}
+
+EXPORTED void charset_decoder_free(charset_decoder **decp)
+{
+    charset_decoder *dec = *decp;
+
+    if (!dec) return;
+
+    convert_free(dec->input);
+    free(dec);
+    *decp = NULL;
+}
+
 static void mimeheader_cat(struct convert_rock *target, const char *s, int flags)
 {
     struct convert_rock *input, *unfold;
@@ -2444,6 +3005,32 @@ EXPORTED int charset_search_mimeheader(const char *substr, comp_pat *pat,
     return res;
 }
 
+/*
+ * Search the MIME header 's' for all the patterns in 'pat', as
+ * charset_searchfile_mpat() does for a body part.
+ */
+EXPORTED int charset_search_mimeheader_mpat(const comp_mpat *pat,
+                                            bitvector_t *found,
+                                            const char *s, int flags)
+{
+    struct convert_rock *input, *tosearch;
+    int res;
+    charset_t utf8 = charset_lookupname("utf-8");
+
+    tosearch = msearch_init(pat, found);
+    input = convert_init(utf8, 0/*to_uni*/, tosearch);
+    input = canon_init(flags, input);
+
+    mimeheader_cat(input, s, flags);
+
+    res = msearch_done(tosearch);
+
+    convert_free(input);
+    charset_free(&utf8);
+
+    return res;
+}
+
 /* Compile a search pattern for later comparison.  We just count
  * how long the string is, and how many times the first character
  * occurs.  Later optimisation could reduce the max_start by
@@ -2471,6 +3058,120 @@ EXPORTED void charset_freepat(comp_pat *pat)
     free((struct comp_pat_s *)pat);
 }
 
+/*
+ * Compile the strings in 'pats', which must already be in search
+ * normal form, into a single Aho-Corasick automaton which finds all
+ * of them in one pass over the text.  Patterns are numbered by their
+ * index in 'pats'.  Empty patterns are never found.
+ */
+EXPORTED comp_mpat *charset_compile_mpat(const strarray_t *pats)
+{
+    comp_mpat *pat = xzmalloc(sizeof(comp_mpat));
+    int maxstates = 1;
+    int *fail, *queue, *ownfirst, *ownnext;
+    int nmatches = 0, allocmatches = 0;
+    int head = 0, tail = 0;
+    int i, c;
+
+    pat->npats = strarray_size(pats);
+    for (i = 0; i < pat->npats; i++)
+        maxstates += strlen(strarray_nth(pats, i));
+
+    pat->delta = xmalloc(maxstates * 256 * sizeof(int));
+    for (c = 0; c < 256; c++)
+        pat->delta[c] = -1;
+    pat->nstates = 1;
+
+    /* build the trie, remembering which patterns end in each state */
+    ownfirst = xmalloc(maxstates * sizeof(int));
+    ownnext = xmalloc((pat->npats + 1) * sizeof(int));
+    ownfirst[0] = -1;
+    for (i = 0; i < pat->npats; i++) {
+        const unsigned char *p = (const unsigned char *)strarray_nth(pats, i);
+        int state = 0;
+
+        if (!*p) continue;
+
+        for ( ; *p ; p++) {
+            int *next = &pat->delta[state * 256 + *p];
+            if (*next < 0) {
+                *next = pat->nstates++;
+                for (c = 0; c < 256; c++)
+                    pat->delta[*next * 256 + c] = -1;
+                ownfirst[*next] = -1;
+            }
+            state = *next;
+        }
+        ownnext[i] = ownfirst[state];
+        ownfirst[state] = i;
+    }
+
+    /* breadth first, turn the trie into a DFA by following each
+     * state's failure link for the transitions it doesn't have */
+    fail = xzmalloc(pat->nstates * sizeof(int));
+    queue = xmalloc(pat->nstates * sizeof(int));
+    queue[tail++] = 0;
+    while (head < tail) {
+        int state = queue[head++];
+        for (c = 0; c < 256; c++) {
+            int *next = &pat->delta[state * 256 + c];
+            if (*next < 0) {
+                *next = state ? pat->delta[fail[state] * 256 + c] : 0;
+            }
+            else {
+                fail[*next] = state ? pat->delta[fail[state] * 256 + c] : 0;
+                queue[tail++] = *next;
+            }
+        }
+    }
+
+    /* each state outputs its own patterns plus those of its failure
+     * state, which being shallower has already been done */
+    pat->outputs = xmalloc(pat->nstates * sizeof(int));
+    for (head = 0; head < tail; head++) {
+        int state = queue[head];
+        int inherit = state ? pat->outputs[fail[state]] : -1;
+        int n = 1;  /* the terminator */
+
+        for (i = ownfirst[state]; i >= 0; i = ownnext[i]) n++;
+        if (inherit >= 0) {
+            for (i = inherit; pat->matches[i] >= 0; i++) n++;
+        }
+        if (nmatches + n > allocmatches) {
+            allocmatches = (nmatches + n) * 2;
+            pat->matches = xrealloc(pat->matches, allocmatches * sizeof(int));
+        }
+
+        pat->outputs[state] = nmatches;
+        for (i = ownfirst[state]; i >= 0; i = ownnext[i])
+            pat->matches[nmatches++] = i;
+        if (inherit >= 0) {
+            for (i = inherit; pat->matches[i] >= 0; i++)
+                pat->matches[nmatches++] = pat->matches[i];
+        }
+        pat->matches[nmatches++] = -1;
+    }
+
+    free(fail);
+    free(queue);
+    free(ownfirst);
+    free(ownnext);
+
+    return pat;
+}
+
+/*
+ * Free the compiled multi-pattern 'pat'
+ */
+EXPORTED void charset_free_mpat(comp_mpat *pat)
+{
+    if (!pat) return;
+    free(pat->delta);
+    free(pat->outputs);
+    free(pat->matches);
+    free(pat);
+}
+
 /*
  * Search for the string 'substr', with compiled pattern 'pat'
  * in the string 's', with length 'len'.  Return nonzero if match
@@ -2500,9 +3201,12 @@ EXPORTED int charset_searchstring(const char *substr, comp_pat *pat,
     input = convert_init(utf8from, 1/*to_uni*/, input);
 
     /* feed the handler */
-    while (len-- > 0) {
-        convert_putc(input, (unsigned char)*s++);
+    while (len > 0) {
+        size_t n = len < CONVERT_BLOCKSIZE ? len : CONVERT_BLOCKSIZE;
+        convert_putn(input, s, n);
         if (search_havematch(tosearch)) break; /* shortcut if there's a match */
+        s += n;
+        len -= n;
     }
 
     /* copy the value */
@@ -2569,9 +3273,10 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
         return 0;
     }
 
-    /* implement the loop here so we can check on the search each time */
-    for (i = 0; i < len; i++) {
-        convert_putc(input, (unsigned char)msg_base[i]);
+    /* implement the loop here so we can check on the search each block */
+    for (i = 0; i < len; i += CONVERT_BLOCKSIZE) {
+        size_t n = len - i < CONVERT_BLOCKSIZE ? len - i : CONVERT_BLOCKSIZE;
+        convert_putn(input, msg_base + i, n);
         if (search_havematch(tosearch)) break;
     }
 
@@ -2583,6 +3288,65 @@ EXPORTED int charset_searchfile(const char *substr, comp_pat *pat,
     return res;
 }
 
+/*
+ * Search for all the patterns in 'pat' in the next 'len' bytes of
+ * 'msg_base', setting the bit in 'found' for each one seen.  Bits
+ * already set in 'found' are left alone.  'charset' and 'encoding' are
+ * as for charset_searchfile().  Returns nonzero iff every pattern has
+ * now been found.
+ */
+EXPORTED int charset_searchfile_mpat(const comp_mpat *pat, bitvector_t *found,
+                                     const char *msg_base, size_t len,
+                                     charset_t charset, int encoding, int flags)
+{
+    struct convert_rock *input, *tosearch;
+    size_t i;
+    int res;
+    charset_t utf8;
+
+    /* Initialize character set mapping */
+    if (charset == CHARSET_UNKNOWN_CHARSET) return 0;
+
+    /* set up the conversion path */
+    utf8 = charset_lookupname("utf-8");
+    tosearch = msearch_init(pat, found);
+    input = convert_init(utf8, 0/*to_uni*/, tosearch);
+    input = canon_init(flags, input);
+    input = convert_init(charset, 1/*to_uni*/, input);
+
+    /* choose encoding extraction if needed */
+    switch (encoding) {
+    case ENCODING_NONE:
+        break;
+
+    case ENCODING_QP:
+        input = qp_init(0, input);
+        break;
+
+    case ENCODING_BASE64:
+        input = b64_init(input);
+        break;
+
+    default:
+        /* Don't know encoding--nothing can match */
+        convert_free(input);
+        charset_free(&utf8);
+        return 0;
+    }
+
+    for (i = 0; i < len && !msearch_done(tosearch); i += CONVERT_BLOCKSIZE) {
+        size_t n = len - i < CONVERT_BLOCKSIZE ? len - i : CONVERT_BLOCKSIZE;
+        convert_putn(input, msg_base + i, n);
+    }
+
+    res = msearch_done(tosearch); /* copy before we free it */
+
+    convert_free(input);
+    charset_free(&utf8);
+
+    return res;
+}
+
 /* This is based on charset_searchfile above. */
 EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
                              void *rock,
@@ -2646,8 +3410,10 @@ EXPORTED int charset_extract(void (*cb)(const struct buf *, void *),
     /* point to the buffer for easy block sending */
     out = (struct buf *)tobuffer->state;
 
-    for (i = 0; i < data->len; i++) {
-        convert_putc(input, (unsigned char)data->s[i]);
+    for (i = 0; i < data->len; i += CONVERT_BLOCKSIZE) {
+        size_t n = data->len - i < CONVERT_BLOCKSIZE ?
+                   data->len - i : CONVERT_BLOCKSIZE;
+        convert_putn(input, data->s + i, n);
 
         /* process a block of output every so often */
         if (buf_len(out) > 4096) {
@@ -60,9 +60,12 @@
 
 #include "unicode/ucnv.h"
 
+#include "bitvector.h"
+#include "strarray.h"
 #include "util.h"
 
 typedef int comp_pat;
+typedef struct comp_mpat comp_mpat;
 /*
  * Charset identifies a character encoding.
  * Use charset_lookupname to create an instance, and release it
@@ -100,6 +103,16 @@ extern int charset_searchstring(const char *substr, comp_pat *pat,
 extern int charset_searchfile(const char *substr, comp_pat *pat,
                               const char *msg_base, size_t len,
                               charset_t charset, int encoding, int flags);
+
+/* Find several search-form patterns in one pass over the text */
+extern comp_mpat *charset_compile_mpat(const strarray_t *pats);
+extern void charset_free_mpat(comp_mpat *pat);
+extern int charset_searchfile_mpat(const comp_mpat *pat, bitvector_t *found,
+                                   const char *msg_base, size_t len,
+                                   charset_t charset, int encoding, int flags);
+extern int charset_search_mimeheader_mpat(const comp_mpat *pat,
+                                          bitvector_t *found,
+                                          const char *s, int flags);
 extern const char *charset_decode_mimebody(const char *msg_base, size_t len,
                                            int encoding, char **retval,
                                            size_t *outlen);
@@ -119,6 +132,17 @@ extern char *charset_unfold(const char *s, size_t len, int flags);
 
 extern int charset_decode(struct buf *dst, const char *src, size_t len, int encoding);
 
+/* Decode a body a piece at a time: the decoded bytes of each piece are
+   appended to dst, which the caller may consume and reset in between,
+   and charset_decoder_flush() completes the body.
+   Returns NULL for an unknown encoding. */
+typedef struct charset_decoder charset_decoder;
+extern charset_decoder *charset_decoder_new(int encoding, struct buf *dst);
+extern void charset_decoder_write(charset_decoder *dec,
+                                  const char *src, size_t len);
+extern void charset_decoder_flush(charset_decoder *dec);
+extern void charset_decoder_free(charset_decoder **decp);
+
 /* Extract the body text for the message denoted by 'uid', convert its
    text to the canonical form for searching, and pass the converted text
    down in a series of invocations of the callback 'cb'.  This is
@@ -40,6 +40,7 @@
  */
 
 #include <config.h>
+#include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
@@ -62,6 +63,7 @@
 
 /* Note that some of these may be undefined symbols
  * if libcyrus was not built with support for them */
+extern struct cyrusdb_backend cyrusdb_blockdb;
 extern struct cyrusdb_backend cyrusdb_flat;
 extern struct cyrusdb_backend cyrusdb_skiplist;
 extern struct cyrusdb_backend cyrusdb_quotalegacy;
@@ -69,6 +71,7 @@ extern struct cyrusdb_backend cyrusdb_sql;
 extern struct cyrusdb_backend cyrusdb_twoskip;
 
 static struct cyrusdb_backend *_backends[] = {
+    &cyrusdb_blockdb,
     &cyrusdb_flat,
     &cyrusdb_skiplist,
     &cyrusdb_quotalegacy,
@@ -80,6 +83,9 @@ static struct cyrusdb_backend *_backends[] = {
 
 #define DEFAULT_BACKEND "twoskip"
 
+static cyrusdb_checkpoint_hook *checkpoint_hook = NULL;
+static cyrusdb_bloom_hook *bloom_hook = NULL;
+
 struct db {
     struct dbengine *engine;
     struct cyrusdb_backend *backend;
@@ -226,6 +232,26 @@ EXPORTED int cyrusdb_fetchnext(struct db *db,
                                   data, datalen, mytid);
 }
 
+EXPORTED int cyrusdb_fetchmany(struct db *db,
+                 const struct buf *keys, size_t nkeys,
+                 foreach_cb *cb, void *rock,
+                 struct txn **mytid)
+{
+    size_t i;
+    int r = 0;
+
+    if (db->backend->fetchmany)
+        return db->backend->fetchmany(db->engine, keys, nkeys,
+                                      cb, rock, mytid);
+
+    for (i = 0; i < nkeys; i++) {
+        r = cyrusdb_forone(db, keys[i].s, keys[i].len, NULL, cb, rock, mytid);
+        if (r) break;
+    }
+
+    return r;
+}
+
 EXPORTED int cyrusdb_foreach(struct db *db,
                const char *prefix, size_t prefixlen,
                foreach_p *p,
@@ -323,6 +349,28 @@ EXPORTED int cyrusdb_compar(struct db *db,
     return db->backend->compar(db->engine, a, alen, b, blen);
 }
 
+EXPORTED void cyrusdb_set_checkpoint_hook(cyrusdb_checkpoint_hook *hook)
+{
+    checkpoint_hook = hook;
+}
+
+HIDDEN void cyrusdb_checkpoint_done(const char *fname, double pause)
+{
+    if (checkpoint_hook) checkpoint_hook(fname, pause);
+}
+
+EXPORTED void cyrusdb_set_bloom_hook(cyrusdb_bloom_hook *hook)
+{
+    bloom_hook = hook;
+}
+
+HIDDEN void cyrusdb_bloom_stats(const char *fname, unsigned long checks,
+                                unsigned long negatives,
+                                unsigned long false_positives)
+{
+    if (bloom_hook) bloom_hook(fname, checks, negatives, false_positives);
+}
+
 /**********************************************/
 
 EXPORTED void cyrusdb_init(void)
@@ -353,9 +401,66 @@ EXPORTED void cyrusdb_done(void)
     }
 }
 
+/* Files some backends keep beside the database, which go wherever it
+ * goes: the twoskip group commit lock and bloom filter, and the
+ * blockdb checkpoint lock.  They are all made again when missing. */
+static const char * const sidecars[] = { ".group", ".bloom", ".CHECKPOINT" };
+#define NSIDECARS (sizeof(sidecars) / sizeof(sidecars[0]))
+
+static void sidecar_name(char *buf, size_t len, const char *fname, size_t i)
+{
+    snprintf(buf, len, "%s%s", fname, sidecars[i]);
+}
+
+/* none of what was beside a database we've just replaced holds */
+static void unlink_sidecars(const char *fname)
+{
+    char buf[1024];
+    size_t i;
+
+    for (i = 0; i < NSIDECARS; i++) {
+        sidecar_name(buf, sizeof(buf), fname, i);
+        unlink(buf);
+    }
+}
+
 EXPORTED int cyrusdb_copyfile(const char *srcname, const char *dstname)
 {
-    return cyrus_copyfile(srcname, dstname, COPYFILE_NOLINK);
+    int r = cyrus_copyfile(srcname, dstname, COPYFILE_NOLINK);
+
+    if (!r) unlink_sidecars(dstname);
+
+    return r;
+}
+
+EXPORTED int cyrusdb_unlinkfile(const char *fname)
+{
+    int r = unlink(fname);
+    int saved_errno = errno;
+
+    unlink_sidecars(fname);
+
+    errno = saved_errno;
+    return r;
+}
+
+EXPORTED int cyrusdb_renamefile(const char *oldname, const char *newname)
+{
+    char oldbuf[1024], newbuf[1024];
+    size_t i;
+    int r;
+
+    r = rename(oldname, newname);
+    if (r) return r;
+
+    /* and not leave any old ones at the new name */
+    for (i = 0; i < NSIDECARS; i++) {
+        sidecar_name(oldbuf, sizeof(oldbuf), oldname, i);
+        sidecar_name(newbuf, sizeof(newbuf), newname, i);
+        if (rename(oldbuf, newbuf) < 0) unlink(newbuf);
+    }
+
+    return 0;
 }
 
 struct db_rock {
@@ -546,6 +651,9 @@ EXPORTED const char *cyrusdb_detect(const char *fname)
     if (!strncmp(buf, "\241\002\213\015twoskip file\0\0\0\0", 16))
         return "twoskip";
 
+    if (!strncmp(buf, "\241\002\213\015blockdb file\0\0\0\0", 16))
+        return "blockdb";
+
     /* unable to detect SQLite databases or flat files explicitly here */
     return NULL;
 }
@@ -650,7 +758,7 @@ HIDDEN int cyrusdb_generic_noarchive(const strarray_t *fnames __attribute__((unu
 HIDDEN int cyrusdb_generic_unlink(const char *fname, int flags __attribute__((unused)))
 {
     if (fname)
-        unlink(fname);
+        cyrusdb_unlinkfile(fname);
     /* XXX - check that it exists unless FORCE flag? */
     return 0;
 }
@@ -90,6 +90,7 @@ typedef int cyrusdb_archiver(const strarray_t *fnames,
                              const char *dirname);
 
 struct dbengine;
+struct buf;
 
 struct cyrusdb_backend {
     const char *name;
@@ -164,6 +165,16 @@ struct cyrusdb_backend {
                  const char **data, size_t *datalen,
                  struct txn **mytid);
 
+    /* fetchmany: look up 'nkeys' keys in one pass, and call 'cb' for
+       each one which exists, in order, just as foreach would.  Keys
+       should be sorted by compar(); out of order keys are still found,
+       but cost a full search each.  May be NULL, in which case
+       cyrusdb_fetchmany() fetches each key in turn */
+    int (*fetchmany)(struct dbengine *mydb,
+                     const struct buf *keys, size_t nkeys,
+                     foreach_cb *cb, void *rock,
+                     struct txn **mytid);
+
     /* foreach: iterate through entries that start with 'prefix'
        if 'p' is NULL (always true) or returns true, call 'cb'
 
@@ -225,6 +236,12 @@ struct cyrusdb_backend {
 
 extern int cyrusdb_copyfile(const char *srcname, const char *dstname);
 
+/* remove or rename a database file along with the files its backend
+ * keeps beside it, returning like unlink(2) and rename(2) do for the
+ * database itself */
+extern int cyrusdb_unlinkfile(const char *fname);
+extern int cyrusdb_renamefile(const char *oldname, const char *newname);
+
 extern int cyrusdb_convert(const char *fromfname, const char *tofname,
                            const char *frombackend, const char *tobackend);
 
@@ -266,6 +283,10 @@ extern int cyrusdb_fetchnext(struct db *db,
                              const char **found, size_t *foundlen,
                              const char **data, size_t *datalen,
                              struct txn **mytid);
+extern int cyrusdb_fetchmany(struct db *db,
+                             const struct buf *keys, size_t nkeys,
+                             foreach_cb *cb, void *rock,
+                             struct txn **mytid);
 extern int cyrusdb_foreach(struct db *db,
                            const char *prefix, size_t prefixlen,
                            foreach_p *p,
@@ -305,6 +326,23 @@ extern int cyrusdb_canfetchnext(const char *backend);
 
 extern strarray_t *cyrusdb_backends(void);
 
+/* statistics: called after each checkpoint, with the number of
+ * seconds other processes were locked out of the database */
+typedef void cyrusdb_checkpoint_hook(const char *fname, double pause);
+extern void cyrusdb_set_checkpoint_hook(cyrusdb_checkpoint_hook *hook);
+void cyrusdb_checkpoint_done(const char *fname, double pause);
+
+/* statistics: called now and then with the number of fetches checked
+ * against a bloom filter since last time, how many of those it showed
+ * to be missing, and how many it let through which were missing anyway */
+typedef void cyrusdb_bloom_hook(const char *fname, unsigned long checks,
+                                unsigned long negatives,
+                                unsigned long false_positives);
+extern void cyrusdb_set_bloom_hook(cyrusdb_bloom_hook *hook);
+void cyrusdb_bloom_stats(const char *fname, unsigned long checks,
+                         unsigned long negatives,
+                         unsigned long false_positives);
+
 /* generic implementations */
 int cyrusdb_generic_init(const char *dbdir, int myflags);
 int cyrusdb_generic_done(void);
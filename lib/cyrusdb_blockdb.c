@@ -0,0 +1,2753 @@
+/* cyrusdb_blockdb.c - sorted, prefix compressed blocks plus a change log
+ *
+ * Copyright (c) 1994-2008 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <errno.h>
+#include <limits.h>
+#include <stdlib.h>
+#include <string.h>
+#include <syslog.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#include "assert.h"
+#include "bsearch.h"
+#include "byteorder64.h"
+#include "cyrusdb.h"
+#include "crc32.h"
+#include "cyr_lock.h"
+#include "mappedfile.h"
+#include "util.h"
+#include "xmalloc.h"
+
+/*
+ * blockdb disk format.
+ *
+ * GOALS:
+ *  a) small files for keys with long common prefixes
+ *  b) few pages touched by a lookup or a foreach
+ *  c) integrity checks throughout
+ *
+ * ACHIEVED BY:
+ *  a)
+ *   - records are packed in key order into blocks of about
+ *     BLOCKSIZE bytes, and each key only stores the bytes it
+ *     doesn't share with the key before it in the same block.
+ *  b)
+ *   - the first key of each block goes into an index, which is
+ *     read into memory once per generation.  A lookup is a binary
+ *     search over the index and a scan of a single block, and a
+ *     foreach reads the blocks in file order.
+ *  c)
+ *   - a crc32 on the header, each block, the index and each
+ *     committed transaction.
+ *
+ * The blocks are never rewritten in place.  Changes are appended
+ * to a log after the index.  Once more than TAILSIZE bytes of the
+ * log are unsorted, the committer writes a RUN: the latest change
+ * to each key since the previous run, sorted, as fixed size entries
+ * pointing back into the log.  A new run takes in the runs before it
+ * while they are no bigger than it is, so each run is more than
+ * twice the size of the next newer one and there are only ever a
+ * few of them.  A process only has to read the log after the newest
+ * run, which it keeps in a sorted in-memory skiplist and catches up
+ * with every time it takes a lock, so opening the database costs the
+ * same however long the log has grown.
+ *
+ * Lookups try the skiplist, then the runs from newest to oldest, and
+ * fall back to the blocks; foreach merges them all.
+ *
+ * Once the log is more than 1/REWRITE_RATIO the size of the blocks,
+ * the committer writes the merged contents into a new file with a
+ * new generation and renames it into place, just like twoskip's
+ * checkpoint.  Like twoskip, the copy is made without holding the
+ * write lock, from the state of the file when it started: the blocks
+ * and the log up to there never change.  Then the checkpointer takes
+ * the write lock, appends the transactions committed meanwhile to
+ * the new file and renames it, so writers only wait for as long as
+ * that takes.  An exclusive lock on "<fname>.CHECKPOINT" stops more
+ * than one process from copying at once.
+ *
+ * HEADER: 80 bytes
+ *  magic: 20 bytes: "4 bytes same as skiplist" "blockdb file\0\0\0\0"
+ *  version: 4 bytes
+ *  generation: 8 bytes
+ *  num_records: 8 bytes
+ *  index_offset: 8 bytes - end of the blocks
+ *  log_offset: 8 bytes - end of the index
+ *  current_size: 8 bytes - end of the last commit
+ *  run_offset: 8 bytes - the newest RUN, or zero
+ *  num_blocks: 4 bytes
+ *  crc32: 4 bytes
+ *
+ * BLOCK: from HEADER_SIZE up to index_offset, one after another
+ *  records, each:
+ *    varint shared, varint unshared, varint vallen,
+ *    the last 'unshared' bytes of the key, value
+ *  crc32: 4 bytes over the records
+ *
+ * The first record in a block always has 'shared' of zero.
+ *
+ * INDEX: from index_offset up to log_offset
+ *  entries, each:
+ *    varint offset, varint length (without the crc), varint keylen,
+ *    first key of the block
+ *  crc32: 4 bytes over the entries
+ *
+ * LOG: from log_offset up to current_size
+ *  changes, each:
+ *    type ('+' store or '-' delete), varint keylen, varint vallen,
+ *    key, value
+ *  after the changes of each transaction:
+ *    '$', crc32: 4 bytes over the changes
+ *  and between transactions, runs:
+ *    '#', prev: 8 bytes - the next older RUN, or zero
+ *    count: 8 bytes
+ *    entries, count of them in key order, each:
+ *      keyoffset: 8 bytes - of the key of the change in the log
+ *      keylen: 8 bytes - top bit set for a delete
+ *      vallen: 8 bytes
+ *    crc32: 4 bytes over each RUNCHUNK entries
+ *    crc32: 4 bytes over the type, prev, count and the entry crcs
+ *
+ * The crc of a chunk of run entries is checked the first time a
+ * process reads any of them, rather than when the run is loaded.
+ *
+ * Varints are 7 bits per byte, least significant first, with the
+ * top bit set on every byte but the last.  Fixed size integers are
+ * in network byte order.
+ *
+ * A commit appends its changes and the COMMIT, fsyncs, then writes
+ * the new current_size into the header and fsyncs again.  Anything
+ * after current_size is a transaction which never committed, so
+ * readers ignore it and the next writer truncates it away.
+ */
+
+
+/********** TUNING *************/
+
+/* don't bother rewriting if the log has less than this much data */
+#define MINREWRITE 16834
+/* write a run once the log after the last one is bigger than this */
+#define TAILSIZE (64*1024)
+/* run entries covered by each crc */
+#define RUNCHUNK 256
+/* most runs there can be; each is over twice the size of the last */
+#define MAXRUNS 48
+/* rewrite once the log reaches this fraction of the blocks */
+#define REWRITE_RATIO 4
+/* start a new block once this many bytes of records are in it */
+#define BLOCKSIZE 4096
+/* write the new file out in chunks of this size when rewriting */
+#define WRITEBUFSIZE (1024*1024)
+/* levels of the in-memory skiplist of log entries */
+#define MAXLEVEL 24
+/* should be 0.5 for binary search semantics */
+#define PROB 0.5
+
+/* release lock in foreach at least every N records */
+#define FOREACH_LOCK_RELEASE 256
+
+/* format specifics */
+#undef VERSION /* defined in config.h */
+#define VERSION 1
+
+/* type aliases */
+#define LLU long long unsigned int
+#define LU long unsigned int
+
+/* log entry types */
+#define STORE '+'
+#define DELETE '-'
+#define COMMIT '$'
+#define RUN '#'
+
+#define RUNENTRY_SIZE 24
+#define RUNHEAD_SIZE 17
+#define RUN_DELETED (1ULL << 63)
+
+/********** DATA STRUCTURES *************/
+
+/* where a block lives, read from the index */
+struct blockref {
+    size_t offset;
+    size_t len;         /* of the records, not including the crc */
+    size_t keyoffset;   /* first key of the block, in the index */
+    size_t keylen;
+};
+
+/* a position in the blocks.  The key has to be rebuilt record by
+ * record from the start of the block, so it lives in a buffer */
+struct blockcursor {
+    size_t block;       /* num_blocks once we've run off the end */
+    size_t next;        /* offset of the record after this one */
+    size_t end;         /* end of the records in this block */
+    struct buf key;
+    size_t valoffset;
+    size_t vallen;
+    int valid;
+};
+
+/* the latest change to a key in the log.  All offsets point
+ * into the file, so they survive a remap */
+struct logentry {
+    size_t keyoffset;
+    size_t keylen;
+    size_t valoffset;
+    size_t vallen;
+    int deleted;
+    struct logentry *next[];
+};
+
+/* a run entry, decoded - the same fields as a logentry */
+struct runentry {
+    size_t keyoffset;
+    size_t keylen;
+    size_t valoffset;
+    size_t vallen;
+    int deleted;
+};
+
+/* a sorted run of the log */
+struct run {
+    size_t offset;
+    size_t end;
+    size_t count;
+    size_t entries;         /* offset of the first entry */
+    size_t crcs;            /* offset of the chunk crcs */
+    unsigned char *checked; /* chunks whose crc has been checked */
+};
+
+struct runcursor {
+    size_t pos;             /* count once we've run off the end */
+    struct runentry e;
+    int valid;
+};
+
+/* the sources a cursor merges, newest first: the log after the runs,
+ * each of the runs, then the blocks */
+#define FROM_LOG 0
+#define FROM_RUN(n) (1 + (n))
+#define FROM_BLOCK(c) (1 + (c)->nruns)
+
+/* cursor flags */
+#define CURSOR_NOBLOCKS   (1<<0)    /* just the log and the runs */
+#define CURSOR_TOMBSTONES (1<<1)    /* return deletes too */
+
+/* a position in the merged view of the blocks and the log */
+struct cursor {
+    struct blockcursor block;
+    struct logentry *log;   /* first log entry not before 'block' */
+    struct runcursor run[MAXRUNS];
+    int nruns;              /* how many of the runs we're merging */
+    int flags;
+    int from;               /* which source we're on */
+    int deleted;            /* only with CURSOR_TOMBSTONES */
+    int valid;
+    uint64_t changes;       /* db->changes when we got here */
+};
+
+struct txn {
+    /* where our changes start, where we truncate to on abort */
+    size_t start;
+};
+
+struct db_header {
+    /* header info */
+    uint32_t version;
+    uint64_t generation;
+    uint64_t num_records;
+    size_t index_offset;
+    size_t log_offset;
+    size_t current_size;
+    size_t run_offset;
+    uint32_t num_blocks;
+};
+
+struct dbengine {
+    /* file data */
+    struct mappedfile *mf;
+
+    struct db_header header;
+
+    /* tracking info */
+    int is_open;
+    size_t end;
+    struct txn *current_txn;
+
+    /* the index, as of index_generation (0 if not loaded) */
+    uint64_t index_generation;
+    struct blockref *index;
+
+    /* the runs as of run_offset, newest first */
+    size_t run_offset;
+    struct run runs[MAXRUNS];
+    int nruns;
+
+    /* the log after the runs, read as far as log_read */
+    size_t tail_start;
+    size_t log_read;
+    struct logentry *overlay;   /* head, with MAXLEVEL pointers */
+    int overlay_level;
+    size_t overlay_count;
+
+    /* bumped whenever the index or the log changes, so cursors
+     * know when to find their place again */
+    uint64_t changes;
+
+    /* for fetch */
+    struct cursor cur;
+    struct buf keybuf;
+
+    /* scratch space for writing log entries */
+    struct buf writebuf;
+
+    /* comparator function to use for sorting */
+    int open_flags;
+    int (*compar) (const char *s1, int l1, const char *s2, int l2);
+};
+
+struct db_list {
+    struct dbengine *db;
+    struct db_list *next;
+    int refcount;
+};
+
+#define HEADER_MAGIC ("\241\002\213\015blockdb file\0\0\0\0")
+#define HEADER_MAGIC_SIZE (20)
+
+/* offsets of header files */
+enum {
+    OFFSET_HEADER = 0,
+    OFFSET_VERSION = 20,
+    OFFSET_GENERATION = 24,
+    OFFSET_NUM_RECORDS = 32,
+    OFFSET_INDEX_OFFSET = 40,
+    OFFSET_LOG_OFFSET = 48,
+    OFFSET_CURRENT_SIZE = 56,
+    OFFSET_RUN_OFFSET = 64,
+    OFFSET_NUM_BLOCKS = 72,
+    OFFSET_CRC32 = 76,
+};
+
+#define HEADER_SIZE 80
+
+static struct db_list *open_blockdb = NULL;
+
+static int mycommit(struct dbengine *db, struct txn *tid);
+static int myabort(struct dbengine *db, struct txn *tid);
+static int mycheckpoint(struct dbengine *db);
+
+/************** HELPER FUNCTIONS ****************/
+
+#define BASE(db) mappedfile_base((db)->mf)
+#define SIZE(db) mappedfile_size((db)->mf)
+#define FNAME(db) mappedfile_fname((db)->mf)
+#define LOGKEY(db, e) (BASE(db) + (e)->keyoffset)
+#define LOGVAL(db, e) (BASE(db) + (e)->valoffset)
+
+/* choose a level appropriately randomly */
+static int randlvl(int lvl, int maxlvl)
+{
+    while (((float) rand() / (float) (RAND_MAX)) < PROB) {
+        lvl++;
+        if (lvl == maxlvl) break;
+    }
+    return lvl;
+}
+
+static void put_varint(struct buf *buf, uint64_t val)
+{
+    while (val >= 0x80) {
+        buf_putc(buf, (val & 0x7f) | 0x80);
+        val >>= 7;
+    }
+    buf_putc(buf, val);
+}
+
+/* returns the number of bytes used, or zero if it runs past 'end' */
+static size_t get_varint(const char *s, const char *end, uint64_t *valp)
+{
+    const unsigned char *p = (const unsigned char *)s;
+    uint64_t val = 0;
+    int shift = 0;
+    size_t n = 0;
+
+    while ((const char *)p + n < end && shift < 64) {
+        unsigned char c = p[n++];
+        val |= (uint64_t)(c & 0x7f) << shift;
+        if (!(c & 0x80)) {
+            *valp = val;
+            return n;
+        }
+        shift += 7;
+    }
+
+    return 0;
+}
+
+/* blocks and log entries aren't aligned, so no casting here */
+static void put_crc(struct buf *buf, uint32_t crc)
+{
+    crc = htonl(crc);
+    buf_appendmap(buf, (const char *)&crc, 4);
+}
+
+static uint32_t get_crc(const char *p)
+{
+    uint32_t crc;
+    memcpy(&crc, p, 4);
+    return ntohl(crc);
+}
+
+static void put_u64(struct buf *buf, uint64_t val)
+{
+    val = htonll(val);
+    buf_appendmap(buf, (const char *)&val, 8);
+}
+
+static uint64_t get_u64(const char *p)
+{
+    uint64_t val;
+    memcpy(&val, p, 8);
+    return ntohll(val);
+}
+
+/************** HEADER ****************/
+
+/* given an open, mapped db, read in the header information */
+static int read_header(struct dbengine *db)
+{
+    uint32_t crc;
+
+    assert(db && db->mf && db->is_open);
+
+    if (SIZE(db) < HEADER_SIZE) {
+        syslog(LOG_ERR,
+               "blockdb: file not large enough for header: %s", FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    if (memcmp(BASE(db), HEADER_MAGIC, HEADER_MAGIC_SIZE)) {
+        syslog(LOG_ERR, "blockdb: invalid magic header: %s", FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    db->header.version
+        = ntohl(*((uint32_t *)(BASE(db) + OFFSET_VERSION)));
+
+    if (db->header.version > VERSION) {
+        syslog(LOG_ERR, "blockdb: version mismatch: %s has version %d",
+               FNAME(db), db->header.version);
+        return CYRUSDB_IOERROR;
+    }
+
+    db->header.generation
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_GENERATION)));
+
+    db->header.num_records
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_NUM_RECORDS)));
+
+    db->header.index_offset
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_INDEX_OFFSET)));
+
+    db->header.log_offset
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_LOG_OFFSET)));
+
+    db->header.current_size
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_CURRENT_SIZE)));
+
+    db->header.run_offset
+        = ntohll(*((uint64_t *)(BASE(db) + OFFSET_RUN_OFFSET)));
+
+    db->header.num_blocks
+        = ntohl(*((uint32_t *)(BASE(db) + OFFSET_NUM_BLOCKS)));
+
+    crc = ntohl(*((uint32_t *)(BASE(db) + OFFSET_CRC32)));
+
+    if (crc32_map(BASE(db), OFFSET_CRC32) != crc) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb header CRC failure",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    if (db->header.index_offset < HEADER_SIZE
+        || db->header.log_offset < db->header.index_offset + 4
+        || db->header.current_size < db->header.log_offset
+        || db->header.current_size > SIZE(db)
+        || (db->header.run_offset
+            && (db->header.run_offset < db->header.log_offset
+                || db->header.run_offset >= db->header.current_size))) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb header offsets invalid",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    db->end = db->header.current_size;
+
+    return 0;
+}
+
+/* write the header to the start of 'mf', which must be locked */
+static int write_header(struct mappedfile *mf, struct db_header *header)
+{
+    union {
+        uint64_t align;
+        char s[HEADER_SIZE];
+    } hbuf;
+    char *buf = hbuf.s;
+    int n;
+
+    /* format one buffer */
+    memcpy(buf, HEADER_MAGIC, HEADER_MAGIC_SIZE);
+    *((uint32_t *)(buf + OFFSET_VERSION)) = htonl(header->version);
+    *((uint64_t *)(buf + OFFSET_GENERATION)) = htonll(header->generation);
+    *((uint64_t *)(buf + OFFSET_NUM_RECORDS)) = htonll(header->num_records);
+    *((uint64_t *)(buf + OFFSET_INDEX_OFFSET)) = htonll(header->index_offset);
+    *((uint64_t *)(buf + OFFSET_LOG_OFFSET)) = htonll(header->log_offset);
+    *((uint64_t *)(buf + OFFSET_CURRENT_SIZE)) = htonll(header->current_size);
+    *((uint64_t *)(buf + OFFSET_RUN_OFFSET)) = htonll(header->run_offset);
+    *((uint32_t *)(buf + OFFSET_NUM_BLOCKS)) = htonl(header->num_blocks);
+    *((uint32_t *)(buf + OFFSET_CRC32)) = htonl(crc32_map(buf, OFFSET_CRC32));
+
+    /* write it out */
+    n = mappedfile_pwrite(mf, buf, HEADER_SIZE, 0);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    return 0;
+}
+
+/* simple wrapper to write with an fsync */
+static int commit_header(struct mappedfile *mf, struct db_header *header)
+{
+    int r = write_header(mf, header);
+    if (!r) r = mappedfile_commit(mf);
+    return r;
+}
+
+/************** INDEX AND BLOCKS ****************/
+
+/* read the index of the current generation into memory */
+static int read_index(struct dbengine *db)
+{
+    const char *base = BASE(db);
+    const char *p = base + db->header.index_offset;
+    const char *end = base + db->header.log_offset - 4;
+    uint64_t offset, len, keylen;
+    size_t i, n;
+
+    if (crc32_map(p, end - p) != get_crc(end)) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb index CRC failure", FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    db->index = xrealloc(db->index,
+                         (db->header.num_blocks + 1) * sizeof(struct blockref));
+
+    for (i = 0; i < db->header.num_blocks; i++) {
+        struct blockref *ref = &db->index[i];
+
+        if (!(n = get_varint(p, end, &offset))) goto corrupt;
+        p += n;
+        if (!(n = get_varint(p, end, &len))) goto corrupt;
+        p += n;
+        if (!(n = get_varint(p, end, &keylen))) goto corrupt;
+        p += n;
+        if (keylen > (size_t)(end - p)) goto corrupt;
+        if (offset < HEADER_SIZE || offset + len + 4 > db->header.index_offset)
+            goto corrupt;
+
+        ref->offset = offset;
+        ref->len = len;
+        ref->keyoffset = p - base;
+        ref->keylen = keylen;
+        p += keylen;
+    }
+
+    if (p != end) goto corrupt;
+
+    return 0;
+
+ corrupt:
+    syslog(LOG_ERR, "DBERROR: %s: blockdb index entry %llu is invalid",
+           FNAME(db), (LLU)i);
+    return CYRUSDB_IOERROR;
+}
+
+/* decode the record at cur->next */
+static int block_read(struct dbengine *db, struct blockcursor *cur)
+{
+    const char *base = BASE(db);
+    const char *p = base + cur->next;
+    const char *end = base + cur->end;
+    uint64_t shared, unshared, vallen;
+    size_t n;
+
+    if (!(n = get_varint(p, end, &shared))) goto corrupt;
+    p += n;
+    if (!(n = get_varint(p, end, &unshared))) goto corrupt;
+    p += n;
+    if (!(n = get_varint(p, end, &vallen))) goto corrupt;
+    p += n;
+
+    if (shared > cur->key.len) goto corrupt;
+    if (unshared > (size_t)(end - p)) goto corrupt;
+    if (vallen > (size_t)(end - p) - unshared) goto corrupt;
+
+    buf_truncate(&cur->key, shared);
+    buf_appendmap(&cur->key, p, unshared);
+    p += unshared;
+
+    cur->valoffset = p - base;
+    cur->vallen = vallen;
+    cur->next = cur->valoffset + vallen;
+    cur->valid = 1;
+
+    return 0;
+
+ corrupt:
+    syslog(LOG_ERR, "DBERROR: %s: blockdb invalid record at %llX",
+           FNAME(db), (LLU)cur->next);
+    cur->valid = 0;
+    return CYRUSDB_IOERROR;
+}
+
+/* move to the first record of block 'n', checking the crc on the way */
+static int block_start(struct dbengine *db, struct blockcursor *cur, size_t n)
+{
+    struct blockref *ref;
+
+    cur->block = n;
+    cur->valid = 0;
+    buf_reset(&cur->key);
+
+    if (n >= db->header.num_blocks) return 0;
+
+    ref = &db->index[n];
+    if (crc32_map(BASE(db) + ref->offset, ref->len)
+        != get_crc(BASE(db) + ref->offset + ref->len)) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb block CRC failure at %llX",
+               FNAME(db), (LLU)ref->offset);
+        return CYRUSDB_IOERROR;
+    }
+
+    cur->next = ref->offset;
+    cur->end = ref->offset + ref->len;
+
+    return block_read(db, cur);
+}
+
+static int block_next(struct dbengine *db, struct blockcursor *cur)
+{
+    if (!cur->valid) return 0;
+
+    if (cur->next < cur->end)
+        return block_read(db, cur);
+
+    return block_start(db, cur, cur->block + 1);
+}
+
+/* move to the first record at or after 'key', or strictly after
+ * it if 'after' is set */
+static int block_seek(struct dbengine *db, struct blockcursor *cur,
+                      const char *key, size_t keylen, int after)
+{
+    size_t lo = 0, hi = db->header.num_blocks;
+    int r, cmp;
+
+    /* the last block which starts no later than key */
+    while (hi - lo > 1) {
+        size_t mid = lo + (hi - lo) / 2;
+        struct blockref *ref = &db->index[mid];
+
+        cmp = db->compar(BASE(db) + ref->keyoffset, ref->keylen, key, keylen);
+        if (cmp <= 0) lo = mid;
+        else hi = mid;
+    }
+
+    r = block_start(db, cur, lo);
+
+    while (!r && cur->valid) {
+        cmp = db->compar(cur->key.s, cur->key.len, key, keylen);
+        if (cmp > 0 || (!cmp && !after)) break;
+        r = block_next(db, cur);
+    }
+
+    return r;
+}
+
+/************** LOG ****************/
+
+/* the first log entry at or after 'key' (strictly after if 'after'),
+ * filling 'update' with the entries before it at each level */
+static struct logentry *overlay_find(struct dbengine *db,
+                                     const char *key, size_t keylen,
+                                     int after, struct logentry **update)
+{
+    struct logentry *e = db->overlay;
+    int i;
+
+    for (i = db->overlay_level - 1; i >= 0; i--) {
+        while (e->next[i]) {
+            struct logentry *next = e->next[i];
+            int cmp = db->compar(LOGKEY(db, next), next->keylen, key, keylen);
+            if (cmp > 0 || (!cmp && !after)) break;
+            e = next;
+        }
+        if (update) update[i] = e;
+    }
+
+    return e->next[0];
+}
+
+/* record a change to a key, replacing any earlier one */
+static void overlay_set(struct dbengine *db,
+                        size_t keyoffset, size_t keylen,
+                        size_t valoffset, size_t vallen, int deleted)
+{
+    struct logentry *update[MAXLEVEL];
+    struct logentry *e;
+    int level, i;
+
+    e = overlay_find(db, BASE(db) + keyoffset, keylen, 0, update);
+
+    if (!e || db->compar(LOGKEY(db, e), e->keylen,
+                         BASE(db) + keyoffset, keylen)) {
+        level = randlvl(1, MAXLEVEL);
+        for (i = db->overlay_level; i < level; i++)
+            update[i] = db->overlay;
+        if (level > db->overlay_level)
+            db->overlay_level = level;
+
+        e = xzmalloc(sizeof(struct logentry)
+                     + level * sizeof(struct logentry *));
+        for (i = 0; i < level; i++) {
+            e->next[i] = update[i]->next[i];
+            update[i]->next[i] = e;
+        }
+        db->overlay_count++;
+    }
+
+    e->keyoffset = keyoffset;
+    e->keylen = keylen;
+    e->valoffset = valoffset;
+    e->vallen = vallen;
+    e->deleted = deleted;
+
+    db->changes++;
+}
+
+static void overlay_free(struct dbengine *db)
+{
+    struct logentry *e, *next;
+
+    if (!db->overlay) return;
+
+    for (e = db->overlay->next[0]; e; e = next) {
+        next = e->next[0];
+        free(e);
+    }
+
+    memset(db->overlay->next, 0, MAXLEVEL * sizeof(struct logentry *));
+    db->overlay_level = 1;
+    db->overlay_count = 0;
+    db->changes++;
+}
+
+/* parse one change at 'offset', returning its length or zero if invalid */
+static size_t parse_change(struct dbengine *db, size_t offset, size_t end,
+                           size_t *keyoffset, size_t *keylen,
+                           size_t *valoffset, size_t *vallen)
+{
+    const char *base = BASE(db);
+    const char *p = base + offset + 1;
+    uint64_t kl, vl;
+    size_t n;
+
+    if (!(n = get_varint(p, base + end, &kl))) return 0;
+    p += n;
+    if (!(n = get_varint(p, base + end, &vl))) return 0;
+    p += n;
+    if (!kl || kl > (size_t)(base + end - p)) return 0;
+    if (vl > (size_t)(base + end - p) - kl) return 0;
+
+    *keyoffset = p - base;
+    *keylen = kl;
+    *valoffset = *keyoffset + kl;
+    *vallen = vl;
+
+    return *valoffset + vl - offset;
+}
+
+/* the length of the run at 'offset', or zero if it's invalid */
+static size_t parse_run(struct dbengine *db, size_t offset, size_t end,
+                        size_t *count)
+{
+    const char *base = BASE(db);
+    uint64_t n, chunks;
+
+    if (offset + RUNHEAD_SIZE + 4 > end) return 0;
+
+    n = get_u64(base + offset + 9);
+    if (n > (end - offset - RUNHEAD_SIZE - 4) / RUNENTRY_SIZE) return 0;
+    chunks = (n + RUNCHUNK - 1) / RUNCHUNK;
+    if (offset + RUNHEAD_SIZE + n * RUNENTRY_SIZE + chunks * 4 + 4 > end)
+        return 0;
+
+    *count = n;
+
+    return RUNHEAD_SIZE + n * RUNENTRY_SIZE + chunks * 4 + 4;
+}
+
+/* the length of any log record at 'offset', or zero if it's invalid */
+static size_t parse_record(struct dbengine *db, size_t offset, size_t end)
+{
+    size_t keyoffset, keylen, valoffset, vallen, count;
+
+    switch (BASE(db)[offset]) {
+    case STORE:
+    case DELETE:
+        return parse_change(db, offset, end,
+                            &keyoffset, &keylen, &valoffset, &vallen);
+    case COMMIT:
+        return (offset + 5 <= end) ? 5 : 0;
+    case RUN:
+        return parse_run(db, offset, end, &count);
+    }
+
+    return 0;
+}
+
+/* read the transactions committed since we last looked */
+static int read_log(struct dbengine *db)
+{
+    size_t end = db->header.current_size;
+    size_t offset = db->log_read;
+    size_t keyoffset, keylen, valoffset, vallen, count;
+    size_t n;
+
+    while (offset < end) {
+        char type = BASE(db)[offset];
+
+        switch (type) {
+        case STORE:
+        case DELETE:
+            n = parse_change(db, offset, end,
+                             &keyoffset, &keylen, &valoffset, &vallen);
+            if (!n) goto corrupt;
+            overlay_set(db, keyoffset, keylen, valoffset, vallen,
+                        type == DELETE);
+            offset += n;
+            break;
+
+        case COMMIT:
+            if (offset + 5 > end) goto corrupt;
+            if (crc32_map(BASE(db) + db->log_read, offset - db->log_read)
+                != get_crc(BASE(db) + offset + 1)) {
+                syslog(LOG_ERR, "DBERROR: %s: blockdb commit CRC failure at %llX",
+                       FNAME(db), (LLU)offset);
+                return CYRUSDB_IOERROR;
+            }
+            offset += 5;
+            db->log_read = offset;
+            break;
+
+        case RUN:
+            /* only ever between transactions, and a newer run than
+             * ours means refresh() reloads them all, so just step
+             * over it */
+            if (offset != db->log_read) goto corrupt;
+            n = parse_run(db, offset, end, &count);
+            if (!n) goto corrupt;
+            offset += n;
+            db->log_read = offset;
+            break;
+
+        default:
+            goto corrupt;
+        }
+    }
+
+    /* current_size always follows a commit */
+    if (db->log_read != end) goto corrupt;
+
+    return 0;
+
+ corrupt:
+    syslog(LOG_ERR, "DBERROR: %s: blockdb invalid log entry at %llX",
+           FNAME(db), (LLU)offset);
+    return CYRUSDB_IOERROR;
+}
+
+/* throw away the overlay and read the log after the runs again */
+static int reread_log(struct dbengine *db)
+{
+    overlay_free(db);
+    db->log_read = db->tail_start;
+    return read_log(db);
+}
+
+/************** RUNS ****************/
+
+static void free_runs(struct dbengine *db)
+{
+    int i;
+
+    for (i = 0; i < db->nruns; i++)
+        free(db->runs[i].checked);
+
+    db->nruns = 0;
+    db->changes++;
+}
+
+/* find the runs from the one in the header back, checking that each
+ * is older than the last and that their heads are intact */
+static int load_runs(struct dbengine *db)
+{
+    const char *base = BASE(db);
+    size_t offset = db->header.run_offset;
+    size_t limit = db->header.current_size;
+    size_t count, len, chunks;
+    struct iovec io[2];
+
+    free_runs(db);
+    db->run_offset = 0;
+    db->tail_start = db->header.log_offset;
+
+    while (offset) {
+        struct run *run = &db->runs[db->nruns];
+
+        if (db->nruns == MAXRUNS) goto corrupt;
+        if (offset < db->header.log_offset || offset >= limit) goto corrupt;
+        if (base[offset] != RUN) goto corrupt;
+
+        len = parse_run(db, offset, limit, &count);
+        if (!len) goto corrupt;
+
+        chunks = (count + RUNCHUNK - 1) / RUNCHUNK;
+        io[0].iov_base = (char *)base + offset;
+        io[0].iov_len = RUNHEAD_SIZE;
+        io[1].iov_base = (char *)base + offset + len - 4 - chunks * 4;
+        io[1].iov_len = chunks * 4;
+        if (crc32_iovec(io, 2) != get_crc(base + offset + len - 4)) {
+            syslog(LOG_ERR, "DBERROR: %s: blockdb run CRC failure at %llX",
+                   FNAME(db), (LLU)offset);
+            free_runs(db);
+            return CYRUSDB_IOERROR;
+        }
+
+        run->offset = offset;
+        run->end = offset + len;
+        run->count = count;
+        run->entries = offset + RUNHEAD_SIZE;
+        run->crcs = run->entries + count * RUNENTRY_SIZE;
+        run->checked = xzmalloc(chunks + 1);
+
+        if (!db->nruns) db->tail_start = run->end;
+        db->nruns++;
+
+        /* the next one is older, so it must end before this one */
+        limit = offset;
+        offset = get_u64(base + offset + 1);
+    }
+
+    db->run_offset = db->header.run_offset;
+
+    return 0;
+
+ corrupt:
+    syslog(LOG_ERR, "DBERROR: %s: blockdb invalid run at %llX",
+           FNAME(db), (LLU)offset);
+    free_runs(db);
+    return CYRUSDB_IOERROR;
+}
+
+/* decode entry 'i' of 'run', checking the crc of its chunk first
+ * if nobody has yet */
+static int run_entry(struct dbengine *db, struct run *run, size_t i,
+                     struct runentry *e)
+{
+    const char *base = BASE(db);
+    size_t chunk = i / RUNCHUNK;
+    const char *p;
+    uint64_t keylen;
+
+    if (!run->checked[chunk]) {
+        size_t first = chunk * RUNCHUNK;
+        size_t n = run->count - first;
+
+        if (n > RUNCHUNK) n = RUNCHUNK;
+        if (crc32_map(base + run->entries + first * RUNENTRY_SIZE,
+                      n * RUNENTRY_SIZE)
+            != get_crc(base + run->crcs + chunk * 4)) {
+            syslog(LOG_ERR, "DBERROR: %s: blockdb run CRC failure at %llX",
+                   FNAME(db), (LLU)(run->entries + first * RUNENTRY_SIZE));
+            return CYRUSDB_IOERROR;
+        }
+        run->checked[chunk] = 1;
+    }
+
+    p = base + run->entries + i * RUNENTRY_SIZE;
+    keylen = get_u64(p + 8);
+
+    e->keyoffset = get_u64(p);
+    e->keylen = keylen & ~RUN_DELETED;
+    e->vallen = get_u64(p + 16);
+    e->deleted = !!(keylen & RUN_DELETED);
+
+    /* the change it points to comes before the run */
+    if (e->keyoffset < db->header.log_offset || e->keyoffset > run->offset
+        || !e->keylen || e->keylen > run->offset - e->keyoffset
+        || e->vallen > run->offset - e->keyoffset - e->keylen) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb invalid run entry at %llX",
+               FNAME(db), (LLU)(p - base));
+        return CYRUSDB_IOERROR;
+    }
+
+    e->valoffset = e->keyoffset + e->keylen;
+
+    return 0;
+}
+
+static int run_read(struct dbengine *db, struct run *run,
+                    struct runcursor *rc)
+{
+    int r;
+
+    rc->valid = 0;
+    if (rc->pos >= run->count) return 0;
+
+    r = run_entry(db, run, rc->pos, &rc->e);
+    if (!r) rc->valid = 1;
+
+    return r;
+}
+
+/* move to the first entry at or after 'key', or strictly after
+ * it if 'after' is set */
+static int run_seek(struct dbengine *db, struct run *run,
+                    struct runcursor *rc,
+                    const char *key, size_t keylen, int after)
+{
+    size_t lo = 0, hi = run->count;
+    int r, cmp;
+
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+
+        r = run_entry(db, run, mid, &rc->e);
+        if (r) return r;
+
+        cmp = db->compar(BASE(db) + rc->e.keyoffset, rc->e.keylen,
+                         key, keylen);
+        if (cmp < 0 || (!cmp && after)) lo = mid + 1;
+        else hi = mid;
+    }
+
+    rc->pos = lo;
+
+    return run_read(db, run, rc);
+}
+
+/* having just read the header, catch up with any changes */
+static int refresh(struct dbengine *db)
+{
+    int r;
+
+    if (db->index_generation != db->header.generation
+        || db->log_read > db->header.current_size) {
+        db->index_generation = 0;
+
+        r = read_index(db);
+        if (r) return r;
+
+        r = load_runs(db);
+        if (r) return r;
+
+        r = reread_log(db);
+        if (r) return r;
+
+        db->index_generation = db->header.generation;
+        return 0;
+    }
+
+    /* somebody wrote a new run, which has the log we've read in it */
+    if (db->run_offset != db->header.run_offset) {
+        r = load_runs(db);
+        if (!r) r = reread_log(db);
+        if (r) db->index_generation = 0;
+        return r;
+    }
+
+    return read_log(db);
+}
+
+/************** CURSORS ****************/
+
+/* the key at the head of source 'n', if it has one */
+static int source_key(struct dbengine *db, struct cursor *c, int n,
+                      const char **key, size_t *keylen)
+{
+    if (n == FROM_LOG) {
+        if (!c->log) return 0;
+        *key = LOGKEY(db, c->log);
+        *keylen = c->log->keylen;
+    }
+    else if (n == FROM_BLOCK(c)) {
+        if ((c->flags & CURSOR_NOBLOCKS) || !c->block.valid) return 0;
+        *key = c->block.key.s;
+        *keylen = c->block.key.len;
+    }
+    else {
+        struct runcursor *rc = &c->run[n - FROM_RUN(0)];
+        if (!rc->valid) return 0;
+        *key = BASE(db) + rc->e.keyoffset;
+        *keylen = rc->e.keylen;
+    }
+
+    return 1;
+}
+
+static int source_next(struct dbengine *db, struct cursor *c, int n)
+{
+    if (n == FROM_LOG) {
+        c->log = c->log->next[0];
+        return 0;
+    }
+
+    if (n == FROM_BLOCK(c))
+        return block_next(db, &c->block);
+
+    c->run[n - FROM_RUN(0)].pos++;
+    return run_read(db, &db->runs[n - FROM_RUN(0)], &c->run[n - FROM_RUN(0)]);
+}
+
+/* line the sources up on the next record to return.  A change in
+ * the log replaces the same key in the runs, a newer run replaces
+ * an older one, and they all replace the blocks */
+static int cursor_settle(struct dbengine *db, struct cursor *c)
+{
+    const char *key, *best = NULL;
+    size_t keylen, bestlen = 0;
+    int n, r;
+
+    for (;;) {
+        c->valid = 0;
+
+        /* the smallest key, from the newest source which has it */
+        for (n = 0; n <= FROM_BLOCK(c); n++) {
+            if (!source_key(db, c, n, &key, &keylen)) continue;
+            if (c->valid && db->compar(key, keylen, best, bestlen) >= 0)
+                continue;
+            best = key;
+            bestlen = keylen;
+            c->from = n;
+            c->valid = 1;
+        }
+
+        if (!c->valid) return 0;
+
+        /* skip the older versions of it */
+        for (n = c->from + 1; n <= FROM_BLOCK(c); n++) {
+            if (!source_key(db, c, n, &key, &keylen)) continue;
+            if (db->compar(key, keylen, best, bestlen)) continue;
+            r = source_next(db, c, n);
+            if (r) return r;
+        }
+
+        if (c->from == FROM_LOG)
+            c->deleted = c->log->deleted;
+        else if (c->from == FROM_BLOCK(c))
+            c->deleted = 0;
+        else
+            c->deleted = c->run[c->from - FROM_RUN(0)].e.deleted;
+
+        if (!c->deleted || (c->flags & CURSOR_TOMBSTONES))
+            return 0;
+
+        r = source_next(db, c, c->from);
+        if (r) return r;
+    }
+}
+
+/* seek a cursor over the log, the newest 'nruns' runs and, unless
+ * CURSOR_NOBLOCKS is set, the blocks */
+static int cursor_seek_ex(struct dbengine *db, struct cursor *c,
+                          const char *key, size_t keylen, int after,
+                          int nruns, int flags)
+{
+    int i, r;
+
+    c->valid = 0;
+    c->changes = db->changes;
+    c->nruns = nruns;
+    c->flags = flags;
+
+    if (flags & CURSOR_NOBLOCKS) {
+        c->block.valid = 0;
+    }
+    else {
+        r = block_seek(db, &c->block, key, keylen, after);
+        if (r) return r;
+    }
+
+    for (i = 0; i < nruns; i++) {
+        r = run_seek(db, &db->runs[i], &c->run[i], key, keylen, after);
+        if (r) return r;
+    }
+
+    c->log = overlay_find(db, key, keylen, after, NULL);
+
+    return cursor_settle(db, c);
+}
+
+static int cursor_seek(struct dbengine *db, struct cursor *c,
+                       const char *key, size_t keylen, int after)
+{
+    return cursor_seek_ex(db, c, key, keylen, after, db->nruns, 0);
+}
+
+static int cursor_next(struct dbengine *db, struct cursor *c)
+{
+    int r;
+
+    if (!c->valid) return 0;
+
+    r = source_next(db, c, c->from);
+    if (r) return r;
+
+    return cursor_settle(db, c);
+}
+
+static void cursor_get(struct dbengine *db, struct cursor *c,
+                       const char **key, size_t *keylen,
+                       const char **val, size_t *vallen)
+{
+    assert(c->valid);
+
+    if (c->from == FROM_LOG) {
+        *key = LOGKEY(db, c->log);
+        *keylen = c->log->keylen;
+        *val = LOGVAL(db, c->log);
+        *vallen = c->log->vallen;
+    }
+    else if (c->from == FROM_BLOCK(c)) {
+        *key = c->block.key.s;
+        *keylen = c->block.key.len;
+        *val = BASE(db) + c->block.valoffset;
+        *vallen = c->block.vallen;
+    }
+    else {
+        struct runentry *e = &c->run[c->from - FROM_RUN(0)].e;
+        *key = BASE(db) + e->keyoffset;
+        *keylen = e->keylen;
+        *val = BASE(db) + e->valoffset;
+        *vallen = e->vallen;
+    }
+}
+
+/* find the current value of 'key' */
+static int lookup(struct dbengine *db, const char *key, size_t keylen,
+                  const char **val, size_t *vallen)
+{
+    struct runcursor rc;
+    struct logentry *e;
+    int i, r;
+
+    e = overlay_find(db, key, keylen, 0, NULL);
+    if (e && !db->compar(LOGKEY(db, e), e->keylen, key, keylen)) {
+        if (e->deleted) return CYRUSDB_NOTFOUND;
+        *val = LOGVAL(db, e);
+        *vallen = e->vallen;
+        return 0;
+    }
+
+    for (i = 0; i < db->nruns; i++) {
+        r = run_seek(db, &db->runs[i], &rc, key, keylen, 0);
+        if (r) return r;
+
+        if (rc.valid && !db->compar(BASE(db) + rc.e.keyoffset, rc.e.keylen,
+                                    key, keylen)) {
+            if (rc.e.deleted) return CYRUSDB_NOTFOUND;
+            *val = BASE(db) + rc.e.valoffset;
+            *vallen = rc.e.vallen;
+            return 0;
+        }
+    }
+
+    r = block_seek(db, &db->cur.block, key, keylen, 0);
+    if (r) return r;
+
+    if (db->cur.block.valid
+        && !db->compar(db->cur.block.key.s, db->cur.block.key.len,
+                       key, keylen)) {
+        *val = BASE(db) + db->cur.block.valoffset;
+        *vallen = db->cur.block.vallen;
+        return 0;
+    }
+
+    return CYRUSDB_NOTFOUND;
+}
+
+/************** WRITING NEW FILES ****************/
+
+/* packs sorted records into blocks, for a new file */
+struct builder {
+    struct mappedfile *mf;
+    struct buf out;         /* finished blocks not written yet */
+    size_t offset;          /* where 'out' goes in the file */
+    struct buf block;       /* records of the block being built */
+    struct buf firstkey;
+    struct buf lastkey;
+    struct buf index;
+    size_t num_blocks;
+    size_t num_records;
+};
+
+static int builder_write(struct builder *b)
+{
+    ssize_t n;
+
+    if (!b->out.len) return 0;
+
+    n = mappedfile_pwritebuf(b->mf, &b->out, b->offset);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    b->offset += b->out.len;
+    buf_reset(&b->out);
+
+    return 0;
+}
+
+static int builder_flush(struct builder *b)
+{
+    size_t offset = b->offset + b->out.len;
+
+    if (!b->block.len) return 0;
+
+    put_varint(&b->index, offset);
+    put_varint(&b->index, b->block.len);
+    put_varint(&b->index, b->firstkey.len);
+    buf_append(&b->index, &b->firstkey);
+
+    buf_append(&b->out, &b->block);
+    put_crc(&b->out, crc32_buf(&b->block));
+    buf_reset(&b->block);
+    b->num_blocks++;
+
+    if (b->out.len >= WRITEBUFSIZE)
+        return builder_write(b);
+
+    return 0;
+}
+
+static int builder_add(struct builder *b,
+                       const char *key, size_t keylen,
+                       const char *val, size_t vallen)
+{
+    size_t shared = 0;
+    int r;
+
+    if (b->block.len >= BLOCKSIZE) {
+        r = builder_flush(b);
+        if (r) return r;
+    }
+
+    if (b->block.len) {
+        while (shared < keylen && shared < b->lastkey.len
+               && key[shared] == b->lastkey.s[shared])
+            shared++;
+    }
+    else {
+        buf_setmap(&b->firstkey, key, keylen);
+    }
+
+    put_varint(&b->block, shared);
+    put_varint(&b->block, keylen - shared);
+    put_varint(&b->block, vallen);
+    buf_appendmap(&b->block, key + shared, keylen - shared);
+    buf_appendmap(&b->block, val, vallen);
+
+    buf_setmap(&b->lastkey, key, keylen);
+    b->num_records++;
+
+    return 0;
+}
+
+/* write out the last block and the index, and fill in the header */
+static int builder_finish(struct builder *b, struct db_header *header)
+{
+    int r;
+
+    r = builder_flush(b);
+    if (!r) r = builder_write(b);
+    if (r) return r;
+
+    header->index_offset = b->offset;
+    put_crc(&b->index, crc32_buf(&b->index));
+    buf_copy(&b->out, &b->index);
+    r = builder_write(b);
+    if (r) return r;
+
+    header->version = VERSION;
+    header->log_offset = b->offset;
+    header->current_size = b->offset;
+    header->num_blocks = b->num_blocks;
+    header->num_records = b->num_records;
+
+    return 0;
+}
+
+static void builder_fini(struct builder *b)
+{
+    buf_free(&b->out);
+    buf_free(&b->block);
+    buf_free(&b->firstkey);
+    buf_free(&b->lastkey);
+    buf_free(&b->index);
+}
+
+/************** LOCKING ****************/
+
+static int unlock(struct dbengine *db)
+{
+    return mappedfile_unlock(db->mf);
+}
+
+/* a writer died before committing, throw its changes away */
+static int recovery(struct dbengine *db)
+{
+    syslog(LOG_NOTICE, "blockdb: recovering %s, discarding %llu bytes",
+           FNAME(db), (LLU)(SIZE(db) - db->header.current_size));
+
+    if (mappedfile_truncate(db->mf, db->header.current_size))
+        return CYRUSDB_IOERROR;
+
+    if (mappedfile_commit(db->mf))
+        return CYRUSDB_IOERROR;
+
+    return 0;
+}
+
+static int write_lock(struct dbengine *db)
+{
+    int r = mappedfile_writelock(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    /* reread header */
+    if (db->is_open) {
+        r = read_header(db);
+
+        if (!r && SIZE(db) > db->header.current_size)
+            r = recovery(db);
+
+        if (!r) r = refresh(db);
+
+        if (r) unlock(db);
+    }
+
+    return r;
+}
+
+static int read_lock(struct dbengine *db)
+{
+    int r = mappedfile_readlock(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    /* reread header, ignoring anything uncommitted after it */
+    if (db->is_open) {
+        r = read_header(db);
+        if (!r) r = refresh(db);
+        if (r) unlock(db);
+    }
+
+    return r;
+}
+
+static int newtxn(struct dbengine *db, struct txn **tidptr)
+{
+    int r;
+
+    assert(!db->current_txn);
+    assert(!*tidptr);
+
+    /* grab a r/w lock */
+    r = write_lock(db);
+    if (r) return r;
+
+    /* create the transaction */
+    db->current_txn = xmalloc(sizeof(struct txn));
+    db->current_txn->start = db->end;
+
+    /* pass it back out */
+    *tidptr = db->current_txn;
+
+    return 0;
+}
+
+static void dispose_db(struct dbengine *db)
+{
+    if (!db) return;
+
+    if (db->mf) {
+        if (mappedfile_islocked(db->mf))
+            unlock(db);
+        mappedfile_close(&db->mf);
+    }
+
+    overlay_free(db);
+    free_runs(db);
+    free(db->overlay);
+    free(db->index);
+    buf_free(&db->cur.block.key);
+    buf_free(&db->keybuf);
+    buf_free(&db->writebuf);
+
+    free(db);
+}
+
+/************************************************************/
+
+static int opendb(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct dbengine *db;
+    int r;
+    int mappedfile_flags = MAPPEDFILE_RW;
+
+    assert(fname);
+    assert(ret);
+
+    db = (struct dbengine *) xzmalloc(sizeof(struct dbengine));
+
+    if (flags & CYRUSDB_CREATE)
+        mappedfile_flags |= MAPPEDFILE_CREATE;
+
+    db->open_flags = flags & ~CYRUSDB_CREATE;
+    db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
+                                            : bsearch_ncompare_raw;
+    db->overlay = xzmalloc(sizeof(struct logentry)
+                           + MAXLEVEL * sizeof(struct logentry *));
+    db->overlay_level = 1;
+
+    r = mappedfile_open(&db->mf, fname, mappedfile_flags);
+    if (r) {
+        /* convert to CYRUSDB errors*/
+        if (r == -ENOENT) r = CYRUSDB_NOTFOUND;
+        else r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    db->is_open = 0;
+
+    /* grab a read lock, only reading the header */
+    r = read_lock(db);
+    if (r) goto done;
+
+    /* if the map size is zero, it's a new file - we need to create an
+     * empty index and the header */
+    if (mappedfile_size(db->mf) == 0) {
+        struct builder b;
+
+        unlock(db);
+        r = write_lock(db);
+        if (r) goto done;
+
+        /* someone else may have beaten us to it */
+        if (mappedfile_size(db->mf) == 0) {
+            memset(&b, 0, sizeof(struct builder));
+            b.mf = db->mf;
+            b.offset = HEADER_SIZE;
+
+            r = builder_finish(&b, &db->header);
+            builder_fini(&b);
+            if (!r) {
+                db->header.generation = 1;
+                r = commit_header(db->mf, &db->header);
+            }
+            if (r) {
+                syslog(LOG_ERR, "DBERROR: writing header for %s: %m",
+                       fname);
+                goto done;
+            }
+        }
+    }
+
+    db->is_open = 1;
+
+    r = read_header(db);
+    if (!r) r = refresh(db);
+    if (r) goto done;
+
+    /* unlock the DB */
+    unlock(db);
+
+    *ret = db;
+
+    if (mytid) {
+        r = newtxn(db, mytid);
+        if (r) goto done;
+    }
+
+done:
+    if (r) dispose_db(db);
+    return r;
+}
+
+static int myopen(const char *fname, int flags, struct dbengine **ret, struct txn **mytid)
+{
+    struct db_list *ent;
+    struct dbengine *mydb;
+    int r = 0;
+
+    /* do we already have this DB open? */
+    for (ent = open_blockdb; ent; ent = ent->next) {
+        if (strcmp(FNAME(ent->db), fname)) continue;
+        if (ent->db->current_txn)
+            return CYRUSDB_LOCKED;
+        if (mytid) {
+            r = newtxn(ent->db, mytid);
+            if (r) return r;
+        }
+        ent->refcount++;
+        *ret = ent->db;
+        return 0;
+    }
+
+    r = opendb(fname, flags, &mydb, mytid);
+    if (r) return r;
+
+    /* track this database in the open list */
+    ent = (struct db_list *) xzmalloc(sizeof(struct db_list));
+    ent->db = mydb;
+    ent->refcount = 1;
+    ent->next = open_blockdb;
+    open_blockdb = ent;
+
+    /* return the open DB */
+    *ret = mydb;
+
+    return 0;
+}
+
+static int myclose(struct dbengine *db)
+{
+    struct db_list *ent = open_blockdb;
+    struct db_list *prev = NULL;
+
+    assert(db);
+
+    /* remove this DB from the open list */
+    while (ent && ent->db != db) {
+        prev = ent;
+        ent = ent->next;
+    }
+    assert(ent);
+
+    if (--ent->refcount <= 0) {
+        if (prev) prev->next = ent->next;
+        else open_blockdb = ent->next;
+        free(ent);
+        if (mappedfile_islocked(db->mf))
+            syslog(LOG_ERR, "blockdb: %s closed while still locked", FNAME(db));
+        dispose_db(db);
+    }
+
+    return 0;
+}
+
+/*************** EXTERNAL APIS ***********************/
+
+static int myfetch(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char **foundkey, size_t *foundkeylen,
+            const char **data, size_t *datalen,
+            struct txn **tidptr, int fetchnext)
+{
+    const char *val = NULL;
+    size_t vallen = 0;
+    int r = 0;
+
+    assert(db);
+    if (datalen) assert(data);
+
+    if (data) *data = NULL;
+    if (datalen) *datalen = 0;
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+    }
+
+    if (fetchnext) {
+        const char *k;
+        size_t kl;
+
+        r = cursor_seek(db, &db->cur, key, keylen, 1);
+        if (r) goto done;
+
+        if (!db->cur.valid) {
+            r = CYRUSDB_NOTFOUND;
+            goto done;
+        }
+
+        cursor_get(db, &db->cur, &k, &kl, &val, &vallen);
+        buf_setmap(&db->keybuf, k, kl);
+
+        if (foundkey) *foundkey = db->keybuf.s;
+        if (foundkeylen) *foundkeylen = db->keybuf.len;
+    }
+    else {
+        r = lookup(db, key, keylen, &val, &vallen);
+        if (r) goto done;
+    }
+
+    if (data) *data = val;
+    if (datalen) *datalen = vallen;
+
+done:
+    if (!tidptr) {
+        /* release read lock */
+        int r1;
+        if ((r1 = unlock(db)) < 0) {
+            return r1;
+        }
+    }
+
+    return r;
+}
+
+/* foreach allows for subsidiary mailbox operations in 'cb'.
+   if there is a txn, 'cb' must make use of it.
+*/
+static int myforeach(struct dbengine *db,
+                     const char *prefix, size_t prefixlen,
+                     foreach_p *goodp,
+                     foreach_cb *cb, void *rock,
+                     struct txn **tidptr)
+{
+    int r = 0, cb_r = 0;
+    int num_misses = 0;
+    int need_unlock = 0;
+    const char *key, *val;
+    size_t keylen, vallen;
+    struct cursor c;
+    struct buf keybuf = BUF_INITIALIZER;
+
+    assert(db);
+    assert(cb);
+    if (prefixlen) assert(prefix);
+
+    memset(&c, 0, sizeof(struct cursor));
+
+    /* Hacky workaround:
+     *
+     * If no transaction was passed, but we're in a transaction,
+     * then just do the read within that transaction.
+     */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+        /* grab a r lock */
+        r = read_lock(db);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    r = cursor_seek(db, &c, prefix, prefixlen, 0);
+
+    while (!r && c.valid) {
+        cursor_get(db, &c, &key, &keylen, &val, &vallen);
+
+        /* does it match prefix? */
+        if (prefixlen) {
+            if (keylen < prefixlen) break;
+            if (db->compar(key, prefixlen, prefix, prefixlen)) break;
+        }
+
+        if (!goodp || goodp(rock, key, keylen, val, vallen)) {
+            /* take a copy of the key - cb may change this database
+             * and clobber our cursor */
+            buf_setmap(&keybuf, key, keylen);
+
+            if (!tidptr) {
+                /* release read lock */
+                r = unlock(db);
+                if (r) break;
+                need_unlock = 0;
+            }
+
+            /* make callback */
+            cb_r = cb(rock, keybuf.s, keybuf.len, val, vallen);
+            if (cb_r) break;
+
+            if (!tidptr) {
+                /* grab a r lock */
+                r = read_lock(db);
+                if (r) break;
+                need_unlock = 1;
+
+                num_misses = 0;
+            }
+        }
+        else if (!tidptr && ++num_misses > FOREACH_LOCK_RELEASE) {
+            buf_setmap(&keybuf, key, keylen);
+
+            /* release read lock */
+            r = unlock(db);
+            if (r) break;
+            need_unlock = 0;
+
+            /* grab a r lock */
+            r = read_lock(db);
+            if (r) break;
+            need_unlock = 1;
+
+            num_misses = 0;
+        }
+
+        /* the cursor only needs finding again if something changed */
+        if (c.changes != db->changes)
+            r = cursor_seek(db, &c, keybuf.s, keybuf.len, 1);
+        else
+            r = cursor_next(db, &c);
+    }
+
+    buf_free(&keybuf);
+    buf_free(&c.block.key);
+
+    if (need_unlock) {
+        /* release read lock */
+        int r1 = unlock(db);
+        if (r1) return r1;
+    }
+
+    return r ? r : cb_r;
+}
+
+/* append a change to the log and the overlay */
+static int append_change(struct dbengine *db,
+                         const char *key, size_t keylen,
+                         const char *data, size_t datalen)
+{
+    struct buf *head = &db->writebuf;
+    struct iovec io[3];
+    size_t keyoffset;
+    ssize_t n;
+
+    buf_reset(head);
+    buf_putc(head, data ? STORE : DELETE);
+    put_varint(head, keylen);
+    put_varint(head, datalen);
+
+    io[0].iov_base = head->s;
+    io[0].iov_len = head->len;
+    io[1].iov_base = (char *)key;
+    io[1].iov_len = keylen;
+    io[2].iov_base = (char *)(data ? data : "");
+    io[2].iov_len = datalen;
+
+    keyoffset = db->end + head->len;
+
+    n = mappedfile_pwritev(db->mf, io, 3, db->end);
+    if (n < 0) return CYRUSDB_IOERROR;
+
+    db->end += n;
+
+    overlay_set(db, keyoffset, keylen, keyoffset + keylen, datalen, !data);
+
+    return 0;
+}
+
+static int need_checkpoint(struct dbengine *db)
+{
+    size_t logsize = db->header.current_size - db->header.log_offset;
+
+    if (db->open_flags & CYRUSDB_NOCOMPACT)
+        return 0;
+
+    return (logsize > MINREWRITE
+            && logsize * REWRITE_RATIO > db->header.log_offset);
+}
+
+/* sort the log after the last run into a new one, merging in the
+ * runs which are no bigger than it.  Called with the write lock held
+ * and everything up to db->end committed */
+static int write_run(struct dbengine *db)
+{
+    size_t old_size = db->header.current_size;
+    struct buf *buf = &db->writebuf;
+    struct buf crcs = BUF_INITIALIZER;
+    size_t start = db->end;
+    size_t offset = db->end;
+    size_t total = db->overlay_count;
+    size_t count = 0, chunkstart = 0;
+    size_t prev;
+    struct cursor c;
+    const char *key, *val;
+    size_t keylen, vallen;
+    uint32_t crc;
+    int m = 0;
+    int r;
+
+    /* keep each run over twice the size of the next newer one */
+    while (m < db->nruns
+           && (db->runs[m].count <= total || db->nruns - m >= MAXRUNS)) {
+        total += db->runs[m].count;
+        m++;
+    }
+
+    prev = (m < db->nruns) ? db->runs[m].offset : 0;
+
+    memset(&c, 0, sizeof(struct cursor));
+    buf_reset(buf);
+    buf_putc(buf, RUN);
+    put_u64(buf, prev);
+    put_u64(buf, 0);    /* the count, once we know it */
+    chunkstart = buf->len;
+
+    /* the deletes have to stay, they hide the blocks */
+    r = cursor_seek_ex(db, &c, NULL, 0, 0, m,
+                       CURSOR_NOBLOCKS | CURSOR_TOMBSTONES);
+    while (!r && c.valid) {
+        cursor_get(db, &c, &key, &keylen, &val, &vallen);
+
+        put_u64(buf, key - BASE(db));
+        put_u64(buf, keylen | (c.deleted ? RUN_DELETED : 0));
+        put_u64(buf, vallen);
+
+        if (!(++count % RUNCHUNK)) {
+            put_crc(&crcs, crc32_map(buf->s + chunkstart,
+                                     buf->len - chunkstart));
+            if (buf->len >= WRITEBUFSIZE) {
+                if (mappedfile_pwritebuf(db->mf, buf, offset) < 0)
+                    r = CYRUSDB_IOERROR;
+                offset += buf->len;
+                buf_reset(buf);
+            }
+            chunkstart = buf->len;
+        }
+
+        if (!r) r = cursor_next(db, &c);
+    }
+    if (r) goto done;
+
+    if (buf->len > chunkstart)
+        put_crc(&crcs, crc32_map(buf->s + chunkstart, buf->len - chunkstart));
+    buf_append(buf, &crcs);
+    if (mappedfile_pwritebuf(db->mf, buf, offset) < 0) {
+        r = CYRUSDB_IOERROR;
+        goto done;
+    }
+    offset += buf->len;
+
+    /* fill in the count, then the crc over the head and chunk crcs */
+    buf_reset(buf);
+    buf_putc(buf, RUN);
+    put_u64(buf, prev);
+    put_u64(buf, count);
+    if (mappedfile_pwritebuf(db->mf, buf, start) < 0) {
+        r = CYRUSDB_IOERROR;
+        goto done;
+    }
+
+    buf_append(buf, &crcs);
+    crc = crc32_buf(buf);
+    buf_reset(buf);
+    put_crc(buf, crc);
+    if (mappedfile_pwritebuf(db->mf, buf, offset) < 0) {
+        r = CYRUSDB_IOERROR;
+        goto done;
+    }
+    db->end = offset + 4;
+
+    r = mappedfile_commit(db->mf);
+    if (r) goto done;
+
+    db->header.run_offset = start;
+    db->header.current_size = db->end;
+    r = commit_header(db->mf, &db->header);
+    if (r) {
+        db->header.run_offset = db->run_offset;
+        db->header.current_size = old_size;
+        goto done;
+    }
+
+    buf_free(&crcs);
+    buf_free(&c.block.key);
+    buf_reset(buf);
+
+    /* the log we had read is all in the run now */
+    r = load_runs(db);
+    if (!r) r = reread_log(db);
+    if (r) db->index_generation = 0;
+    return r;
+
+ done:
+    /* the log still has it all, so just carry on without */
+    db->end = old_size;
+    if (mappedfile_truncate(db->mf, old_size) || mappedfile_commit(db->mf))
+        r = CYRUSDB_IOERROR;
+    buf_free(&crcs);
+    buf_free(&c.block.key);
+    buf_reset(buf);
+    return r;
+}
+
+static int mycommit(struct dbengine *db, struct txn *tid)
+{
+    struct buf buf = BUF_INITIALIZER;
+    ssize_t n;
+    int r = 0;
+
+    assert(db);
+    assert(tid == db->current_txn);
+
+    /* no need to commit if we haven't written anything */
+    if (db->end == tid->start)
+        goto done;
+
+    /* the commit covers all our changes */
+    buf_putc(&buf, COMMIT);
+    put_crc(&buf, crc32_map(BASE(db) + tid->start, db->end - tid->start));
+
+    n = mappedfile_pwritebuf(db->mf, &buf, db->end);
+    buf_free(&buf);
+    if (n < 0) {
+        r = CYRUSDB_IOERROR;
+        goto done;
+    }
+    db->end += n;
+
+    /* commit ALL outstanding changes first, before
+     * rewriting the header */
+    r = mappedfile_commit(db->mf);
+    if (r) goto done;
+
+    /* finally, update the header and commit again */
+    db->header.current_size = db->end;
+    r = commit_header(db->mf, &db->header);
+    if (r) goto done;
+
+    db->log_read = db->end;
+
+    /* keep the log that has to be read on open short */
+    if (db->end - db->tail_start > TAILSIZE) {
+        int r2 = write_run(db);
+        if (r2) {
+            syslog(LOG_NOTICE, "blockdb: failed to write a run for %s",
+                   FNAME(db));
+        }
+    }
+
+ done:
+    if (r) {
+        int r2;
+
+        /* error during commit; we must abort */
+        r2 = myabort(db, tid);
+        if (r2) {
+            syslog(LOG_ERR, "DBERROR: blockdb %s: commit AND abort failed",
+                   FNAME(db));
+        }
+    }
+    else {
+        free(tid);
+        db->current_txn = NULL;
+
+        if (need_checkpoint(db)) {
+            int r2 = mycheckpoint(db);
+            if (r2) {
+                syslog(LOG_NOTICE, "blockdb: failed to checkpoint %s: %m",
+                       FNAME(db));
+            }
+        }
+        else {
+            unlock(db);
+        }
+    }
+
+    return r;
+}
+
+static int myabort(struct dbengine *db, struct txn *tid)
+{
+    int r = 0;
+
+    assert(db);
+    assert(tid == db->current_txn);
+
+    /* free the tid */
+    free(tid);
+    db->current_txn = NULL;
+
+    /* the header on disk still has the last commit, and
+     * everything after it is ours to throw away */
+    r = read_header(db);
+    if (!r && SIZE(db) > db->header.current_size)
+        r = recovery(db);
+
+    /* and the overlay has our changes in it */
+    if (!r) r = reread_log(db);
+
+    unlock(db);
+
+    return r;
+}
+
+static int mystore(struct dbengine *db,
+            const char *key, size_t keylen,
+            const char *data, size_t datalen,
+            struct txn **tidptr, int force)
+{
+    struct txn *localtid = NULL;
+    const char *oldval = NULL;
+    size_t oldvallen = 0;
+    int r = 0;
+    int r2 = 0;
+
+    assert(db);
+    assert(key && keylen);
+
+    /* not keeping the transaction, just create one local to
+     * this function */
+    if (!tidptr) tidptr = &localtid;
+
+    /* make sure we're write locked and up to date */
+    if (!*tidptr) {
+        r = newtxn(db, tidptr);
+        if (r) return r;
+    }
+
+    r = lookup(db, key, keylen, &oldval, &oldvallen);
+
+    if (!r) {
+        /* could be a delete or a replace */
+        if (!data) {
+            r = append_change(db, key, keylen, NULL, 0);
+            if (!r) db->header.num_records--;
+        }
+        else if (!force) {
+            r = CYRUSDB_EXISTS;
+        }
+        else if (oldvallen != datalen || memcmp(oldval, data, datalen)) {
+            r = append_change(db, key, keylen, data, datalen);
+        }
+        /* unchanged?  Save the IO */
+    }
+    else if (r == CYRUSDB_NOTFOUND) {
+        r = 0;
+        /* only create if it's not a delete, obviously */
+        if (data) {
+            r = append_change(db, key, keylen, data, datalen);
+            if (!r) db->header.num_records++;
+        }
+        /* must be a delete - are we forcing? */
+        else if (!force) {
+            r = CYRUSDB_NOTFOUND;
+        }
+    }
+
+    if (r) {
+        r2 = myabort(db, *tidptr);
+        *tidptr = NULL;
+    }
+    else if (localtid) {
+        /* commit the store, which releases the write lock */
+        r = mycommit(db, localtid);
+    }
+
+    return r2 ? r2 : r;
+}
+
+/* only one process copies for a checkpoint at a time */
+static int checkpoint_lock(struct dbengine *db, int *fdp)
+{
+    char fname[1024];
+    int fd;
+
+    snprintf(fname, sizeof(fname), "%s.CHECKPOINT", FNAME(db));
+    fd = open(fname, O_RDWR | O_CREAT, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: blockdb open %s: %m", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    if (lock_nonblocking(fd, fname) < 0) {
+        int r = CYRUSDB_IOERROR;
+        if (errno == EACCES || errno == EAGAIN || errno == EWOULDBLOCK)
+            r = CYRUSDB_LOCKED;
+        else
+            syslog(LOG_ERR, "IOERROR: blockdb lock %s: %m", fname);
+        close(fd);
+        return r;
+    }
+
+    *fdp = fd;
+
+    return 0;
+}
+
+/* append the transactions from 'offset' on to the new file, leaving
+ * out the runs.  Each commit's crc only covers its own changes, so
+ * they can be copied byte for byte */
+static int copy_tail(struct dbengine *db, size_t offset,
+                     struct mappedfile *newmf, struct db_header *newheader)
+{
+    size_t from = offset;
+    size_t n;
+
+    while (offset < db->end) {
+        n = parse_record(db, offset, db->end);
+        if (!n) {
+            syslog(LOG_ERR, "DBERROR: %s: blockdb invalid log entry at %llX",
+                   FNAME(db), (LLU)offset);
+            return CYRUSDB_IOERROR;
+        }
+
+        if (BASE(db)[offset] == RUN) {
+            if (offset > from) {
+                if (mappedfile_pwrite(newmf, BASE(db) + from, offset - from,
+                                      newheader->current_size) < 0)
+                    return CYRUSDB_IOERROR;
+                newheader->current_size += offset - from;
+            }
+            from = offset + n;
+        }
+
+        offset += n;
+    }
+
+    if (offset > from) {
+        if (mappedfile_pwrite(newmf, BASE(db) + from, offset - from,
+                              newheader->current_size) < 0)
+            return CYRUSDB_IOERROR;
+        newheader->current_size += offset - from;
+    }
+
+    return 0;
+}
+
+/* merge the blocks and the log into a new file, then rename it over
+ * the old one.  Called with the write lock held, returns unlocked */
+static int mycheckpoint(struct dbengine *db)
+{
+    uint64_t generation = db->header.generation;
+    uint64_t num_records = db->header.num_records;
+    size_t old_size = db->header.current_size;
+    size_t start = db->header.current_size;
+    struct mappedfile *newmf = NULL;
+    struct db_header newheader;
+    struct timeval begin, pause_begin, now;
+    struct builder b;
+    struct cursor c;
+    const char *key, *val;
+    size_t keylen, vallen;
+    char newfname[1024];
+    int lockfd = -1;
+    int locked = 1;
+    int r = 0;
+
+    assert(!db->current_txn);
+
+    gettimeofday(&begin, NULL);
+
+    r = checkpoint_lock(db, &lockfd);
+    if (r) {
+        unlock(db);
+        /* someone else is already on it */
+        return (r == CYRUSDB_LOCKED) ? 0 : r;
+    }
+
+    memset(&b, 0, sizeof(struct builder));
+    memset(&c, 0, sizeof(struct cursor));
+    memset(&newheader, 0, sizeof(struct db_header));
+
+    /* let everyone else carry on while we copy.  Nothing up to
+     * 'start' changes until somebody renames a new file into place,
+     * and only the holder of the checkpoint lock does that */
+    unlock(db);
+    locked = 0;
+
+    /* open fname.NEW */
+    snprintf(newfname, sizeof(newfname), "%s.NEW", FNAME(db));
+    unlink(newfname);
+
+    r = mappedfile_open(&newmf, newfname, MAPPEDFILE_RW | MAPPEDFILE_CREATE);
+    if (r) goto err;
+
+    r = mappedfile_writelock(newmf);
+    if (r) goto err;
+
+    b.mf = newmf;
+    b.offset = HEADER_SIZE;
+
+    r = cursor_seek(db, &c, NULL, 0, 0);
+    while (!r && c.valid) {
+        cursor_get(db, &c, &key, &keylen, &val, &vallen);
+        r = builder_add(&b, key, keylen, val, vallen);
+        if (!r) r = cursor_next(db, &c);
+    }
+    if (!r) r = builder_finish(&b, &newheader);
+    if (r) goto err;
+
+    if (newheader.num_records != num_records) {
+        syslog(LOG_ERR, "DBERROR: %s: blockdb record count mismatch %llu != %llu",
+               FNAME(db), (LLU)newheader.num_records, (LLU)num_records);
+        r = CYRUSDB_INTERNAL;
+        goto err;
+    }
+
+    /* now lock everyone out while we catch up */
+    gettimeofday(&pause_begin, NULL);
+
+    r = write_lock(db);
+    if (r) goto err;
+    locked = 1;
+
+    if (db->header.generation != generation || db->end < start) {
+        /* somebody replaced the file under us, our copy is stale */
+        r = 0;
+        goto err;
+    }
+
+    /* the new file's log starts with everything committed since */
+    r = copy_tail(db, start, newmf, &newheader);
+    if (r) goto err;
+
+    newheader.num_records = db->header.num_records;
+
+    /* increase the generation count */
+    newheader.generation = db->header.generation + 1;
+
+    r = commit_header(newmf, &newheader);
+    if (r) goto err;
+
+    /* move new file to original file name */
+    r = mappedfile_rename(newmf, FNAME(db));
+    if (r) goto err;
+
+    /* OK, we're committed now - switch over to the new file */
+    unlock(db);
+    mappedfile_close(&db->mf);
+    db->mf = newmf;
+    newmf = NULL;
+
+    r = read_header(db);
+    if (!r) r = refresh(db);
+    unlock(db);
+
+    gettimeofday(&now, NULL);
+
+    builder_fini(&b);
+    buf_free(&c.block.key);
+    close(lockfd);
+
+    if (r) return r;
+
+    {
+        double pause = timesub(&pause_begin, &now);
+
+        syslog(LOG_INFO,
+               "blockdb: checkpointed %s (%llu record%s in %lu block%s, %llu => %llu bytes) in %2.3f seconds (%2.3f locked)",
+               FNAME(db), (LLU)db->header.num_records,
+               db->header.num_records == 1 ? "" : "s",
+               (LU)db->header.num_blocks,
+               db->header.num_blocks == 1 ? "" : "s",
+               (LLU)old_size, (LLU)db->header.current_size,
+               timesub(&begin, &now), pause);
+
+        cyrusdb_checkpoint_done(FNAME(db), pause);
+    }
+
+    return 0;
+
+ err:
+    if (newmf) {
+        /* it's going away, nothing to sync */
+        mappedfile_defer(newmf);
+        mappedfile_unlock(newmf);
+        mappedfile_close(&newmf);
+    }
+    unlink(newfname);
+    builder_fini(&b);
+    buf_free(&c.block.key);
+    if (locked) unlock(db);
+    close(lockfd);
+    return r ? CYRUSDB_IOERROR : 0;
+}
+
+/* an explicit repack, outside of any transaction */
+static int myrepack(struct dbengine *db)
+{
+    int r;
+
+    if (db->current_txn) return CYRUSDB_LOCKED;
+
+    r = write_lock(db);
+    if (r) return r;
+
+    return mycheckpoint(db);
+}
+
+/* dump the database */
+static int dump(struct dbengine *db, int detail __attribute__((unused)))
+{
+    struct blockcursor cur;
+    struct buf scratch = BUF_INITIALIZER;
+    size_t keyoffset, keylen, valoffset, vallen, count;
+    size_t offset, n, i;
+    int r = 0;
+
+    memset(&cur, 0, sizeof(struct blockcursor));
+
+    if (!db->current_txn) {
+        r = read_lock(db);
+        if (r) return r;
+    }
+
+    printf("HEADER: v=%lu gen=%llu num=%llu blocks=%lu idx=%08llX log=%08llX run=%08llX sz=%08llX\n",
+           (LU)db->header.version,
+           (LLU)db->header.generation,
+           (LLU)db->header.num_records,
+           (LU)db->header.num_blocks,
+           (LLU)db->header.index_offset,
+           (LLU)db->header.log_offset,
+           (LLU)db->header.run_offset,
+           (LLU)db->header.current_size);
+
+    for (i = 0; i < db->header.num_blocks; i++) {
+        struct blockref *ref = &db->index[i];
+
+        buf_setmap(&scratch, BASE(db) + ref->keyoffset, ref->keylen);
+        buf_replace_char(&scratch, '\0', '-');
+        printf("%08llX BLOCK len=%llu (%s)\n",
+               (LLU)ref->offset, (LLU)ref->len, buf_cstring(&scratch));
+
+        r = block_start(db, &cur, i);
+        while (!r && cur.valid && cur.block == i) {
+            buf_copy(&scratch, &cur.key);
+            buf_replace_char(&scratch, '\0', '-');
+            printf("\tkl=%llu dl=%llu (%s)\n", (LLU)cur.key.len,
+                   (LLU)cur.vallen, buf_cstring(&scratch));
+            r = block_next(db, &cur);
+        }
+        if (r) {
+            printf("ERROR\n");
+            goto done;
+        }
+    }
+
+    for (offset = db->header.log_offset; offset < db->end; offset += n) {
+        char type = BASE(db)[offset];
+
+        printf("%08llX ", (LLU)offset);
+
+        if (type == COMMIT) {
+            printf("COMMIT\n");
+            n = 5;
+            continue;
+        }
+
+        if (type == RUN) {
+            n = parse_run(db, offset, db->end, &count);
+            if (!n) {
+                printf("ERROR\n");
+                r = CYRUSDB_IOERROR;
+                break;
+            }
+            printf("RUN prev=%08llX count=%llu\n",
+                   (LLU)get_u64(BASE(db) + offset + 1), (LLU)count);
+            continue;
+        }
+
+        n = 0;
+        if (type == STORE || type == DELETE)
+            n = parse_change(db, offset, db->end,
+                             &keyoffset, &keylen, &valoffset, &vallen);
+        if (!n) {
+            printf("ERROR\n");
+            r = CYRUSDB_IOERROR;
+            break;
+        }
+
+        buf_setmap(&scratch, BASE(db) + keyoffset, keylen);
+        buf_replace_char(&scratch, '\0', '-');
+        printf("%s kl=%llu dl=%llu (%s)\n",
+               (type == STORE ? "STORE" : "DELETE"),
+               (LLU)keylen, (LLU)vallen, buf_cstring(&scratch));
+    }
+
+ done:
+    buf_free(&cur.key);
+    buf_free(&scratch);
+
+    if (!db->current_txn) unlock(db);
+
+    return r;
+}
+
+/* perform some basic consistency checks */
+static int myconsistent(struct dbengine *db)
+{
+    struct blockcursor cur;
+    struct cursor c;
+    struct buf prev = BUF_INITIALIZER;
+    struct logentry *e;
+    struct runentry re;
+    const char *key, *val;
+    size_t keylen, vallen;
+    size_t num_records = 0;
+    size_t block = (size_t)-1;
+    size_t i;
+    int n;
+    int r = 0;
+
+    memset(&cur, 0, sizeof(struct blockcursor));
+    memset(&c, 0, sizeof(struct cursor));
+
+    /* the blocks are in order, and each starts with its index key */
+    r = block_start(db, &cur, 0);
+    while (!r && cur.valid) {
+        if (cur.block != block) {
+            struct blockref *ref = &db->index[cur.block];
+
+            block = cur.block;
+            if (db->compar(cur.key.s, cur.key.len,
+                           BASE(db) + ref->keyoffset, ref->keylen)) {
+                syslog(LOG_ERR, "DBERROR: blockdb %s: block %llu doesn't match the index",
+                       FNAME(db), (LLU)block);
+                r = CYRUSDB_INTERNAL;
+                goto done;
+            }
+        }
+
+        if (prev.len && db->compar(prev.s, prev.len,
+                                   cur.key.s, cur.key.len) >= 0) {
+            syslog(LOG_ERR, "DBERROR: blockdb %s: out of order in block %llu",
+                   FNAME(db), (LLU)cur.block);
+            r = CYRUSDB_INTERNAL;
+            goto done;
+        }
+        buf_copy(&prev, &cur.key);
+
+        r = block_next(db, &cur);
+    }
+    if (r) goto done;
+
+    /* the log is in order */
+    buf_reset(&prev);
+    for (e = db->overlay->next[0]; e; e = e->next[0]) {
+        if (prev.len && db->compar(prev.s, prev.len,
+                                   LOGKEY(db, e), e->keylen) >= 0) {
+            syslog(LOG_ERR, "DBERROR: blockdb %s: log out of order",
+                   FNAME(db));
+            r = CYRUSDB_INTERNAL;
+            goto done;
+        }
+        buf_setmap(&prev, LOGKEY(db, e), e->keylen);
+    }
+
+    /* and so is each run, with all of its crcs intact */
+    for (n = 0; n < db->nruns; n++) {
+        struct run *run = &db->runs[n];
+
+        buf_reset(&prev);
+        for (i = 0; i < run->count; i++) {
+            r = run_entry(db, run, i, &re);
+            if (r) goto done;
+
+            if (prev.len && db->compar(prev.s, prev.len,
+                                       BASE(db) + re.keyoffset,
+                                       re.keylen) >= 0) {
+                syslog(LOG_ERR, "DBERROR: blockdb %s: run at %llX out of order",
+                       FNAME(db), (LLU)run->offset);
+                r = CYRUSDB_INTERNAL;
+                goto done;
+            }
+            buf_setmap(&prev, BASE(db) + re.keyoffset, re.keylen);
+        }
+    }
+
+    /* and together they have the right number of records */
+    r = cursor_seek(db, &c, NULL, 0, 0);
+    while (!r && c.valid) {
+        cursor_get(db, &c, &key, &keylen, &val, &vallen);
+        num_records++;
+        r = cursor_next(db, &c);
+    }
+    if (r) goto done;
+
+    if (num_records != db->header.num_records) {
+        syslog(LOG_ERR, "DBERROR: blockdb %s: record count mismatch %llu != %llu",
+               FNAME(db), (LLU)num_records, (LLU)db->header.num_records);
+        r = CYRUSDB_INTERNAL;
+    }
+
+ done:
+    buf_free(&prev);
+    buf_free(&cur.key);
+    buf_free(&c.block.key);
+    return r;
+}
+
+static int consistent(struct dbengine *db)
+{
+    int r;
+
+    r = read_lock(db);
+    if (r) return r;
+
+    r = myconsistent(db);
+
+    unlock(db);
+
+    return r;
+}
+
+static int fetch(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    assert(key);
+    assert(keylen);
+    return myfetch(mydb, key, keylen, NULL, NULL,
+                   data, datalen, tidptr, 0);
+}
+
+static int fetchnext(struct dbengine *mydb,
+                 const char *key, size_t keylen,
+                 const char **foundkey, size_t *fklen,
+                 const char **data, size_t *datalen,
+                 struct txn **tidptr)
+{
+    return myfetch(mydb, key, keylen, foundkey, fklen,
+                   data, datalen, tidptr, 1);
+}
+
+static int create(struct dbengine *db,
+                  const char *key, size_t keylen,
+                  const char *data, size_t datalen,
+                  struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 0);
+}
+
+static int store(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 const char *data, size_t datalen,
+                 struct txn **tid)
+{
+    if (datalen) assert(data);
+    return mystore(db, key, keylen, data ? data : "", datalen, tid, 1);
+}
+
+static int delete(struct dbengine *db,
+                 const char *key, size_t keylen,
+                 struct txn **tid, int force)
+{
+    return mystore(db, key, keylen, NULL, 0, tid, force);
+}
+
+/* blockdb compar function is set at open */
+static int mycompar(struct dbengine *db, const char *a, int alen,
+                    const char *b, int blen)
+{
+    return db->compar(a, alen, b, blen);
+}
+
+HIDDEN struct cyrusdb_backend cyrusdb_blockdb =
+{
+    "blockdb",                  /* name */
+
+    &cyrusdb_generic_init,
+    &cyrusdb_generic_done,
+    &cyrusdb_generic_sync,
+    &cyrusdb_generic_archive,
+    &cyrusdb_generic_unlink,
+
+    &myopen,
+    &myclose,
+
+    &fetch,
+    &fetch,
+    &fetchnext,
+    NULL,
+
+    &myforeach,
+    &create,
+    &store,
+    &delete,
+
+    &mycommit,
+    &myabort,
+
+    &dump,
+    &consistent,
+    &myrepack,
+    &mycompar
+};
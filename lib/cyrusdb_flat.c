@@ -845,6 +845,7 @@ EXPORTED struct cyrusdb_backend cyrusdb_flat =
     &fetch,
     &fetchlock,
     NULL,
+    NULL,
 
     &foreach,
     &create,
@@ -889,6 +889,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_quotalegacy =
     &fetch,
     &fetch,
     NULL,
+    NULL,
 
     &foreach,
     &create,
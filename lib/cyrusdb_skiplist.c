@@ -2462,6 +2462,7 @@ EXPORTED struct cyrusdb_backend cyrusdb_skiplist =
     &fetch,
     &fetchlock,
     NULL,
+    NULL,
 
     &myforeach,
     &create,
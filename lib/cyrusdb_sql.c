@@ -908,6 +908,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_sql =
     &fetch,
     &fetch,
     NULL,
+    NULL,
 
     &foreach,
     &create,
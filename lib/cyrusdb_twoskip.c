@@ -47,18 +47,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <syslog.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #ifdef HAVE_UNISTD_H
 #include <unistd.h>
 #endif
 
 #include "assert.h"
+#include "bloom.h"
 #include "bsearch.h"
 #include "byteorder64.h"
 #include "cyrusdb.h"
 #include "crc32.h"
 #include "libcyr_cfg.h"
 #include "mappedfile.h"
+#include "retry.h"
 #include "util.h"
 #include "xmalloc.h"
 
@@ -254,6 +259,16 @@
  * more reliable than just using the inode, because inodes
  * can be reused.
  *
+ * The copy is done without holding the write lock, like any
+ * other foreach, so writers carry on appending to the old
+ * file meanwhile.  Then the checkpointer takes the write lock,
+ * brings every key written or deleted since the copy started
+ * up to date in the new file, and renames it into place - so
+ * writers are only locked out for as long as it takes to catch
+ * up with the tail.  An exclusive lock on byte 2 of "<fname>.group" stops
+ * more than one process from copying at once; anyone else
+ * who finds the database due for a checkpoint just leaves it.
+ *
  * LOCATION OPTIMISATION:
  * If the generation is unchanged AND the size of the file
  * is unchanged, then all offsets stored in the skiploc are
@@ -262,6 +277,81 @@
  * regular fetches that happen to hit either the current key,
  * the gap immediately after, or the next key.  All other
  * locations cause a full relocate.
+ *
+ * GROUP COMMIT:
+ * If twoskip_groupcommit is set, commit appends the COMMIT
+ * record but doesn't fsync or move current_size.  Instead the
+ * header carries the PENDING flag as well as DIRTY, and the
+ * committer takes a shared lock on "<fname>.group", drops the
+ * database lock and queues for the sync lock in the same file.
+ * Whoever holds the sync lock fsyncs everything committed so
+ * far without holding the database lock, so other writers keep
+ * appending meanwhile, and then moves current_size up to cover
+ * it.  The next in the queue usually finds its COMMIT already
+ * covered and returns without any IO at all.  If others are
+ * waiting, the holder of the sync lock can sleep for
+ * twoskip_groupcommit_delay first to let more transactions join.
+ *
+ * While anyone holds the shared lock, committed transactions past
+ * current_size are treated as real: readers and writers set 'end'
+ * to the end of the file.  If nobody holds it, every committer in
+ * the tail is dead or the machine crashed, none of them were told
+ * their data was safe, and plain recovery to current_size is fine.
+ *
+ * Each transaction remembers its own start, which takes the place
+ * of current_size in the level zero logic above, so an abort only
+ * rolls back to there.  To keep crash recovery to current_size
+ * working as well, a record below current_size must never lose
+ * its last level zero pointer below current_size - if it would,
+ * the tail so far is fsynced and current_size moved up to the
+ * start of the transaction first.
+ *
+ * SNAPSHOT READS:
+ * If twoskip_snapshot_reads is set, fetch and foreach outside a
+ * transaction don't lock the file at all.  They read the header and
+ * use current_size as 'end', and everything below that is a snapshot
+ * of the last commit which writers never change, apart from pointers.
+ * A checkpoint writes a new file, so an old snapshot stays readable
+ * and the next one picks up the new file.
+ *
+ * The pointers are why this works: a higher level pointer to or past
+ * 'end' belongs to a later transaction, so the reader just carries on
+ * at the level below.  At level zero, writers always replace the
+ * lower of the two pointers, so the highest one below 'end' stays
+ * correct for the snapshot until later transactions have replaced
+ * both.  Then the reader sees no pointer below 'end', just like a
+ * record head caught half rewritten fails its CRC, and both mean the
+ * same thing: CYRUSDB_AGAIN, take a new snapshot and find the same
+ * key again.  After SNAPSHOT_RETRIES of those in a row, the reader
+ * gives up and takes a read lock.
+ *
+ * A skiploc found in a snapshot may have skipped pointers to later
+ * records, which is fine for reading but wrong for linking in new
+ * ones, so writers always relocate rather than reuse it.
+ *
+ * BLOOM FILTERS:
+ * If twoskip_bloom is set, a checkpoint also writes a bloom filter
+ * of every key in the new file to "<fname>.bloom", and renames it
+ * into place just before the database.  Its header records the
+ * generation, repack size and inode number of the file it was built
+ * for - so a filter left behind by another database of the same name
+ * isn't trusted - and 'covered': the offset up to
+ * which every key stored is in the filter.  Writers map the file
+ * shared and set the bits for each key they store, and on commit
+ * move 'covered' up to the end of their transaction - but only if
+ * it already reached the start, so one writer who didn't keep the
+ * filter up to date (or a crash that lost its bits) leaves it
+ * unused until the next checkpoint rather than wrong.  The bits
+ * are fdatasynced before the database itself, by the committer or
+ * in group commit mode by whoever syncs for the group.
+ *
+ * A fetch of an exact key checks the filter first, if it's for the
+ * current generation and covers everything the reader can see -
+ * 'end', or the start of its own transaction, whose stores are in
+ * the filter already - and if the key isn't in it, returns
+ * CYRUSDB_NOTFOUND without searching the skiplist.  Deleted keys
+ * stay in the filter until the next checkpoint, which only costs
+ * a search.
  */
 
 
@@ -279,6 +369,18 @@
 /* release lock in foreach at least every N records */
 #define FOREACH_LOCK_RELEASE 256
 
+/* take a read lock after this many snapshots in a row were too old */
+#define SNAPSHOT_RETRIES 3
+
+/* size bloom filters for twice the records at checkpoint, within
+ * these limits, for this rate of false positives */
+#define BLOOM_MINENTRIES 1024
+#define BLOOM_MAXENTRIES (1<<27)
+#define BLOOM_ERROR 0.01
+
+/* pass bloom filter statistics on every N checks */
+#define BLOOM_STATS_BATCH 1024
+
 /* format specifics */
 #undef VERSION /* defined in config.h */
 #define VERSION 1
@@ -354,14 +456,19 @@ struct skiploc {
     /* need a generation so we know if the location is still valid */
     uint64_t generation;
     size_t end;
+
+    /* found without a lock, only good for reading */
+    int snapshot;
 };
 
 #define DIRTY (1<<0)
+#define PENDING (1<<1)
 
 struct txn {
     /* logstart is where we start changes from on commit, where we truncate
        to on abort */
     int num;
+    size_t start;
 };
 
 struct db_header {
@@ -387,9 +494,38 @@ struct dbengine {
     int txn_num;
     struct txn *current_txn;
 
+    /* lock-free reads */
+    int snapshot_reads; /* allowed */
+    int snapshot;       /* reading from one right now */
+
     /* comparator function to use for sorting */
     int open_flags;
     int (*compar) (const char *s1, int l1, const char *s2, int l2);
+
+    /* group commit state, survives checkpoints */
+    struct {
+        int enabled;    /* share fsyncs with other committers */
+        int delay;      /* microseconds to wait for more of them */
+        int fd;         /* <fname>.group, -1 if not opened yet */
+        int waiting;    /* we hold a shared lock on it */
+    } group;
+
+    /* bloom filter of keys, see BLOOM FILTERS */
+    struct {
+        int enabled;
+        int fd;                 /* <fname>.bloom, -1 if not opened */
+        char *base;             /* mapped shared */
+        size_t size;
+        uint64_t generation;    /* of the file it was built for */
+        uint64_t repack_size;   /* likewise */
+        uint64_t ino;           /* likewise */
+        uint64_t tried;         /* database generation we opened it for */
+        struct bloom filter;    /* bits at base + BLOOM_HEADER_SIZE */
+        /* statistics not passed on yet */
+        unsigned long checks;
+        unsigned long negatives;
+        unsigned long false_positives;
+    } bloom;
 };
 
 struct db_list {
@@ -417,6 +553,22 @@ enum {
 #define DUMMY_OFFSET HEADER_SIZE
 #define MAXRECORDHEAD ((MAXLEVEL + 5)*8)
 
+#define BLOOM_MAGIC ("\241\002\213\015twoskip bloom\0\0\0")
+#define BLOOM_MAGIC_SIZE (20)
+
+/* offsets of bloom filter header fields, the CRC doesn't
+ * cover 'covered' since writers update it in place */
+enum {
+    BLOOM_OFFSET_ENTRIES = 20,
+    BLOOM_OFFSET_GENERATION = 24,
+    BLOOM_OFFSET_REPACK_SIZE = 32,
+    BLOOM_OFFSET_INODE = 40,
+    BLOOM_OFFSET_CRC32 = 48,
+    BLOOM_OFFSET_COVERED = 56,
+};
+
+#define BLOOM_HEADER_SIZE 64
+
 /* mount a scratch monkey */
 static union skipwritebuf {
     uint64_t align;
@@ -469,6 +621,7 @@ static int read_header(struct dbengine *db)
     assert(db && db->mf && db->is_open);
 
     if (SIZE(db) < HEADER_SIZE) {
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR,
                "twoskip: file not large enough for header: %s", FNAME(db));
         return CYRUSDB_IOERROR;
@@ -506,6 +659,8 @@ static int read_header(struct dbengine *db)
     crc = ntohl(*((uint32_t *)(BASE(db) + OFFSET_CRC32)));
 
     if (crc32_map(BASE(db), OFFSET_CRC32) != crc) {
+        /* caught in the middle of a write */
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: %s: twoskip header CRC failure",
                FNAME(db));
         return CYRUSDB_IOERROR;
@@ -575,6 +730,10 @@ static int read_onerecord(struct dbengine *db, size_t offset,
 
     if (!offset) return 0;
 
+    /* written after our snapshot */
+    if (db->snapshot && offset >= db->end)
+        return CYRUSDB_AGAIN;
+
     record->offset = offset;
     record->len = 24; /* absolute minimum */
 
@@ -631,6 +790,8 @@ static int read_onerecord(struct dbengine *db, size_t offset,
     record->crc32_head = ntohl(*((uint32_t *)base));
     if (crc32_map(BASE(db) + record->offset, (offset - record->offset))
         != record->crc32_head) {
+        /* caught in the middle of a rewrite */
+        if (db->snapshot) return CYRUSDB_AGAIN;
         syslog(LOG_ERR, "DBERROR: twoskip checksum head error for %s at %08llX",
                FNAME(db), (LLU)offset);
         return CYRUSDB_IOERROR;
@@ -789,6 +950,7 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
     /* dirty the header if not already dirty */
     if (!(db->header.flags & DIRTY)) {
         db->header.flags |= DIRTY;
+        if (db->group.enabled) db->header.flags |= PENDING;
         r = commit_header(db);
         if (r) return r;
     }
@@ -796,6 +958,354 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
     return write_record(db, record, key, val);
 }
 
+/************************** GROUP COMMIT ***************************/
+
+static int group_open(struct dbengine *db, int create)
+{
+    char fname[1024];
+
+    if (db->group.fd >= 0) return 0;
+
+    snprintf(fname, sizeof(fname), "%s.group", FNAME(db));
+    db->group.fd = open(fname, O_RDWR | (create ? O_CREAT : 0), 0644);
+    if (db->group.fd < 0) {
+        if (create || errno != ENOENT)
+            syslog(LOG_ERR, "IOERROR: twoskip open %s: %m", fname);
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* the .group locks are always fcntl, even with flock locking, because
+ * F_GETLK lets us look for waiters without taking the lock ourselves.
+ * Byte 0 is held shared by every waiting committer, byte 1 exclusive
+ * by whoever is doing the fsync for the group, and byte 2 exclusive
+ * by a process copying the database for a checkpoint. */
+enum {
+    GROUP_WAITING = 0,
+    GROUP_SYNCING = 1,
+    GROUP_CHECKPOINT = 2
+};
+
+static int group_setlock(struct dbengine *db, int which, short type)
+{
+    struct flock fl;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = type;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = which;
+    fl.l_len = 1;
+
+    while (fcntl(db->group.fd, F_SETLKW, &fl) < 0) {
+        if (errno == EINTR) continue;
+        syslog(LOG_ERR, "IOERROR: twoskip lock %s.group: %m", FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    if (which == GROUP_WAITING)
+        db->group.waiting = (type != F_UNLCK);
+
+    return 0;
+}
+
+/* is another process waiting for the tail to be fsynced? */
+static int group_others(struct dbengine *db)
+{
+    struct flock fl;
+
+    if (group_open(db, 0)) return 0;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = GROUP_WAITING;
+    fl.l_len = 1;
+
+    if (fcntl(db->group.fd, F_GETLK, &fl) < 0) return 0;
+
+    return (fl.l_type != F_UNLCK);
+}
+
+/* is anyone at all waiting for the tail to be fsynced? */
+static int group_islive(struct dbengine *db)
+{
+    /* F_GETLK doesn't report our own locks */
+    return db->group.waiting || group_others(db);
+}
+
+/* find the end of the last COMMIT record past current_size */
+static size_t group_tailend(struct dbengine *db)
+{
+    struct skiprecord record;
+    size_t offset = db->header.current_size;
+    size_t end = offset;
+
+    while (offset < SIZE(db)) {
+        if (read_onerecord(db, offset, &record)) break;
+        offset += record.len;
+        if (record.type == COMMIT) end = offset;
+    }
+
+    return end;
+}
+
+/* if the tail past current_size is entirely committed transactions
+ * that a live process is waiting on, use them */
+static int group_adopt(struct dbengine *db)
+{
+    struct skiprecord record;
+    size_t offset;
+
+    if (!(db->header.flags & PENDING)) return 0;
+
+    /* a COMMIT record is 24 bytes */
+    if (SIZE(db) < db->header.current_size + 24) return 0;
+
+    if (!group_islive(db)) return 0;
+
+    offset = SIZE(db) - 24;
+    if (read_onerecord(db, offset, &record)) return 0;
+    if (record.type != COMMIT) return 0;
+    if (record.nextloc[0] < db->header.current_size) return 0;
+    if (record.nextloc[0] >= offset) return 0;
+
+    db->end = SIZE(db);
+
+    return 1;
+}
+
+/* would rewriting the level zero pointers of this record leave it
+ * with nothing to recover to if we crashed now? */
+static int group_conflict(struct dbengine *db, struct skiprecord *record)
+{
+    size_t start = db->current_txn->start;
+    size_t current_size = db->header.current_size;
+
+    /* nothing pending */
+    if (start == current_size) return 0;
+
+    /* thrown away by crash recovery anyway */
+    if (record->offset >= current_size) return 0;
+
+    /* already this transaction, the other one is safe */
+    if (record->nextloc[0] >= start || record->nextloc[1] >= start)
+        return 0;
+
+    return (record->nextloc[0] >= current_size
+            || record->nextloc[1] >= current_size);
+}
+
+/* make everything before this transaction durable, in the middle of
+ * the transaction */
+static int group_flush(struct dbengine *db)
+{
+    int r = mappedfile_sync(db->mf);
+    if (r) return r;
+
+    db->header.current_size = db->current_txn->start;
+    return commit_header(db);
+}
+
+/* make everything up to the end of the file durable and mark the
+ * header clean */
+static int sync_tail(struct dbengine *db)
+{
+    /* commit ALL outstanding changes first, before
+     * rewriting the header */
+    int r = mappedfile_commit(db->mf);
+    if (r) return r;
+
+    /* finally, update the header and commit again */
+    db->header.current_size = db->end;
+    db->header.flags &= ~(DIRTY|PENDING);
+    return commit_header(db);
+}
+
+/************************** BLOOM FILTER ***************************/
+
+static void bloom_report(struct dbengine *db)
+{
+    if (!db->bloom.checks) return;
+
+    cyrusdb_bloom_stats(FNAME(db), db->bloom.checks, db->bloom.negatives,
+                        db->bloom.false_positives);
+
+    db->bloom.checks = 0;
+    db->bloom.negatives = 0;
+    db->bloom.false_positives = 0;
+}
+
+static void bloom_close(struct dbengine *db)
+{
+    if (db->bloom.base) {
+        bloom_free(&db->bloom.filter);
+        munmap(db->bloom.base, db->bloom.size);
+        db->bloom.base = NULL;
+    }
+
+    if (db->bloom.fd >= 0) {
+        close(db->bloom.fd);
+        db->bloom.fd = -1;
+    }
+}
+
+/* map <fname>.bloom, once per generation of the database */
+static void bloom_open(struct dbengine *db)
+{
+    char fname[1024];
+    struct stat sbuf;
+    uint32_t entries;
+    uint32_t crc;
+
+    bloom_close(db);
+    db->bloom.tried = db->header.generation;
+
+    snprintf(fname, sizeof(fname), "%s.bloom", FNAME(db));
+    db->bloom.fd = open(fname, O_RDWR, 0);
+    if (db->bloom.fd < 0) {
+        if (errno != ENOENT)
+            syslog(LOG_ERR, "IOERROR: twoskip open %s: %m", fname);
+        return;
+    }
+
+    if (fstat(db->bloom.fd, &sbuf) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip fstat %s: %m", fname);
+        goto err;
+    }
+    if (sbuf.st_size < BLOOM_HEADER_SIZE) goto bad;
+
+    db->bloom.size = sbuf.st_size;
+    db->bloom.base = mmap(NULL, db->bloom.size, PROT_READ|PROT_WRITE,
+                          MAP_SHARED, db->bloom.fd, 0);
+    if (db->bloom.base == MAP_FAILED) {
+        db->bloom.base = NULL;
+        syslog(LOG_ERR, "IOERROR: twoskip mmap %s: %m", fname);
+        goto err;
+    }
+
+    if (memcmp(db->bloom.base, BLOOM_MAGIC, BLOOM_MAGIC_SIZE))
+        goto bad;
+
+    crc = ntohl(*((uint32_t *)(db->bloom.base + BLOOM_OFFSET_CRC32)));
+    if (crc32_map(db->bloom.base, BLOOM_OFFSET_CRC32) != crc)
+        goto bad;
+
+    entries = ntohl(*((uint32_t *)(db->bloom.base + BLOOM_OFFSET_ENTRIES)));
+    db->bloom.generation
+        = ntohll(*((uint64_t *)(db->bloom.base + BLOOM_OFFSET_GENERATION)));
+    db->bloom.repack_size
+        = ntohll(*((uint64_t *)(db->bloom.base + BLOOM_OFFSET_REPACK_SIZE)));
+    db->bloom.ino
+        = ntohll(*((uint64_t *)(db->bloom.base + BLOOM_OFFSET_INODE)));
+
+    /* somebody else's, or from before the database was copied */
+    if (stat(FNAME(db), &sbuf) < 0 || (uint64_t) sbuf.st_ino != db->bloom.ino)
+        goto err;
+
+    if (bloom_init_buffer(&db->bloom.filter, entries, BLOOM_ERROR,
+                          (unsigned char *)db->bloom.base + BLOOM_HEADER_SIZE))
+        goto bad;
+    if (db->bloom.size != BLOOM_HEADER_SIZE + (size_t)db->bloom.filter.bytes)
+        goto bad;
+
+    return;
+
+ bad:
+    syslog(LOG_ERR, "DBERROR: twoskip %s: invalid bloom filter", fname);
+ err:
+    bloom_close(db);
+}
+
+/* does the filter hold every key stored below 'upto'? */
+static int bloom_covers(struct dbengine *db, size_t upto)
+{
+    size_t covered;
+
+    if (!db->bloom.enabled) return 0;
+
+    if (db->bloom.tried != db->header.generation)
+        bloom_open(db);
+
+    if (!db->bloom.base) return 0;
+    if (db->bloom.generation != db->header.generation) return 0;
+    if (db->bloom.repack_size != db->header.repack_size) return 0;
+
+    covered = ntohll(*((uint64_t *)(db->bloom.base + BLOOM_OFFSET_COVERED)));
+
+    return (covered >= upto);
+}
+
+/* the transaction ending at 'end' kept the filter up to date */
+static void bloom_cover(struct dbengine *db, size_t end)
+{
+    *((uint64_t *)(db->bloom.base + BLOOM_OFFSET_COVERED)) = htonll(end);
+}
+
+/* the filter has to be on disk before any keys it covers are */
+static int bloom_sync(struct dbengine *db)
+{
+    if (db->bloom.fd < 0) return 0;
+
+    if (fdatasync(db->bloom.fd) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip fdatasync %s.bloom: %m",
+               FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* write a filter for a new file about to be renamed to 'dbfname' */
+static int bloom_write(const char *dbfname, struct bloom *filter,
+                       const unsigned char *bits, uint64_t generation,
+                       size_t repack_size, ino_t ino, size_t covered)
+{
+    char *buf = scratchspace.s;
+    char fname[1024];
+    char newfname[1024];
+    int fd;
+    int r = 0;
+
+    snprintf(fname, sizeof(fname), "%s.bloom", dbfname);
+    snprintf(newfname, sizeof(newfname), "%s.bloom.NEW", dbfname);
+
+    memset(buf, 0, BLOOM_HEADER_SIZE);
+    memcpy(buf, BLOOM_MAGIC, BLOOM_MAGIC_SIZE);
+    *((uint32_t *)(buf + BLOOM_OFFSET_ENTRIES)) = htonl(filter->entries);
+    *((uint64_t *)(buf + BLOOM_OFFSET_GENERATION)) = htonll(generation);
+    *((uint64_t *)(buf + BLOOM_OFFSET_REPACK_SIZE)) = htonll(repack_size);
+    *((uint64_t *)(buf + BLOOM_OFFSET_INODE)) = htonll((uint64_t) ino);
+    *((uint32_t *)(buf + BLOOM_OFFSET_CRC32))
+        = htonl(crc32_map(buf, BLOOM_OFFSET_CRC32));
+    *((uint64_t *)(buf + BLOOM_OFFSET_COVERED)) = htonll(covered);
+
+    fd = open(newfname, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (fd < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip open %s: %m", newfname);
+        return CYRUSDB_IOERROR;
+    }
+
+    if (retry_write(fd, buf, BLOOM_HEADER_SIZE) < 0
+        || retry_write(fd, bits, filter->bytes) < 0
+        || fdatasync(fd) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip writing %s: %m", newfname);
+        r = CYRUSDB_IOERROR;
+    }
+
+    close(fd);
+
+    if (!r && rename(newfname, fname) < 0) {
+        syslog(LOG_ERR, "IOERROR: twoskip rename %s: %m", newfname);
+        r = CYRUSDB_IOERROR;
+    }
+
+    if (r) unlink(newfname);
+
+    return r;
+}
+
 /************************** LOCATION MANAGEMENT ***************************/
 
 /* find the next record at a given level, encapsulating the
@@ -803,8 +1313,12 @@ static int append_record(struct dbengine *db, struct skiprecord *record,
 static size_t _getloc(struct dbengine *db, struct skiprecord *record,
                       uint8_t level)
 {
-    if (level)
+    if (level) {
+        /* a later transaction, carry on at the level below */
+        if (db->snapshot && record->nextloc[level + 1] >= db->end)
+            return 0;
         return record->nextloc[level + 1];
+    }
 
     /* if one is past, must be the other */
     if (record->nextloc[0] >= db->end)
@@ -831,9 +1345,9 @@ static void _setloc(struct dbengine *db, struct skiprecord *record,
 
     /* level zero is special */
     /* already this transaction, update this one */
-    if (record->nextloc[0] >= db->header.current_size)
+    if (record->nextloc[0] >= db->current_txn->start)
         record->nextloc[0] = offset;
-    else if (record->nextloc[1] >= db->header.current_size)
+    else if (record->nextloc[1] >= db->current_txn->start)
         record->nextloc[1] = offset;
     /* otherwise, update older one */
     else if (record->nextloc[1] > record->nextloc[0])
@@ -858,9 +1372,11 @@ static int relocate(struct dbengine *db)
     /* pointer validity */
     loc->generation = db->header.generation;
     loc->end = db->end;
+    loc->snapshot = db->snapshot;
 
     /* start with the dummy */
     r = read_onerecord(db, DUMMY_OFFSET, &loc->record);
+    if (r) return r;
     loc->is_exactmatch = 0;
 
     /* initialise pointers */
@@ -923,6 +1439,21 @@ static int relocate(struct dbengine *db)
     return 0;
 }
 
+/* can we still use the offsets in the skiploc? */
+static int loc_isvalid(struct dbengine *db)
+{
+    struct skiploc *loc = &db->loc;
+
+    if (loc->end != db->end || loc->generation != db->header.generation)
+        return 0;
+
+    /* may have skipped pointers we need to update */
+    if (loc->snapshot && !db->snapshot)
+        return 0;
+
+    return 1;
+}
+
 /* helper function to find a location, either by using the existing
  * location if it's close enough, or using the full relocate above */
 static int find_loc(struct dbengine *db, const char *key, size_t keylen)
@@ -937,8 +1468,7 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
         buf_truncate(&loc->keybuf, keylen);
 
     /* can we special case advance? */
-    if (keylen && loc->end == db->end
-               && loc->generation == db->header.generation) {
+    if (keylen && loc_isvalid(db)) {
         cmp = db->compar(KEY(db, &loc->record), loc->record.keylen,
                          loc->keybuf.s, loc->keybuf.len);
         /* same place, and was exact.  Otherwise we're going back,
@@ -973,6 +1503,7 @@ static int find_loc(struct dbengine *db, const char *key, size_t keylen)
 
                 for (i = 0; i < newrecord.level; i++)
                     loc->forwardloc[i] = _getloc(db, &newrecord, i);
+                if (db->snapshot) loc->snapshot = 1;
 
                 /* make sure this record is complete */
                 r = check_tailcrc(db, &loc->record);
@@ -1002,7 +1533,7 @@ static int advance_loc(struct dbengine *db)
     int r;
 
     /* has another session made changes?  Need to re-find the location */
-    if (loc->end != db->end || loc->generation != db->header.generation) {
+    if (!loc_isvalid(db)) {
         r = relocate(db);
         if (r) return r;
     }
@@ -1024,6 +1555,7 @@ static int advance_loc(struct dbengine *db)
     /* update forward pointers */
     for (i = 0; i < loc->record.level; i++)
         loc->forwardloc[i] = _getloc(db, &loc->record, i);
+    if (db->snapshot) loc->snapshot = 1;
 
     /* keep our location */
     buf_setmap(&loc->keybuf, KEY(db, &loc->record), loc->record.keylen);
@@ -1057,6 +1589,12 @@ static int stitch(struct dbengine *db, uint8_t maxlevel, size_t newoffset)
         /* always getting higher */
         assert(oldrecord.level > level);
 
+        /* don't clobber the last pointer crash recovery could use */
+        if (!level && group_conflict(db, &oldrecord)) {
+            r = group_flush(db);
+            if (r) return r;
+        }
+
         for (i = level; i < maxlevel; i++)
             _setloc(db, &oldrecord, i, loc->forwardloc[i]);
 
@@ -1193,8 +1731,10 @@ static int write_lock(struct dbengine *db)
         if (r) return r;
 
         /* recovery checks for consistency */
-        r = recovery(db);
-        if (r) return r;
+        if (!group_adopt(db)) {
+            r = recovery(db);
+            if (r) return r;
+        }
     }
 
     return 0;
@@ -1212,7 +1752,7 @@ static int read_lock(struct dbengine *db)
 
         /* we just take and keep a write lock if inconsistent,
          * the write lock will fix it up */
-        if (!db_is_clean(db)) {
+        if (!db_is_clean(db) && !group_adopt(db)) {
             unlock(db);
             r = write_lock(db);
             if (r) return r;
@@ -1226,6 +1766,50 @@ static int read_lock(struct dbengine *db)
     return 0;
 }
 
+/* read from the last commit without a lock, see SNAPSHOT READS.
+ * Unlike read_lock, this never runs recovery - a dirty header just
+ * means there's a writer, and we don't look at its changes */
+static int snapshot_begin(struct dbengine *db)
+{
+    int r;
+
+    r = mappedfile_refresh(db->mf);
+    if (r) return CYRUSDB_IOERROR;
+
+    db->snapshot = 1;
+
+    r = read_header(db);
+
+    /* committed after we mapped the file */
+    if (!r && db->end > SIZE(db))
+        r = CYRUSDB_AGAIN;
+
+    if (r) db->snapshot = 0;
+
+    return r;
+}
+
+/* start a read outside a transaction, without locking if we can */
+static int read_begin(struct dbengine *db, int attempt)
+{
+    if (db->snapshot_reads && attempt < SNAPSHOT_RETRIES) {
+        int r = snapshot_begin(db);
+        if (r != CYRUSDB_AGAIN) return r;
+    }
+
+    return read_lock(db);
+}
+
+static int read_end(struct dbengine *db)
+{
+    if (db->snapshot) {
+        db->snapshot = 0;
+        return 0;
+    }
+
+    return unlock(db);
+}
+
 static int newtxn(struct dbengine *db, struct txn **tidptr)
 {
     int r;
@@ -1241,6 +1825,7 @@ static int newtxn(struct dbengine *db, struct txn **tidptr)
     db->txn_num++;
     db->current_txn = xmalloc(sizeof(struct txn));
     db->current_txn->num = db->txn_num;
+    db->current_txn->start = db->end;
 
     /* pass it back out */
     *tidptr = db->current_txn;
@@ -1253,11 +1838,17 @@ static void dispose_db(struct dbengine *db)
     if (!db) return;
 
     if (db->mf) {
+        bloom_report(db);
         if (mappedfile_islocked(db->mf))
             unlock(db);
         mappedfile_close(&db->mf);
     }
 
+    if (db->group.fd >= 0)
+        close(db->group.fd);
+
+    bloom_close(db);
+
     buf_free(&db->loc.keybuf);
 
     free(db);
@@ -1282,6 +1873,15 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
     db->open_flags = flags & ~CYRUSDB_CREATE;
     db->compar = (flags & CYRUSDB_MBOXSORT) ? bsearch_ncompare_mbox
                                             : bsearch_ncompare_raw;
+    db->group.enabled =
+        libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_GROUPCOMMIT);
+    db->group.delay =
+        libcyrus_config_getint(CYRUSOPT_TWOSKIP_GROUPCOMMIT_DELAY);
+    db->group.fd = -1;
+    db->snapshot_reads =
+        libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_SNAPSHOT_READS);
+    db->bloom.enabled = libcyrus_config_getswitch(CYRUSOPT_TWOSKIP_BLOOM);
+    db->bloom.fd = -1;
 
     r = mappedfile_open(&db->mf, fname, mappedfile_flags);
     if (r) {
@@ -1346,7 +1946,7 @@ static int opendb(const char *fname, int flags, struct dbengine **ret, struct tx
     r = read_header(db);
     if (r) goto done;
 
-    if (!db_is_clean(db)) {
+    if (!db_is_clean(db) && !group_adopt(db)) {
         if (!mappedfile_iswritelocked(db->mf))
             goto retry_write;
 
@@ -1440,6 +2040,8 @@ static int myfetch(struct dbengine *db,
             const char **data, size_t *datalen,
             struct txn **tidptr, int fetchnext)
 {
+    int attempt = 0;
+    int bloomed = 0;
     int r = 0;
 
     assert(db);
@@ -1462,11 +2064,24 @@ static int myfetch(struct dbengine *db,
             if (r) return r;
         }
     } else {
-        /* grab a r lock */
-        r = read_lock(db);
+ retry:
+        /* grab a r lock, or a snapshot */
+        r = read_begin(db, attempt);
         if (r) return r;
     }
 
+    /* don't bother looking for a key that isn't there */
+    if (!fetchnext && bloom_covers(db, tidptr ? (*tidptr)->start : db->end)
+        && db->header.num_records <= (uint64_t)db->bloom.filter.entries) {
+        bloomed = 1;
+        db->bloom.checks++;
+        if (!bloom_check(&db->bloom.filter, key, keylen)) {
+            db->bloom.negatives++;
+            r = CYRUSDB_NOTFOUND;
+            goto done;
+        }
+    }
+
     r = find_loc(db, key, keylen);
     if (r) goto done;
 
@@ -1485,15 +2100,23 @@ static int myfetch(struct dbengine *db,
     else {
         /* we didn't get an exact match */
         r = CYRUSDB_NOTFOUND;
+        if (bloomed) db->bloom.false_positives++;
     }
 
 done:
+    if (bloomed && db->bloom.checks >= BLOOM_STATS_BATCH)
+        bloom_report(db);
+
     if (!tidptr) {
         /* release read lock */
         int r1;
-        if ((r1 = unlock(db)) < 0) {
+        if ((r1 = read_end(db)) < 0) {
             return r1;
         }
+
+        /* writers overtook our snapshot */
+        if (r == CYRUSDB_AGAIN && attempt++ < SNAPSHOT_RETRIES)
+            goto retry;
     }
 
     return r;
@@ -1511,6 +2134,8 @@ static int myforeach(struct dbengine *db,
     int r = 0, cb_r = 0;
     int num_misses = 0;
     int need_unlock = 0;
+    int attempt = 0;
+    int started = 0;
     const char *val;
     size_t vallen;
     struct buf keybuf = BUF_INITIALIZER;
@@ -1532,12 +2157,13 @@ static int myforeach(struct dbengine *db,
             if (r) return r;
         }
     } else {
-        /* grab a r lock */
-        r = read_lock(db);
+        /* grab a r lock, or a snapshot */
+        r = read_begin(db, attempt);
         if (r) return r;
         need_unlock = 1;
     }
 
+ restart:
     r = find_loc(db, prefix, prefixlen);
     if (r) goto done;
 
@@ -1547,7 +2173,11 @@ static int myforeach(struct dbengine *db,
         if (r) goto done;
     }
 
+ resume:
     while (db->loc.is_exactmatch) {
+        started = 1;
+        attempt = 0;
+
         /* does it match prefix? */
         if (prefixlen) {
             if (db->loc.record.keylen < prefixlen) break;
@@ -1565,7 +2195,7 @@ static int myforeach(struct dbengine *db,
 
             if (!tidptr) {
                 /* release read lock */
-                r = unlock(db);
+                r = read_end(db);
                 if (r) goto done;
                 need_unlock = 0;
             }
@@ -1577,7 +2207,7 @@ static int myforeach(struct dbengine *db,
 
             if (!tidptr) {
                 /* grab a r lock */
-                r = read_lock(db);
+                r = read_begin(db, attempt);
                 if (r) goto done;
                 need_unlock = 1;
 
@@ -1596,12 +2226,12 @@ static int myforeach(struct dbengine *db,
                 buf_copy(&keybuf, &db->loc.keybuf);
 
                 /* release read lock */
-                r = unlock(db);
+                r = read_end(db);
                 if (r) goto done;
                 need_unlock = 0;
 
                 /* grab a r lock */
-                r = read_lock(db);
+                r = read_begin(db, attempt);
                 if (r) goto done;
                 need_unlock = 1;
 
@@ -1620,35 +2250,271 @@ static int myforeach(struct dbengine *db,
 
  done:
 
+    /* writers overtook our snapshot, carry on from a new one */
+    if (r == CYRUSDB_AGAIN && db->snapshot) {
+        /* the last key we got to, empty if we ran off the end */
+        buf_copy(&keybuf, &db->loc.keybuf);
+
+        read_end(db);
+        need_unlock = 0;
+
+        r = read_begin(db, ++attempt);
+        if (r) goto done;
+        need_unlock = 1;
+
+        if (!started) goto restart;
+
+        if (keybuf.len) {
+            r = find_loc(db, keybuf.s, keybuf.len);
+            if (!r) r = advance_loc(db);
+            if (!r) goto resume;
+            goto done;
+        }
+    }
+
     buf_free(&keybuf);
 
     if (need_unlock) {
         /* release read lock */
-        int r1 = unlock(db);
+        int r1 = read_end(db);
         if (r1) return r1;
     }
 
     return r ? r : cb_r;
 }
 
-/* helper function for all writes - wraps create and delete and the FORCE
- * logic for each */
-static int skipwrite(struct dbengine *db,
-                     const char *key, size_t keylen,
-                     const char *data, size_t datalen,
-                     int force)
+/* fetchmany searches for each key starting from where the search
+ * for the key before it left off: the last record before that key at
+ * each level.  Those records stay before any later key, so the search
+ * climbs from level zero only until the next record at the level above
+ * is past the key, and searches down again from there.  A key close to
+ * the previous one costs a few reads rather than a full relocate */
+struct finger {
+    /* valid while these are unchanged, like a skiploc */
+    uint64_t generation;
+    size_t end;
+    int snapshot;
+
+    /* the last record at each level before the previous key */
+    size_t path[MAXLEVEL];
+};
+
+static void finger_reset(struct dbengine *db, struct finger *finger)
 {
-    int r = find_loc(db, key, keylen);
-    if (r) return r;
+    uint8_t i;
 
-    /* could be a delete or a replace */
-    if (db->loc.is_exactmatch) {
-        if (!data) return delete_here(db);
-        if (!force) return CYRUSDB_EXISTS;
-        /* unchanged?  Save the IO */
-        if (!db->compar(data, datalen,
-                        VAL(db, &db->loc.record),
-                        db->loc.record.vallen))
+    finger->generation = db->header.generation;
+    finger->end = db->end;
+    finger->snapshot = db->snapshot;
+
+    for (i = 0; i < MAXLEVEL; i++)
+        finger->path[i] = DUMMY_OFFSET;
+}
+
+/* is record 'a' further along than record 'b'? */
+static int finger_isafter(struct dbengine *db, struct skiprecord *a,
+                          struct skiprecord *b)
+{
+    if (a->offset == b->offset || a->offset == DUMMY_OFFSET)
+        return 0;
+
+    if (b->offset == DUMMY_OFFSET)
+        return 1;
+
+    return (db->compar(KEY(db, a), a->keylen, KEY(db, b), b->keylen) > 0);
+}
+
+/* find 'key', which sorts after the previous key searched for.  Sets
+ * found->offset to zero if it's not there */
+static int finger_find(struct dbengine *db, struct finger *finger,
+                       const char *key, size_t keylen,
+                       struct skiprecord *found)
+{
+    struct skiprecord record;
+    struct skiprecord next;
+    size_t offset;
+    uint8_t level;
+    uint8_t top;
+    int cmp;
+    int r;
+
+    found->offset = 0;
+
+    if (finger->generation != db->header.generation
+        || finger->end != db->end || finger->snapshot != db->snapshot)
+        finger_reset(db, finger);
+
+    /* climb while the key is beyond the next record up */
+    for (top = 0; top + 1 < MAXLEVEL; top++) {
+        r = read_onerecord(db, finger->path[top + 1], &record);
+        if (r) return r;
+        offset = _getloc(db, &record, top + 1);
+        if (!offset) break;
+        r = read_skipdelete(db, offset, &next);
+        if (r) return r;
+        if (!next.offset) break;
+        if (db->compar(KEY(db, &next), next.keylen, key, keylen) >= 0)
+            break;
+    }
+
+    r = read_onerecord(db, finger->path[top], &record);
+    if (r) return r;
+
+    /* and search down, keeping the path for the next key */
+    for (level = top + 1; level; level--) {
+        if (level <= top && finger->path[level - 1] != record.offset) {
+            r = read_onerecord(db, finger->path[level - 1], &next);
+            if (r) return r;
+            if (finger_isafter(db, &next, &record))
+                record = next;
+        }
+
+        while ((offset = _getloc(db, &record, level - 1))) {
+            r = read_skipdelete(db, offset, &next);
+            if (r) return r;
+            if (!next.offset) break;
+
+            cmp = db->compar(KEY(db, &next), next.keylen, key, keylen);
+            if (cmp > 0) break;
+            if (cmp == 0) {
+                if (level == 1) *found = next;
+                break;
+            }
+
+            record = next;
+        }
+
+        finger->path[level - 1] = record.offset;
+    }
+
+    /* make sure this record is complete */
+    if (found->offset)
+        return check_tailcrc(db, found);
+
+    return 0;
+}
+
+/* like fetch for each key in turn, calling 'cb' as foreach does */
+static int myfetchmany(struct dbengine *db,
+                       const struct buf *keys, size_t nkeys,
+                       foreach_cb *cb, void *rock,
+                       struct txn **tidptr)
+{
+    struct skiprecord record;
+    struct finger finger;
+    int need_unlock = 0;
+    int attempt = 0;
+    int bloomed;
+    size_t i = 0;
+    int r = 0, cb_r = 0;
+
+    assert(db);
+    assert(cb);
+
+    if (!nkeys) return 0;
+
+    memset(&finger, 0, sizeof(struct finger));
+
+    /* Hacky workaround, as for foreach */
+    if (!tidptr && db->current_txn)
+        tidptr = &db->current_txn;
+    if (tidptr) {
+        if (!*tidptr) {
+            r = newtxn(db, tidptr);
+            if (r) return r;
+        }
+    } else {
+ retry:
+        /* grab a r lock, or a snapshot */
+        r = read_begin(db, attempt);
+        if (r) return r;
+        need_unlock = 1;
+    }
+
+    for (; i < nkeys; i++) {
+        const char *key = keys[i].s;
+        size_t keylen = keys[i].len;
+
+        assert(keylen);
+
+        /* out of order, search from the top again */
+        if (i && db->compar(key, keylen, keys[i-1].s, keys[i-1].len) < 0)
+            finger.generation = 0;
+
+        bloomed = 0;
+        if (bloom_covers(db, tidptr ? (*tidptr)->start : db->end)
+            && db->header.num_records <= (uint64_t)db->bloom.filter.entries) {
+            bloomed = 1;
+            db->bloom.checks++;
+            if (!bloom_check(&db->bloom.filter, key, keylen)) {
+                db->bloom.negatives++;
+                continue;
+            }
+        }
+
+        r = finger_find(db, &finger, key, keylen, &record);
+        if (r) goto done;
+
+        if (!record.offset) {
+            if (bloomed) db->bloom.false_positives++;
+            continue;
+        }
+
+        if (!tidptr) {
+            /* release read lock */
+            r = read_end(db);
+            if (r) goto done;
+            need_unlock = 0;
+        }
+
+        /* make callback */
+        cb_r = cb(rock, key, keylen, VAL(db, &record), record.vallen);
+        if (cb_r) goto done;
+
+        if (!tidptr) {
+            /* grab a r lock */
+            r = read_begin(db, attempt);
+            if (r) goto done;
+            need_unlock = 1;
+        }
+    }
+
+ done:
+    if (db->bloom.checks >= BLOOM_STATS_BATCH)
+        bloom_report(db);
+
+    if (need_unlock) {
+        /* release read lock */
+        int r1 = read_end(db);
+        need_unlock = 0;
+        if (r1) return r1;
+
+        /* writers overtook our snapshot, carry on from a new one */
+        if (r == CYRUSDB_AGAIN && attempt++ < SNAPSHOT_RETRIES)
+            goto retry;
+    }
+
+    return r ? r : cb_r;
+}
+
+/* helper function for all writes - wraps create and delete and the FORCE
+ * logic for each */
+static int skipwrite(struct dbengine *db,
+                     const char *key, size_t keylen,
+                     const char *data, size_t datalen,
+                     int force)
+{
+    int r = find_loc(db, key, keylen);
+    if (r) return r;
+
+    /* could be a delete or a replace */
+    if (db->loc.is_exactmatch) {
+        if (!data) return delete_here(db);
+        if (!force) return CYRUSDB_EXISTS;
+        /* unchanged?  Save the IO */
+        if (!db->compar(data, datalen,
+                        VAL(db, &db->loc.record),
+                        db->loc.record.vallen))
             return 0;
         return store_here(db, data, datalen);
     }
@@ -1662,36 +2528,153 @@ static int skipwrite(struct dbengine *db,
     return 0;
 }
 
+/* has our commit been made durable, by someone else or a checkpoint? */
+static int group_synced(struct dbengine *db, uint64_t generation,
+                        size_t commit_end)
+{
+    return (db->header.generation != generation
+            || db->header.current_size >= commit_end);
+}
+
+static int need_checkpoint(struct dbengine *db)
+{
+    if (db->open_flags & CYRUSDB_NOCOMPACT)
+        return 0;
+
+    return (db->header.current_size > MINREWRITE
+            && db->header.current_size > 2 * db->header.repack_size);
+}
+
+/* make sure everything up to commit_end is on disk.  Committers queue
+ * up on the sync lock, and usually find that whoever held it before
+ * them has already done the work - otherwise they fsync everything
+ * committed so far, for the whole group.  Called with the write lock
+ * held, returns unlocked. */
+static int group_commit(struct dbengine *db, size_t commit_end)
+{
+    uint64_t generation = db->header.generation;
+    size_t target;
+    int synced = 0;
+    int r;
+
+    r = group_open(db, 1);
+    if (!r) r = group_setlock(db, GROUP_WAITING, F_RDLCK);
+    if (r) {
+        /* can't tell anyone we're waiting, so don't */
+        r = bloom_sync(db);
+        if (!r) r = mappedfile_sync(db->mf);
+        if (!r) r = sync_tail(db);
+        unlock(db);
+        return r;
+    }
+
+    unlock(db);
+
+    r = group_setlock(db, GROUP_SYNCING, F_WRLCK);
+    if (r) goto done;
+
+    /* a read lock is enough to find out that we're done */
+    r = read_lock(db);
+    if (r) goto unlock_sync;
+
+    if (db->group.delay && !group_synced(db, generation, commit_end)
+        && group_others(db)) {
+        /* give anyone else who's already committing a chance to join in */
+        unlock(db);
+        usleep(db->group.delay);
+        r = read_lock(db);
+        if (r) goto unlock_sync;
+    }
+
+    if (group_synced(db, generation, commit_end)) {
+        unlock(db);
+        goto unlock_sync;
+    }
+
+    /* everything up to here is committed, fsync it without holding
+     * the database lock so that others can keep on appending */
+    target = db->end;
+    bloom_covers(db, target); /* open it for this generation */
+    unlock(db);
+
+    r = bloom_sync(db);
+    if (!r) r = mappedfile_sync(db->mf);
+    if (r) goto unlock_sync;
+
+    r = write_lock(db);
+    if (r) goto unlock_sync;
+
+    if (db->header.generation == generation
+        && db->header.current_size < target) {
+        db->header.current_size = target;
+        if (db->end == target)
+            db->header.flags &= ~(DIRTY|PENDING);
+        r = commit_header(db);
+        synced = 1;
+    }
+
+    unlock(db);
+
+ unlock_sync:
+    group_setlock(db, GROUP_SYNCING, F_UNLCK);
+ done:
+    group_setlock(db, GROUP_WAITING, F_UNLCK);
+
+    /* and whoever synced gets to checkpoint if it's time, once
+     * the rest of the group have been let go */
+    if (!r && synced && need_checkpoint(db)) {
+        int r2 = write_lock(db);
+        if (!r2) {
+            if (need_checkpoint(db))
+                r2 = mycheckpoint(db);
+            else
+                unlock(db);
+        }
+        if (r2) {
+            syslog(LOG_NOTICE, "twoskip: failed to checkpoint %s: %m",
+                   FNAME(db));
+        }
+    }
+
+    return r;
+}
+
 static int mycommit(struct dbengine *db, struct txn *tid)
 {
     struct skiprecord newrecord;
+    size_t commit_end = 0;
     int r = 0;
 
     assert(db);
     assert(tid == db->current_txn);
 
-    /* no need to abort if we're not dirty */
-    if (!(db->header.flags & DIRTY))
+    /* no need to commit if we haven't written anything */
+    if (db->end == tid->start)
         goto done;
 
     /* build a commit record */
     memset(&newrecord, 0, sizeof(struct skiprecord));
     newrecord.type = COMMIT;
-    newrecord.nextloc[0] = db->header.current_size;
+    newrecord.nextloc[0] = tid->start;
 
     /* append to the file */
     r = append_record(db, &newrecord, NULL, NULL);
     if (r) goto done;
 
-    /* commit ALL outstanding changes first, before
-     * rewriting the header */
-    r = mappedfile_commit(db->mf);
-    if (r) goto done;
+    /* our keys are all in the filter */
+    if (bloom_covers(db, tid->start))
+        bloom_cover(db, db->end);
 
-    /* finally, update the header and commit again */
-    db->header.current_size = db->end;
-    db->header.flags &= ~DIRTY;
-    r = commit_header(db);
+    if (db->group.enabled) {
+        /* leave the fsync for later, but keep the record count */
+        commit_end = db->end;
+        r = write_header(db);
+        if (!r) mappedfile_defer(db->mf);
+        goto done;
+    }
+
+    r = bloom_sync(db);
+    if (!r) r = sync_tail(db);
 
  done:
     if (r) {
@@ -1704,10 +2687,17 @@ static int mycommit(struct dbengine *db, struct txn *tid)
                    FNAME(db));
         }
     }
+    else if (commit_end) {
+        free(tid);
+        db->current_txn = NULL;
+
+        r = group_commit(db, commit_end);
+    }
     else {
-        if (!(db->open_flags & CYRUSDB_NOCOMPACT)
-            && db->header.current_size > MINREWRITE
-            && db->header.current_size > 2 * db->header.repack_size) {
+        free(tid);
+        db->current_txn = NULL;
+
+        if (need_checkpoint(db)) {
             int r2 = mycheckpoint(db);
             if (r2) {
                 syslog(LOG_NOTICE, "twoskip: failed to checkpoint %s: %m",
@@ -1717,9 +2707,6 @@ static int mycommit(struct dbengine *db, struct txn *tid)
         else {
             unlock(db);
         }
-
-        free(tid);
-        db->current_txn = NULL;
     }
 
     return r;
@@ -1732,13 +2719,19 @@ static int myabort(struct dbengine *db, struct txn *tid)
     assert(db);
     assert(tid == db->current_txn);
 
+    /* roll back to the start of this transaction, which is past
+     * current_size if we're on top of a pending group commit */
+    db->end = tid->start;
+
     /* free the tid */
     free(tid);
     db->current_txn = NULL;
-    db->end = db->header.current_size;
 
     /* recovery will clean up */
-    r = recovery1(db, NULL);
+    if ((db->header.flags & PENDING) && db->end == SIZE(db))
+        r = 0; /* nothing of ours to throw away */
+    else
+        r = recovery1(db, NULL);
 
     buf_free(&db->loc.keybuf);
     memset(&db->loc, 0, sizeof(struct skiploc));
@@ -1772,6 +2765,9 @@ static int mystore(struct dbengine *db,
 
     r = skipwrite(db, key, keylen, data, datalen, force);
 
+    if (!r && data && bloom_covers(db, (*tidptr)->start))
+        bloom_add(&db->bloom.filter, key, keylen);
+
     if (r) {
         r2 = myabort(db, *tidptr);
         *tidptr = NULL;
@@ -1784,58 +2780,254 @@ static int mystore(struct dbengine *db,
     return r2 ? r2 : r;
 }
 
-/* compress 'db', closing at the end.  Uses foreach to copy into a new
- * database, then rewrites over the old one */
+/* compress 'db'.  Uses foreach to copy into a new database without
+ * holding the lock, then catches up with the changes made meanwhile
+ * and renames the copy over the old one */
 
 struct copy_rock {
     struct dbengine *db;
     struct txn *tid;
+    struct bloom filter;    /* for the copy, if bits is set */
+    unsigned char *bits;
+    int r;
 };
 
+/* copy from the predicate, so foreach only drops the lock every
+ * FOREACH_LOCK_RELEASE records rather than for every one */
+static int copy_p(void *rock,
+                  const char *key, size_t keylen,
+                  const char *val, size_t vallen)
+{
+    struct copy_rock *cr = (struct copy_rock *)rock;
+
+    cr->r = mystore(cr->db, key, keylen, val, vallen, &cr->tid, 0);
+
+    if (cr->bits) bloom_add(&cr->filter, key, keylen);
+
+    /* only call copy_cb to bail out */
+    return (cr->r != 0);
+}
+
 static int copy_cb(void *rock,
-                   const char *key, size_t keylen,
-                   const char *val, size_t vallen)
+                   const char *key __attribute__((unused)),
+                   size_t keylen __attribute__((unused)),
+                   const char *val __attribute__((unused)),
+                   size_t vallen __attribute__((unused)))
 {
     struct copy_rock *cr = (struct copy_rock *)rock;
 
-    return mystore(cr->db, key, keylen, val, vallen, &cr->tid, 0);
+    return cr->r;
+}
+
+/* only one process copies for a checkpoint at a time */
+static int checkpoint_lock(struct dbengine *db)
+{
+    struct flock fl;
+    int r;
+
+    r = group_open(db, 1);
+    if (r) return r;
+
+    memset(&fl, 0, sizeof(struct flock));
+    fl.l_type = F_WRLCK;
+    fl.l_whence = SEEK_SET;
+    fl.l_start = GROUP_CHECKPOINT;
+    fl.l_len = 1;
+
+    while (fcntl(db->group.fd, F_SETLK, &fl) < 0) {
+        if (errno == EINTR) continue;
+        if (errno == EACCES || errno == EAGAIN) return CYRUSDB_LOCKED;
+        syslog(LOG_ERR, "IOERROR: twoskip lock %s.group: %m", FNAME(db));
+        return CYRUSDB_IOERROR;
+    }
+
+    return 0;
+}
+
+/* find the last record in 'db' with a key before the given one, or
+ * the very last record if keylen is zero.  Gives the DUMMY if none */
+static int find_before(struct dbengine *db, const char *key, size_t keylen,
+                       struct skiprecord *record)
+{
+    struct skiprecord next;
+    size_t offset;
+    uint8_t level;
+    int r;
+
+    if (keylen) {
+        r = find_loc(db, key, keylen);
+        if (r) return r;
+        if (!db->loc.is_exactmatch) {
+            *record = db->loc.record;
+            return 0;
+        }
+        return read_onerecord(db, db->loc.backloc[0], record);
+    }
+
+    r = read_onerecord(db, DUMMY_OFFSET, record);
+    if (r) return r;
+
+    for (level = record->level; level; level--) {
+        while ((offset = _getloc(db, record, level-1))) {
+            r = read_skipdelete(db, offset, &next);
+            if (r) return r;
+            if (!next.offset) break;
+            *record = next;
+        }
+    }
+
+    return 0;
+}
+
+/* make the copy of 'key' match the live database */
+static int resync_key(struct dbengine *db, struct copy_rock *cr,
+                      const char *key, size_t keylen)
+{
+    int r = find_loc(db, key, keylen);
+    if (r) return r;
+
+    if (!db->loc.is_exactmatch)
+        return mystore(cr->db, key, keylen, NULL, 0, &cr->tid, 1);
+
+    if (cr->bits) bloom_add(&cr->filter, key, keylen);
+
+    return mystore(cr->db, key, keylen, VAL(db, &db->loc.record),
+                   db->loc.record.vallen, &cr->tid, 1);
+}
+
+/* a DELETE record doesn't say which key it removed, only the record
+ * after it.  Any key which wasn't rewritten since 'start' hasn't
+ * changed, so the deleted key lies between the last such key before
+ * that record and the record itself - resync everything the copy
+ * has in that range */
+static int resync_delete(struct dbengine *db, struct copy_rock *cr,
+                         size_t start, struct skiprecord *delrecord)
+{
+    struct skiprecord record;
+    struct buf upto = BUF_INITIALIZER;
+    struct buf key = BUF_INITIALIZER;
+    int r = 0;
+
+    if (delrecord->nextloc[0]) {
+        r = read_onerecord(db, delrecord->nextloc[0], &record);
+        if (r) goto done;
+        buf_setmap(&upto, KEY(db, &record), record.keylen);
+    }
+
+    /* the last unchanged key before it */
+    r = find_before(db, upto.s, upto.len, &record);
+    while (!r && record.offset >= start && record.offset != DUMMY_OFFSET) {
+        buf_setmap(&key, KEY(db, &record), record.keylen);
+        r = find_before(db, key.s, key.len, &record);
+    }
+    if (r) goto done;
+
+    if (record.offset == DUMMY_OFFSET)
+        buf_reset(&key);
+    else
+        buf_setmap(&key, KEY(db, &record), record.keylen);
+
+    /* and walk the copy from there */
+    for (;;) {
+        /* the next key after this one */
+        r = find_loc(cr->db, key.s, key.len);
+        if (!r) r = advance_loc(cr->db);
+        if (r || !cr->db->loc.is_exactmatch) break;
+
+        buf_copy(&key, &cr->db->loc.keybuf);
+        if (upto.len && db->compar(key.s, key.len, upto.s, upto.len) >= 0)
+            break;
+
+        r = resync_key(db, cr, key.s, key.len);
+        if (r) break;
+    }
+
+ done:
+    buf_free(&upto);
+    buf_free(&key);
+    return r;
 }
 
+/* called with the write lock held and no transaction, returns unlocked */
 static int mycheckpoint(struct dbengine *db)
 {
+    uint64_t generation = db->header.generation;
     size_t old_size = db->header.current_size;
+    size_t start = db->header.current_size;
+    struct skiprecord record;
+    struct timeval begin, pause_begin, now;
     char newfname[1024];
-    clock_t start = sclock();
     struct copy_rock cr;
+    struct stat sbuf;
+    int locked = 0;
+    size_t offset;
     int r = 0;
 
-    r = myconsistent(db, db->current_txn);
+    assert(!db->current_txn);
+
+    gettimeofday(&begin, NULL);
+
+    r = checkpoint_lock(db);
     if (r) {
-        syslog(LOG_ERR, "db %s, inconsistent pre-checkpoint, bailing out",
-               FNAME(db));
         unlock(db);
-        return r;
+        /* someone else is already on it */
+        return (r == CYRUSDB_LOCKED) ? 0 : r;
     }
 
+    /* let everyone else carry on while we copy */
+    unlock(db);
+
     /* open fname.NEW */
     snprintf(newfname, sizeof(newfname), "%s.NEW", FNAME(db));
     unlink(newfname);
 
     cr.db = NULL;
     cr.tid = NULL;
+    cr.bits = NULL;
+    cr.r = 0;
     r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &cr.db, &cr.tid);
-    if (r) return r;
+    if (r) goto unlock_checkpoint;
+    cr.db->group.enabled = 0;
+    cr.db->bloom.enabled = 0;
 
-    r = myforeach(db, NULL, 0, NULL, copy_cb, &cr, &db->current_txn);
+    if (db->bloom.enabled) {
+        uint64_t entries = db->header.num_records * 2;
+        if (entries < BLOOM_MINENTRIES) entries = BLOOM_MINENTRIES;
+        if (entries > BLOOM_MAXENTRIES) entries = BLOOM_MAXENTRIES;
+        cr.bits = xzmalloc(bloom_bytes(entries, BLOOM_ERROR));
+        bloom_init_buffer(&cr.filter, entries, BLOOM_ERROR, cr.bits);
+    }
+
+    r = myforeach(db, NULL, 0, copy_p, copy_cb, &cr, NULL);
     if (r) goto err;
 
-    r = myconsistent(cr.db, cr.tid);
-    if (r) {
-        syslog(LOG_ERR, "db %s, inconsistent post-checkpoint, bailing out",
-               FNAME(db));
+    /* now lock everyone out while we catch up */
+    gettimeofday(&pause_begin, NULL);
+
+    r = write_lock(db);
+    if (r) goto err;
+    locked = 1;
+
+    if (db->header.generation != generation || db->end < start) {
+        /* somebody replaced the file under us, our copy is stale */
+        r = 0;
         goto err;
     }
 
+    /* catch up with everything written since we started copying.
+     * The copy saw at least the state as of 'start', and maybe some
+     * later changes too, so bring each key that changed since then
+     * into line with the live database */
+    for (offset = start; offset < db->end; offset += record.len) {
+        r = read_onerecord(db, offset, &record);
+        if (r) goto err;
+        if (record.type == RECORD)
+            r = resync_key(db, &cr, KEY(db, &record), record.keylen);
+        else if (record.type == DELETE)
+            r = resync_delete(db, &cr, start, &record);
+        if (r) goto err;
+    }
+
     /* remember the repack size */
     cr.db->header.repack_size = cr.db->end;
 
@@ -1843,8 +3035,24 @@ static int mycheckpoint(struct dbengine *db)
     cr.db->header.generation = db->header.generation + 1;
 
     r = mycommit(cr.db, cr.tid);
+    cr.tid = NULL;
     if (r) goto err;
 
+    /* check the copy as it will be, header and all, before it
+     * replaces the database we've only read from */
+    r = myconsistent(cr.db, NULL);
+    if (r) {
+        syslog(LOG_ERR, "db %s, inconsistent post-checkpoint, bailing out",
+               FNAME(db));
+        goto err;
+    }
+
+    /* without the filter, fetches are just slower */
+    if (cr.bits && !stat(FNAME(cr.db), &sbuf))
+        bloom_write(FNAME(db), &cr.filter, cr.bits,
+                    cr.db->header.generation, cr.db->header.repack_size,
+                    sbuf.st_ino, cr.db->end);
+
     /* move new file to original file name */
     r = mappedfile_rename(cr.db->mf, FNAME(db));
     if (r) goto err;
@@ -1852,20 +3060,32 @@ static int mycheckpoint(struct dbengine *db)
     /* OK, we're committed now - clean up */
     unlock(db);
 
+    gettimeofday(&now, NULL);
+
     /* gotta clean it all up */
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
 
+    bloom_close(db);
+    cr.db->group = db->group;
+    cr.db->bloom = db->bloom;
     *db = *cr.db;
     free(cr.db); /* leaked? */
+    free(cr.bits);
+
+    group_setlock(db, GROUP_CHECKPOINT, F_UNLCK);
 
     {
+        double pause = timesub(&pause_begin, &now);
+
         syslog(LOG_INFO,
-               "twoskip: checkpointed %s (%llu record%s, %llu => %llu bytes) in %2.3f seconds",
+               "twoskip: checkpointed %s (%llu record%s, %llu => %llu bytes) in %2.3f seconds (%2.3f locked)",
                FNAME(db), (LLU)db->header.num_records,
                db->header.num_records == 1 ? "" : "s", (LLU)old_size,
                (LLU)(db->header.current_size),
-               (sclock() - start) / (double) CLOCKS_PER_SEC);
+               timesub(&begin, &now), pause);
+
+        cyrusdb_checkpoint_done(FNAME(db), pause);
     }
 
     return 0;
@@ -1874,8 +3094,24 @@ static int mycheckpoint(struct dbengine *db)
     if (cr.tid) myabort(cr.db, cr.tid);
     unlink(FNAME(cr.db));
     dispose_db(cr.db);
-    unlock(db);
-    return CYRUSDB_IOERROR;
+    if (locked) unlock(db);
+ unlock_checkpoint:
+    free(cr.bits);
+    group_setlock(db, GROUP_CHECKPOINT, F_UNLCK);
+    return r ? CYRUSDB_IOERROR : 0;
+}
+
+/* an explicit repack, outside of any transaction */
+static int myrepack(struct dbengine *db)
+{
+    int r;
+
+    if (db->current_txn) return CYRUSDB_LOCKED;
+
+    r = write_lock(db);
+    if (r) return r;
+
+    return mycheckpoint(db);
 }
 
 
@@ -2091,6 +3327,8 @@ static int recovery2(struct dbengine *db, int *count)
 
     r = opendb(newfname, db->open_flags | CYRUSDB_CREATE, &newdb, NULL);
     if (r) return r;
+    newdb->group.enabled = 0;
+    newdb->bloom.enabled = 0;
 
     /* increase the generation count */
     newdb->header.generation = db->header.generation + 1;
@@ -2136,6 +3374,9 @@ static int recovery2(struct dbengine *db, int *count)
     mappedfile_close(&db->mf);
     buf_free(&db->loc.keybuf);
 
+    bloom_close(db);
+    newdb->group = db->group;
+    newdb->bloom = db->bloom;
     *db = *newdb;
     free(newdb); /* leaked? */
 
@@ -2276,14 +3517,16 @@ static int recovery1(struct dbengine *db, int *count)
         }
     }
 
-    r = mappedfile_truncate(db->mf, db->header.current_size);
+    r = mappedfile_truncate(db->mf, db->end);
     if (r) return r;
 
     r = mappedfile_commit(db->mf);
     if (r) return r;
 
-    /* clear the dirty flag */
-    db->header.flags &= ~DIRTY;
+    /* clear the dirty flag, unless we kept transactions which are
+     * still waiting for a group commit */
+    if (db->end == db->header.current_size)
+        db->header.flags &= ~(DIRTY|PENDING);
     db->header.num_records = num_records;
     r = commit_header(db);
     if (r) return r;
@@ -2303,6 +3546,10 @@ static int recovery(struct dbengine *db)
     if (db_is_clean(db))
         return 0;
 
+    /* keep whatever a waiting group committer has finished */
+    if ((db->header.flags & PENDING) && group_islive(db))
+        db->end = group_tailend(db);
+
     r = recovery1(db, &count);
     if (r) {
         syslog(LOG_ERR, "DBERROR: recovery1 failed %s, trying recovery2", FNAME(db));
@@ -2393,6 +3640,7 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
     &fetch,
     &fetch,
     &fetchnext,
+    &myfetchmany,
 
     &myforeach,
     &create,
@@ -2404,6 +3652,6 @@ HIDDEN struct cyrusdb_backend cyrusdb_twoskip =
 
     &dump,
     &consistent,
-    &mycheckpoint,
+    &myrepack,
     &mycompar
 };
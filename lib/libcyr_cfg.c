@@ -145,6 +145,22 @@ static struct cyrusopt_s cyrus_options[] = {
       CFGVAL(long, 1),
       CYRUS_OPT_SWITCH },
 
+    { CYRUSOPT_TWOSKIP_GROUPCOMMIT,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_GROUPCOMMIT_DELAY,
+      CFGVAL(long, 0),
+      CYRUS_OPT_INT },
+
+    { CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
+    { CYRUSOPT_TWOSKIP_BLOOM,
+      CFGVAL(long, 0),
+      CYRUS_OPT_SWITCH },
+
     { CYRUSOPT_LAST, { NULL }, CYRUS_OPT_NOTOPT }
 };
 
@@ -105,6 +105,14 @@ enum cyrus_opt {
     CYRUSOPT_SQL_USESSL,
     /* Checkpoint after every recovery (OFF) */
     CYRUSOPT_SKIPLIST_ALWAYS_CHECKPOINT,
+    /* Share fsyncs between concurrent twoskip commits (OFF) */
+    CYRUSOPT_TWOSKIP_GROUPCOMMIT,
+    /* Microseconds to wait for more group commits (0) */
+    CYRUSOPT_TWOSKIP_GROUPCOMMIT_DELAY,
+    /* Read twoskip without locking, from a snapshot (OFF) */
+    CYRUSOPT_TWOSKIP_SNAPSHOT_READS,
+    /* Keep a bloom filter of twoskip keys for missing fetches (OFF) */
+    CYRUSOPT_TWOSKIP_BLOOM,
 
     CYRUSOPT_LAST
 
@@ -249,6 +249,46 @@ EXPORTED int mappedfile_readlock(struct mappedfile *mf)
     return 0;
 }
 
+/* like mappedfile_readlock, but without the lock: pick up a replacement
+ * file and remap to the current size.  Only for callers which can cope
+ * with the file being written underneath them */
+EXPORTED int mappedfile_refresh(struct mappedfile *mf)
+{
+    struct stat sbuf, sbuffile;
+    int newfd = -1;
+
+    assert(mf->lock_status == MF_UNLOCKED);
+    assert(mf->fd != -1);
+    assert(!mf->dirty);
+
+    for (;;) {
+        if (fstat(mf->fd, &sbuf) == -1) {
+            syslog(LOG_ERR, "IOERROR: fstat %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        if (stat(mf->fname, &sbuffile) == -1) {
+            syslog(LOG_ERR, "IOERROR: stat %s: %m", mf->fname);
+            return -EIO;
+        }
+        if (sbuf.st_ino == sbuffile.st_ino) break;
+        buf_free(&mf->map_buf);
+
+        newfd = open(mf->fname, O_RDWR, 0644);
+        if (newfd == -1) {
+            syslog(LOG_ERR, "IOERROR: open %s: %m", mf->fname);
+            return -EIO;
+        }
+
+        dup2(newfd, mf->fd);
+        close(newfd);
+    }
+
+    _ensure_mapped(mf, sbuf.st_size, /*update*/0);
+
+    return 0;
+}
+
 EXPORTED int mappedfile_writelock(struct mappedfile *mf)
 {
     int r;
@@ -335,6 +375,24 @@ EXPORTED int mappedfile_commit(struct mappedfile *mf)
     return 0;
 }
 
+/* like mappedfile_commit, but sync even if nothing was written through
+ * this handle - another process may have left its writes for us */
+EXPORTED int mappedfile_sync(struct mappedfile *mf)
+{
+    mf->dirty++;
+    mf->was_resized = 1;
+
+    return mappedfile_commit(mf);
+}
+
+/* hand the job of syncing everything written so far to someone else,
+ * which makes it possible to unlock without a commit */
+EXPORTED void mappedfile_defer(struct mappedfile *mf)
+{
+    mf->dirty = 0;
+    mf->was_resized = 0;
+}
+
 EXPORTED ssize_t mappedfile_pwrite(struct mappedfile *mf,
                                    const void *base, size_t len,
                                    off_t offset)
@@ -0,0 +1,149 @@
+/* uidhash.c - a hash table mapping 32 bit UIDs to 32 bit numbers
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <string.h>
+
+#include "assert.h"
+#include "uidhash.h"
+#include "xmalloc.h"
+
+#define MINALLOC    64
+
+/* Fibonacci hashing: UIDs are mostly dense runs, and multiplying
+ * by the golden ratio spreads those evenly over the top bits */
+static inline uint32_t slotof(const uidhash_t *uh, uint32_t key)
+{
+    return (uint32_t)(key * 2654435769U) >> uh->shift;
+}
+
+static void place(uidhash_t *uh, uint32_t key, uint32_t value)
+{
+    uint32_t mask = uh->alloc - 1;
+    uint32_t slot = slotof(uh, key);
+
+    while (uh->data[slot*2] && uh->data[slot*2] != key)
+        slot = (slot + 1) & mask;
+
+    if (!uh->data[slot*2]) {
+        uh->data[slot*2] = key;
+        uh->count++;
+    }
+    uh->data[slot*2+1] = value;
+}
+
+static void rehash(uidhash_t *uh, uint32_t newalloc)
+{
+    uint32_t *olddata = uh->data;
+    uint32_t oldalloc = uh->alloc;
+    uint32_t shift = 32;
+    uint32_t i;
+
+    for (i = newalloc; i > 1; i >>= 1)
+        shift--;
+
+    uh->data = xzmalloc(sizeof(uint32_t) * 2 * newalloc);
+    uh->alloc = newalloc;
+    uh->shift = shift;
+    uh->count = 0;
+
+    for (i = 0; i < oldalloc; i++) {
+        if (olddata[i*2])
+            place(uh, olddata[i*2], olddata[i*2+1]);
+    }
+
+    free(olddata);
+}
+
+EXPORTED void uidhash_fini(uidhash_t *uh)
+{
+    if (!uh)
+        return;
+    free(uh->data);
+    uidhash_init(uh);
+}
+
+/* empty the table, but keep the allocation for rebuilding */
+EXPORTED void uidhash_reset(uidhash_t *uh)
+{
+    if (uh->data)
+        memset(uh->data, 0, sizeof(uint32_t) * 2 * uh->alloc);
+    uh->count = 0;
+}
+
+/* make room for at least @count entries without rehashing */
+EXPORTED void uidhash_reserve(uidhash_t *uh, uint32_t count)
+{
+    uint32_t newalloc = uh->alloc ? uh->alloc : MINALLOC;
+
+    while (newalloc / 2 <= count)
+        newalloc *= 2;
+
+    if (newalloc > uh->alloc)
+        rehash(uh, newalloc);
+}
+
+EXPORTED void uidhash_insert(uidhash_t *uh, uint32_t key, uint32_t value)
+{
+    assert(key);
+    assert(value);
+
+    uidhash_reserve(uh, uh->count + 1);
+    place(uh, key, value);
+}
+
+EXPORTED uint32_t uidhash_lookup(const uidhash_t *uh, uint32_t key)
+{
+    uint32_t mask = uh->alloc - 1;
+    uint32_t slot;
+
+    if (!uh->count || !key)
+        return 0;
+
+    for (slot = slotof(uh, key); uh->data[slot*2]; slot = (slot + 1) & mask) {
+        if (uh->data[slot*2] == key)
+            return uh->data[slot*2+1];
+    }
+
+    return 0;
+}
@@ -0,0 +1,74 @@
+/* uidhash.h - a hash table mapping 32 bit UIDs to 32 bit numbers
+ *
+ * Copyright (c) 1994-2011 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_UIDHASH_H__
+#define __CYRUS_UIDHASH_H__
+
+#include <sys/types.h>
+
+#include <stdint.h>
+#include <string.h>
+
+/*
+ * Open addressing with linear probing, kept at most half full.
+ * Neither keys nor values may be zero: a zero key marks an empty
+ * slot and a zero value means "not found".  There is no delete,
+ * callers are expected to reset and rebuild instead.
+ */
+typedef struct
+{
+    uint32_t count;
+    uint32_t alloc;     /* number of slots, zero or a power of two */
+    uint32_t shift;     /* 32 - log2(alloc) */
+    uint32_t *data;     /* alloc pairs of (key, value) */
+} uidhash_t;
+
+#define UIDHASH_INITIALIZER     { 0, 0, 0, NULL }
+#define uidhash_init(uh)        (memset((uh), 0, sizeof(uidhash_t)))
+void uidhash_fini(uidhash_t *);
+void uidhash_reset(uidhash_t *);
+
+void uidhash_reserve(uidhash_t *, uint32_t count);
+void uidhash_insert(uidhash_t *, uint32_t key, uint32_t value);
+uint32_t uidhash_lookup(const uidhash_t *, uint32_t key);
+
+#endif /* __CYRUS_UIDHASH_H__ */
@@ -0,0 +1,501 @@
+/* workerpool.c -- sharing out independent jobs between forked workers
+ *
+ * Copyright (c) 2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#include <config.h>
+
+#include <assert.h>
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <syslog.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+
+#include "exitcodes.h"
+#include "ptrarray.h"
+#include "retry.h"
+#include "workerpool.h"
+#include "xmalloc.h"
+
+/*
+ * Each worker sends its results back on a pipe of its own, as a
+ * header followed by the result.  Unless the pool is ordered, the
+ * parent hands out jobs the same way, as a header followed by the
+ * job's input, on another pipe of the worker's own, one job at a time,
+ * and dismisses the worker by closing that pipe.
+ */
+
+/* next_dynamic() found nothing to report, but may yet */
+#define AGAIN   (3)
+
+struct header {
+    int job;
+    uint32_t len;
+};
+
+struct worker {
+    pid_t pid;
+    int resfd;              /* -1 once the worker has gone */
+    int jobfd;              /* -1 once dismissed, or if ordered */
+    int job;                /* the job it is running, or -1 */
+};
+
+struct workerpool {
+    char *name;
+    int flags;
+    int njobs;
+    int next;               /* next job to hand out (or to read, if ordered) */
+    ptrarray_t inputs;      /* struct buf * for jobs next..njobs-1 */
+    int stopped;
+    int nworkers;
+    int started;
+    struct worker *workers;
+    struct pollfd *pfds;
+    void (*oldpipe)(int);
+};
+
+static void worker_main(struct workerpool *pool, int k,
+                        const struct workerpool_ops *ops, void *rock)
+{
+    struct worker *w = &pool->workers[k];
+    struct buf in = BUF_INITIALIZER, out = BUF_INITIALIZER;
+    int job = k;
+    int r;
+
+    r = ops->setup ? ops->setup(rock) : 0;
+
+    while (!r) {
+        struct header hdr;
+        struct iovec iov[2];
+
+        buf_reset(&in);
+        if (pool->flags & WORKERPOOL_ORDERED) {
+            if (job >= pool->njobs) break;
+        }
+        else {
+            if (retry_read(w->jobfd, &hdr, sizeof(hdr)) != sizeof(hdr))
+                break;
+            job = hdr.job;
+            if (hdr.len) {
+                buf_ensure(&in, hdr.len);
+                if (retry_read(w->jobfd, in.s, hdr.len) != (ssize_t) hdr.len)
+                    break;
+                buf_truncate(&in, hdr.len);
+            }
+        }
+
+        buf_reset(&out);
+        r = ops->run(job, &in, &out, rock);
+        if (r) break;
+
+        hdr.job = job;
+        hdr.len = out.len;
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = out.s;
+        iov[1].iov_len = out.len;
+        if (retry_writev(w->resfd, iov, out.len ? 2 : 1) < 0)
+            break;
+
+        job += pool->nworkers;
+    }
+
+    buf_free(&in);
+    buf_free(&out);
+
+    if (ops->cleanup) ops->cleanup(r, rock);
+
+    close(w->resfd);
+    if (w->jobfd >= 0) close(w->jobfd);
+    fflush(stdout);
+
+    /* don't run the parent's exit handlers */
+    _exit(r ? EC_TEMPFAIL : 0);
+}
+
+/* hand the next job to w, or dismiss it if there is none (and the
+ * pool doesn't persist); returns nonzero if w took a job */
+static int dispatch(struct workerpool *pool, struct worker *w)
+{
+    if (w->jobfd < 0 || w->job >= 0) return 0;
+
+    if (!pool->stopped && pool->next < pool->njobs) {
+        struct buf *in = ptrarray_head(&pool->inputs);
+        struct header hdr = { pool->next, in ? in->len : 0 };
+        struct iovec iov[2];
+
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(hdr);
+        iov[1].iov_base = in ? in->s : NULL;
+        iov[1].iov_len = hdr.len;
+        if (retry_writev(w->jobfd, iov, hdr.len ? 2 : 1) >= 0) {
+            if (in) {
+                ptrarray_shift(&pool->inputs);
+                buf_destroy(in);
+            }
+            w->job = pool->next++;
+            return 1;
+        }
+    }
+    else if ((pool->flags & WORKERPOOL_PERSIST) && !pool->stopped) {
+        /* wait for the next job to be submitted */
+        return 0;
+    }
+
+    /* closing the pipe makes the worker's read fail */
+    close(w->jobfd);
+    w->jobfd = -1;
+    return 0;
+}
+
+/* w has gone, returns the job it took with it or -1 */
+static int worker_gone(struct workerpool *pool, struct worker *w)
+{
+    int job = w->job;
+
+    if (job >= 0 || (pool->flags & WORKERPOOL_ORDERED))
+        syslog(LOG_ERR, "%s: worker %d exited early", pool->name, (int) w->pid);
+
+    close(w->resfd);
+    w->resfd = -1;
+    if (w->jobfd >= 0) close(w->jobfd);
+    w->jobfd = -1;
+    w->job = -1;
+
+    return job;
+}
+
+EXPORTED struct workerpool *workerpool_start(const char *name,
+                                             int nworkers, int njobs, int flags,
+                                             const struct workerpool_ops *ops,
+                                             void *rock)
+{
+    struct workerpool *pool;
+    int k, j;
+
+    if (flags & WORKERPOOL_PERSIST) njobs = 0;
+    else if (nworkers > njobs) nworkers = njobs;
+    if (nworkers < 1) return NULL;
+
+    pool = xzmalloc(sizeof(struct workerpool));
+    pool->name = xstrdup(name);
+    pool->flags = flags;
+    pool->njobs = njobs;
+    pool->nworkers = nworkers;
+    pool->workers = xzmalloc(nworkers * sizeof(struct worker));
+    pool->pfds = xzmalloc(nworkers * sizeof(struct pollfd));
+    for (k = 0; k < nworkers; k++) {
+        pool->workers[k].resfd = -1;
+        pool->workers[k].jobfd = -1;
+        pool->workers[k].job = -1;
+    }
+
+    /* a dead worker mustn't take the parent down with it */
+    if (!(flags & WORKERPOOL_ORDERED))
+        pool->oldpipe = signal(SIGPIPE, SIG_IGN);
+
+    /* don't let the workers print our buffered output again */
+    fflush(stdout);
+
+    for (k = 0; k < nworkers; k++) {
+        struct worker *w = &pool->workers[k];
+        int respipe[2], jobpipe[2] = { -1, -1 };
+
+        if (pipe(respipe) < 0) {
+            syslog(LOG_ERR, "IOERROR: %s: pipe: %m", name);
+            break;
+        }
+        if (!(flags & WORKERPOOL_ORDERED) && pipe(jobpipe) < 0) {
+            syslog(LOG_ERR, "IOERROR: %s: pipe: %m", name);
+            close(respipe[0]);
+            close(respipe[1]);
+            break;
+        }
+
+        w->pid = fork();
+        if (w->pid < 0) {
+            syslog(LOG_ERR, "IOERROR: %s: fork: %m", name);
+            w->pid = 0;
+            close(respipe[0]);
+            close(respipe[1]);
+            if (jobpipe[0] >= 0) {
+                close(jobpipe[0]);
+                close(jobpipe[1]);
+            }
+            break;
+        }
+
+        if (!w->pid) {
+            /* child */
+            for (j = 0; j < k; j++) {
+                if (pool->workers[j].resfd >= 0) close(pool->workers[j].resfd);
+                if (pool->workers[j].jobfd >= 0) close(pool->workers[j].jobfd);
+            }
+            close(respipe[0]);
+            w->resfd = respipe[1];
+            if (jobpipe[0] >= 0) {
+                close(jobpipe[1]);
+                w->jobfd = jobpipe[0];
+            }
+            worker_main(pool, k, ops, rock);
+            /* never returns */
+        }
+
+        close(respipe[1]);
+        w->resfd = respipe[0];
+        if (jobpipe[0] >= 0) {
+            close(jobpipe[0]);
+            w->jobfd = jobpipe[1];
+            dispatch(pool, w);
+        }
+        pool->started++;
+    }
+
+    if (!pool->started) {
+        workerpool_finish(&pool);
+        return NULL;
+    }
+
+    return pool;
+}
+
+EXPORTED int workerpool_submit(struct workerpool *pool, const struct buf *in)
+{
+    struct buf *copy = buf_new();
+    int job = pool->njobs++;
+    int k;
+
+    assert(pool->flags & WORKERPOOL_PERSIST);
+
+    buf_copy(copy, in);
+    ptrarray_append(&pool->inputs, copy);
+
+    /* give it to an idle worker, if there is one */
+    for (k = 0; k < pool->nworkers; k++) {
+        if (dispatch(pool, &pool->workers[k])) break;
+    }
+
+    return job;
+}
+
+static int read_result(struct worker *w, int job, struct buf *out)
+{
+    struct header hdr;
+
+    if (retry_read(w->resfd, &hdr, sizeof(hdr)) != sizeof(hdr))
+        return -1;
+    if (hdr.job != job)
+        return -1;
+
+    buf_reset(out);
+    if (hdr.len) {
+        buf_ensure(out, hdr.len);
+        if (retry_read(w->resfd, out->s, hdr.len) != (ssize_t) hdr.len)
+            return -1;
+        buf_truncate(out, hdr.len);
+    }
+
+    return 0;
+}
+
+static int next_ordered(struct workerpool *pool, int timeout,
+                        int *jobp, struct buf *out)
+{
+    struct worker *w;
+    int job = pool->next;
+    int r;
+
+    if (job >= pool->njobs) return WORKERPOOL_DONE;
+
+    w = &pool->workers[job % pool->nworkers];
+    if (w->resfd >= 0) {
+        struct pollfd pfd = { w->resfd, POLLIN, 0 };
+
+        r = poll(&pfd, 1, timeout);
+        if (r < 0 && errno == EINTR) return WORKERPOOL_TIMEOUT;
+        if (!r) return WORKERPOOL_TIMEOUT;
+        if (r < 0) syslog(LOG_ERR, "IOERROR: %s: poll: %m", pool->name);
+
+        if (r < 0 || read_result(w, job, out))
+            worker_gone(pool, w);
+    }
+
+    pool->next++;
+    *jobp = job;
+    return w->resfd >= 0 ? 0 : WORKERPOOL_LOST;
+}
+
+static int next_dynamic(struct workerpool *pool, int timeout,
+                        int *jobp, struct buf *out)
+{
+    struct worker *w;
+    int i, n = 0, busy = 0, r;
+
+    for (i = 0; i < pool->nworkers; i++) {
+        if (pool->workers[i].resfd < 0) continue;
+        if (pool->workers[i].job >= 0) busy++;
+        pool->pfds[n].fd = pool->workers[i].resfd;
+        pool->pfds[n].events = POLLIN;
+        pool->pfds[n].revents = 0;
+        n++;
+    }
+
+    /* the workers of a persistent pool stay, waiting for more */
+    if (n && !busy && (pool->flags & WORKERPOOL_PERSIST) &&
+        (pool->stopped || pool->next >= pool->njobs))
+        return WORKERPOOL_DONE;
+
+    if (!n) {
+        /* nobody left to do the rest */
+        if (pool->stopped || pool->next >= pool->njobs)
+            return WORKERPOOL_DONE;
+        *jobp = pool->next++;
+        if (ptrarray_size(&pool->inputs)) {
+            struct buf *in = ptrarray_shift(&pool->inputs);
+            buf_destroy(in);
+        }
+        return WORKERPOOL_LOST;
+    }
+
+    r = poll(pool->pfds, n, timeout);
+    if (r < 0 && errno == EINTR) return WORKERPOOL_TIMEOUT;
+    if (!r) return WORKERPOOL_TIMEOUT;
+
+    for (i = 0, n = 0; i < pool->nworkers; i++) {
+        int job;
+
+        w = &pool->workers[i];
+        if (w->resfd < 0) continue;
+        if (r > 0 && !pool->pfds[n++].revents) continue;
+        if (r < 0) {
+            /* give up on the workers one at a time */
+            syslog(LOG_ERR, "IOERROR: %s: poll: %m", pool->name);
+        }
+        else if (w->job >= 0 && !read_result(w, w->job, out)) {
+            *jobp = w->job;
+            w->job = -1;
+            dispatch(pool, w);
+            return 0;
+        }
+
+        job = worker_gone(pool, w);
+        if (job < 0) return AGAIN;
+        *jobp = job;
+        return WORKERPOOL_LOST;
+    }
+
+    return AGAIN;
+}
+
+EXPORTED int workerpool_next(struct workerpool *pool, int timeout,
+                             int *jobp, struct buf *out)
+{
+    int r;
+
+    do {
+        if (pool->flags & WORKERPOOL_ORDERED)
+            r = next_ordered(pool, timeout, jobp, out);
+        else
+            r = next_dynamic(pool, timeout, jobp, out);
+    } while (r == AGAIN || (r == WORKERPOOL_TIMEOUT && timeout < 0));
+
+    return r;
+}
+
+EXPORTED void workerpool_stop(struct workerpool *pool)
+{
+    pool->stopped = 1;
+}
+
+EXPORTED int workerpool_nworkers(const struct workerpool *pool)
+{
+    return pool->started;
+}
+
+EXPORTED int workerpool_finish(struct workerpool **poolp)
+{
+    struct workerpool *pool = *poolp;
+    int failed = 0;
+    int k, status;
+
+    if (!pool) return 0;
+
+    /* closing the pipes stops any worker we didn't wait for */
+    for (k = 0; k < pool->nworkers; k++) {
+        struct worker *w = &pool->workers[k];
+
+        if (w->resfd >= 0) close(w->resfd);
+        if (w->jobfd >= 0) close(w->jobfd);
+    }
+    for (k = 0; k < pool->nworkers; k++) {
+        struct worker *w = &pool->workers[k];
+
+        if (w->pid <= 0) continue;
+        if (waitpid(w->pid, &status, 0) < 0)
+            failed = 1;
+        else if (WIFSIGNALED(status) && WTERMSIG(status) == SIGPIPE &&
+                 (pool->stopped || pool->next < pool->njobs))
+            continue;   /* we closed its pipe before taking every result */
+        else if (!WIFEXITED(status) || WEXITSTATUS(status))
+            failed = 1;
+    }
+
+    if (!(pool->flags & WORKERPOOL_ORDERED))
+        signal(SIGPIPE, pool->oldpipe);
+
+    while (ptrarray_size(&pool->inputs)) {
+        struct buf *in = ptrarray_pop(&pool->inputs);
+        buf_destroy(in);
+    }
+    ptrarray_fini(&pool->inputs);
+    free(pool->name);
+    free(pool->workers);
+    free(pool->pfds);
+    free(pool);
+    *poolp = NULL;
+
+    return failed;
+}
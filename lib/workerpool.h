@@ -0,0 +1,118 @@
+/* workerpool.h -- sharing out independent jobs between forked workers
+ *
+ * Copyright (c) 2017 Carnegie Mellon University.  All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ *
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ *
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in
+ *    the documentation and/or other materials provided with the
+ *    distribution.
+ *
+ * 3. The name "Carnegie Mellon University" must not be used to
+ *    endorse or promote products derived from this software without
+ *    prior written permission. For permission or any legal
+ *    details, please contact
+ *      Carnegie Mellon University
+ *      Center for Technology Transfer and Enterprise Creation
+ *      4615 Forbes Avenue
+ *      Suite 302
+ *      Pittsburgh, PA  15213
+ *      (412) 268-7393, fax: (412) 268-7395
+ *      innovation@andrew.cmu.edu
+ *
+ * 4. Redistributions of any form whatsoever must retain the following
+ *    acknowledgment:
+ *    "This product includes software developed by Computing Services
+ *     at Carnegie Mellon University (http://www.cmu.edu/computing/)."
+ *
+ * CARNEGIE MELLON UNIVERSITY DISCLAIMS ALL WARRANTIES WITH REGARD TO
+ * THIS SOFTWARE, INCLUDING ALL IMPLIED WARRANTIES OF MERCHANTABILITY
+ * AND FITNESS, IN NO EVENT SHALL CARNEGIE MELLON UNIVERSITY BE LIABLE
+ * FOR ANY SPECIAL, INDIRECT OR CONSEQUENTIAL DAMAGES OR ANY DAMAGES
+ * WHATSOEVER RESULTING FROM LOSS OF USE, DATA OR PROFITS, WHETHER IN
+ * AN ACTION OF CONTRACT, NEGLIGENCE OR OTHER TORTIOUS ACTION, ARISING
+ * OUT OF OR IN CONNECTION WITH THE USE OR PERFORMANCE OF THIS SOFTWARE.
+ */
+
+#ifndef __CYRUS_LIB_WORKERPOOL_H__
+#define __CYRUS_LIB_WORKERPOOL_H__
+
+#include <config.h>
+
+#include "util.h"
+
+/*
+ * A worker pool forks processes to run jobs 0..njobs-1 and passes the
+ * result of each job back to the parent over a pipe.
+ *
+ * By default a job is handed to whichever worker finishes first, and
+ * results come back in the order they are finished.  With
+ * WORKERPOOL_ORDERED worker k runs jobs k, k+n, k+2n... without waiting
+ * to be told, and results come back in job order; the pipes then limit
+ * how far the workers can run ahead of the parent.
+ *
+ * With WORKERPOOL_PERSIST the pool starts with no jobs and the workers
+ * wait for them until the pool is finished.  Each job is added with
+ * workerpool_submit(), which gives it an input to pass to run().
+ *
+ * The parent should close any database it has open before starting a
+ * pool: the workers open their own.
+ */
+
+#define WORKERPOOL_ORDERED      (1<<0)
+#define WORKERPOOL_PERSIST      (1<<1)  /* not with WORKERPOOL_ORDERED */
+
+/* workerpool_next() return values */
+#define WORKERPOOL_LOST         (1)     /* the job wasn't done */
+#define WORKERPOOL_TIMEOUT      (2)
+#define WORKERPOOL_DONE         (-1)    /* no more results */
+
+struct workerpool;
+
+/* All of these are called in the worker */
+struct workerpool_ops {
+    /* before the first job; nonzero makes the worker give up */
+    int (*setup)(void *rock);
+    /* run 'job' with the input it was submitted with (empty unless
+     * the pool persists), appending its result to 'out'; nonzero
+     * abandons the job and makes the worker give up */
+    int (*run)(int job, const struct buf *in, struct buf *out, void *rock);
+    /* before the worker exits, with the error it gave up with, if any */
+    void (*cleanup)(int r, void *rock);
+};
+
+/* Start up to 'nworkers' workers, returns NULL if none could be started.
+ * 'njobs' is ignored if the pool persists. */
+extern struct workerpool *workerpool_start(const char *name,
+                                           int nworkers, int njobs, int flags,
+                                           const struct workerpool_ops *ops,
+                                           void *rock);
+
+/* Add a job to a persistent pool, returns its number.  Jobs are
+ * numbered from 0 for the life of the pool. */
+extern int workerpool_submit(struct workerpool *pool, const struct buf *in);
+
+/* Wait up to 'timeout' milliseconds (-1 for ever) for the next result.
+ * Returns 0 with the job's result in 'out', WORKERPOOL_LOST if the job
+ * wasn't done (its worker gave up or died, or there is no worker left
+ * to give it to), WORKERPOOL_TIMEOUT or WORKERPOOL_DONE.  A persistent
+ * pool is DONE whenever every job submitted so far has been reported. */
+extern int workerpool_next(struct workerpool *pool, int timeout,
+                           int *jobp, struct buf *out);
+
+/* Hand out no more jobs; those already handed out still report back */
+extern void workerpool_stop(struct workerpool *pool);
+
+extern int workerpool_nworkers(const struct workerpool *pool);
+
+/* Dismiss the workers and wait for them, returns nonzero if any of
+ * them failed */
+extern int workerpool_finish(struct workerpool **poolp);
+
+#endif /* __CYRUS_LIB_WORKERPOOL_H__ */
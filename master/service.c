@@ -86,6 +86,25 @@ static int verbose = 0;
 static int lockfd = -1;
 static int newfile = 0;
 
+/* idle connections parked by the service between requests */
+struct parked_conn {
+    int fd;
+    time_t expire;
+    service_resume_t *proc;
+    void *rock;
+};
+static struct parked_conn *parked = NULL;
+static int nparked = 0;
+static int parked_alloc = 0;
+static int parked_max = 0;      /* stop accepting with this many parked */
+static int parking = 1;         /* can service_main() park connections? */
+static int draining = 0;        /* stop accepting, exit once none parked */
+static int available = 1;       /* has the master been told we're ready? */
+
+/* how often a process holding parked connections retries the accept
+ * lock while another process is waiting for new connections (usec) */
+#define PARKED_LOCK_RETRY 100000
+
 void notify_master(int fd, int msg)
 {
     struct notify_message notifymsg;
@@ -214,6 +233,28 @@ static int lockaccept(void)
     return 0;
 }
 
+/* like lockaccept(), but don't wait for the lock.
+ * returns 1 if we now hold it */
+static int trylockaccept(void)
+{
+    struct flock alockinfo;
+
+    if (lockfd == -1) return 1;
+
+    alockinfo.l_start = 0;
+    alockinfo.l_len = 0;
+    alockinfo.l_whence = SEEK_SET;
+    alockinfo.l_type = F_WRLCK;
+
+    if (fcntl(lockfd, F_SETLK, &alockinfo) < 0) {
+        if (errno != EACCES && errno != EAGAIN && errno != EINTR)
+            syslog(LOG_ERR, "fcntl: F_SETLK: error getting accept lock: %m");
+        return 0;
+    }
+
+    return 1;
+}
+
 static int unlockaccept(void)
 {
     struct flock alockinfo;
@@ -281,6 +322,130 @@ static int safe_wait_readable(int fd)
     return r;
 }
 
+void service_park_limit(int max)
+{
+    parked_max = max;
+}
+
+int service_park(int fd, int timeout, service_resume_t *proc, void *rock)
+{
+    if (!parking || fd < 0 || fd >= FD_SETSIZE) return -1;
+
+    if (nparked == parked_alloc) {
+        parked_alloc += 16;
+        parked = xrealloc(parked, parked_alloc * sizeof(struct parked_conn));
+    }
+
+    parked[nparked].fd = fd;
+    parked[nparked].expire = timeout > 0 ? time(NULL) + timeout : 0;
+    parked[nparked].proc = proc;
+    parked[nparked].rock = rock;
+    nparked++;
+
+    return 0;
+}
+
+/* Can we take on another connection? */
+static int accepting(void)
+{
+    return !draining && (!parked_max || nparked < parked_max);
+}
+
+/* Like safe_wait_readable(LISTEN_FD), but also wait on the parked
+ * connections, and only on those unless 'listening'.
+ * Returns the index of a parked connection which is readable or has
+ * timed out, nparked if LISTEN_FD is readable, or -1 if interrupted
+ * or (when not listening) it's time to retry the accept lock. */
+static int wait_readable_parked(int listening, int *timedout)
+{
+    fd_set rfds;
+    struct timeval tv, *tvp = NULL;
+    time_t now = time(NULL), expire = 0;
+    int i, maxfd = -1, r;
+
+    *timedout = 0;
+
+    FD_ZERO(&rfds);
+    if (listening) {
+        FD_SET(LISTEN_FD, &rfds);
+        maxfd = LISTEN_FD;
+    }
+    for (i = 0; i < nparked; i++) {
+        if (parked[i].expire) {
+            if (parked[i].expire <= now) {
+                *timedout = 1;
+                return i;
+            }
+            if (!expire || parked[i].expire < expire)
+                expire = parked[i].expire;
+        }
+        FD_SET(parked[i].fd, &rfds);
+        if (parked[i].fd > maxfd) maxfd = parked[i].fd;
+    }
+
+    if (expire) {
+        tv.tv_sec = expire - now;
+        tv.tv_usec = 0;
+        tvp = &tv;
+    }
+    if (!listening && accepting()) {
+        tv.tv_sec = 0;
+        tv.tv_usec = PARKED_LOCK_RETRY;
+        tvp = &tv;
+    }
+
+    /* see safe_wait_readable() */
+    signals_reset_sighup_handler(0);
+
+    r = signals_select(maxfd+1, &rfds, NULL, NULL, tvp);
+
+    signals_reset_sighup_handler(1);
+
+    if (r <= 0) return -1;
+
+    for (i = 0; i < nparked; i++) {
+        if (FD_ISSET(parked[i].fd, &rfds)) return i;
+    }
+
+    return nparked;
+}
+
+/* Called whenever service_main() or a parked connection returns.
+ * Returns 0 if this process should exit. */
+static int served_connection(int max_use)
+{
+    if (signals_poll()) {
+        /* caught SIGHUP */
+        return 0;
+    }
+
+    if (use_count >= max_use) {
+        /* exceeded max use count: stop accepting, and exit once the
+         * parked connections have all closed or timed out */
+        if (!nparked) return 0;
+        draining = 1;
+    }
+
+    /* a process that can't accept connections isn't ready for one */
+    if (accepting()) {
+        notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
+        available = 1;
+    }
+
+    return 1;
+}
+
+/* take parked connection 'i' out of the list and resume it */
+static void resume_parked(int i, int timedout)
+{
+    struct parked_conn conn = parked[i];
+
+    parked[i] = parked[--nparked];
+
+    if (verbose) syslog(LOG_DEBUG, "resuming parked connection");
+    conn.proc(conn.fd, timedout, conn.rock);
+}
+
 int main(int argc, char **argv, char **envp)
 {
     int fdflags;
@@ -476,24 +641,34 @@ int main(int argc, char **argv, char **envp)
     getlockfd(service, id);
 
     if (debug_stdio) {
+        /* we exit as soon as service_main() returns, so it can't park */
+        parking = 0;
         service_main(service_argv.count, service_argv.data, envp);
         service_abort(0);
         return 0;
     }
 
     for (;;) {
+        int locked = 0, resume = -1, timedout = 0;
+
         /* ok, listen to this socket until someone talks to us */
 
         /* (re)set signal handlers, including SIGALRM */
         signals_add_handlers(SIGALRM);
 
-        if (use_count > 0) {
+        if (use_count > 0 && !nparked) {
             /* we want to time out after 60 seconds, set an alarm */
             alarm(reuse_timeout);
         }
 
-        /* lock */
-        lockaccept();
+        /* lock, but don't leave parked connections waiting for it */
+        if (!nparked) {
+            lockaccept();
+            locked = 1;
+        }
+        else if (accepting()) {
+            locked = trylockaccept();
+        }
 
         fd = -1;
         while (fd < 0 && !signals_poll()) { /* loop until we succeed */
@@ -517,7 +692,17 @@ int main(int argc, char **argv, char **envp)
                 /* Wait for the file descriptor to be connected to, in a
                  * signal-safe manner.  This ensures the accept() does
                  * not block and we don't need to make it signal-safe.  */
-                if (safe_wait_readable(LISTEN_FD) < 0)
+                if (nparked) {
+                    /* ...or for a parked connection to need us */
+                    resume = wait_readable_parked(locked, &timedout);
+                    if (resume < 0) {
+                        if (!locked && accepting()) locked = trylockaccept();
+                        continue;
+                    }
+                    if (resume < nparked) break;
+                    resume = -1;
+                }
+                else if (safe_wait_readable(LISTEN_FD) < 0)
                     continue;
                 fd = accept(LISTEN_FD, NULL, NULL);
                 if (fd < 0) {
@@ -577,9 +762,20 @@ int main(int argc, char **argv, char **envp)
         /* unlock */
         unlockaccept();
 
+        if (resume >= 0) {
+            alarm(0);
+            if (available)
+                notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
+            available = 0;
+            resume_parked(resume, timedout);
+
+            if (!served_connection(max_use)) break;
+            continue;
+        }
+
         if (fd < 0 && (signals_poll() || newfile)) {
             /* timed out (SIGALRM), SIGHUP, or new process file */
-            if (MESSAGE_MASTER_ON_EXIT)
+            if (MESSAGE_MASTER_ON_EXIT && available)
                 notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
             service_abort(0);
         }
@@ -609,6 +805,7 @@ int main(int argc, char **argv, char **envp)
         }
 
         notify_master(STATUS_FD, MASTER_SERVICE_UNAVAILABLE);
+        available = 0;
         syslog(LOG_DEBUG, "accepted connection");
 
         if (fd != 0 && dup2(fd, 0) < 0) {
@@ -634,12 +831,7 @@ int main(int argc, char **argv, char **envp)
         service_main(service_argv.count, service_argv.data, envp);
         /* if we returned, we can service another client with this process */
 
-        if (signals_poll() || use_count >= max_use) {
-            /* caught SIGHUP or exceeded max use count */
-            break;
-        }
-
-        notify_master(STATUS_FD, MASTER_SERVICE_AVAILABLE);
+        if (!served_connection(max_use)) break;
     }
 
     service_abort(0);
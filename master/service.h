@@ -59,6 +59,18 @@ extern int service_main(int argc, char **argv, char **envp);
 extern int service_main_fd(int fd, int argc, char **argv, char **envp);
 extern void service_abort(int error);
 
+/* Hand an idle connection back to the skeleton from service_main().
+ * While waiting for new connections the skeleton also waits on 'fd',
+ * and once it becomes readable (or 'timeout' seconds pass, if nonzero)
+ * calls 'proc' with the process marked busy, as for a new connection.
+ * Returns -1, leaving 'fd' with the caller, if it can't be parked. */
+typedef void service_resume_t(int fd, int timedout, void *rock);
+extern int service_park(int fd, int timeout, service_resume_t *proc,
+                        void *rock);
+
+/* Stop accepting new connections while 'max' (if nonzero) are parked */
+extern void service_park_limit(int max);
+
 enum {
     MAX_USE = 250,
     REUSE_TIMEOUT = 60